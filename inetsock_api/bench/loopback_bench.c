@@ -0,0 +1,539 @@
+// loopback_bench.c - benchmarks this library over 127.0.0.1: throughput across
+// a sweep of payload sizes, round-trip latency, and connection rate
+//
+// The server runs in a child process (an echo server on RunServer, or on
+// RunServerEx with -w); the client side runs in this process.  Both sides use
+// nothing but the inetsock_api functions, so that the numbers move when the
+// library's Send, Receive, OpenSocket or callback paths get faster or slower.
+//
+// Results go to standard output as one JSON object per line, so that two
+// builds can be compared with a script; progress and errors go to standard
+// error.  Build it against the library and inetsock_core, e.g.:
+//
+//   gcc -O2 -Iinclude -o loopback_bench bench/loopback_bench.c src/*.c <inetsock_core> -lpthread
+//
+// Usage: loopback_bench [-p port] [-t seconds] [-w workers] [-l samples]
+//                       [-c connections] [-u] [-b bytes]
+//   -p  port the echo server listens on (default 17000)
+//   -t  seconds to run each throughput measurement for (default 2)
+//   -w  worker threads for the server; 0 runs RunServer (default 0)
+//   -l  round trips to time for the latency measurement (default 100000)
+//   -c  connections to open and close for the connection rate (default 10000)
+//   -u  run the server's event loop on io_uring
+//   -b  turn on buffered send mode on both ends, with a buffer this size
+//
+
+#include <errno.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/prctl.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+#include "inetsock_api.h"
+
+#ifndef ERROR
+#define ERROR							-1
+#endif //ERROR
+
+/**
+ * @brief Payload sizes, in bytes, that the throughput measurement sweeps over.
+ */
+static const size_t g_payloadSizes[] = { 16, 64, 256, 1024, 4096, 16384, 65536 };
+
+/**
+ * @brief Payload size, in bytes, of the messages the latency measurement bounces.
+ */
+#ifndef LATENCY_PAYLOAD_SIZE
+#define LATENCY_PAYLOAD_SIZE			64
+#endif //LATENCY_PAYLOAD_SIZE
+
+/**
+ * @brief Upper bound, in bytes, on the data the throughput measurement keeps in
+ * flight, so that neither end ever blocks with both socket buffers full.
+ */
+#ifndef MAX_BYTES_IN_FLIGHT
+#define MAX_BYTES_IN_FLIGHT				(128 * 1024)
+#endif //MAX_BYTES_IN_FLIGHT
+
+/**
+ * @brief Upper bound on the number of messages the throughput measurement keeps
+ * in flight.
+ */
+#ifndef MAX_MESSAGES_IN_FLIGHT
+#define MAX_MESSAGES_IN_FLIGHT			64
+#endif //MAX_MESSAGES_IN_FLIGHT
+
+///////////////////////////////////////////////////////////////////////////////
+// Benchmark settings, from the command line.
+
+static int g_nPort = 17000;
+static int g_nSeconds = 2;
+static int g_nWorkers = 0;
+static int g_nLatencySamples = 100000;
+static int g_nConnections = 10000;
+static int g_bUring = 0;
+static size_t g_nSendBuffer = 0;
+
+///////////////////////////////////////////////////////////////////////////////
+// Process ID of the echo server child, or zero once it has been reaped.
+
+static pid_t g_nServerPid = 0;
+
+///////////////////////////////////////////////////////////////////////////////
+// NowSeconds - Reads the monotonic clock, in seconds.
+
+static double NowSeconds(void)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	return (double)now.tv_sec + (double)now.tv_nsec / 1e9;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// ServerCallback - Echoes whatever a client sends straight back to it.
+
+static void ServerCallback(HSOCKET hSocket, void* lpUserState)
+{
+	switch (GetSocketState(hSocket))
+	{
+		case SOCKET_STATE_RECEIVED:
+		{
+			PSOCKETRECVDATA pRecvData = (PSOCKETRECVDATA)lpUserState;
+
+			SetSocketState(hSocket, SOCKET_STATE_READY);
+			SendBytes(hSocket, pRecvData->pData, (size_t)pRecvData->nBytesReceived);
+			break;
+		}
+
+		case SOCKET_STATE_ACCEPTED:
+		case SOCKET_STATE_SENT:
+			SetSocketState(hSocket, SOCKET_STATE_READY);
+			break;
+
+		default:
+			break;
+	}
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// ClientCallback - Keeps the benchmark's client sockets in the READY state, so
+// that they can be sent on again.
+
+static void ClientCallback(HSOCKET hSocket, void* lpUserState)
+{
+	(void)lpUserState;
+
+	switch (GetSocketState(hSocket))
+	{
+		case SOCKET_STATE_CONNECTED:
+		case SOCKET_STATE_SENT:
+			SetSocketState(hSocket, SOCKET_STATE_READY);
+			break;
+
+		default:
+			break;
+	}
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// RunEchoServer - Runs the echo server in the child process.  Never returns.
+
+static void RunEchoServer(void)
+{
+	HSOCKET hServer = INVALID_HANDLE_VALUE;
+
+	// Go down with the parent, however it exits; otherwise the server would
+	// hang on to the port, and to the parent's standard output.
+	prctl(PR_SET_PDEATHSIG, SIGTERM);
+	if (1 == getppid())
+		exit(EXIT_FAILURE);	/* the parent is already gone */
+
+	hServer = OpenSocket(SOCKET_TYPE_SERVER, ServerCallback);
+	if (INVALID_HANDLE_VALUE == hServer)
+	{
+		perror("loopback_bench: OpenSocket");
+		exit(EXIT_FAILURE);
+	}
+
+	if (g_bUring)
+		SetSocketIoBackend(hServer, SOCKET_IO_BACKEND_IO_URING);
+
+	if (g_nSendBuffer > 0)
+		SetSendBuffering(hServer, g_nSendBuffer);
+
+	if (g_nWorkers > 0)
+		RunServerEx(hServer, g_nPort, g_nWorkers);
+	else
+		RunServer(hServer, g_nPort);
+
+	exit(EXIT_SUCCESS);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Connect - Opens a client socket and connects it to the echo server.  Returns
+// the handle, or INVALID_HANDLE_VALUE.  ConnectToServer ends the process if
+// the connection is refused, so only call this once WaitForServer says the
+// server is up.
+
+static HSOCKET Connect(void)
+{
+	HSOCKET hSocket = OpenSocket(SOCKET_TYPE_CLIENT, ClientCallback);
+	if (INVALID_HANDLE_VALUE == hSocket)
+		return INVALID_HANDLE_VALUE;
+
+	ConnectToServer(hSocket, "127.0.0.1", g_nPort);
+	if (SOCKET_STATE_READY != GetSocketState(hSocket))
+	{
+		CloseSocket(hSocket);
+		return INVALID_HANDLE_VALUE;
+	}
+
+	if (g_nSendBuffer > 0)
+		SetSendBuffering(hSocket, g_nSendBuffer);
+
+	return hSocket;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// WaitForServer - Waits for the child's echo server to start accepting
+// connections.  Probes with a plain connect(), which, unlike ConnectToServer,
+// can be refused without ending the process.  Returns zero once the server
+// is up, or ERROR if it does not come up in time.
+
+static int WaitForServer(void)
+{
+	struct sockaddr_in addr;
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons((uint16_t)g_nPort);
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+	for (int i = 0; i < 200; i++)
+	{
+		int nProbe = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+		if (nProbe < 0)
+			return ERROR;
+
+		if (0 == connect(nProbe, (struct sockaddr*)&addr, sizeof(addr)))
+		{
+			close(nProbe);
+			return 0;
+		}
+
+		close(nProbe);
+
+		if (ECONNREFUSED != errno)
+			return ERROR;
+
+		usleep(10000);
+	}
+
+	return ERROR;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// StopServer - Kills and reaps the echo server child, if it is still around.
+// Registered with atexit() in the parent, so that the library's own exits on
+// failure do not leave the child behind either.
+
+static void StopServer(void)
+{
+	if (g_nServerPid <= 0)
+		return;
+
+	kill(g_nServerPid, SIGTERM);
+	waitpid(g_nServerPid, NULL, 0);
+
+	g_nServerPid = 0;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// ReceiveExactly - Receives and consumes exactly nBytes from the socket.
+// Returns zero on success, or ERROR.
+
+static int ReceiveExactly(HSOCKET hSocket, size_t nBytes)
+{
+	while (nBytes > 0)
+	{
+		const char* pData = NULL;
+		int nReceived = Receive(hSocket, &pData);
+		if (nReceived <= 0)
+			return ERROR;
+
+		size_t nCommit = ((size_t)nReceived < nBytes) ? (size_t)nReceived : nBytes;
+		ReceiveCommit(hSocket, nCommit);
+		nBytes -= nCommit;
+	}
+
+	return 0;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// MeasureThroughput - Streams messages of the specified size through the echo
+// server for g_nSeconds, keeping a window of them in flight, and reports
+// messages and megabytes per second (of payload, in each direction).
+
+static int MeasureThroughput(HSOCKET hSocket, size_t nPayload)
+{
+	char* pPayload = (char*)malloc(nPayload);
+	long long nMessages = 0;
+	int nWindow = (int)(MAX_BYTES_IN_FLIGHT / nPayload);
+	double dStart = 0.0;
+	double dElapsed = 0.0;
+
+	if (NULL == pPayload)
+		return ERROR;
+
+	memset(pPayload, 'x', nPayload);
+
+	if (nWindow < 1)
+		nWindow = 1;
+	if (nWindow > MAX_MESSAGES_IN_FLIGHT)
+		nWindow = MAX_MESSAGES_IN_FLIGHT;
+
+	dStart = NowSeconds();
+
+	for (int i = 0; i < nWindow; i++)
+	{
+		if (SendBytes(hSocket, pPayload, nPayload) < 0)
+			goto fail;
+	}
+
+	if (g_nSendBuffer > 0)
+		Flush(hSocket);
+
+	// Each echo that comes back makes room for one more message.
+	while ((dElapsed = NowSeconds() - dStart) < g_nSeconds)
+	{
+		if (ReceiveExactly(hSocket, nPayload) < 0
+				|| SendBytes(hSocket, pPayload, nPayload) < 0)
+			goto fail;
+
+		if (g_nSendBuffer > 0)
+			Flush(hSocket);
+
+		nMessages++;
+	}
+
+	// Drain the window, so that the next measurement starts clean.
+	for (int i = 0; i < nWindow; i++)
+	{
+		if (ReceiveExactly(hSocket, nPayload) < 0)
+			goto fail;
+	}
+
+	printf("{\"benchmark\":\"throughput\",\"payload_bytes\":%zu,\"window\":%d,"
+			"\"messages\":%lld,\"seconds\":%.6f,\"msgs_per_sec\":%.1f,\"mb_per_sec\":%.3f}\n",
+			nPayload, nWindow, nMessages, dElapsed, nMessages / dElapsed,
+			(double)nMessages * nPayload / dElapsed / (1024.0 * 1024.0));
+	fflush(stdout);
+
+	free(pPayload);
+	return 0;
+
+fail:
+	free(pPayload);
+	return ERROR;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// CompareDoubles - qsort comparison function for the latency samples.
+
+static int CompareDoubles(const void* pLeft, const void* pRight)
+{
+	double dLeft = *(const double*)pLeft;
+	double dRight = *(const double*)pRight;
+
+	return (dLeft > dRight) - (dLeft < dRight);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// MeasureLatency - Bounces one small message at a time off the echo server and
+// reports percentiles of the round-trip time, in microseconds.
+
+static int MeasureLatency(HSOCKET hSocket)
+{
+	char payload[LATENCY_PAYLOAD_SIZE];
+	double* pSamples = (double*)malloc(g_nLatencySamples * sizeof(double));
+	double dTotal = 0.0;
+
+	if (NULL == pSamples)
+		return ERROR;
+
+	memset(payload, 'x', sizeof(payload));
+
+	for (int i = 0; i < g_nLatencySamples; i++)
+	{
+		double dStart = NowSeconds();
+
+		if (SendBytes(hSocket, payload, sizeof(payload)) < 0)
+			goto fail;
+
+		if (g_nSendBuffer > 0)
+			Flush(hSocket);
+
+		if (ReceiveExactly(hSocket, sizeof(payload)) < 0)
+			goto fail;
+
+		pSamples[i] = (NowSeconds() - dStart) * 1e6;
+		dTotal += pSamples[i];
+	}
+
+	qsort(pSamples, g_nLatencySamples, sizeof(double), CompareDoubles);
+
+	printf("{\"benchmark\":\"latency\",\"payload_bytes\":%d,\"samples\":%d,"
+			"\"mean_us\":%.3f,\"p50_us\":%.3f,\"p99_us\":%.3f,\"p999_us\":%.3f,\"max_us\":%.3f}\n",
+			LATENCY_PAYLOAD_SIZE, g_nLatencySamples, dTotal / g_nLatencySamples,
+			pSamples[(int)(0.50 * (g_nLatencySamples - 1))],
+			pSamples[(int)(0.99 * (g_nLatencySamples - 1))],
+			pSamples[(int)(0.999 * (g_nLatencySamples - 1))],
+			pSamples[g_nLatencySamples - 1]);
+	fflush(stdout);
+
+	free(pSamples);
+	return 0;
+
+fail:
+	free(pSamples);
+	return ERROR;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// MeasureConnectionRate - Opens, connects and closes g_nConnections client
+// sockets, one after the other, and reports how many it got through per
+// second.  Returns zero on success, or ERROR if a socket could not be opened.
+
+static int MeasureConnectionRate(void)
+{
+	double dStart = NowSeconds();
+	double dElapsed = 0.0;
+
+	for (int i = 0; i < g_nConnections; i++)
+	{
+		HSOCKET hSocket = Connect();
+		if (INVALID_HANDLE_VALUE == hSocket)
+			return ERROR;
+
+		CloseSocket(hSocket);
+	}
+
+	dElapsed = NowSeconds() - dStart;
+
+	printf("{\"benchmark\":\"connection_rate\",\"connections\":%d,"
+			"\"seconds\":%.6f,\"connections_per_sec\":%.1f}\n",
+			g_nConnections, dElapsed, g_nConnections / dElapsed);
+	fflush(stdout);
+
+	return 0;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// ParseArguments - Reads the benchmark settings off the command line.
+// Returns zero on success, or ERROR if the command line is malformed.
+
+static int ParseArguments(int argc, char* argv[])
+{
+	int nOption = 0;
+
+	while (-1 != (nOption = getopt(argc, argv, "p:t:w:l:c:ub:")))
+	{
+		switch (nOption)
+		{
+			case 'p':	g_nPort = atoi(optarg);					break;
+			case 't':	g_nSeconds = atoi(optarg);				break;
+			case 'w':	g_nWorkers = atoi(optarg);				break;
+			case 'l':	g_nLatencySamples = atoi(optarg);		break;
+			case 'c':	g_nConnections = atoi(optarg);			break;
+			case 'u':	g_bUring = 1;							break;
+			case 'b':	g_nSendBuffer = (size_t)atol(optarg);	break;
+			default:	return ERROR;
+		}
+	}
+
+	if (g_nPort <= 0 || g_nSeconds <= 0 || g_nWorkers < 0
+			|| g_nLatencySamples <= 0 || g_nConnections <= 0)
+		return ERROR;
+
+	return 0;
+}
+
+int main(int argc, char* argv[])
+{
+	HSOCKET hSocket = INVALID_HANDLE_VALUE;
+	int nResult = EXIT_SUCCESS;
+
+	if (ParseArguments(argc, argv) < 0)
+	{
+		fprintf(stderr, "Usage: %s [-p port] [-t seconds] [-w workers] [-l samples] "
+				"[-c connections] [-u] [-b bytes]\n", argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	g_nServerPid = fork();
+	if (g_nServerPid < 0)
+	{
+		perror("loopback_bench: fork");
+		return EXIT_FAILURE;
+	}
+
+	if (0 == g_nServerPid)
+		RunEchoServer();
+
+	atexit(StopServer);
+
+	if (WaitForServer() < 0
+			|| INVALID_HANDLE_VALUE == (hSocket = Connect()))
+	{
+		fprintf(stderr, "loopback_bench: could not connect to the echo server on port %d\n",
+				g_nPort);
+		return EXIT_FAILURE;
+	}
+
+	for (size_t i = 0; i < sizeof(g_payloadSizes) / sizeof(g_payloadSizes[0]); i++)
+	{
+		fprintf(stderr, "loopback_bench: throughput, %zu-byte messages\n", g_payloadSizes[i]);
+		if (MeasureThroughput(hSocket, g_payloadSizes[i]) < 0)
+		{
+			perror("loopback_bench: throughput");
+			nResult = EXIT_FAILURE;
+			break;
+		}
+	}
+
+	if (EXIT_SUCCESS == nResult)
+	{
+		fprintf(stderr, "loopback_bench: latency\n");
+		if (MeasureLatency(hSocket) < 0)
+		{
+			perror("loopback_bench: latency");
+			nResult = EXIT_FAILURE;
+		}
+	}
+
+	CloseSocket(hSocket);
+
+	if (EXIT_SUCCESS == nResult)
+	{
+		fprintf(stderr, "loopback_bench: connection rate\n");
+		if (MeasureConnectionRate() < 0)
+		{
+			perror("loopback_bench: connection rate");
+			nResult = EXIT_FAILURE;
+		}
+	}
+
+	return nResult;
+}
+
+///////////////////////////////////////////////////////////////////////////////
@@ -5,6 +5,11 @@
 #ifndef __INETSOCK_API_H__
 #define __INETSOCK_API_H__
 
+#include <stddef.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
 #ifndef INVALID_HANDLE_VALUE
 #define INVALID_HANDLE_VALUE	NULL
 #endif
@@ -29,9 +34,91 @@ typedef enum
 	SOCKET_STATE_RECEIVING,
 	SOCKET_STATE_RECEIVED,
 	SOCKET_STATE_LISTENING,
+	SOCKET_STATE_TIMEOUT,	/* a timeout set with SetSocketTimeouts expired */
+	SOCKET_STATE_WRITE_HIGH_WATERMARK,	/* the send queue reached its high watermark (see SetSendQueue) */
+	SOCKET_STATE_WRITE_DRAINED,	/* the send queue fell back to its low watermark */
 	SOCKET_STATE_UNKNOWN,
 } SOCKET_STATE;
 
+/** @brief Number of SOCKET_STATE values; the size of SOCKETSTATS::nStateChanges. */
+#define SOCKET_STATE_COUNT		(SOCKET_STATE_UNKNOWN + 1)
+
+/**
+ * @brief Number of buckets in a LATENCYHISTOGRAM.  Each power of two, from 4 ns up to about 68
+ * seconds, is split into four buckets, so every recorded value is known to within 25%.
+ */
+#define SOCKET_LATENCY_BUCKETS	140
+
+/**
+ * @brief Bitmask of SOCKET_STATE values.  A socket's callback is only called for transitions into
+ * the states whose bits are set in the socket's event mask; transitions into any other state just
+ * update the socket's state.  Build masks with SOCKET_EVENT, e.g.,
+ * SOCKET_EVENT(SOCKET_STATE_ACCEPTED) | SOCKET_EVENT(SOCKET_STATE_RECEIVED).
+ */
+typedef unsigned int SOCKET_EVENT_MASK;
+
+/** @brief Gets the SOCKET_EVENT_MASK bit that corresponds to the specified SOCKET_STATE value. */
+#define SOCKET_EVENT(state)		((SOCKET_EVENT_MASK)1 << (state))
+
+/** @brief Event mask that subscribes to every state transition.  This is the default. */
+#define SOCKET_EVENT_ALL		((SOCKET_EVENT_MASK)~0U)
+
+/**
+ * @brief Values that select how the event loop that RunServer and RunServerEx run on a server
+ * socket does its I/O.
+ */
+typedef enum
+{
+	SOCKET_IO_BACKEND_EPOLL,	/** readiness notification with epoll, then read(); the default */
+	SOCKET_IO_BACKEND_IO_URING	/** batched accept, receive and close requests through io_uring */
+} SOCKET_IO_BACKEND;
+
+/**
+ * @brief Values that select which thread a socket's callback runs on.
+ */
+typedef enum
+{
+	SOCKET_CALLBACK_INLINE,		/** on the thread that changed the socket's state; the default */
+	SOCKET_CALLBACK_WORKERS		/** on the library's pool of callback worker threads */
+} SOCKET_CALLBACK_MODE;
+
+/**
+ * @brief Values that select how the data a socket receives is split into messages before it is
+ * handed to the socket's callback or to ReceiveMessage (see SetSocketFraming).
+ */
+typedef enum
+{
+	SOCKET_FRAMING_NONE,			/** raw bytes, as they come in; the default */
+	SOCKET_FRAMING_DELIMITER,		/** each message ends with a delimiter, e.g. "\r\n" */
+	SOCKET_FRAMING_PREFIX_8,		/** each message starts with its length in one byte */
+	SOCKET_FRAMING_PREFIX_16,		/** ... in two bytes, most significant first */
+	SOCKET_FRAMING_PREFIX_32,		/** ... in four bytes, most significant first */
+	SOCKET_FRAMING_PREFIX_VARINT	/** ... as a LEB128 varint, as in Protocol Buffers */
+} SOCKET_FRAMING;
+
+/**
+ * @brief Values that say which of a socket's timeouts expired (see SetSocketTimeouts).  The
+ * callback gets a pointer to one of these as the state bag of SOCKET_STATE_TIMEOUT.
+ */
+typedef enum
+{
+	SOCKET_TIMEOUT_IDLE,			/** nothing was sent or received for the idle timeout */
+	SOCKET_TIMEOUT_READ,			/** nothing was received for the read timeout */
+	SOCKET_TIMEOUT_WRITE			/** sent data sat unacknowledged for the write timeout */
+} SOCKET_TIMEOUT_KIND;
+
+/**
+ * @brief Named sets of kernel socket options for common workloads (see SetSocketTuningProfile
+ * and GetTuningProfile).
+ */
+typedef enum
+{
+	SOCKET_TUNING_DEFAULT,			/** the kernel's defaults; the default */
+	SOCKET_TUNING_LOW_LATENCY,		/** request/response traffic: no Nagle, quick ACKs, busy polling */
+	SOCKET_TUNING_BULK_THROUGHPUT,	/** large transfers: big kernel buffers, full segments */
+	SOCKET_TUNING_MANY_IDLE			/** many mostly quiet connections: small kernel buffers */
+} SOCKET_TUNING_PROFILE;
+
 /** @brief Values that indicate what type of socket we are using (e.g., a client socket or a
  *  server socket)
 */
@@ -40,15 +127,18 @@ typedef enum
 	SOCKET_TYPE_CLIENT,
 	SOCKET_TYPE_DATA,		/** typically only ever used in a FTP connection */
 	SOCKET_TYPE_SERVER,
+	SOCKET_TYPE_DATAGRAM,	/** UDP; message-oriented, and not necessarily connected (see SendTo) */
 	SOCKET_TYPE_UNKNOWN
 } SOCKET_TYPE;
 
 /**
  * \brief Opaque type that represents a socket handle.  A socket handle is a Windows-ish concept
  * whereas Linux has a int that is the socket file descriptor.  However, this allows functions to
- * use sockets without worrying about how they are implemented.
+ * use sockets without worrying about how they are implemented.  A handle is an encoded value, not a
+ * pointer, and must never be dereferenced; once a socket has been closed, every handle to it is stale
+ * and is treated by the functions in this library as if it were INVALID_HANDLE_VALUE.
  */
-typedef struct _tagSOCKET *HSOCKET;
+typedef struct _tagHSOCKET *HSOCKET;
 
 /*typedef struct _tagSOCKETSENDDATA {
 	HSOCKET hSocket;
@@ -56,6 +146,113 @@ typedef struct _tagSOCKET *HSOCKET;
 	int nBytesSent;
 } SOCKETSENDDATA, *PSOCKETSENDDATA;*/
 
+/**
+ * @brief State bag that is passed to a socket's callback along with the SOCKET_STATE_RECEIVED
+ * state.  Tells the callback where the data that has come in lives and how many bytes of it
+ * there are.
+ * @remarks pData points straight into the socket's receive ring buffer and is only valid for
+ * the duration of the callback.  It covers every byte that has not been consumed yet, including
+ * any the callback left behind last time.  If the callback does not call ReceiveCommit, all of
+ * the bytes are consumed when it returns; otherwise, only the committed bytes are, and the rest
+ * are handed to the callback again, followed by new data, the next time data arrives.
+ */
+typedef struct _tagSOCKETRECVDATA {
+	const char* pData;		/* Points to the unconsumed bytes; NOT null-terminated */
+	int nBytesReceived;		/* Number of bytes pData refers to */
+} SOCKETRECVDATA, *PSOCKETRECVDATA;
+
+/**
+ * @brief State bag that is passed to a socket's callback by SendFile and ReceiveFile, along with
+ * SOCKET_STATE_SENDING or SOCKET_STATE_RECEIVING after each chunk of the file has been moved, and
+ * along with SOCKET_STATE_SENT or SOCKET_STATE_RECEIVED once the transfer is complete.
+ */
+typedef struct _tagSOCKETFILEPROGRESS {
+	size_t nBytesTransferred;	/* Number of bytes of the file moved so far */
+	size_t nBytesTotal;			/* Number of bytes to be moved in all; zero if not known up front */
+} SOCKETFILEPROGRESS, *PSOCKETFILEPROGRESS;
+
+/**
+ * @brief One datagram sent or received on a SOCKET_TYPE_DATAGRAM socket.  Passed to SendDatagrams
+ * and filled in by ReceiveFrom and ReceiveDatagrams.  Also the state bag that is passed to the
+ * callback of a datagram socket that RunServer services, along with SOCKET_STATE_RECEIVED, once
+ * for each datagram that arrives.
+ * @remarks With segmentation offload (see SetDatagramSegmentation), one SOCKETDATAGRAM may stand
+ * for a run of datagrams to or from the same peer: every nSegmentSize bytes of the payload are a
+ * datagram of their own, and the last one may be shorter.  A received pData refers to the
+ * socket's receive buffer and is only valid until the next receive on the socket (in a callback,
+ * only for the duration of the callback).
+ */
+typedef struct _tagSOCKETDATAGRAM {
+	const char* pData;			/* The payload; NOT null-terminated.  Must stay the first member */
+	size_t nLength;				/* Number of bytes pData refers to */
+	size_t nSegmentSize;		/* Size of each datagram the payload is split into; 0 if it is one */
+	struct sockaddr_storage addr;	/* The peer the datagram came from or goes to */
+	socklen_t nAddrLength;		/* Length of addr; 0, when sending, for the connected peer */
+} SOCKETDATAGRAM, *PSOCKETDATAGRAM;
+
+/**
+ * @brief Kernel socket options that trade latency against throughput and memory.  Passed to
+ * SetSocketTuning and filled in by GetSocketTuning and GetTuningProfile.  Zero leaves an option
+ * at the kernel's default.
+ */
+typedef struct _tagSOCKETTUNING {
+	int bNoDelay;				/* TCP_NODELAY: send small writes at once, rather than coalescing them */
+	int bQuickAck;				/* TCP_QUICKACK: acknowledge data at once, rather than after a delay */
+	int nSendBufferSize;		/* SO_SNDBUF, in bytes; zero for the kernel's automatic sizing */
+	int nRecvBufferSize;		/* SO_RCVBUF, in bytes; zero for the kernel's automatic sizing */
+	int nBusyPollUs;			/* SO_BUSY_POLL: microseconds to poll the device for data before sleeping */
+	int bFastOpen;				/* TCP Fast Open: the first Send goes out in the SYN (see SetSocketTuning); no profile sets it */
+	int nNotSentLowWatermark;	/* TCP_NOTSENT_LOWAT: most unsent bytes the kernel holds before the socket stops being writable */
+} SOCKETTUNING, *PSOCKETTUNING;
+
+/**
+ * @brief Counters kept by the cache of host name lookups that ConnectToServer and
+ * ConnectToServerAsync resolve through.  Filled in by GetDnsCacheStats.
+ */
+typedef struct _tagDNSCACHESTATS {
+	unsigned long long nHits;			/* Lookups answered with addresses from the cache */
+	unsigned long long nNegativeHits;	/* Lookups answered from the cache with "no such host" */
+	unsigned long long nMisses;		/* Lookups that had to go to the resolver */
+	unsigned long long nRefreshes;		/* Background refreshes done */
+} DNSCACHESTATS, *PDNSCACHESTATS;
+
+/**
+ * @brief Counters of the I/O done on a socket, or, summed over every socket, in the whole
+ * process.  Filled in by GetSocketStats and, as part of a GLOBALSTATS, by GetGlobalStats.
+ */
+typedef struct _tagSOCKETSTATS {
+	unsigned long long nBytesSent;		/* Bytes the kernel accepted for sending */
+	unsigned long long nBytesReceived;	/* Bytes read from the kernel */
+	unsigned long long nSendCalls;		/* System calls made to send data (sendmsg, sendfile) */
+	unsigned long long nRecvCalls;		/* System calls (or io_uring requests) made to receive data */
+	unsigned long long nPartialSends;	/* Send calls that took fewer bytes than were offered */
+	unsigned long long nSendWouldBlock;	/* Send calls that failed with EAGAIN */
+	unsigned long long nRecvWouldBlock;	/* Receive calls that failed with EAGAIN */
+	unsigned long long nStateChanges[SOCKET_STATE_COUNT];	/* Transitions into each SOCKET_STATE */
+} SOCKETSTATS, *PSOCKETSTATS;
+
+/**
+ * @brief Distribution of a latency, in nanoseconds.  Bucket i counts the samples whose value
+ * falls in the i-th of a series of ranges that grows geometrically; use GetLatencyPercentile to
+ * read the histogram rather than interpreting the buckets directly.
+ */
+typedef struct _tagLATENCYHISTOGRAM {
+	unsigned long long nCount;			/* Number of samples */
+	unsigned long long nTotalNs;		/* Sum of all samples, for computing the mean */
+	unsigned long long nMaxNs;			/* Largest sample */
+	unsigned long long nBuckets[SOCKET_LATENCY_BUCKETS];	/* Samples per bucket */
+} LATENCYHISTOGRAM, *PLATENCYHISTOGRAM;
+
+/**
+ * @brief Process-wide counters and latency histograms.  Filled in by GetGlobalStats.
+ */
+typedef struct _tagGLOBALSTATS {
+	SOCKETSTATS totals;					/* Counters summed over every socket, open or closed */
+	LATENCYHISTOGRAM connectLatency;	/* ConnectToServer and ConnectToServerAsync, resolution included */
+	LATENCYHISTOGRAM sendLatency;		/* Send, SendBytes and SendV, from call to return */
+	LATENCYHISTOGRAM callbackLatency;	/* Time spent in socket callbacks */
+} GLOBALSTATS, *PGLOBALSTATS;
+
 /**
  * @brief Pointer to a function that will be executed as a callback each time a given socket's
  * state changes.
@@ -67,15 +264,66 @@ typedef struct _tagSOCKET *HSOCKET;
  */
 typedef void (*LPSOCKET_EVENT_ROUTINE)(HSOCKET hSocket, void* lpUserState);
 
+/**
+ * @brief Gets a connected client socket to the specified host and port from the library's
+ * connection pool, reusing an idle connection to the same destination if there is a good one and
+ * connecting a new one otherwise.
+ * @param pszHostAddress Points to a buffer that contains a null terminated string that contains
+ * either a valid IP address or DNS-resolvable hostname.
+ * @param nPort Integer specifying the port on which the server is listening.
+ * @param lpfnCallback Function to be called when the state of the socket changes.
+ * @returns Handle to a socket that is connected and in the SOCKET_STATE_READY state; or
+ * INVALID_HANDLE_VALUE, with errno set, if no connection could be had.  errno is EAGAIN if the
+ * destination already has as many connections as ConfigureConnectionPool allows.
+ * @remarks Before an idle connection is reused, it is checked for having been hung up on by the
+ * peer or having unread data on it; such connections are closed instead.  A new connection fires
+ * OPENED and CONNECTED as usual; a reused one fires nothing.  Give the socket back with
+ * ReleaseConnection when done with it, or close it with CloseSocket if it is no longer fit for
+ * reuse (e.g., the protocol does not allow another request on it).  pszHostAddress may be a
+ * "unix:" address (see ConnectToServer), in which case nPort is ignored.
+ */
+HSOCKET AcquireConnection(const char* pszHostAddress, int nPort,
+		LPSOCKET_EVENT_ROUTINE lpfnCallback);
+
 /**
  * @brief Closes all connections on the specified socket and releases its resources back to the
  * operating system.
  * @param HSOCKET handle of the socket to be closed.
  * @remarks This function does nothing if the socket is already in the SOCKET_STATE_CLOSED state or
- * has had its resources released.
+ * has had its resources released.  It may be called from any thread, even while other threads
+ * are sending or receiving on the socket: their calls fail (with EPIPE or EBADF) instead of
+ * blocking, the socket's state can no longer change except to SOCKET_STATE_CLOSED, and the
+ * socket's resources are released once the last of those calls has returned.  A socket that is
+ * serviced by RunServer or RunServerEx is only hung up on when closed from any other thread than
+ * its event loop's; the loop then closes it.
  */
 void CloseSocket(HSOCKET hSocket);
 
+/**
+ * @brief Sets the limits that the connection pool behind AcquireConnection works within.
+ * @param nMaxPerHost Maximum number of connections, checked out and idle together, to any one
+ * host and port.  Zero or less restores the default of 32.
+ * @param nIdleTimeoutSeconds Number of seconds a connection may sit idle in the pool before it is
+ * closed rather than reused.  Zero turns pooling off: released connections are closed at once.
+ * The default is 60.
+ */
+void ConfigureConnectionPool(int nMaxPerHost, int nIdleTimeoutSeconds);
+
+/**
+ * @brief Sets how the library caches host name lookups.
+ * @param nTtlSeconds Number of seconds a successful lookup is reused for; zero turns the cache
+ * off.  The default is 60.
+ * @param nNegativeTtlSeconds Number of seconds the fact that a host name does not exist is
+ * remembered for; zero turns negative caching off.  The default is 5.
+ * @param bBackgroundRefresh Nonzero to have a host name that is in use looked up again, on a
+ * background thread, once it is three quarters of the way to expiring, so that callers keep
+ * getting cached answers.  Off by default.
+ * @remarks The libc resolver does not report the TTLs of the DNS records it finds, so the
+ * cache's own TTLs are used instead.  Address literals are never cached.  Entries already in the
+ * cache keep the lifetime they were given; call FlushDnsCache to be rid of them.
+ */
+void ConfigureDnsCache(int nTtlSeconds, int nNegativeTtlSeconds, int bBackgroundRefresh);
+
 /**
  * @brief Connects to a remote server using the speified socket, host address, and port number.
  * @param hSocket Handle to the socket that should be used for connection.  Must have already been
@@ -83,16 +331,109 @@ void CloseSocket(HSOCKET hSocket);
  * @param pszHostAddress Points to a buffer that contains a null terminated string that contains either
  * a valid IPv4 address or DNS-resolvable hostname.
  * @param nPort Integer specifying the port on which the server is listening.
+ * @remarks A SOCKET_TYPE_DATAGRAM socket may be connected too.  No packets are exchanged; the
+ * address just becomes the socket's default peer, which is what Send, SendBytes and SendV send
+ * to, and the only peer the socket then receives from.
+ *
+ * A server on the same machine can be reached over a Unix-domain socket instead of TCP, which
+ * skips the TCP/IP stack altogether: pass "unix:/path/to/socket" (a socket file) or
+ * "unix:@name" (a name in Linux's abstract namespace) as pszHostAddress, and the socket becomes
+ * a Unix-domain socket as it connects.  nPort is ignored.  See SetServerAddress for the server
+ * side.
+ *
+ * A connect that fails ends the program, as KillSocket does.  A TCP socket that has been tuned
+ * for Fast Open (bFastOpen in SetSocketTuning) is the exception, once the kernel holds a Fast
+ * Open cookie for the server.  Such a socket sends nothing while it connects, so ConnectToServer
+ * reports SOCKET_STATE_CONNECTED without having heard from the server.  A server that refuses
+ * the connection or cannot be reached is then reported by the first Send, SendBytes or SendV
+ * instead.  That call fails with errno set to ECONNREFUSED, EHOSTUNREACH, ETIMEDOUT or the like,
+ * and the socket goes into SOCKET_STATE_ERROR.
  */
 void ConnectToServer(HSOCKET hSocket, const char* pszHostAddress, int nPort);
 
+/**
+ * @brief Starts connecting to a remote server using the specified socket, host address, and port
+ * number, and returns without waiting for the connection to be made.
+ * @param hSocket Handle to the socket that should be used for connection.  Must have been opened
+ * as a SOCKET_TYPE_CLIENT socket.
+ * @param pszHostAddress Points to a buffer that contains a null terminated string that contains
+ * either a valid IPv4 or IPv6 address or a DNS-resolvable hostname.
+ * @param nPort Integer specifying the port on which the server is listening.
+ * @param nTimeoutMs Number of milliseconds to allow for the connection to be made; zero or less
+ * means no limit other than the operating system's own.
+ * @returns Zero if the connection is being made, in which case the callback is later called with
+ * either SOCKET_STATE_CONNECTED or SOCKET_STATE_ERROR; ERROR, with errno set, if the connection
+ * could not be started (e.g., the host name could not be resolved).
+ * @remarks Every address the host name resolves to is tried.  Attempts start one after another,
+ * alternating between IPv6 and IPv4, without waiting for earlier ones to fail; the first to
+ * connect wins.  The CONNECTED and ERROR callbacks are called on a thread that belongs to this
+ * library, which all asynchronous connects in the process share, so a callback should not block.
+ * Closing the socket before the connection has been made cancels the connect.  A "unix:"
+ * address (see ConnectToServer) is taken as well; nPort is then ignored.
+ */
+int ConnectToServerAsync(HSOCKET hSocket, const char* pszHostAddress, int nPort,
+		int nTimeoutMs);
+
+/**
+ * @brief Writes out everything that Send, SendBytes or SendV have left in the output buffer of a
+ * socket in buffered send mode (see SetSendBuffering), and pushes out anything the kernel is
+ * holding back to fill a segment.  For a socket in non-blocking send mode (see SetSendQueue),
+ * also writes out as much of the send queue as the kernel will take without blocking.
+ * @param hSocket Socket handle representing the TCP endpoint whose output is to be flushed.
+ * @returns ERROR if the operation failed; number of bytes written from the output buffer
+ * otherwise (zero if it was empty, or the socket is not in buffered send mode).
+ *	If the ERROR value is returned, errno should be examined to determine the
+ *  cause of the error.  The socket's state will be set to SOCKET_STATE_ERROR.
+ * @remarks Sockets serviced by RunServer or RunServerEx are flushed automatically once the
+ * callbacks for each batch of events have run, so callbacks need not call this.  Threads other
+ * than the event loop's that send on such a socket in buffered send mode have to, though.
+ */
+int Flush(HSOCKET hSocket);
+
+/**
+ * @brief Closes every idle connection in the connection pool behind AcquireConnection.
+ */
+void FlushConnectionPool(void);
+
+/**
+ * @brief Throws away every cached host name lookup, so that the next connect to each host goes
+ * to the resolver.  The counters reported by GetDnsCacheStats are not reset.
+ */
+void FlushDnsCache(void);
+
+/**
+ * @brief Gets the counters kept by the cache of host name lookups.
+ * @param pStats Address of a DNSCACHESTATS structure to be filled in.
+ */
+void GetDnsCacheStats(PDNSCACHESTATS pStats);
+
+/**
+ * @brief Gets the process-wide I/O counters and latency histograms.
+ * @param pStats Address of a GLOBALSTATS structure to be filled in.
+ * @remarks Counters are kept per thread, without locks, and summed up here; the result is a
+ * consistent snapshot of each counter, but not necessarily of all of them at the same instant.
+ * Only connects that succeed are recorded in the connect latency histogram.
+ */
+void GetGlobalStats(PGLOBALSTATS pStats);
+
 /**
  * @brief Call this function if the state of the specified socket is SOCKET_STATE_ERROR.
  * @param hSocket Socket handle (of type HSOCKET) that references the socket you want information for.
  * @return Long integer that corresponds to the operating system errno code.
+ * @remarks The code is the value errno had when the socket was put into SOCKET_STATE_ERROR, on
+ * whichever thread that happened; it does not change when other calls fail afterwards.
  */
 long GetLastError(HSOCKET hSocket);
 
+/**
+ * @brief Reads a percentile off a latency histogram.
+ * @param pHistogram Histogram to read, e.g., one of the members of a GLOBALSTATS.
+ * @param dPercentile Percentile to read, from 0.0 to 100.0 (e.g., 99.9).
+ * @returns Upper bound, in nanoseconds, of the bucket the percentile falls in, capped at the
+ * largest sample; zero if the histogram is empty.
+ */
+unsigned long long GetLatencyPercentile(const LATENCYHISTOGRAM* pHistogram, double dPercentile);
+
 /**
  * @brief Gets the SOCKET_STATE value that corresponds to the state that the socket with
  * the specified handle is currently in.
@@ -101,6 +442,24 @@ long GetLastError(HSOCKET hSocket);
  */
 SOCKET_STATE GetSocketState(HSOCKET hSocket);
 
+/**
+ * @brief Gets the I/O counters of the specified socket.
+ * @param hSocket Socket handle (of type HSOCKET) that references the socket you want information for.
+ * @param pStats Address of a SOCKETSTATS structure to be filled in.
+ * @returns Zero on success; ERROR if the handle is not valid.
+ * @remarks The counters start from zero when the socket is opened (or accepted) and are kept up
+ * to date without locks, so they are cheap enough to leave on at all times.
+ */
+int GetSocketStats(HSOCKET hSocket, PSOCKETSTATS pStats);
+
+/**
+ * @brief Gets the kernel socket options that the specified socket is tuned with.
+ * @param hSocket Handle to the socket.
+ * @param pTuning Address of a SOCKETTUNING that is filled in with the socket's settings.
+ * @returns Zero on success; ERROR, with errno set, if the handle is not valid.
+ */
+int GetSocketTuning(HSOCKET hSocket, PSOCKETTUNING pTuning);
+
 /**
  * @brief Gets the SOCKET_TYPE value that the socket with the specified handle was opened as.
  * @param hSocket Socket handle (of type HSOCKET) that references the socket you want information for.
@@ -108,6 +467,15 @@ SOCKET_STATE GetSocketState(HSOCKET hSocket);
  */
 SOCKET_TYPE GetSocketType(HSOCKET hSocket);
 
+/**
+ * @brief Gets the settings behind a tuning profile, to adjust before passing them to
+ * SetSocketTuning.
+ * @param profile One of the SOCKET_TUNING_PROFILE values.
+ * @param pTuning Address of a SOCKETTUNING that is filled in with the profile's settings.
+ * @returns Zero on success; ERROR, with errno set to EINVAL, if the profile is unknown.
+ */
+int GetTuningProfile(SOCKET_TUNING_PROFILE profile, PSOCKETTUNING pTuning);
+
 /**
  * @brief Forcibly terminates the program with the ERROR exit code while also closing
  * and deallocating the memory for the socket.
@@ -121,15 +489,197 @@ void KillSocket(HSOCKET hSocket, const char* pszMessage);
  */
 HSOCKET OpenSocket(SOCKET_TYPE type, LPSOCKET_EVENT_ROUTINE lpfnCallback);
 
+/**
+ * @brief Opens (creates) a new socket of the specified type, whose callback is only called for the
+ * state transitions in the specified event mask.
+ * @param type One of the SOCKET_TYPE values.  Specifies which type of socket is to be opened.
+ * @param lpfnCallback Function to be called when the socket enters a state in dwEventMask.
+ * @param dwEventMask Bitmask of the SOCKET_STATE values the callback wants to hear about; see
+ * SOCKET_EVENT.  Pass SOCKET_EVENT_ALL to get the same behavior as OpenSocket.
+ * @returns Handle to the new socket, or INVALID_HANDLE_VALUE on failure.
+ * @remarks Client sockets accepted by a server socket inherit the server socket's event mask.
+ * If SOCKET_STATE_RECEIVED is not in the mask, data that arrives on sockets the server's event
+ * loop is servicing is consumed without anyone seeing it.  The new socket starts out with the
+ * tuning profile selected by SetDefaultTuningProfile, and accepted sockets with their server
+ * socket's tuning.
+ */
+HSOCKET OpenSocketEx(SOCKET_TYPE type, LPSOCKET_EVENT_ROUTINE lpfnCallback,
+		SOCKET_EVENT_MASK dwEventMask);
+
+/**
+ * @brief Lends the caller a pointer to the data that has been received on a socket but not
+ * consumed yet.  The data is not copied: the pointer refers straight into the socket's receive
+ * ring buffer.  If there is no such data, reads from the operating system first, which blocks if
+ * the socket is in blocking mode.
+ * @param hSocket Socket handle representing the TCP endpoint from which to receive data.
+ * @param ppData Address of a pointer that receives the address of the data.  The data is NOT
+ * null-terminated, and the pointer is only valid until the next call to any receive function
+ * on the same socket.
+ * @returns Number of bytes available at *ppData; zero if the peer has closed the connection; or
+ * ERROR if the operation failed.  If ERROR is returned, errno should be examined to determine the
+ * cause of the error: EAGAIN means a non-blocking socket has nothing to read yet; anything else
+ * also puts the socket in SOCKET_STATE_ERROR.
+ * @remarks Call ReceiveCommit to mark bytes as consumed; until then, Receive keeps returning
+ * them.  The ring buffer is allocated the first time the socket receives data and then reused
+ * for the life of the socket, so steady-state receiving does not allocate memory.  Only one
+ * thread at a time may receive on a socket.
+ */
+int Receive(HSOCKET hSocket, const char** ppData);
+
+/**
+ * @brief Lends the caller a pointer to the next complete message received on a socket that has
+ * a framing mode (see SetSocketFraming), reading from the operating system until the whole
+ * message is in.  The message is not copied: the pointer refers straight into the socket's
+ * receive ring buffer.
+ * @param hSocket Socket handle representing the TCP endpoint from which to receive data.
+ * @param ppData Address of a pointer that receives the address of the message, without its
+ * length prefix or delimiter.  The message is NOT null-terminated, and the pointer is only valid
+ * until the next call to any receive function on the same socket.  Set to NULL if the peer has
+ * closed the connection.
+ * @returns Number of bytes in the message, which may be zero (e.g., an empty line); zero, with
+ * *ppData set to NULL, if the peer has closed the connection; or ERROR if the operation failed.
+ * If ERROR is returned, errno should be examined to determine the cause of the error: EAGAIN
+ * means a non-blocking socket does not have a whole message yet; EINVAL, that the socket has no
+ * framing mode; anything else (e.g., EMSGSIZE for a message that is too large) also puts the
+ * socket in SOCKET_STATE_ERROR.
+ * @remarks The message is consumed as it is returned; there is no need to call ReceiveCommit.
+ * Intended for sockets that are not serviced by RunServer or RunServerEx, whose callbacks get
+ * their messages in SOCKET_STATE_RECEIVED instead.  Only one thread at a time may receive on a
+ * socket.
+ */
+int ReceiveMessage(HSOCKET hSocket, const char** ppData);
+
+/**
+ * @brief Marks bytes returned by Receive (or passed to the callback in a SOCKETRECVDATA) as
+ * consumed, so that their space in the socket's receive ring buffer can be reused.
+ * @param hSocket Socket handle representing the TCP endpoint the data was received on.
+ * @param nBytes Number of bytes, counting from the start of the unconsumed data, to consume.
+ * Values larger than the amount of unconsumed data consume all of it.
+ */
+void ReceiveCommit(HSOCKET hSocket, size_t nBytes);
+
+/**
+ * @brief Receives as many datagrams as are waiting on a SOCKET_TYPE_DATAGRAM socket, up to a
+ * limit, with a single recvmmsg() system call.  If none are waiting, waits for the first one (if
+ * the socket is in blocking mode), but not for any more after that.
+ * @param hSocket Handle to the datagram socket to receive on.
+ * @param pDatagrams Array that is filled in with a SOCKETDATAGRAM for each datagram received,
+ * including the address of the peer that sent it.
+ * @param nMaxDatagrams Number of elements in the pDatagrams array.  At most DATAGRAM_BATCH_SIZE
+ * (32, by default) datagrams are received per call.
+ * @returns Number of datagrams received; or ERROR if the operation failed, in which case errno
+ * should be examined to determine the cause of the error.  EAGAIN means a non-blocking socket
+ * has nothing to read yet.
+ * @remarks The payloads are not copied out: each pData refers to the socket's receive buffer,
+ * which is allocated the first time the socket receives, and is only valid until the next
+ * receive on the socket.  A datagram that is larger than the buffer's slot for it (64 KB, by
+ * default) is cut short.  Errors on a datagram socket concern one packet, not the socket, so it
+ * does not go into SOCKET_STATE_ERROR.  Only one thread at a time may receive on a socket.
+ */
+int ReceiveDatagrams(HSOCKET hSocket, PSOCKETDATAGRAM pDatagrams, int nMaxDatagrams);
+
+/**
+ * @brief Takes open file descriptors that the peer of a socket in descriptor passing mode (see
+ * SetDescriptorPassing) has sent over, in the order in which they arrived.
+ * @param hSocket Handle to the Unix-domain socket the descriptors came in on.
+ * @param pFds Array that is filled in with the descriptors.
+ * @param nMaxFds Number of elements in the pFds array.
+ * @returns Number of descriptors taken, which is zero if none are waiting; or ERROR if the
+ * operation failed, in which case errno should be examined to determine the cause of the error.
+ * @remarks The descriptors belong to the caller from then on, and are close-on-exec.  They come
+ * in with the data they were sent with, so call this from the RECEIVED callback, or after
+ * Receive.  Descriptors that are never taken are closed along with the socket.
+ */
+int ReceiveDescriptors(HSOCKET hSocket, int* pFds, int nMaxFds);
+
+/**
+ * @brief Receives data from a connected socket directly into a file, without copying it through
+ * user memory.  Intended for SOCKET_TYPE_DATA sockets (e.g., the receiving end of an FTP data
+ * connection).
+ * @param hSocket Socket handle representing the TCP endpoint from which to receive data.
+ * @param nFileDescriptor Descriptor of the file to write to.  Must be open for writing.
+ * @param nOffset Offset in the file at which to start writing.  The file position of
+ * nFileDescriptor is not changed.
+ * @param nCount Number of bytes to receive, or zero to receive until the peer closes the
+ * connection.
+ * @returns ERROR if the operation failed; number of bytes written to the file otherwise.
+ *	If the ERROR value is returned, errno should be examined to determine the
+ *  cause of the error.  The socket's state will be set to SOCKET_STATE_ERROR.
+ * @remarks Any data already received into the socket's receive buffer (e.g., by Receive) is
+ * written to the file first.  Progress is reported through the socket callback: the callback
+ * is fired with SOCKET_STATE_RECEIVING after each chunk and with SOCKET_STATE_RECEIVED at the
+ * end, with a pointer to a SOCKETFILEPROGRESS as the state bag each time.
+ */
+ssize_t ReceiveFile(HSOCKET hSocket, int nFileDescriptor, off_t nOffset, size_t nCount);
+
+/**
+ * @brief Receives one datagram on a SOCKET_TYPE_DATAGRAM socket, along with the address of the
+ * peer that sent it.  Works like ReceiveDatagrams with room for one datagram.
+ * @param hSocket Handle to the datagram socket to receive on.
+ * @param pDatagram Address of a SOCKETDATAGRAM that is filled in with the datagram.
+ * @returns Number of bytes in the datagram, which may be zero; or ERROR if the operation failed,
+ * in which case errno should be examined to determine the cause of the error.
+ */
+int ReceiveFrom(HSOCKET hSocket, PSOCKETDATAGRAM pDatagram);
+
+/**
+ * @brief Gives a socket that was obtained from AcquireConnection back to the connection pool, so
+ * that a later AcquireConnection to the same host and port can reuse the connection.
+ * @param hSocket Handle to the socket to give back.  The caller must not use it again.
+ * @remarks The socket is closed instead if it is not in the SOCKET_STATE_READY state, if it did
+ * not come from AcquireConnection, or if pooling has been turned off.  Its callback is not called
+ * while it sits in the pool.
+ */
+void ReleaseConnection(HSOCKET hSocket);
+
 /**
  * @brief Runs the listen/accept/connect loop for a server on a specified port number, using the
  * socket specified as the server's TCP endpoint.  The server runs on the same local machine
  * as which the calling program resides.
  * @param hSocket Handle to the server TCP endpoint's socket.
  * @param nPort Port number on which the server is to listen for incoming connections.
+ * @remarks The loop is a single-threaded, edge-triggered epoll reactor, so one thread can serve
+ * many clients at once.  Each incoming connection gets its own HSOCKET, which shares the server
+ * socket's callback.  The callback is fired on the server socket with SOCKET_STATE_ACCEPTED and
+ * the new client HSOCKET as the state bag; on the client socket with SOCKET_STATE_RECEIVED and a
+ * pointer to a SOCKETRECVDATA as the state bag each time a batch of data arrives; and on the client socket
+ * with SOCKET_STATE_CLOSED when the peer hangs up or CloseSocket is called on it.  This function
+ * does not return until CloseSocket is called on the server socket (e.g., from the callback) or
+ * a fatal error occurs, in which case the server socket is put in SOCKET_STATE_ERROR.
+ *
+ * A SOCKET_TYPE_DATAGRAM socket may be run as a server too.  It is bound to nPort and, rather than
+ * accepting connections, receives datagrams from every peer in batches (see ReceiveDatagrams);
+ * the callback is fired on it with SOCKET_STATE_RECEIVED and a pointer to a SOCKETDATAGRAM as the
+ * state bag once for each datagram.  Reply with SendDatagrams, using the datagram's address.
+ * Datagram sockets always use the epoll backend.
+ *
+ * A socket that was given a Unix-domain address with SetServerAddress listens on that address,
+ * and nPort is ignored.
  */
 void RunServer(HSOCKET hSocket, int nPort);
 
+/**
+ * @brief Runs a multi-threaded server on a specified port number.  Works like RunServer, except
+ * that it runs one listening socket and one event loop per worker thread, with every worker
+ * pinned to its own CPU core.
+ * @param hSocket Handle to the server TCP endpoint's socket.  The first worker listens on it.
+ * @param nPort Port number on which the server is to listen for incoming connections.
+ * @param nThreads Number of worker threads to run.  Zero or less means one per online CPU core;
+ * one is the same as calling RunServer.
+ * @remarks All of the listening sockets are bound to nPort with SO_REUSEPORT, so the kernel
+ * spreads incoming connections across the workers.  A client HSOCKET is serviced for its whole
+ * lifetime by the worker that accepted it, so callbacks for any one client always fire on the
+ * same thread, but callbacks for different clients may fire on different threads at the same time.
+ * SOCKET_STATE_ACCEPTED fires on the listening socket of the worker that accepted the connection,
+ * which, for all but the first worker, is a handle the library opens and closes itself.  Calling
+ * CloseSocket on any listening socket from its callback stops every worker.  This function does
+ * not return until all of the workers have stopped.  A SOCKET_TYPE_DATAGRAM socket may be run
+ * this way too; the kernel then spreads the datagrams across the workers by the peer's address.
+ * With a Unix-domain address (see SetServerAddress), which cannot be bound more than once, the
+ * workers all listen on the one socket, and the first worker that gets to a connection takes it.
+ */
+void RunServerEx(HSOCKET hSocket, int nPort, int nThreads);
+
 /**
  * @brief Sends data over an open and connected socket.  This function will check the socket
  * for a SOCKET_STATE_CONNECTED state, and refuses to run if this is not the case.
@@ -138,9 +688,343 @@ void RunServer(HSOCKET hSocket, int nPort);
  * @returns ERROR if the operation failed; number of bytes sent otherwise.
  *	If the ERROR value is returned, errno should be examined to determine the
  *  cause of the error.  The socket's state will be set to SOCKET_STATE_ERROR.
+ * @remarks Several threads may send on the same socket at once.  They take turns, each call
+ * waiting until the one before it (including the SENDING and SENT callbacks it fires) is done,
+ * so the data of one call is never interleaved with that of another.
  */
 int Send(HSOCKET hSocket, const char* pszData);
 
+/**
+ * @brief Sends a buffer of binary data over an open and connected socket.  Works like Send,
+ * except that the length of the data is given explicitly, so the data may contain zero bytes
+ * and is never scanned for a terminator.
+ * @param hSocket Socket handle representing the TCP endpoint over which to send data.
+ * @param pvData Pointer to a buffer containing the data to be sent.
+ * @param nLength Number of bytes in the buffer to send.  Must not exceed INT_MAX.
+ * @returns ERROR if the operation failed; number of bytes sent otherwise.
+ *	If the ERROR value is returned, errno should be examined to determine the
+ *  cause of the error.  The socket's state will be set to SOCKET_STATE_ERROR.
+ * @remarks Partial writes are handled internally: the function does not return until every
+ * byte has been handed to the kernel or an error occurs.  The exception is a call made on the
+ * thread of the socket's own event loop (e.g., from its RECEIVED callback), which must never
+ * wait for a slow peer: there, whatever the kernel will not take is put on the socket's send
+ * queue (see SetSendQueue) for the loop to write out, and the call counts it as sent.
+ * SendFile and SendDescriptors cannot queue, and fail with errno set to EAGAIN instead.
+ */
+int SendBytes(HSOCKET hSocket, const void* pvData, size_t nLength);
+
+/**
+ * @brief Sends several datagrams on a SOCKET_TYPE_DATAGRAM socket, as many as possible per
+ * sendmmsg() system call.  Each datagram may go to a different peer.
+ * @param hSocket Handle to the datagram socket to send on.
+ * @param pDatagrams Array of SOCKETDATAGRAM structures describing the datagrams to send.  A
+ * datagram whose nAddrLength is zero goes to the peer the socket is connected to; one whose
+ * nSegmentSize is nonzero is split into datagrams of that size by the kernel or the NIC (UDP
+ * GSO).  The array is not modified.
+ * @param nCount Number of elements in the pDatagrams array.
+ * @returns Number of datagrams sent, which is less than nCount if the kernel stopped taking them
+ * part of the way through; or ERROR if none could be sent, in which case errno should be examined
+ * to determine the cause of the error.
+ * @remarks The socket must be in SOCKET_STATE_READY.  The callback sees one SENDING/SENT pair for
+ * the whole call, with the number of datagrams sent in the state bag.  Errors on a datagram socket
+ * concern one packet, not the socket, so it goes back to SOCKET_STATE_READY rather than into
+ * SOCKET_STATE_ERROR.  Several threads may send on the same socket at once; they take turns.
+ */
+int SendDatagrams(HSOCKET hSocket, const SOCKETDATAGRAM* pDatagrams, int nCount);
+
+/**
+ * @brief Sends data, with open file descriptors attached, over a connected Unix-domain socket
+ * (SCM_RIGHTS).  The peer gets its own descriptors for the same open files, pipes or sockets,
+ * as if it had opened them itself; see ReceiveDescriptors.
+ * @param hSocket Socket handle representing the Unix-domain endpoint over which to send.
+ * @param pvData Pointer to a buffer containing the data to send along.  Descriptors cannot be
+ * sent on their own; at least one byte has to go with them.
+ * @param nLength Number of bytes in the buffer to send.
+ * @param pFds Array of the descriptors to send.  They stay open in the caller.
+ * @param nFds Number of elements in the pFds array; at most UNIX_PASSED_FDS_MAX (64, by default).
+ * @returns ERROR if the operation failed; number of bytes sent otherwise.
+ *	If the ERROR value is returned, errno should be examined to determine the
+ *  cause of the error.  The socket's state will be set to SOCKET_STATE_ERROR.
+ * @remarks The descriptors go with the first byte of the data, so anything buffered or queued
+ * for the socket is sent first, and the call blocks, as SendFile does, until it can be.  The
+ * callback sees SENDING and SENT, with the byte count in the state bag, as for SendBytes.  A
+ * peer that is not in descriptor passing mode gets the data, and the kernel closes the
+ * descriptors for it.
+ */
+int SendDescriptors(HSOCKET hSocket, const void* pvData, size_t nLength,
+		const int* pFds, int nFds);
+
+/**
+ * @brief Sends part or all of a file over an open and connected socket, without copying it
+ * through user memory.  Intended for SOCKET_TYPE_DATA sockets (e.g., the sending end of an FTP
+ * data connection).
+ * @param hSocket Socket handle representing the TCP endpoint over which to send data.
+ * @param nFileDescriptor Descriptor of the file to send.  Must be open for reading.
+ * @param nOffset Offset in the file at which to start reading.  The file position of
+ * nFileDescriptor is not changed.
+ * @param nCount Number of bytes to send, or zero to send everything from nOffset to the end of
+ * the file.
+ * @returns ERROR if the operation failed; number of bytes sent otherwise.
+ *	If the ERROR value is returned, errno should be examined to determine the
+ *  cause of the error.  The socket's state will be set to SOCKET_STATE_ERROR.
+ * @remarks Progress is reported through the socket callback: the callback is fired with
+ * SOCKET_STATE_SENDING after each chunk and with SOCKET_STATE_SENT at the end, with a pointer to
+ * a SOCKETFILEPROGRESS as the state bag each time.
+ */
+ssize_t SendFile(HSOCKET hSocket, int nFileDescriptor, off_t nOffset, size_t nCount);
+
+/**
+ * @brief Sends one datagram on a SOCKET_TYPE_DATAGRAM socket to the specified host and port.
+ * @param hSocket Handle to the datagram socket to send on.
+ * @param pvData Pointer to a buffer containing the payload of the datagram.
+ * @param nLength Number of bytes in the buffer to send.
+ * @param pszHostAddress Points to a buffer that contains a null terminated string that contains
+ * either a valid IP address or DNS-resolvable hostname.  The name is resolved through the
+ * library's DNS cache, so repeated sends to the same host do not wait on the resolver.
+ * @param nPort Port number that the peer receives on.
+ * @returns ERROR if the operation failed; number of bytes sent otherwise.  If ERROR is returned,
+ * errno should be examined to determine the cause of the error.
+ * @remarks To send many datagrams, or to reply to the sender of a received one, fill in
+ * SOCKETDATAGRAM structures (see SetDatagramAddress) and call SendDatagrams.
+ */
+int SendTo(HSOCKET hSocket, const void* pvData, size_t nLength, const char* pszHostAddress,
+		int nPort);
+
+/**
+ * @brief Sends the contents of several buffers, one after the other, over an open and connected
+ * socket, in a single system call where possible (scatter/gather I/O).  Use this to send, e.g.,
+ * a header and a body without first copying them into one buffer.
+ * @param hSocket Socket handle representing the TCP endpoint over which to send data.
+ * @param pIov Pointer to an array of iovec structures describing the buffers to send.  The
+ * array is not modified.
+ * @param nIovCount Number of elements in the pIov array.  Must not exceed IOV_MAX.
+ * @returns ERROR if the operation failed; total number of bytes sent otherwise.
+ *	If the ERROR value is returned, errno should be examined to determine the
+ *  cause of the error.  The socket's state will be set to SOCKET_STATE_ERROR.
+ * @remarks Partial writes are handled internally, as with SendBytes.  The socket callback sees
+ * a single SENDING/SENT pair for the whole call, with the total byte count in the state bag.
+ */
+int SendV(HSOCKET hSocket, const struct iovec* pIov, int nIovCount);
+
+/**
+ * @brief Fills in the destination of a SOCKETDATAGRAM with the address of the specified host
+ * and port, resolved through the library's DNS cache.  Resolve once, then reuse the structure
+ * for every datagram to the same peer.
+ * @param hSocket Handle to the datagram socket the datagram is to be sent on.  Only the first
+ * address of the host that fits the socket's address family is used.
+ * @param pDatagram Address of the SOCKETDATAGRAM whose addr and nAddrLength are to be set.
+ * @param pszHostAddress Points to a buffer that contains a null terminated string that contains
+ * either a valid IP address or DNS-resolvable hostname.
+ * @param nPort Port number that the peer receives on.
+ * @returns Zero on success; ERROR, with errno set, if the host could not be resolved to an
+ * address that fits the socket.
+ */
+int SetDatagramAddress(HSOCKET hSocket, PSOCKETDATAGRAM pDatagram, const char* pszHostAddress,
+		int nPort);
+
+/**
+ * @brief Turns UDP segmentation offload on or off for a SOCKET_TYPE_DATAGRAM socket.  On the
+ * sending side (UDP GSO), every payload longer than the segment size is split into datagrams of
+ * that size below the socket layer, so that one send call can carry dozens of datagrams to the
+ * same peer.  On the receiving side (UDP GRO), datagrams that arrive back to back from the same
+ * peer may be handed over together, as one SOCKETDATAGRAM whose nSegmentSize says how to split it.
+ * @param hSocket Handle to the datagram socket.
+ * @param nSegmentSize Size, in bytes, of the datagrams that payloads are split into when sent,
+ * unless a SOCKETDATAGRAM says otherwise; zero to turn offload off.  Should fit in one IP packet
+ * on the path (e.g., 1472 bytes on an Ethernet link for IPv4).
+ * @returns Zero on success; ERROR, with errno set, on failure.  errno is ENOPROTOOPT if the
+ * kernel does not support segmentation offload (it needs Linux 4.18 for sending and 5.0 for
+ * receiving).
+ * @remarks Takes effect immediately, and is passed on to the extra sockets that RunServerEx opens.
+ */
+int SetDatagramSegmentation(HSOCKET hSocket, size_t nSegmentSize);
+
+/**
+ * @brief Selects which thread the callbacks of sockets opened from now on run on, unless
+ * SetSocketCallbackMode says otherwise for a particular socket.
+ * @param mode One of the SOCKET_CALLBACK_MODE values.  SOCKET_CALLBACK_INLINE is the default.
+ * @remarks Process-wide.  Sockets that are already open keep the mode they were opened with.
+ */
+void SetDefaultCallbackMode(SOCKET_CALLBACK_MODE mode);
+
+/**
+ * @brief Selects how the event loops of server sockets opened from now on do their I/O, unless
+ * SetSocketIoBackend says otherwise for a particular socket.
+ * @param backend One of the SOCKET_IO_BACKEND values.  SOCKET_IO_BACKEND_EPOLL is the default.
+ * @remarks Process-wide.  Sockets that are already open keep the backend they were opened with.
+ */
+void SetDefaultIoBackend(SOCKET_IO_BACKEND backend);
+
+/**
+ * @brief Selects the tuning profile that sockets opened from now on start out with, unless
+ * SetSocketTuning or SetSocketTuningProfile says otherwise for a particular socket.
+ * @param profile One of the SOCKET_TUNING_PROFILE values.  SOCKET_TUNING_DEFAULT is the default.
+ * @remarks Process-wide.  Sockets that are already open keep the tuning they have.
+ */
+void SetDefaultTuningProfile(SOCKET_TUNING_PROFILE profile);
+
+/**
+ * @brief Turns descriptor passing mode on or off for the specified Unix-domain socket.  In that
+ * mode, file descriptors that the peer sends along with its data (see SendDescriptors) are kept
+ * for ReceiveDescriptors to hand out; otherwise, the kernel closes them as the data is read.
+ * @param hSocket Handle to the socket; a client, or a server whose clients are to be in the mode.
+ * @param bEnable Nonzero to turn the mode on, zero to turn it off.  It is off by default.
+ * @returns Zero on success; ERROR, with errno set, on failure (EINVAL for datagram sockets).
+ * @remarks Client sockets accepted by a server socket inherit the server socket's mode, so set
+ * it before calling RunServer.  A server in this mode always uses the epoll backend, since
+ * io_uring receives leave the descriptors behind.
+ */
+int SetDescriptorPassing(HSOCKET hSocket, int bEnable);
+
+/**
+ * @brief Sets the capacity of the ring buffer that the specified socket receives data into.
+ * @param hSocket Handle to the socket whose receive buffer is to be sized.
+ * @param nBytes Capacity, in bytes.  Rounded up to a multiple of the page size.  Must not be
+ * smaller than the amount of data that is waiting to be consumed.
+ * @returns Zero on success; ERROR if the buffer could not be resized, in which case errno should
+ * be examined to determine the cause of the error and the old buffer is kept.
+ * @remarks Optional.  Sockets that never call this get a 64 KB buffer the first time they
+ * receive data.
+ */
+int SetReceiveBufferSize(HSOCKET hSocket, size_t nBytes);
+
+/**
+ * @brief Turns buffered send mode on or off for the specified socket.  In buffered send mode,
+ * Send, SendBytes and SendV copy small writes into a per-socket output buffer instead of making
+ * a system call each, so that a reply built from many small pieces goes out in as few system
+ * calls and TCP segments as possible.
+ * @param hSocket Handle to the socket whose send mode is to be changed.
+ * @param nThreshold Size, in bytes, of the output buffer.  A write that would take the buffer
+ * past this size is sent straight away, together with what is already buffered, in one system
+ * call.  Zero turns buffered send mode off, flushing the buffer first.  Must not exceed INT_MAX.
+ * @returns Zero on success; ERROR, with errno set, on failure.  errno is EINVAL for a
+ * SOCKET_TYPE_DATAGRAM socket, whose datagrams must not be run together.
+ * @remarks Data sent in buffered mode is only guaranteed to be on its way once Flush has been
+ * called; the SENT callback means the data has been accepted into the output buffer.  Sockets
+ * serviced by RunServer or RunServerEx are flushed after every batch of callbacks, and a socket's
+ * buffer is flushed when it is closed.  Client sockets accepted by a server socket inherit the
+ * server socket's threshold.  Writes that overflow the buffer are sent with MSG_MORE, so the
+ * kernel holds back a partly filled segment until Flush.
+ */
+int SetSendBuffering(HSOCKET hSocket, size_t nThreshold);
+
+/**
+ * @brief Turns non-blocking send mode on or off for the specified socket.  In non-blocking send
+ * mode, Send, SendBytes and SendV never wait for the peer: whatever the kernel will not take
+ * right away is copied onto a per-socket send queue, a chain of pooled buffers, which the
+ * socket's event loop writes out as the connection becomes writable.
+ * @param hSocket Handle to the socket, or to a server socket whose clients are to get the mode.
+ * @param nHighWatermark Number of queued bytes at which the socket stops taking more data.  Zero
+ * turns non-blocking send mode off, waiting for the queue to be written out first.
+ * @param nLowWatermark Number of queued bytes at which the socket takes data again.  Must not
+ * exceed nHighWatermark.
+ * @returns Zero on success; ERROR, with errno set, on failure.  errno is EINVAL for a
+ * SOCKET_TYPE_DATAGRAM socket.
+ * @remarks When the queue reaches nHighWatermark, the socket goes into
+ * SOCKET_STATE_WRITE_HIGH_WATERMARK, and when it has fallen back to nLowWatermark, into
+ * SOCKET_STATE_WRITE_DRAINED; the callback gets a pointer to the number of bytes queued, as a
+ * size_t, each time, and the socket goes back to the state it was in once the callback returns,
+ * unless the callback moved it on.  In between, sends fail with errno set to EAGAIN, and leave
+ * the socket's state alone, so a producer can hold off until the DRAINED callback; a slow peer
+ * never ties up more than about nHighWatermark bytes.  A single send is taken whole, however
+ * large, if the queue is below nHighWatermark when it starts.  Sockets that no event loop
+ * services write out their queues at their next send or Flush.  SendFile waits until the queue
+ * has been written out, and then blocks as usual (on the event loop's thread, it fails with
+ * EAGAIN instead).  Whatever is still queued when the socket is
+ * closed goes out only if the kernel takes it there and then.  Client sockets accepted by a
+ * server socket inherit the server socket's watermarks.
+ */
+int SetSendQueue(HSOCKET hSocket, size_t nHighWatermark, size_t nLowWatermark);
+
+/**
+ * @brief Gives a server socket a Unix-domain address to listen on, rather than a TCP port, so
+ * that clients on the same machine can connect without going through the TCP/IP stack.
+ * @param hSocket Handle to the server socket (or SOCKET_TYPE_DATAGRAM socket).  Must not have
+ * been bound yet, by RunServer or otherwise.
+ * @param pszAddress Points to a null terminated string that contains either "unix:" and the path
+ * of the socket file to create, or "unix:@" and a name in Linux's abstract namespace.
+ * @returns Zero on success; ERROR, with errno set, on failure.  errno is EINVAL if pszAddress is
+ * not a "unix:" address or the socket is already bound, and ENAMETOOLONG if the path does not
+ * fit in a Unix-domain socket address (107 bytes).
+ * @remarks RunServer and RunServerEx then bind the socket to the address and ignore their port.
+ * A socket file left behind by a server that is no longer running is removed and replaced; one
+ * that a live server is listening on makes RunServer fail with EADDRINUSE.  The socket file is
+ * removed again when the socket is closed.  An abstract name needs no file, and is released
+ * along with the socket.  Clients connect with "unix:" addresses too (see ConnectToServer).
+ * Servers on a Unix-domain address always use the epoll backend.
+ */
+int SetServerAddress(HSOCKET hSocket, const char* pszAddress);
+
+/**
+ * @brief Selects which thread the callback of the specified socket runs on.  In
+ * SOCKET_CALLBACK_WORKERS mode, the thread that changes the socket's state (e.g., an event loop)
+ * only queues the call, and a pool of worker threads makes it, so that a slow callback does not
+ * hold up I/O on other sockets.
+ * @param hSocket Handle to the socket.
+ * @param mode One of the SOCKET_CALLBACK_MODE values.
+ * @returns Zero on success; ERROR if the handle is not valid (errno is EBADF) or the mode is
+ * unknown (errno is EINVAL).
+ * @remarks Set the mode before the socket is put to use; calls already queued are still made
+ * by the workers.  A socket's calls are made one at a time, in the order its state changed;
+ * calls for different sockets run in parallel.  Client sockets accepted by a server socket
+ * inherit the server socket's mode, and the ACCEPTED call for a client is made before any call
+ * for the client itself.  State bags that point into the library's memory are copied: the data
+ * of a RECEIVED call is a copy that has already been consumed from the receive ring, so
+ * ReceiveCommit does nothing.  Since the callback runs later, the library puts the socket back
+ * into SOCKET_STATE_READY itself after ACCEPTED, CONNECTED, SENT and RECEIVED; GetSocketState
+ * still reports the state the call was made for while the callback runs.  Data the callback
+ * sends in buffered send mode is flushed once the worker is done with the socket.  The pool
+ * has one worker per CPU, and is started the first time it is needed.  If it cannot be
+ * started, callbacks run inline.
+ */
+int SetSocketCallbackMode(HSOCKET hSocket, SOCKET_CALLBACK_MODE mode);
+
+/**
+ * @brief Changes which state transitions the callback of the specified socket is called for.
+ * @param hSocket Handle to the socket whose event mask is to be changed.
+ * @param dwEventMask Bitmask of the SOCKET_STATE values the callback wants to hear about; see
+ * SOCKET_EVENT.
+ * @remarks Takes effect at the next state transition.  Client sockets that have already been
+ * accepted by a server socket keep the mask they were accepted with.
+ */
+void SetSocketEventMask(HSOCKET hSocket, SOCKET_EVENT_MASK dwEventMask);
+
+/**
+ * @brief Selects how the data the specified socket receives is split into messages.  With a
+ * framing mode, the RECEIVED callback is fired once per complete message, with a SOCKETRECVDATA
+ * whose pData points at the message, past its length prefix and short of its delimiter, right
+ * where it sits in the receive ring buffer; and ReceiveMessage returns one message at a time.
+ * @param hSocket Handle to the socket.
+ * @param framing One of the SOCKET_FRAMING values.
+ * @param pszDelimiter For SOCKET_FRAMING_DELIMITER, the null-terminated delimiter, of up to 8
+ * bytes; NULL means "\r\n".  Ignored for the other framing modes.
+ * @param nMaxMessageSize Largest message, in bytes, not counting its length prefix or delimiter,
+ * to accept; zero for as large as the receive buffer can grow (16 MB, less the framing).
+ * @returns Zero on success; ERROR if the handle is not valid, or, with errno set to EINVAL, if the
+ * framing mode or delimiter is.
+ * @remarks Set the framing mode before data starts to arrive.  Client sockets accepted by a
+ * server socket inherit the server socket's framing mode.  A message larger than nMaxMessageSize
+ * (EMSGSIZE), or a malformed varint prefix (EBADMSG), puts the socket in SOCKET_STATE_ERROR, and
+ * the event loop closes the connection.  Each message is consumed when the callback returns, so
+ * callbacks of framed sockets do not call ReceiveCommit.
+ */
+int SetSocketFraming(HSOCKET hSocket, SOCKET_FRAMING framing, const char* pszDelimiter,
+		size_t nMaxMessageSize);
+
+/**
+ * @brief Selects how the event loop that RunServer or RunServerEx runs on the specified server
+ * socket does its I/O.
+ * @param hSocket Handle to the server socket.
+ * @param backend One of the SOCKET_IO_BACKEND values.
+ * @returns Zero on success; ERROR if the handle is not valid (errno is EBADF) or the backend is
+ * unknown (errno is EINVAL).
+ * @remarks Takes effect the next time a server is run on the socket.  Overrides the default
+ * set with SetDefaultIoBackend.  If io_uring turns out not to be available when the server
+ * starts, or the kernel's io_uring lacks multishot accept (Linux 5.19), the event loop runs on
+ * epoll instead.
+ */
+int SetSocketIoBackend(HSOCKET hSocket, SOCKET_IO_BACKEND backend);
+
 /**
  * @brief Sets the state of the specified socket to a new value as indicated by the newState
  * parameter.
@@ -158,11 +1042,77 @@ void SetSocketState(HSOCKET hSocket, SOCKET_STATE newState);
  * @param hSocket Handle to the socket for which the state is to be changed.
  * @param newState One of the SOCKET_STATE values that defines the new state.
  * @param lpUserState State bag to be passed along to the socket callback.
- * @remarks If this socket has a callback registered, then the callback is called with the
- * value passed in for the lpUserState parameter. *
+ * @remarks If this socket has a callback registered, and newState is in the socket's event
+ * mask, then the callback is called with the value passed in for the lpUserState parameter.
+ * Moves that make no sense are ignored, and fire no callback: a socket in SOCKET_STATE_ERROR or
+ * SOCKET_STATE_CLOSED stays there, and one in SOCKET_STATE_CLOSING can only go on to
+ * SOCKET_STATE_CLOSED.  The state is changed atomically, so this is safe to call from any thread.
  */
 void SetSocketStateEx(HSOCKET hSocket, SOCKET_STATE newState, void* lpUserState);
 
+/**
+ * @brief Sets how long the connection of the specified socket may go without traffic before its
+ * event loop gives up on it.  When a timeout expires, the socket goes into SOCKET_STATE_TIMEOUT,
+ * and the callback gets a pointer to a SOCKET_TIMEOUT_KIND that says which one it was.
+ * @param hSocket Handle to the socket, or to a server socket whose clients are to get the
+ * timeouts.
+ * @param nIdleTimeoutMs Milliseconds without anything sent or received; zero for no limit.
+ * @param nReadTimeoutMs Milliseconds without anything received; zero for no limit.
+ * @param nWriteTimeoutMs Milliseconds that sent data may sit in the kernel, not yet acknowledged
+ * by the peer; zero for no limit.  Also limits how long a send waits for room in the kernel's
+ * send buffer, after which it fails with ETIMEDOUT.
+ * @returns Zero on success; ERROR if the handle is not valid, or, with errno set to EINVAL, if a
+ * timeout is negative.
+ * @remarks Client sockets accepted by a server socket inherit the server socket's timeouts,
+ * which start to run at the accept.  The event loop keeps the timeouts on a timer wheel with
+ * 10 ms ticks, so a timeout fires up to a tick late, never early.  Once the callback returns,
+ * the connection is closed, unless the callback moved the socket on to another state (e.g.,
+ * SOCKET_STATE_READY), in which case all of its timeouts start over.  Callbacks run by the
+ * callback workers cannot do that in time, so their connections are always closed.  Called on
+ * an accepted client from anywhere but its event loop's thread (i.e., not from the client's own
+ * callback), new timeouts take effect when the client next receives something, or when its
+ * current timer goes off, whichever is first.  Sockets that no event loop services only get
+ * the limit on how long a send (or ReceiveFile) waits.
+ */
+int SetSocketTimeouts(HSOCKET hSocket, int nIdleTimeoutMs, int nReadTimeoutMs,
+		int nWriteTimeoutMs);
+
+/**
+ * @brief Tunes the kernel socket options of the specified socket, one by one.
+ * @param hSocket Handle to the socket to tune.
+ * @param pTuning Address of the settings; see SOCKETTUNING.  Start from GetTuningProfile or
+ * GetSocketTuning to change only some of them.
+ * @returns Zero on success; ERROR, with errno set, if any option was refused (e.g., EPERM for
+ * SO_BUSY_POLL without CAP_NET_ADMIN).  The settings are kept, and the options that were not
+ * refused take effect, either way.
+ * @remarks Options take effect at once, and are applied again wherever the socket gets a new
+ * descriptor (ConnectToServerAsync, "unix:" addresses); TCP options are ignored on sockets that
+ * are not TCP ones.  Client sockets accepted by a server socket inherit its settings, so tune
+ * the server socket before calling RunServer; its buffer sizes are only used in full by clients
+ * if they are set before it listens.  Fast Open, too, has to be set before the socket connects
+ * or listens: a client socket then sends no SYN when ConnectToServer connects it, which
+ * reports CONNECTED at once, and its first Send goes out in the SYN instead, saving a round trip
+ * once the server has handed out a Fast Open cookie (the very first connection asks for one).
+ * A server that cannot be connected to is then only reported by that first Send (see
+ * ConnectToServer), which is why no tuning profile turns Fast Open on.  Servers need
+ * the net.ipv4.tcp_fastopen sysctl to allow Fast Open (e.g., 3); clients are allowed by
+ * default.  ConnectToServerAsync does not use Fast Open.  Kernel buffer sizes that are set turn
+ * off automatic sizing, and are doubled by the kernel; above the net.core.wmem_max and rmem_max
+ * limits, they are cut down to those unless the process has CAP_NET_ADMIN.  Quick
+ * acknowledgements are switched on again after every read, since the kernel switches them off
+ * by itself.
+ */
+int SetSocketTuning(HSOCKET hSocket, const SOCKETTUNING* pTuning);
+
+/**
+ * @brief Tunes the kernel socket options of the specified socket with one of the tuning
+ * profiles.  Same as SetSocketTuning with the profile's settings (see GetTuningProfile).
+ * @param hSocket Handle to the socket to tune.
+ * @param profile One of the SOCKET_TUNING_PROFILE values.
+ * @returns Zero on success; ERROR, with errno set, on failure, as for SetSocketTuning.
+ */
+int SetSocketTuningProfile(HSOCKET hSocket, SOCKET_TUNING_PROFILE profile);
+
 /**
  * @brief Sets the state of the specified socket to a new value as indicated by the newState
  * parameter.
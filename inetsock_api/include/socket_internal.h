@@ -0,0 +1,750 @@
+// socket_internal.h - definitions that are shared between the source files of this library,
+// but that are not part of its public API.  Users of the library should include
+// inetsock_api.h only.
+//
+
+#ifndef __INETSOCK_API_SOCKET_INTERNAL_H__
+#define __INETSOCK_API_SOCKET_INTERNAL_H__
+
+#include "inetsock_api.h"
+
+/**
+ * @brief Size, in bytes, of a CPU cache line.  Socket objects are aligned to, and padded out
+ * to a multiple of, this size so that two sockets never share a cache line.
+ */
+#ifndef CACHE_LINE_SIZE
+#define CACHE_LINE_SIZE					64
+#endif //CACHE_LINE_SIZE
+
+/**
+ * @brief Longest delimiter, in bytes, that SetSocketFraming accepts.
+ */
+#ifndef FRAME_DELIMITER_MAX_LENGTH
+#define FRAME_DELIMITER_MAX_LENGTH		8
+#endif //FRAME_DELIMITER_MAX_LENGTH
+
+/**
+ * @brief Largest number of datagrams moved with one sendmmsg() or recvmmsg() call.
+ */
+#ifndef DATAGRAM_BATCH_SIZE
+#define DATAGRAM_BATCH_SIZE				32
+#endif //DATAGRAM_BATCH_SIZE
+
+/**
+ * @brief Largest number of file descriptors passed over a Unix-domain socket with one send.
+ */
+#ifndef UNIX_PASSED_FDS_MAX
+#define UNIX_PASSED_FDS_MAX				64
+#endif //UNIX_PASSED_FDS_MAX
+
+/**
+ * @brief Length, in milliseconds, of one tick of an event loop's timer wheel; socket timeouts
+ * fire up to this much late, never early.
+ */
+#ifndef TIMER_WHEEL_TICK_MS
+#define TIMER_WHEEL_TICK_MS				10
+#endif //TIMER_WHEEL_TICK_MS
+
+/**
+ * @brief Number of levels of a timer wheel, and log2 of the number of slots per level.  With
+ * 10 ms ticks, four levels of 64 slots reach out to about 46 hours.
+ */
+#define TIMER_WHEEL_LEVELS				4
+#define TIMER_WHEEL_SLOT_BITS			6
+#define TIMER_WHEEL_SLOTS				(1 << TIMER_WHEEL_SLOT_BITS)
+
+///////////////////////////////////////////////////////////////////////////////
+// TIMERNODE struct - one timer on a timer wheel (see timer_wheel.c), embedded
+// in the object it times.
+
+typedef struct _tagTIMERNODE {
+	struct _tagTIMERNODE* pNext;	/* Next timer in the same slot */
+	struct _tagTIMERNODE** ppPrev;	/* Link that points at this timer, or NULL while it is not armed */
+	unsigned long long nExpires;	/* Tick the timer expires on */
+	unsigned int	nSlot;			/* Slot the timer is in, counting across all levels */
+} TIMERNODE, *PTIMERNODE;
+
+///////////////////////////////////////////////////////////////////////////////
+// TIMERWHEEL struct - a hierarchical timer wheel (see timer_wheel.c).  Each
+// event loop has one, for the timeouts of its client sockets.
+
+typedef struct _tagTIMERWHEEL {
+	unsigned long long nNext;		/* Next tick to be processed */
+	unsigned int	nTimers;		/* Number of timers armed */
+	unsigned long long nOccupied[TIMER_WHEEL_LEVELS];	/* Per level, a bit for each slot that is not empty */
+	PTIMERNODE		pSlots[TIMER_WHEEL_LEVELS * TIMER_WHEEL_SLOTS];	/* Heads of the slots' lists */
+	PTIMERNODE		pExpired;		/* Timers that have expired but not been handed out yet */
+} TIMERWHEEL, *PTIMERWHEEL;
+
+/**
+ * @brief Pointer to one chunk of a socket's send queue.  Only send_queue.c looks inside.
+ */
+typedef struct _tagSENDCHUNK *PSENDCHUNK;
+
+///////////////////////////////////////////////////////////////////////////////
+// SOCKET struct - wraps a socket file descriptor in an opaque type that also
+// carries information about the state and type of socket.  Socket objects
+// live in the socket pool (see socket_pool.c) and are handed out to callers
+// as HSOCKET values that encode the object's slot in the pool and the slot's
+// generation; they are never handed out as pointers.
+
+struct _tagSOCKET {
+	int				nSocketDescriptor;		/* Linux file descriptor */
+	long			dwLastError;	/* errno of the failure that put the socket in SOCKET_STATE_ERROR */
+	SOCKET_TYPE 	sockType;		/* What type of socket is this? */
+	SOCKET_STATE 	sockState;		/* What state is this socket in?  Only ever changed by CAS */
+	int				nRefs;			/* The owner's reference, plus one per call in progress on another thread */
+	pthread_mutex_t	sendLock;		/* Serializes senders; recursive, so callbacks can send */
+	LPSOCKET_EVENT_ROUTINE lpfnCallback;	/* Function that gets called when something happens on this socket */
+	SOCKET_EVENT_MASK dwEventMask;	/* States whose transitions lpfnCallback is called for */
+	HSOCKET			hSelf;			/* The handle callers know this socket by */
+	unsigned int	nGeneration;	/* Bumped each time the slot is released; stale handles do not match */
+	unsigned int	nNextFree;		/* Index + 1 of the next slot on the pool's free list, or 0 */
+	int				bInUse;			/* Nonzero while the slot belongs to an open socket */
+	struct _tagSERVERLOOP* pServerLoop;	/* Event loop this socket is registered with, if any */
+	struct _tagSOCKET* pPrev;		/* Previous client in the owning event loop's client list */
+	struct _tagSOCKET* pNext;		/* Next client in the owning event loop's client list */
+	struct _tagSOCKET* pNextPending;	/* Next socket in the owning event loop's deferred-close list */
+	int				bClosePending;	/* Nonzero once CloseSocket has been called on this socket */
+	char*			pRecvRing;		/* Receive buffer; nRecvCapacity bytes, compacted before each read */
+	size_t			nRecvCapacity;	/* Size of the receive ring; a multiple of the page size */
+	size_t			nRecvHead;		/* Offset of the first unconsumed byte in the receive ring */
+	size_t			nRecvTail;		/* Offset just past the last byte read into the receive ring */
+	int				bRecvCommitted;	/* Set by ReceiveCommit; lets the event loop see if the callback consumed data */
+	SOCKET_FRAMING	framing;		/* How received data is split into messages (see framing.c) */
+	char			frameDelimiter[FRAME_DELIMITER_MAX_LENGTH];	/* Delimiter, for SOCKET_FRAMING_DELIMITER */
+	size_t			nFrameDelimiterLength;	/* Number of bytes of frameDelimiter in use */
+	size_t			nMaxMessageSize;	/* Largest message payload accepted */
+	size_t			nFrameScanned;	/* Unread bytes already searched for the delimiter in vain */
+	struct _tagCONNECTREQUEST* pConnect;	/* Connect in progress (see connector.c), or NULL */
+	struct _tagPOOLDESTINATION* pPoolDest;	/* Connection pool destination this socket counts against, or NULL */
+	struct _tagSOCKET* pNextIdle;	/* Next connection in the pool destination's idle list */
+	time_t			nIdleSince;		/* When the socket was last handed back to the connection pool */
+	int				bPoolIdle;		/* Nonzero while the socket sits idle in the connection pool */
+	SOCKET_IO_BACKEND ioBackend;	/* How an event loop run on this (server) socket does its I/O */
+	SOCKET_CALLBACK_MODE callbackMode;	/* Which thread lpfnCallback runs on */
+	struct _tagCALLBACKQUEUE* pCallbackQueue;	/* Calls waiting for the callback workers, or NULL */
+	int				nFixedFile;		/* Slot in the io_uring loop's fixed file table, or -1 */
+	int				nUringInFlight;	/* Number of io_uring requests outstanding on this socket */
+	char*			pSendBuffer;	/* Output buffer of a socket in buffered send mode, or NULL */
+	size_t			nSendLength;	/* Number of bytes waiting in pSendBuffer */
+	size_t			nSendThreshold;	/* Size at which the output buffer is written out; 0 if not buffered */
+	int				bSendCorked;	/* Nonzero while data sent with MSG_MORE may be held back by the kernel */
+	int				bFlushQueued;	/* Nonzero while on the owning event loop's pending-flush list */
+	struct _tagSOCKET* pNextFlush;	/* Next socket in the owning event loop's pending-flush list */
+	int				nIdleTimeoutMs;	/* Close after this long with no traffic either way; 0 for never */
+	int				nReadTimeoutMs;	/* Close after this long with nothing received; 0 for never */
+	int				nWriteTimeoutMs;	/* Close after sent data has gone unacknowledged this long; 0 for never */
+	int				bTimeoutsChanged;	/* Set when the timeouts change off the event loop's thread */
+	unsigned long long nLastRecvMs;	/* When data last came in (see GetCoarseTimeMs) */
+	unsigned long long nLastSendMs;	/* When data last went out */
+	unsigned long long nDrainedBytesSent;	/* stats.nBytesSent as of when the kernel's send queue was last seen empty */
+	unsigned long long nTimeoutsSinceMs;	/* When the timeouts last started over: at the accept, or when one was survived */
+	TIMERNODE		timer;			/* Timeout on the owning event loop's timer wheel */
+	PSENDCHUNK		pSendQueueHead;	/* Oldest chunk of the send queue (see send_queue.c), or NULL */
+	PSENDCHUNK		pSendQueueTail;	/* Newest chunk of the send queue, or NULL */
+	size_t			nSendQueued;	/* Number of bytes on the send queue; read without sendLock */
+	size_t			nSendHighWatermark;	/* Queue length at which sends are refused; 0 if sends block */
+	size_t			nSendLowWatermark;	/* Queue length at which sends are taken again */
+	int				bSendQueueHigh;	/* Nonzero from SOCKET_STATE_WRITE_HIGH_WATERMARK until SOCKET_STATE_WRITE_DRAINED */
+	int				bWritableArmed;	/* Nonzero while the io_uring loop has a poll for writability outstanding */
+	int				bWritableWanted;	/* Set when send queueing is turned on off an io_uring loop's thread */
+	char*			pDatagramBuffer;	/* Receive buffer of a datagram socket (see datagram.c), or NULL */
+	size_t			nDatagramSegmentSize;	/* UDP GSO segment size, and GRO on, if nonzero */
+	struct _tagRESOLVEDADDRESS* pListenAddr;	/* Unix-domain address a server socket listens on (see unix_socket.c), or NULL */
+	int				bUnlinkOnClose;	/* Nonzero if closing the socket removes the socket file at pListenAddr */
+	int				bPassDescriptors;	/* Nonzero if descriptors that come in with the data are kept */
+	struct _tagFDQUEUE* pReceivedFds;	/* Descriptors received and not yet taken, or NULL */
+	SOCKETTUNING	tuning;			/* Kernel socket options the socket wants (see socket_tuning.c) */
+	SOCKETSTATS		stats;			/* I/O counters (see socket_stats.c) */
+} __attribute__((aligned(CACHE_LINE_SIZE)));
+
+/**
+ * @brief Pointer to a socket object.  Only ever used inside the library; callers get an HSOCKET.
+ */
+typedef struct _tagSOCKET *PSOCKET;
+
+///////////////////////////////////////////////////////////////////////////////
+// URING struct - an io_uring instance and the mappings of its rings (see
+// uring.c).
+
+typedef struct _tagURING {
+	int				nRingFd;		/* io_uring instance descriptor */
+	unsigned int*	pSqHead;		/* Submission queue head; advanced by the kernel */
+	unsigned int*	pSqTail;		/* Submission queue tail; advanced by us */
+	unsigned int*	pSqArray;		/* Submission queue index array */
+	unsigned int	nSqMask;		/* Submission queue size minus one */
+	unsigned int	nSqEntries;		/* Submission queue size */
+	unsigned int	nSqTail;		/* Our copy of the tail, including entries not yet published */
+	unsigned int	nToSubmit;		/* Entries queued but not yet handed to the kernel */
+	struct io_uring_sqe* pSqes;		/* Submission queue entries */
+	unsigned int*	pCqHead;		/* Completion queue head; advanced by us */
+	unsigned int*	pCqTail;		/* Completion queue tail; advanced by the kernel */
+	unsigned int	nCqMask;		/* Completion queue size minus one */
+	struct io_uring_cqe* pCqes;		/* Completion queue entries */
+	void*			pSqRing;		/* Mapping of the submission ring */
+	void*			pCqRing;		/* Mapping of the completion ring (may equal pSqRing) */
+	size_t			nSqRingSize;	/* Size of the submission ring mapping */
+	size_t			nCqRingSize;	/* Size of the completion ring mapping */
+	size_t			nSqesSize;		/* Size of the submission queue entry mapping */
+	unsigned int	nFeatures;		/* IORING_FEAT_* flags the kernel reported at setup */
+} URING, *PURING;
+
+/**
+ * @brief Creates an io_uring instance and maps its rings.
+ * @param pUring Structure to fill in.
+ * @param nEntries Minimum number of submission queue entries.
+ * @returns Zero on success; ERROR, with errno set, if io_uring is not available.
+ */
+int UringInit(PURING pUring, unsigned int nEntries);
+
+/**
+ * @brief Unmaps the rings of an io_uring instance and closes it.
+ * @param pUring Instance to destroy.
+ */
+void UringDestroy(PURING pUring);
+
+/**
+ * @brief Tells whether the kernel behind an io_uring instance supports the specified request
+ * opcodes.
+ * @param pUring Instance to ask about.
+ * @param pOpcodes Array of IORING_OP_* values.
+ * @param nOpcodes Number of elements in the pOpcodes array.
+ * @returns Nonzero if every one of the opcodes is supported; zero if any is not, or if the
+ * kernel is too old to say (IORING_REGISTER_PROBE is Linux 5.6).
+ */
+int UringSupports(PURING pUring, const unsigned char* pOpcodes, int nOpcodes);
+
+/**
+ * @brief Gets a cleared submission queue entry to fill in.  It is handed to the kernel by the
+ * next UringSubmit.
+ * @param pUring Instance to get the entry from.
+ * @returns Pointer to the entry; NULL, with errno set, if the queue is full and could not be
+ * flushed.
+ */
+struct io_uring_sqe* UringGetSqe(PURING pUring);
+
+/**
+ * @brief Hands every queued submission to the kernel and optionally waits for completions.
+ * @param pUring Instance to submit to.
+ * @param nWaitFor Number of completions to wait for; zero not to wait.
+ * @returns Number of entries submitted; ERROR, with errno set, on failure.
+ */
+int UringSubmit(PURING pUring, unsigned int nWaitFor);
+
+/**
+ * @brief Hands every queued submission to the kernel and waits, for a limited time, for a
+ * completion.
+ * @param pUring Instance to submit to.
+ * @param nTimeoutMs Milliseconds to wait at most, or -1 to wait indefinitely.
+ * @returns Number of entries submitted; ERROR, with errno set (ETIME if the time ran out), on
+ * failure.
+ */
+int UringWait(PURING pUring, int nTimeoutMs);
+
+/**
+ * @brief Gets the oldest completion that has not been consumed yet.
+ * @param pUring Instance to look at.
+ * @returns Pointer to the completion, or NULL if there is none.
+ */
+struct io_uring_cqe* UringPeekCqe(PURING pUring);
+
+/**
+ * @brief Consumes the completion UringPeekCqe returned.
+ * @param pUring Instance the completion came from.
+ */
+void UringSeenCqe(PURING pUring);
+
+/**
+ * @brief Registers an empty table of fixed files with an io_uring instance.
+ * @param pUring Instance to register the table with.
+ * @param nCount Number of slots in the table.
+ * @returns Zero on success; ERROR, with errno set, on failure.
+ */
+int UringRegisterFiles(PURING pUring, unsigned int nCount);
+
+/**
+ * @brief Puts a descriptor into (or, with -1, empties) a slot of an io_uring instance's fixed
+ * file table, synchronously.
+ * @param pUring Instance whose table is to be updated.
+ * @param nSlot Slot to update.
+ * @param nFileDescriptor Descriptor to put in the slot, or -1 to empty it.
+ * @returns Zero on success; ERROR, with errno set, on failure.
+ */
+int UringUpdateFile(PURING pUring, unsigned int nSlot, int nFileDescriptor);
+
+/**
+ * @brief Latencies that the library keeps a process-wide histogram of (see socket_stats.c).
+ */
+typedef enum {
+	LATENCY_CONNECT,
+	LATENCY_SEND,
+	LATENCY_CALLBACK,
+	LATENCY_KIND_COUNT
+} LATENCY_KIND;
+
+/**
+ * @brief Reads the monotonic clock, for timing an operation with RecordLatency.
+ * @returns Current time, in nanoseconds.
+ */
+unsigned long long StatsNow(void);
+
+/**
+ * @brief Records how long an operation took in the process-wide histogram for its kind.
+ * @param kind Which histogram to record the latency in.
+ * @param nStartNs Value StatsNow returned when the operation started.
+ */
+void RecordLatency(LATENCY_KIND kind, unsigned long long nStartNs);
+
+/**
+ * @brief Counts one system call made to send data on a socket, in the socket's counters and in
+ * the process-wide ones.
+ * @param pSocket Socket the data was sent on.
+ * @param nResult What the system call returned; if negative, errno tells why.
+ * @param nRequested Number of bytes the system call was asked to send.
+ */
+void CountSend(PSOCKET pSocket, ssize_t nResult, size_t nRequested);
+
+/**
+ * @brief Counts one system call (or io_uring request) made to receive data on a socket.
+ * @param pSocket Socket the data was received on.
+ * @param nResult What the call returned; if negative, errno tells why.
+ */
+void CountRecv(PSOCKET pSocket, ssize_t nResult);
+
+/**
+ * @brief Counts a transition of a socket into a new state.
+ * @param pSocket Socket whose state changed.
+ * @param newState State the socket went into.
+ */
+void CountStateChange(PSOCKET pSocket, SOCKET_STATE newState);
+
+/**
+ * @brief Looks for a complete message at the front of a framed socket's unread data.
+ * @param pSocket Socket object whose receive ring is to be looked at.
+ * @param pnOffset Receives the offset of the message's payload from the start of the unread data.
+ * @param pnLength Receives the length of the message's payload.
+ * @param pnConsumed Receives the number of bytes the message takes up in the ring; or, if it is
+ * not all there yet, the number of bytes it will take up, if that is known, or one more than
+ * there are now, if not.
+ * @returns 1 if there is a complete message; zero if not yet; ERROR, with errno set to EMSGSIZE
+ * or EBADMSG, if the data cannot be a valid message.
+ */
+int FindMessage(PSOCKET pSocket, size_t* pnOffset, size_t* pnLength, size_t* pnConsumed);
+
+/**
+ * @brief Gets the largest number of bytes a message takes up in the receive ring besides its
+ * payload (its length prefix or delimiter).
+ * @param framing One of the SOCKET_FRAMING values.
+ * @param nDelimiterLength Length of the delimiter, for SOCKET_FRAMING_DELIMITER.
+ * @returns Number of bytes.
+ */
+size_t GetFrameOverhead(SOCKET_FRAMING framing, size_t nDelimiterLength);
+
+/**
+ * @brief Reads the coarse monotonic clock, which socket timeouts are measured by.
+ * @returns Current time, in milliseconds.
+ */
+unsigned long long GetCoarseTimeMs(void);
+
+/**
+ * @brief Sets up an empty timer wheel.
+ * @param pWheel Wheel to set up.
+ * @param nNowMs Current time (see GetCoarseTimeMs).
+ */
+void TimerWheelInit(PTIMERWHEEL pWheel, unsigned long long nNowMs);
+
+/**
+ * @brief Sets a timer to expire at the specified time, moving it if it is already armed.
+ * @param pWheel Wheel to put the timer on.
+ * @param pNode Timer to arm.
+ * @param nExpiresMs When the timer is to expire (see GetCoarseTimeMs).
+ */
+void TimerWheelArm(PTIMERWHEEL pWheel, PTIMERNODE pNode, unsigned long long nExpiresMs);
+
+/**
+ * @brief Takes a timer off the wheel it is on, if it is armed.
+ * @param pWheel Wheel the timer is on.
+ * @param pNode Timer to cancel.
+ */
+void TimerWheelCancel(PTIMERWHEEL pWheel, PTIMERNODE pNode);
+
+/**
+ * @brief Advances a timer wheel towards the current time and takes one expired timer off it.
+ * Call it until it returns NULL.
+ * @param pWheel Wheel to advance.
+ * @param nNowMs Current time (see GetCoarseTimeMs).
+ * @returns Timer that has expired, no longer armed; or NULL if there are no more.
+ */
+PTIMERNODE TimerWheelExpire(PTIMERWHEEL pWheel, unsigned long long nNowMs);
+
+/**
+ * @brief Gets how long an event loop may wait for I/O before its timer wheel needs advancing.
+ * @param pWheel Wheel to look at.
+ * @param nNowMs Current time (see GetCoarseTimeMs).
+ * @returns Milliseconds to wait, or -1 to wait indefinitely, as epoll_wait and poll take it.
+ */
+int TimerWheelTimeout(PTIMERWHEEL pWheel, unsigned long long nNowMs);
+
+/**
+ * @brief Copies data onto the end of a socket's send queue.  The caller holds the socket's send lock.
+ * @param pSocket Socket object to queue the data on.
+ * @param pIov Buffers to copy.
+ * @param nIovCount Number of buffers.
+ * @returns Zero on success; ERROR, with errno set to ENOMEM and nothing queued, on failure.
+ */
+int AppendSendQueue(PSOCKET pSocket, const struct iovec* pIov, int nIovCount);
+
+/**
+ * @brief Writes as much of a socket's send queue as the kernel takes without blocking.  The
+ * caller holds the socket's send lock.
+ * @param pSocket Socket object whose queue is to be written.
+ * @returns Number of bytes written, which may be zero; ERROR, with errno set, if the connection
+ * failed.
+ */
+ssize_t WriteSendQueue(PSOCKET pSocket);
+
+/**
+ * @brief Throws away everything on a socket's send queue.
+ * @param pSocket Socket object whose queue is to be emptied.
+ */
+void FreeSendQueue(PSOCKET pSocket);
+
+/**
+ * @brief Sends a run of datagrams with as few sendmmsg() calls as possible.  The caller holds the
+ * socket's send lock.
+ * @param pSocket Datagram socket object to send on.
+ * @param pDatagrams Datagrams to send.
+ * @param nCount Number of datagrams.
+ * @returns Number of datagrams sent; ERROR, with errno set, if none were.
+ */
+int SendDatagramBatch(PSOCKET pSocket, const SOCKETDATAGRAM* pDatagrams, int nCount);
+
+/**
+ * @brief Receives a run of datagrams with one recvmmsg() call, into the socket's datagram
+ * receive buffer.  Only one thread at a time receives on a socket.
+ * @param pSocket Datagram socket object to receive on.
+ * @param pDatagrams Filled in with one SOCKETDATAGRAM per datagram received.
+ * @param nMaxDatagrams Room in pDatagrams; no more than DATAGRAM_BATCH_SIZE are received.
+ * @param nFlags Flags for recvmmsg(), e.g. MSG_DONTWAIT.
+ * @returns Number of datagrams received; ERROR, with errno set, on failure.
+ */
+int ReceiveDatagramBatch(PSOCKET pSocket, PSOCKETDATAGRAM pDatagrams, int nMaxDatagrams,
+		int nFlags);
+
+/**
+ * @brief Sets a datagram socket's UDP GSO segment size, and turns UDP GRO on or off to match,
+ * from pSocket->nDatagramSegmentSize.
+ * @param pSocket Datagram socket object.
+ * @returns Zero on success; ERROR, with errno set, on failure.
+ */
+int ApplyDatagramSegmentation(PSOCKET pSocket);
+
+/**
+ * @brief Lets go of a datagram socket's receive buffer.
+ * @param pSocket Socket object.
+ */
+void FreeDatagramBuffer(PSOCKET pSocket);
+
+/**
+ * @brief Pointer to the descriptors that have come in on a socket in descriptor passing mode.
+ * Only the Unix-domain socket code (see unix_socket.c) looks inside.
+ */
+typedef struct _tagFDQUEUE *PFDQUEUE;
+
+/**
+ * @brief Tells whether an address names a Unix-domain socket ("unix:/path", "unix:@name").
+ * @param pszAddress Address to look at; may be NULL.
+ * @returns Nonzero if so; zero otherwise.
+ */
+int IsUnixAddress(const char* pszAddress);
+
+/**
+ * @brief Turns a "unix:" address into the socket address it names; "unix:@name" names name in
+ * the abstract namespace.
+ * @param pszAddress Address to parse; IsUnixAddress must be true of it.
+ * @param pAddr Receives the socket address.
+ * @param pnAddrLength Receives the number of bytes of *pAddr that are in use.
+ * @returns Zero on success; ERROR, with errno set to EINVAL or ENAMETOOLONG, on failure.
+ */
+int ParseUnixAddress(const char* pszAddress, struct sockaddr_storage* pAddr,
+		socklen_t* pnAddrLength);
+
+/**
+ * @brief Replaces a socket's descriptor, in place, with a Unix-domain socket of the same type.
+ * @param pSocket Socket object, which must not be connected or listening yet.
+ * @returns Zero on success, or if the socket is a Unix-domain one already; ERROR, with errno
+ * set, on failure.
+ */
+int SwitchToUnixDomain(PSOCKET pSocket);
+
+/**
+ * @brief Binds a server socket to its Unix-domain address, pSocket->pListenAddr, removing a
+ * stale socket file that is in the way.
+ * @param pSocket Server socket object.
+ * @returns Zero on success; ERROR, with errno set, on failure.
+ */
+int BindUnixAddress(PSOCKET pSocket);
+
+/**
+ * @brief Removes the socket file a server socket created, if any, and lets go of its
+ * Unix-domain address.
+ * @param pSocket Socket object that is being closed.
+ */
+void ReleaseUnixAddress(PSOCKET pSocket);
+
+/**
+ * @brief Reads from a socket in descriptor passing mode, as readv() would, and queues the
+ * descriptors that came with the data.  Only one thread at a time receives on a socket.
+ * @param pSocket Socket object to read from.
+ * @param pIov Buffer to read into.
+ * @returns Number of bytes read; zero if the peer closed the connection; ERROR, with errno set,
+ * on failure.
+ */
+ssize_t ReceiveWithDescriptors(PSOCKET pSocket, const struct iovec* pIov);
+
+/**
+ * @brief Sends data with descriptors attached to its first byte.  The caller holds the socket's
+ * send lock.
+ * @param pSocket Unix-domain socket object to send on.
+ * @param pvData Data to send; at least one byte.
+ * @param nLength Number of bytes of data.
+ * @param pFds Descriptors to pass.
+ * @param nFds Number of descriptors, from 1 to UNIX_PASSED_FDS_MAX.
+ * @returns Number of bytes sent, which may be short; ERROR, with errno set, if nothing was.
+ */
+ssize_t SendWithDescriptors(PSOCKET pSocket, const void* pvData, size_t nLength,
+		const int* pFds, int nFds);
+
+/**
+ * @brief Takes descriptors off the front of a socket's queue of received ones.
+ * @param pSocket Socket object.
+ * @param pFds Receives the descriptors, which now belong to the caller.
+ * @param nMaxFds Room in pFds.
+ * @returns Number of descriptors taken.
+ */
+int TakeDescriptors(PSOCKET pSocket, int* pFds, int nMaxFds);
+
+/**
+ * @brief Closes the descriptors a closing socket received that were never taken, and lets go of
+ * its queue.
+ * @param pSocket Socket object that is being closed.
+ */
+void FreeDescriptorQueue(PSOCKET pSocket);
+
+/**
+ * @brief Points in a socket's life at which its tuning is handed to the kernel (see
+ * socket_tuning.c).
+ */
+typedef enum {
+	TUNING_STAGE_OPEN,			/* newly opened; not yet connected or listening */
+	TUNING_STAGE_CONNECTED,		/* connected or listening already, possibly on a new descriptor */
+	TUNING_STAGE_ACCEPTED		/* newly accepted; has its listener's options already */
+} TUNING_STAGE;
+
+/**
+ * @brief Hands a socket's tuning, pSocket->tuning, to the kernel, as fits the point in the
+ * socket's life it is at.
+ * @param pSocket Socket object to tune.
+ * @param pOld Tuning the socket had until now, so that options that are being turned off are
+ * turned off; or NULL if the socket has the kernel's defaults.
+ * @param stage Point in the socket's life the socket is at.
+ * @returns Zero on success; ERROR, with errno set, if any option was refused.  The rest are set
+ * regardless.
+ */
+int ApplySocketTuning(PSOCKET pSocket, const SOCKETTUNING* pOld, TUNING_STAGE stage);
+
+/**
+ * @brief Puts a socket that is tuned for quick acknowledgements back into quick acknowledgement
+ * mode.  Called after every read.
+ * @param pSocket Socket object that has just read.
+ */
+void RearmQuickAck(PSOCKET pSocket);
+
+/**
+ * @brief Gets the tuning that sockets start out with (see SetDefaultTuningProfile).
+ * @param pTuning Filled in with the tuning.
+ */
+void GetDefaultTuning(PSOCKETTUNING pTuning);
+
+/**
+ * @brief Pointer to the calls of one socket's callback that are waiting for the callback workers.
+ * Only the callback pool (see callback_pool.c) looks inside.
+ */
+typedef struct _tagCALLBACKQUEUE *PCALLBACKQUEUE;
+
+/**
+ * @brief Queues a call of a socket's callback for the callback workers to make.
+ * @param pSocket Socket whose state changed.
+ * @param newState State the socket went into.
+ * @param lpUserState State bag to pass to the callback.
+ * @param nBagBytes Number of bytes at lpUserState to copy, or zero to pass the pointer as is.
+ * @param nDataBytes If nonzero, the bag is a SOCKETRECVDATA or a SOCKETDATAGRAM, and this many
+ * bytes of the data it points to are copied as well.
+ * @returns Zero if the call was queued; ERROR if the caller has to make it (the workers could not
+ * be started, or memory ran out).
+ */
+int QueueCallback(PSOCKET pSocket, SOCKET_STATE newState, void* lpUserState,
+		size_t nBagBytes, size_t nDataBytes);
+
+/**
+ * @brief Lets go of a closing socket's callback queue.  Calls still on it are made regardless.
+ * @param pSocket Socket object that is being closed.
+ */
+void ReleaseCallbackQueue(PSOCKET pSocket);
+
+/**
+ * @brief Tells whether the calling thread is a callback worker making a call for the specified
+ * socket.
+ * @param hSocket Handle to the socket.
+ * @param pState Receives the state the call is being made for.
+ * @returns Nonzero if so; zero otherwise, in which case *pState is left alone.
+ */
+int GetCallbackState(HSOCKET hSocket, SOCKET_STATE* pState);
+
+/**
+ * @brief Gets the callback mode that sockets start out in (see SetDefaultCallbackMode).
+ * @returns One of the SOCKET_CALLBACK_MODE values.
+ */
+SOCKET_CALLBACK_MODE GetDefaultCallbackMode(void);
+
+/**
+ * @brief Pointer to the connection pool's record of one destination.  Only the connection pool
+ * (see connection_pool.c) looks inside.
+ */
+typedef struct _tagPOOLDESTINATION *PPOOLDESTINATION;
+
+/**
+ * @brief One address a host name resolved to, ready to be passed to connect().
+ */
+typedef struct _tagRESOLVEDADDRESS {
+	struct sockaddr_storage addr;	/* IPv4 or IPv6 address and port, or Unix-domain address */
+	socklen_t		nAddrLength;	/* Number of bytes of addr that are in use */
+} RESOLVEDADDRESS, *PRESOLVEDADDRESS;
+
+/**
+ * @brief Pointer to an asynchronous connect request.  Only the connector (see connector.c) looks
+ * inside.
+ */
+typedef struct _tagCONNECTREQUEST *PCONNECTREQUEST;
+
+/**
+ * @brief Takes a socket object out of the pool and gives it a fresh handle.  Every field other
+ * than hSelf is reset.
+ * @returns Pointer to the socket object, or NULL if the pool is exhausted or out of memory.
+ */
+PSOCKET AllocSocket(void);
+
+/**
+ * @brief Returns a socket object to the pool.  Every handle to it goes stale at once.
+ * @param pSocket Socket object to release.  Its descriptor must already have been closed.
+ */
+void ReleaseSocket(PSOCKET pSocket);
+
+/**
+ * @brief Translates a handle into the socket object it refers to.
+ * @param hSocket Handle to translate.
+ * @returns Pointer to the socket object; or NULL if hSocket is INVALID_HANDLE_VALUE, was never a
+ * valid handle, or refers to a socket that has since been closed.
+ */
+PSOCKET LookupSocket(HSOCKET hSocket);
+
+/**
+ * @brief Looks up the socket object for a handle and takes a reference to it, so that the object
+ * and its descriptor stay put until the matching LeaveSocket, even if another thread closes the
+ * socket in the meantime.
+ * @param hSocket Handle to look up.
+ * @returns Pointer to the socket object; or NULL, with errno set to EBADF, if the handle is stale
+ * or the socket is already being closed.
+ */
+PSOCKET EnterSocket(HSOCKET hSocket);
+
+/**
+ * @brief Drops a reference taken by EnterSocket.  If the socket was closed in the meantime and
+ * this was the last reference, the calling thread finishes closing it.  errno is left as it was.
+ * @param pSocket Socket object returned by EnterSocket.
+ */
+void LeaveSocket(PSOCKET pSocket);
+
+/**
+ * @brief Calls free() on the buffer ppBuffer points to, if any, and sets *ppBuffer to NULL.
+ * @param ppBuffer Address of the pointer to the buffer to be freed.
+ */
+void free_buffer(void **ppBuffer);
+
+/**
+ * @brief Does the work of SetSocketStateEx for a socket object the library already holds: moves
+ * the socket to the new state with an atomic compare-and-swap, if the move is allowed, and then,
+ * if the state is in the socket's event mask, calls the callback with the socket's handle.
+ * @param pSocket Socket object whose state is to be changed.
+ * @param newState One of the SOCKET_STATE values that defines the new state.
+ * @param lpUserState State bag to be passed along to the socket callback.
+ * @returns Nonzero if the state was changed; zero if the move was rejected (e.g., the socket is
+ * in SOCKET_STATE_ERROR, or is closing or closed).  Moves into SOCKET_STATE_ERROR record errno
+ * as the socket's last error.
+ */
+int ChangeSocketState(PSOCKET pSocket, SOCKET_STATE newState, void* lpUserState);
+
+/**
+ * @brief Same as ChangeSocketState, for state bags that live on the caller's stack or in the
+ * socket's buffers: if the callback is to be run by the callback workers, it gets a copy.
+ * @param pSocket Socket object whose state is to be changed.
+ * @param newState One of the SOCKET_STATE values that defines the new state.
+ * @param lpUserState State bag to be passed along to the socket callback.
+ * @param nBagBytes Number of bytes at lpUserState to copy.
+ * @param nDataBytes If nonzero, the bag is a SOCKETRECVDATA, and this many bytes of the data it
+ * points to are copied as well.
+ * @returns Nonzero if the state was changed.
+ */
+int ChangeSocketStateCopy(PSOCKET pSocket, SOCKET_STATE newState, void* lpUserState,
+		size_t nBagBytes, size_t nDataBytes);
+
+/**
+ * @brief Finds the stream socket addresses of a host, going through the DNS cache (see
+ * dns_cache.c) unless the host is an address literal.  A "unix:" address is its own one and
+ * only address, and nPort is ignored.
+ * @param pszHostAddress Host name or address literal to resolve.
+ * @param nPort Port number to fill in to each address.
+ * @param ppAddrs Receives an array of addresses, in the order the resolver gave them, that the
+ * caller must free with free_buffer.
+ * @returns Number of addresses in the array; or ERROR, with errno set to EHOSTUNREACH if the name
+ * does not exist, or to another value if the lookup could not be done.
+ */
+int ResolveHost(const char* pszHostAddress, int nPort, PRESOLVEDADDRESS* ppAddrs);
+
+/**
+ * @brief Connects a socket, synchronously and without firing any callbacks, to the first address
+ * of a host that fits the socket's address family and accepts the connection.
+ * @param pSocket Socket object to connect.
+ * @param pszHostAddress Host name or address literal to connect to.
+ * @param nPort Port number to connect to.
+ * @returns Zero on success; ERROR, with errno set, on failure.
+ */
+int ConnectSocket(PSOCKET pSocket, const char* pszHostAddress, int nPort);
+
+/**
+ * @brief Resolves a host and hands a connect to it over to the connector thread, which fires
+ * CONNECTED or ERROR on the socket when the connect is over.
+ * @param pSocket Client socket to connect.
+ * @param pszHostAddress Host name or address literal to connect to.
+ * @param nPort Port number to connect to.
+ * @param nTimeoutMs Milliseconds to allow for the connect, or zero (or less) for no limit.
+ * @returns Zero if the connect is under way; ERROR with errno set if it could not be started.
+ */
+int StartConnect(PSOCKET pSocket, const char* pszHostAddress, int nPort, int nTimeoutMs);
+
+/**
+ * @brief Tells the connection pool that a socket it handed out is being closed, so that the
+ * socket stops counting against its destination.  Does nothing for sockets that did not come
+ * from the pool.
+ * @param pSocket Socket object that is being closed.
+ */
+void DetachPooledSocket(PSOCKET pSocket);
+
+/**
+ * @brief Stops any connect that is in progress on a socket, without firing its callback.
+ * @param pSocket Socket object whose connect is to be stopped.
+ */
+void CancelConnect(PSOCKET pSocket);
+
+#endif //__INETSOCK_API_SOCKET_INTERNAL_H__
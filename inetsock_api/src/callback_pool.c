@@ -0,0 +1,539 @@
+// callback_pool.c - provides the pool of worker threads that runs socket
+// callbacks for sockets in SOCKET_CALLBACK_WORKERS mode
+//
+// The thread that changes a socket's state (an event loop, the connector
+// thread, a sender) does not call the callback itself; it copies the event
+// (handle, state, callback and state bag) onto the socket's callback queue
+// and moves on.  A queue with events on it is scheduled on one of the
+// workers' deques, and is only ever on one deque, and only ever run by one
+// worker, at a time; that is what keeps each socket's events in order.
+//
+// Events are pushed onto a queue with a lock-free compare-and-swap, newest
+// first; the worker that runs the queue takes the whole stack at once with an
+// atomic exchange and reverses it.  The deques are short mutex-protected
+// lists: a worker runs the queues on its own deque, oldest first, and when it
+// runs dry it steals from the newest end of the others'.  A worker with
+// nothing to do and nothing to steal sleeps until more work is scheduled.
+// The pool is started the first time it is needed and runs until the process
+// exits.
+//
+
+#include "stdafx.h"
+
+#include "socket_internal.h"
+
+/**
+ * @brief Number of callback worker threads.  Zero means one per online CPU.
+ */
+#ifndef CALLBACK_WORKER_THREADS
+#define CALLBACK_WORKER_THREADS			0
+#endif //CALLBACK_WORKER_THREADS
+
+/**
+ * @brief Number of events a worker runs for one socket before it puts the
+ * socket's queue at the back of its deque, so that a socket that never goes
+ * quiet cannot starve the others.
+ */
+#ifndef CALLBACK_BATCH_SIZE
+#define CALLBACK_BATCH_SIZE				64
+#endif //CALLBACK_BATCH_SIZE
+
+///////////////////////////////////////////////////////////////////////////////
+// CALLBACKEVENT struct - one call of a socket callback, waiting to be made.
+// Any state bag that had to be copied follows the struct.
+
+typedef struct _tagCALLBACKEVENT {
+	struct _tagCALLBACKEVENT* pNext;	/* Next event on the queue */
+	HSOCKET			hSocket;		/* Handle the callback is called with */
+	SOCKET_STATE	state;			/* State the socket went into */
+	LPSOCKET_EVENT_ROUTINE lpfnCallback;	/* Callback to call */
+	void*			lpUserState;	/* State bag; points at bag if it was copied */
+	char			bag[] __attribute__((aligned(__BIGGEST_ALIGNMENT__)));
+} CALLBACKEVENT, *PCALLBACKEVENT;
+
+///////////////////////////////////////////////////////////////////////////////
+// CALLBACKQUEUE struct - the events of one socket that have not been run yet.
+// The socket holds a reference, and so does the pool while the queue is
+// scheduled, so that the events of a socket that has since been closed
+// (CLOSED among them) are still run.
+
+typedef struct _tagCALLBACKQUEUE {
+	PCALLBACKEVENT	pPushed;		/* Events not yet taken by a worker, newest first */
+	int				bScheduled;		/* Nonzero while on a deque or being run */
+	int				nRefs;			/* The socket's reference, plus the pool's while scheduled */
+	struct _tagCALLBACKQUEUE* pNextWork;	/* Next (newer) queue on the deque */
+	struct _tagCALLBACKQUEUE* pPrevWork;	/* Previous (older) queue on the deque */
+} CALLBACKQUEUE;
+
+///////////////////////////////////////////////////////////////////////////////
+// CALLBACKWORKER struct - one worker thread's deque of scheduled queues.
+
+typedef struct _tagCALLBACKWORKER {
+	pthread_mutex_t	lock;			/* Protects the deque */
+	PCALLBACKQUEUE	pOldest;		/* Where the owner takes work from */
+	PCALLBACKQUEUE	pNewest;		/* Where work is added, and stolen from */
+} __attribute__((aligned(CACHE_LINE_SIZE))) CALLBACKWORKER, *PCALLBACKWORKER;
+
+///////////////////////////////////////////////////////////////////////////////
+// Pool state.  g_nScheduled counts the queues sitting on deques, so that a
+// worker can tell whether it is worth going to sleep; g_idleLock and
+// g_idleCond are only used for sleeping and waking.
+
+static pthread_once_t g_workersOnce = PTHREAD_ONCE_INIT;
+static PCALLBACKWORKER g_pWorkers = NULL;
+static int g_nWorkers = 0;
+static unsigned int g_nNextWorker = 0;
+static int g_nScheduled = 0;
+static int g_nIdle = 0;
+static pthread_mutex_t g_idleLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t g_idleCond = PTHREAD_COND_INITIALIZER;
+static SOCKET_CALLBACK_MODE g_defaultCallbackMode = SOCKET_CALLBACK_INLINE;
+
+static __thread PCALLBACKWORKER t_pWorker = NULL;
+static __thread PCALLBACKEVENT t_pCurrentEvent = NULL;
+
+///////////////////////////////////////////////////////////////////////////////
+// ReleaseQueue - Internal function that drops a reference to a callback
+// queue, freeing it when the last one is gone.  By then it is empty: events
+// are only pushed by a holder of the socket's reference, and a queue with
+// events on it is scheduled.
+
+static void ReleaseQueue(PCALLBACKQUEUE pQueue)
+{
+	if (0 == __atomic_sub_fetch(&pQueue->nRefs, 1, __ATOMIC_ACQ_REL))
+		free_buffer((void**)&pQueue);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// PushWork - Internal function that puts a queue on the newest end of a
+// worker's deque, and wakes a sleeping worker, if there is one, to run it.
+
+static void PushWork(PCALLBACKWORKER pWorker, PCALLBACKQUEUE pQueue)
+{
+	pthread_mutex_lock(&pWorker->lock);
+
+	pQueue->pNextWork = NULL;
+	pQueue->pPrevWork = pWorker->pNewest;
+	if (NULL != pWorker->pNewest)
+		pWorker->pNewest->pNextWork = pQueue;
+	else
+		__atomic_store_n(&pWorker->pOldest, pQueue, __ATOMIC_RELAXED);
+	pWorker->pNewest = pQueue;
+
+	// Pairs with the idle count going up before a worker's last look at
+	// g_nScheduled in WaitForWork: one of the two sees the other.
+	__atomic_add_fetch(&g_nScheduled, 1, __ATOMIC_SEQ_CST);
+
+	pthread_mutex_unlock(&pWorker->lock);
+
+	if (0 == __atomic_load_n(&g_nIdle, __ATOMIC_SEQ_CST))
+		return;
+
+	pthread_mutex_lock(&g_idleLock);
+	pthread_cond_signal(&g_idleCond);
+	pthread_mutex_unlock(&g_idleLock);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// PopWork - Internal function that takes a queue off a worker's deque: the
+// oldest, for the deque's owner, or the newest, for a thief.  Returns NULL if
+// the deque is empty.
+
+static PCALLBACKQUEUE PopWork(PCALLBACKWORKER pWorker, int bSteal)
+{
+	PCALLBACKQUEUE pQueue = NULL;
+
+	// Do not bother the owner for the lock if there is nothing to take.
+	if (NULL == __atomic_load_n(&pWorker->pOldest, __ATOMIC_RELAXED))
+		return NULL;
+
+	pthread_mutex_lock(&pWorker->lock);
+
+	pQueue = bSteal ? pWorker->pNewest : pWorker->pOldest;
+	if (NULL != pQueue)
+	{
+		if (NULL != pQueue->pPrevWork)
+			pQueue->pPrevWork->pNextWork = pQueue->pNextWork;
+		else
+			__atomic_store_n(&pWorker->pOldest, pQueue->pNextWork, __ATOMIC_RELAXED);
+
+		if (NULL != pQueue->pNextWork)
+			pQueue->pNextWork->pPrevWork = pQueue->pPrevWork;
+		else
+			pWorker->pNewest = pQueue->pPrevWork;
+
+		pQueue->pNextWork = NULL;
+		pQueue->pPrevWork = NULL;
+
+		__atomic_sub_fetch(&g_nScheduled, 1, __ATOMIC_SEQ_CST);
+	}
+
+	pthread_mutex_unlock(&pWorker->lock);
+
+	return pQueue;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// FindWork - Internal function that gets the next queue for a worker to run:
+// from its own deque if it can, and otherwise stolen from another worker's.
+
+static PCALLBACKQUEUE FindWork(PCALLBACKWORKER pSelf)
+{
+	PCALLBACKQUEUE pQueue = PopWork(pSelf, 0);
+	int nSelf = (int)(pSelf - g_pWorkers);
+
+	for (int i = 1; NULL == pQueue && i < g_nWorkers; i++)
+		pQueue = PopWork(&g_pWorkers[(nSelf + i) % g_nWorkers], 1);
+
+	return pQueue;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// WaitForWork - Internal function that puts a worker to sleep until a queue
+// is scheduled somewhere.
+
+static void WaitForWork(void)
+{
+	pthread_mutex_lock(&g_idleLock);
+
+	__atomic_add_fetch(&g_nIdle, 1, __ATOMIC_SEQ_CST);
+	while (0 == __atomic_load_n(&g_nScheduled, __ATOMIC_SEQ_CST))
+		pthread_cond_wait(&g_idleCond, &g_idleLock);
+	__atomic_sub_fetch(&g_nIdle, 1, __ATOMIC_SEQ_CST);
+
+	pthread_mutex_unlock(&g_idleLock);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// RunEvent - Internal function that calls the callback for one event.  While
+// it runs, GetSocketState reports the state the event was queued for.
+
+static void RunEvent(PCALLBACKEVENT pEvent)
+{
+	unsigned long long nStartNs = StatsNow();
+
+	t_pCurrentEvent = pEvent;
+
+	pEvent->lpfnCallback(pEvent->hSocket, pEvent->lpUserState);
+
+	t_pCurrentEvent = NULL;
+
+	RecordLatency(LATENCY_CALLBACK, nStartNs);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// RunQueue - Internal function that runs the events on a scheduled queue, in
+// the order they were queued, until the queue is empty or the worker has run
+// CALLBACK_BATCH_SIZE of them.  Whatever the callbacks sent in buffered send
+// mode is flushed once they are done with a socket.
+
+static void RunQueue(PCALLBACKWORKER pSelf, PCALLBACKQUEUE pQueue)
+{
+	int nRun = 0;
+
+	for (;;)
+	{
+		PCALLBACKEVENT pEvents = __atomic_exchange_n(&pQueue->pPushed, NULL,
+				__ATOMIC_ACQUIRE);
+		PCALLBACKEVENT pOldest = NULL;
+
+		if (NULL == pEvents)
+		{
+			// Give up the queue; but an event may have been pushed after the
+			// exchange by a thread that saw it still scheduled, in which
+			// case take it back, unless that thread has already scheduled it
+			// again itself.
+			__atomic_store_n(&pQueue->bScheduled, 0, __ATOMIC_SEQ_CST);
+			if (NULL == __atomic_load_n(&pQueue->pPushed, __ATOMIC_SEQ_CST)
+					|| __atomic_exchange_n(&pQueue->bScheduled, 1, __ATOMIC_SEQ_CST))
+			{
+				ReleaseQueue(pQueue);
+				return;
+			}
+
+			continue;
+		}
+
+		while (NULL != pEvents)
+		{
+			PCALLBACKEVENT pNext = pEvents->pNext;
+			pEvents->pNext = pOldest;
+			pOldest = pEvents;
+			pEvents = pNext;
+		}
+
+		while (NULL != pOldest)
+		{
+			PCALLBACKEVENT pNext = pOldest->pNext;
+
+			RunEvent(pOldest);
+
+			if (NULL == pNext || pNext->hSocket != pOldest->hSocket)
+				Flush(pOldest->hSocket);
+
+			free_buffer((void**)&pOldest);
+			pOldest = pNext;
+			nRun++;
+		}
+
+		if (nRun >= CALLBACK_BATCH_SIZE)
+		{
+			PushWork(pSelf, pQueue);
+			return;
+		}
+	}
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// CallbackWorkerThread - Internal function that runs one callback worker for
+// the life of the process.
+
+static void* CallbackWorkerThread(void* pArg)
+{
+	PCALLBACKWORKER pSelf = (PCALLBACKWORKER)pArg;
+
+	t_pWorker = pSelf;
+
+	for (;;)
+	{
+		PCALLBACKQUEUE pQueue = FindWork(pSelf);
+		if (NULL == pQueue)
+		{
+			WaitForWork();
+			continue;
+		}
+
+		RunQueue(pSelf, pQueue);
+	}
+
+	return NULL;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// StartCallbackWorkers - Internal function, run once, that creates the
+// worker threads.  If none can be created, g_nWorkers stays at zero and
+// callbacks go on running inline.
+
+static void StartCallbackWorkers(void)
+{
+	int nWorkers = CALLBACK_WORKER_THREADS;
+	int nStarted = 0;
+	PCALLBACKWORKER pWorkers = NULL;
+	pthread_attr_t attr;
+
+	if (nWorkers <= 0)
+		nWorkers = (int)sysconf(_SC_NPROCESSORS_ONLN);
+
+	if (nWorkers <= 0)
+		nWorkers = 1;
+
+	if (0 != posix_memalign((void**)&pWorkers, CACHE_LINE_SIZE,
+			nWorkers * sizeof(CALLBACKWORKER)))
+		return;
+
+	memset(pWorkers, 0, nWorkers * sizeof(CALLBACKWORKER));
+	for (int i = 0; i < nWorkers; i++)
+		pthread_mutex_init(&pWorkers[i].lock, NULL);
+
+	// The workers look at the whole array when they steal, including the
+	// deques of any that fail to start; work queued there is still done.
+	g_pWorkers = pWorkers;
+	g_nWorkers = nWorkers;
+
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+
+	for (int i = 0; i < nWorkers; i++)
+	{
+		pthread_t thread;
+		if (0 == pthread_create(&thread, &attr, CallbackWorkerThread, &pWorkers[i]))
+			nStarted++;
+	}
+
+	pthread_attr_destroy(&attr);
+
+	if (0 == nStarted)
+		g_nWorkers = 0;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// GetQueue - Internal function that gets a socket's callback queue, creating
+// it the first time.  Returns NULL if out of memory.
+
+static PCALLBACKQUEUE GetQueue(PSOCKET pSocket)
+{
+	PCALLBACKQUEUE pQueue = __atomic_load_n(&pSocket->pCallbackQueue, __ATOMIC_ACQUIRE);
+	PCALLBACKQUEUE pExpected = NULL;
+
+	if (NULL != pQueue)
+		return pQueue;
+
+	pQueue = (PCALLBACKQUEUE)calloc(1, sizeof(CALLBACKQUEUE));
+	if (NULL == pQueue)
+		return NULL;
+
+	pQueue->nRefs = 1;	/* the socket's */
+
+	// Two threads may race to make the queue; the loser uses the winner's.
+	if (!__atomic_compare_exchange_n(&pSocket->pCallbackQueue, &pExpected, pQueue, 0,
+			__ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+	{
+		free_buffer((void**)&pQueue);
+		return pExpected;
+	}
+
+	return pQueue;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// QueueCallback - Queues a call of a socket's callback on the callback worker
+// pool.  The state bag, if nBagBytes is nonzero, is copied; and if nDataBytes
+// is nonzero, the bag is a SOCKETRECVDATA or a SOCKETDATAGRAM, both of which
+// start with the data pointer, and the data it points to is copied as well.
+// ACCEPTED goes on the new client's queue rather than the server's, so that
+// the callback hears of the client before it hears from it.  Returns zero if
+// the call was queued, or ERROR if the caller should make the call itself
+// (the pool could not be started, or memory ran out).
+
+int QueueCallback(PSOCKET pSocket, SOCKET_STATE newState, void* lpUserState,
+		size_t nBagBytes, size_t nDataBytes)
+{
+	PSOCKET pQueueSocket = pSocket;
+	PCALLBACKQUEUE pQueue = NULL;
+	PCALLBACKEVENT pEvent = NULL;
+
+	pthread_once(&g_workersOnce, StartCallbackWorkers);
+	if (0 == g_nWorkers)
+		return ERROR;
+
+	if (SOCKET_STATE_ACCEPTED == newState)
+	{
+		PSOCKET pClient = LookupSocket((HSOCKET)lpUserState);
+		if (NULL != pClient)
+			pQueueSocket = pClient;
+	}
+
+	pQueue = GetQueue(pQueueSocket);
+	if (NULL == pQueue)
+		return ERROR;
+
+	pEvent = (PCALLBACKEVENT)malloc(sizeof(CALLBACKEVENT) + nBagBytes + nDataBytes);
+	if (NULL == pEvent)
+		return ERROR;
+
+	pEvent->hSocket = pSocket->hSelf;
+	pEvent->state = newState;
+	pEvent->lpfnCallback = pSocket->lpfnCallback;
+	pEvent->lpUserState = lpUserState;
+
+	if (nBagBytes > 0)
+	{
+		memcpy(pEvent->bag, lpUserState, nBagBytes);
+		pEvent->lpUserState = pEvent->bag;
+	}
+
+	if (nDataBytes > 0)
+	{
+		PSOCKETRECVDATA pRecvData = (PSOCKETRECVDATA)pEvent->bag;
+		memcpy(pEvent->bag + nBagBytes, pRecvData->pData, nDataBytes);
+		pRecvData->pData = pEvent->bag + nBagBytes;
+	}
+
+	pEvent->pNext = __atomic_load_n(&pQueue->pPushed, __ATOMIC_RELAXED);
+	while (!__atomic_compare_exchange_n(&pQueue->pPushed, &pEvent->pNext, pEvent, 1,
+			__ATOMIC_SEQ_CST, __ATOMIC_RELAXED))
+		;
+
+	// Whoever flips the flag schedules the queue, on their own deque if
+	// they are a worker (e.g., a callback that sent on another socket).
+	if (!__atomic_exchange_n(&pQueue->bScheduled, 1, __ATOMIC_SEQ_CST))
+	{
+		__atomic_add_fetch(&pQueue->nRefs, 1, __ATOMIC_RELAXED);
+
+		if (NULL != t_pWorker)
+			PushWork(t_pWorker, pQueue);
+		else
+			PushWork(&g_pWorkers[__atomic_fetch_add(&g_nNextWorker, 1,
+					__ATOMIC_RELAXED) % (unsigned int)g_nWorkers], pQueue);
+	}
+
+	return 0;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// ReleaseCallbackQueue - Drops a closing socket's reference to its callback
+// queue.  Events still on the queue are run all the same.
+
+void ReleaseCallbackQueue(PSOCKET pSocket)
+{
+	PCALLBACKQUEUE pQueue = __atomic_exchange_n(&pSocket->pCallbackQueue, NULL,
+			__ATOMIC_ACQ_REL);
+
+	if (NULL != pQueue)
+		ReleaseQueue(pQueue);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// GetCallbackState - Tells whether the calling thread is a callback worker in
+// the middle of running an event for the specified socket, and if so, which
+// state the event was queued for.
+
+int GetCallbackState(HSOCKET hSocket, SOCKET_STATE* pState)
+{
+	PCALLBACKEVENT pEvent = t_pCurrentEvent;
+
+	if (NULL == pEvent || pEvent->hSocket != hSocket)
+		return 0;
+
+	*pState = pEvent->state;
+
+	return 1;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// GetDefaultCallbackMode - Gets the callback mode that newly opened sockets
+// start out in.
+
+SOCKET_CALLBACK_MODE GetDefaultCallbackMode(void)
+{
+	return __atomic_load_n(&g_defaultCallbackMode, __ATOMIC_RELAXED);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// SetDefaultCallbackMode - Selects which thread the callbacks of sockets
+// opened from now on run on, process-wide.
+
+void SetDefaultCallbackMode(SOCKET_CALLBACK_MODE mode)
+{
+	if (SOCKET_CALLBACK_INLINE != mode && SOCKET_CALLBACK_WORKERS != mode)
+		return;
+
+	__atomic_store_n(&g_defaultCallbackMode, mode, __ATOMIC_RELAXED);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// SetSocketCallbackMode - Selects which thread the specified socket's
+// callback runs on.  Returns zero on success, or ERROR with errno set.
+
+int SetSocketCallbackMode(HSOCKET hSocket, SOCKET_CALLBACK_MODE mode)
+{
+	PSOCKET pSocket = NULL;
+
+	if (SOCKET_CALLBACK_INLINE != mode && SOCKET_CALLBACK_WORKERS != mode)
+	{
+		errno = EINVAL;
+		return ERROR;
+	}
+
+	pSocket = EnterSocket(hSocket);
+	if (NULL == pSocket)
+		return ERROR;
+
+	__atomic_store_n(&pSocket->callbackMode, mode, __ATOMIC_RELAXED);
+
+	LeaveSocket(pSocket);
+
+	return 0;
+}
+
+///////////////////////////////////////////////////////////////////////////////
@@ -0,0 +1,396 @@
+// connection_pool.c - provides the pool of connected client sockets behind
+// AcquireConnection and ReleaseConnection
+//
+// Connections are pooled per destination (host name, as the caller spelled
+// it, and port).  A released connection goes on its destination's idle list,
+// most recently used first; AcquireConnection takes from the front of that
+// list, skipping (and closing) any connection that has been idle too long or
+// that fails a liveness check, and only opens a new connection if none is
+// left.  Each destination is allowed a limited number of connections, idle
+// and checked out together.
+//
+
+#include "stdafx.h"
+
+#include "socket_internal.h"
+
+/**
+ * @brief Default maximum number of connections, checked out and idle together,
+ * that the pool allows to any one destination.
+ */
+#ifndef CONNECTION_POOL_DEFAULT_MAX_PER_HOST
+#define CONNECTION_POOL_DEFAULT_MAX_PER_HOST	32
+#endif //CONNECTION_POOL_DEFAULT_MAX_PER_HOST
+
+/**
+ * @brief Default number of seconds a connection may sit idle in the pool
+ * before it is closed instead of being reused.
+ */
+#ifndef CONNECTION_POOL_DEFAULT_IDLE_TIMEOUT
+#define CONNECTION_POOL_DEFAULT_IDLE_TIMEOUT	60
+#endif //CONNECTION_POOL_DEFAULT_IDLE_TIMEOUT
+
+///////////////////////////////////////////////////////////////////////////////
+// POOLDESTINATION struct - the connections the pool holds for one host and
+// port.  Destinations are never freed; there are only ever a handful.
+
+typedef struct _tagPOOLDESTINATION {
+	char*			pszHost;		/* Host name, as the caller spelled it */
+	int				nPort;			/* Port number */
+	int				nOpen;			/* Connections checked out or idle */
+	PSOCKET			pIdle;			/* Idle connections, most recently released first */
+	struct _tagPOOLDESTINATION* pNext;	/* Next destination in the pool */
+} POOLDESTINATION;
+
+///////////////////////////////////////////////////////////////////////////////
+// Pool state, all protected by g_poolMutex.
+
+static pthread_mutex_t g_poolMutex = PTHREAD_MUTEX_INITIALIZER;
+static PPOOLDESTINATION g_pDestinations = NULL;
+static int g_nMaxPerHost = CONNECTION_POOL_DEFAULT_MAX_PER_HOST;
+static int g_nIdleTimeout = CONNECTION_POOL_DEFAULT_IDLE_TIMEOUT;
+
+///////////////////////////////////////////////////////////////////////////////
+// NowSeconds - Internal function that reads the monotonic clock, in seconds.
+
+static time_t NowSeconds(void)
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// TakeExpired - Internal function that takes every connection that has been
+// idle too long off a destination's idle list and adds it to the specified
+// list of connections to be closed.  Since the idle list is kept in the order
+// the connections were released, the expired ones are all at its tail.  The
+// caller must hold g_poolMutex.
+
+static void TakeExpired(PPOOLDESTINATION pDest, time_t nNow, PSOCKET* ppStale)
+{
+	PSOCKET* ppLink = &pDest->pIdle;
+
+	while (NULL != *ppLink && nNow - (*ppLink)->nIdleSince <= g_nIdleTimeout)
+		ppLink = &(*ppLink)->pNextIdle;
+
+	while (NULL != *ppLink)
+	{
+		PSOCKET pSocket = *ppLink;
+		*ppLink = pSocket->pNextIdle;
+		pDest->nOpen--;
+		pSocket->pPoolDest = NULL;
+		pSocket->bPoolIdle = 0;
+		pSocket->pNextIdle = *ppStale;
+		*ppStale = pSocket;
+	}
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// CloseStale - Internal function that closes every connection on a list that
+// TakeExpired (or the like) built.  Must be called without g_poolMutex held.
+
+static void CloseStale(PSOCKET pStale)
+{
+	while (NULL != pStale)
+	{
+		PSOCKET pNext = pStale->pNextIdle;
+		pStale->pNextIdle = NULL;
+		CloseSocket(pStale->hSelf);
+		pStale = pNext;
+	}
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// FindDestination - Internal function that finds the pool's entry for the
+// specified host and port, creating it if need be.  Returns NULL if out of
+// memory.  The caller must hold g_poolMutex.
+
+static PPOOLDESTINATION FindDestination(const char* pszHost, int nPort)
+{
+	PPOOLDESTINATION pDest = g_pDestinations;
+
+	for (; NULL != pDest; pDest = pDest->pNext)
+	{
+		if (nPort == pDest->nPort && 0 == strcasecmp(pszHost, pDest->pszHost))
+			return pDest;
+	}
+
+	pDest = (PPOOLDESTINATION)calloc(1, sizeof(POOLDESTINATION));
+	if (NULL == pDest)
+		return NULL;
+
+	pDest->pszHost = strdup(pszHost);
+	if (NULL == pDest->pszHost)
+	{
+		free_buffer((void**)&pDest);
+		return NULL;
+	}
+
+	pDest->nPort = nPort;
+	pDest->pNext = g_pDestinations;
+	g_pDestinations = pDest;
+
+	return pDest;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// IsConnectionAlive - Internal function that checks, without blocking, that
+// an idle connection is still good to send a request on: the peer must not
+// have hung up, and must not have sent anything the last user left unread
+// (which would otherwise be mistaken for the answer to the next request).
+
+static int IsConnectionAlive(PSOCKET pSocket)
+{
+	char chPeek = 0;
+	ssize_t nPeeked = 0;
+
+	if (pSocket->nRecvTail != pSocket->nRecvHead)
+		return 0;	/* unread data in the receive ring */
+
+	nPeeked = recv(pSocket->nSocketDescriptor, &chPeek, 1, MSG_PEEK | MSG_DONTWAIT);
+	if (nPeeked < 0 && (EAGAIN == errno || EWOULDBLOCK == errno))
+		return 1;
+
+	return 0;	/* zero: orderly shutdown; positive: stray data; else: error */
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// AcquireConnection - Gets a connected client socket to the specified host and
+// port, reusing an idle one from the pool if there is a good one, or opening
+// and connecting a new one otherwise.  The socket reports to the specified
+// callback and is in the READY state.  Returns INVALID_HANDLE_VALUE with
+// errno set if no connection could be had.
+
+HSOCKET AcquireConnection(const char* pszHostAddress, int nPort,
+		LPSOCKET_EVENT_ROUTINE lpfnCallback)
+{
+	PPOOLDESTINATION pDest = NULL;
+	PSOCKET pStale = NULL;
+	PSOCKET pSocket = NULL;
+	HSOCKET hSocket = INVALID_HANDLE_VALUE;
+	time_t nNow = 0;
+
+	if (NULL == pszHostAddress || '\0' == pszHostAddress[0]
+			|| ((nPort <= 0 || nPort > 65535) && !IsUnixAddress(pszHostAddress))
+			|| NULL == lpfnCallback)
+	{
+		errno = EINVAL;
+		return INVALID_HANDLE_VALUE;
+	}
+
+	nNow = NowSeconds();
+
+	pthread_mutex_lock(&g_poolMutex);
+
+	pDest = FindDestination(pszHostAddress, nPort);
+	if (NULL == pDest)
+	{
+		pthread_mutex_unlock(&g_poolMutex);
+		errno = ENOMEM;
+		return INVALID_HANDLE_VALUE;
+	}
+
+	// Take the most recently used idle connection that is still good.
+	// Anything unfit is set aside to be closed once the lock is dropped.
+	TakeExpired(pDest, nNow, &pStale);
+
+	while (NULL != pDest->pIdle)
+	{
+		PSOCKET pCandidate = pDest->pIdle;
+		pDest->pIdle = pCandidate->pNextIdle;
+		pCandidate->pNextIdle = NULL;
+		pCandidate->bPoolIdle = 0;
+
+		if (IsConnectionAlive(pCandidate))
+		{
+			pSocket = pCandidate;
+			break;
+		}
+
+		pDest->nOpen--;
+		pCandidate->pPoolDest = NULL;
+		pCandidate->pNextIdle = pStale;
+		pStale = pCandidate;
+	}
+
+	if (NULL == pSocket)
+	{
+		if (pDest->nOpen >= g_nMaxPerHost)
+		{
+			pthread_mutex_unlock(&g_poolMutex);
+			errno = EAGAIN;
+			goto closeStale;
+		}
+
+		pDest->nOpen++;		/* reserve the slot before connecting */
+	}
+
+	pthread_mutex_unlock(&g_poolMutex);
+
+	if (NULL != pSocket)
+	{
+		pSocket->lpfnCallback = lpfnCallback;
+		hSocket = pSocket->hSelf;
+		goto closeStale;
+	}
+
+	hSocket = OpenSocket(SOCKET_TYPE_CLIENT, lpfnCallback);
+	pSocket = LookupSocket(hSocket);
+	if (NULL == pSocket || ConnectSocket(pSocket, pszHostAddress, nPort) < 0)
+	{
+		int nSavedErrno = errno;
+
+		CloseSocket(hSocket);
+		hSocket = INVALID_HANDLE_VALUE;
+
+		pthread_mutex_lock(&g_poolMutex);
+		pDest->nOpen--;
+		pthread_mutex_unlock(&g_poolMutex);
+
+		errno = nSavedErrno;
+		goto closeStale;
+	}
+
+	pSocket->pPoolDest = pDest;
+	ChangeSocketState(pSocket, SOCKET_STATE_CONNECTED, NULL);
+	ChangeSocketState(pSocket, SOCKET_STATE_READY, NULL);
+
+closeStale:
+	CloseStale(pStale);
+
+	return hSocket;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// ConfigureConnectionPool - Sets the limits the connection pool works within.
+// Connections already open are not affected.
+
+void ConfigureConnectionPool(int nMaxPerHost, int nIdleTimeoutSeconds)
+{
+	pthread_mutex_lock(&g_poolMutex);
+
+	g_nMaxPerHost = (nMaxPerHost > 0) ? nMaxPerHost : CONNECTION_POOL_DEFAULT_MAX_PER_HOST;
+	g_nIdleTimeout = (nIdleTimeoutSeconds >= 0) ? nIdleTimeoutSeconds : 0;
+
+	pthread_mutex_unlock(&g_poolMutex);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// DetachPooledSocket - Tells the pool that a socket it handed out is being
+// closed, so that the socket stops counting against its destination.
+
+void DetachPooledSocket(PSOCKET pSocket)
+{
+	if (NULL == pSocket->pPoolDest)
+		return;
+
+	pthread_mutex_lock(&g_poolMutex);
+
+	if (NULL != pSocket->pPoolDest)
+	{
+		// Closing a connection while it sits idle is the caller's mistake
+		// (its handle was given up by ReleaseConnection), but a harmless one.
+		if (pSocket->bPoolIdle)
+		{
+			PSOCKET* ppLink = &pSocket->pPoolDest->pIdle;
+			while (NULL != *ppLink && pSocket != *ppLink)
+				ppLink = &(*ppLink)->pNextIdle;
+
+			if (NULL != *ppLink)
+				*ppLink = pSocket->pNextIdle;
+
+			pSocket->pNextIdle = NULL;
+			pSocket->bPoolIdle = 0;
+		}
+
+		pSocket->pPoolDest->nOpen--;
+		pSocket->pPoolDest = NULL;
+	}
+
+	pthread_mutex_unlock(&g_poolMutex);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// FlushConnectionPool - Closes every idle connection in the pool.
+
+void FlushConnectionPool(void)
+{
+	PSOCKET pStale = NULL;
+
+	pthread_mutex_lock(&g_poolMutex);
+
+	for (PPOOLDESTINATION pDest = g_pDestinations; NULL != pDest; pDest = pDest->pNext)
+	{
+		while (NULL != pDest->pIdle)
+		{
+			PSOCKET pSocket = pDest->pIdle;
+			pDest->pIdle = pSocket->pNextIdle;
+			pDest->nOpen--;
+			pSocket->pPoolDest = NULL;
+			pSocket->bPoolIdle = 0;
+			pSocket->pNextIdle = pStale;
+			pStale = pSocket;
+		}
+	}
+
+	pthread_mutex_unlock(&g_poolMutex);
+
+	CloseStale(pStale);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// ReleaseConnection - Hands a socket that was obtained from AcquireConnection
+// back to the pool, so the next AcquireConnection for the same destination
+// can reuse it.  A socket that is not in the READY state, or that the pool
+// has no use for, is closed instead.
+
+void ReleaseConnection(HSOCKET hSocket)
+{
+	PSOCKET pSocket = LookupSocket(hSocket);
+	PPOOLDESTINATION pDest = NULL;
+	PSOCKET pStale = NULL;
+	int bKeep = 0;
+
+	if (NULL == pSocket)
+		return;
+
+	// Anything left in a buffered socket's output goes out before it idles;
+	// if that fails, the socket is in SOCKET_STATE_ERROR and gets closed.
+	if (!pSocket->bPoolIdle)
+		Flush(hSocket);
+
+	pthread_mutex_lock(&g_poolMutex);
+
+	if (pSocket->bPoolIdle)
+	{
+		pthread_mutex_unlock(&g_poolMutex);
+		return;		/* released twice */
+	}
+
+	pDest = pSocket->pPoolDest;
+	if (NULL != pDest && SOCKET_STATE_READY == pSocket->sockState
+			&& !pSocket->bClosePending && g_nIdleTimeout > 0)
+	{
+		time_t nNow = NowSeconds();
+
+		// Nobody is listening for this socket's events while it is idle.
+		pSocket->lpfnCallback = NULL;
+		pSocket->nIdleSince = nNow;
+		pSocket->bPoolIdle = 1;
+		pSocket->pNextIdle = pDest->pIdle;
+		pDest->pIdle = pSocket;
+		bKeep = 1;
+
+		TakeExpired(pDest, nNow, &pStale);
+	}
+
+	pthread_mutex_unlock(&g_poolMutex);
+
+	if (!bKeep)
+		CloseSocket(hSocket);
+
+	CloseStale(pStale);
+}
+
+///////////////////////////////////////////////////////////////////////////////
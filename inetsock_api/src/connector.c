@@ -0,0 +1,572 @@
+// connector.c - provides the asynchronous connect engine behind
+// ConnectToServerAsync
+//
+// A single background thread, started the first time it is needed, drives
+// every outstanding connect in the process from one epoll instance.  For each
+// request it starts a non-blocking connect to the first address the host
+// resolved to, and then, every CONNECT_ATTEMPT_DELAY_MS (or at once, if an
+// attempt fails), to the next one, alternating between address families the
+// way RFC 8305 ("Happy Eyeballs") describes.  The first attempt to complete
+// wins and is moved onto the socket's own descriptor; the rest are dropped.
+// If nothing has won by the caller's deadline, the connect fails with
+// ETIMEDOUT.
+//
+
+#include "stdafx.h"
+
+#include "socket_internal.h"
+
+/**
+ * @brief Delay, in milliseconds, between starting a connection attempt to one
+ * of a host's addresses and starting one to the next, while the earlier
+ * attempts are still pending.  RFC 8305 recommends 250 ms.
+ */
+#ifndef CONNECT_ATTEMPT_DELAY_MS
+#define CONNECT_ATTEMPT_DELAY_MS		250
+#endif //CONNECT_ATTEMPT_DELAY_MS
+
+/**
+ * @brief Maximum number of epoll events the connector thread processes per
+ * call to epoll_wait.
+ */
+#ifndef MAX_CONNECT_EVENTS
+#define MAX_CONNECT_EVENTS				64
+#endif //MAX_CONNECT_EVENTS
+
+///////////////////////////////////////////////////////////////////////////////
+// CONNECTATTEMPT struct - one non-blocking connect to one of the addresses a
+// request's host resolved to.  The epoll registration points at this struct.
+
+typedef struct _tagCONNECTATTEMPT {
+	struct _tagCONNECTREQUEST* pRequest;	/* Request this attempt belongs to */
+	int				nSocketDescriptor;	/* Descriptor of the attempt, or -1 once it is over */
+} CONNECTATTEMPT, *PCONNECTATTEMPT;
+
+///////////////////////////////////////////////////////////////////////////////
+// CONNECTREQUEST struct - everything the connector thread needs to know about
+// one call to ConnectToServerAsync.
+
+typedef struct _tagCONNECTREQUEST {
+	PSOCKET			pSocket;		/* Socket to connect; NULL once the request is cancelled */
+	PRESOLVEDADDRESS pAddrs;		/* Addresses, in the order they are to be tried */
+	PCONNECTATTEMPT	pAttempts;		/* One slot per address */
+	int				nAddrs;			/* Number of addresses (and attempt slots) */
+	int				nStarted;		/* Number of attempts started so far */
+	int				nPending;		/* Number of attempts still in flight */
+	int				nLastError;		/* errno of the most recent attempt to fail */
+	int				bFinished;		/* Nonzero once FinishRequest has run */
+	long long		nNextStartMs;	/* When to start the next attempt */
+	long long		nDeadlineMs;	/* When to give up, or zero for never */
+	unsigned long long nStartNs;	/* When ConnectToServerAsync was called (see StatsNow) */
+	struct _tagCONNECTREQUEST* pNext;	/* Next request in the submission or active list */
+} CONNECTREQUEST;
+
+///////////////////////////////////////////////////////////////////////////////
+// Connector state.  g_pSubmitted is shared with the threads that start and
+// cancel requests and is protected by g_connectMutex; g_pActive belongs to the
+// connector thread alone.
+
+static pthread_once_t g_connectorOnce = PTHREAD_ONCE_INIT;
+static pthread_mutex_t g_connectMutex = PTHREAD_MUTEX_INITIALIZER;
+static int g_nConnectorEpollFd = -1;
+static int g_nConnectorWakeFd = -1;
+static PCONNECTREQUEST g_pSubmitted = NULL;
+static PCONNECTREQUEST g_pActive = NULL;
+
+///////////////////////////////////////////////////////////////////////////////
+// NowMs - Internal function that reads the monotonic clock, in milliseconds.
+
+static long long NowMs(void)
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (long long)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// CloseAttempt - Internal function that ends a connection attempt.  It is
+// taken out of the epoll set explicitly, since the winning attempt's
+// connection lives on in the socket's descriptor, and epoll would keep
+// reporting it otherwise.
+
+static void CloseAttempt(PCONNECTATTEMPT pAttempt)
+{
+	if (pAttempt->nSocketDescriptor < 0)
+		return;
+
+	epoll_ctl(g_nConnectorEpollFd, EPOLL_CTL_DEL, pAttempt->nSocketDescriptor, NULL);
+	close(pAttempt->nSocketDescriptor);
+	pAttempt->nSocketDescriptor = -1;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// FreeRequest - Internal function that releases a request and everything it
+// owns.  Any attempts still open are closed.
+
+static void FreeRequest(PCONNECTREQUEST pRequest)
+{
+	if (NULL == pRequest)
+		return;
+
+	for (int i = 0; NULL != pRequest->pAttempts && i < pRequest->nStarted; i++)
+		CloseAttempt(&pRequest->pAttempts[i]);
+
+	free_buffer((void**)&pRequest->pAddrs);
+	free_buffer((void**)&pRequest->pAttempts);
+	free_buffer((void**)&pRequest);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// OrderAddresses - Internal function that fills in the request's list of
+// addresses to try, alternating between address families and starting with
+// the family of the first address the resolver returned, so that a broken
+// IPv6 (or IPv4) path costs at most one attempt delay.  Returns zero on
+// success, or ERROR if out of memory.
+
+static int OrderAddresses(PCONNECTREQUEST pRequest, const PRESOLVEDADDRESS pResolved,
+		int nCount)
+{
+	sa_family_t nPreferredFamily = pResolved[0].addr.ss_family;
+	int nPreferred = 0;
+	int nOther = 0;
+
+	pRequest->pAddrs = (PRESOLVEDADDRESS)calloc(nCount, sizeof(RESOLVEDADDRESS));
+	pRequest->pAttempts = (PCONNECTATTEMPT)calloc(nCount, sizeof(CONNECTATTEMPT));
+	if (NULL == pRequest->pAddrs || NULL == pRequest->pAttempts)
+		return ERROR;
+
+	// Walk two cursors over the list: one over addresses of the preferred
+	// family and one over everything else, taking from each in turn.
+	while (pRequest->nAddrs < nCount)
+	{
+		while (nPreferred < nCount && pResolved[nPreferred].addr.ss_family != nPreferredFamily)
+			nPreferred++;
+
+		if (nPreferred < nCount)
+			pRequest->pAddrs[pRequest->nAddrs++] = pResolved[nPreferred++];
+
+		while (nOther < nCount && pResolved[nOther].addr.ss_family == nPreferredFamily)
+			nOther++;
+
+		if (nOther < nCount)
+			pRequest->pAddrs[pRequest->nAddrs++] = pResolved[nOther++];
+	}
+
+	return 0;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// FinishRequest - Internal function that ends a request, either by moving the
+// winning attempt's connection onto the socket's own descriptor or by failing
+// with the specified errno value, and then fires CONNECTED or ERROR.  The
+// request stays on the active list until the next pass of the connector
+// loop, so that epoll events still in hand that point at its attempts do not
+// point at freed memory.
+
+static void FinishRequest(PCONNECTREQUEST pRequest, int nWinner, int nError)
+{
+	PSOCKET pSocket = NULL;
+
+	pRequest->bFinished = 1;
+
+	pthread_mutex_lock(&g_connectMutex);
+
+	pSocket = pRequest->pSocket;
+	if (NULL != pSocket)
+	{
+		pSocket->pConnect = NULL;
+
+		if (nWinner >= 0)
+		{
+			// The rest of the library expects blocking sockets, and callers
+			// may be holding on to the socket's descriptor number, so the
+			// connection takes over the descriptor rather than replacing it.
+			int nFlags = fcntl(pRequest->pAttempts[nWinner].nSocketDescriptor, F_GETFL);
+			if (nFlags < 0
+					|| fcntl(pRequest->pAttempts[nWinner].nSocketDescriptor,
+							F_SETFL, nFlags & ~O_NONBLOCK) < 0
+					|| dup3(pRequest->pAttempts[nWinner].nSocketDescriptor,
+							pSocket->nSocketDescriptor, O_CLOEXEC) < 0)
+				nError = errno;
+			else
+				ApplySocketTuning(pSocket, NULL, TUNING_STAGE_CONNECTED);
+		}
+	}
+
+	pthread_mutex_unlock(&g_connectMutex);
+
+	// Close every attempt, the winner included; the socket has its own copy.
+	for (int i = 0; i < pRequest->nStarted; i++)
+		CloseAttempt(&pRequest->pAttempts[i]);
+
+	pRequest->nPending = 0;
+
+	if (NULL == pSocket)
+		return;		/* cancelled by CloseSocket */
+
+	if (0 == nError)
+	{
+		RecordLatency(LATENCY_CONNECT, pRequest->nStartNs);
+		ChangeSocketState(pSocket, SOCKET_STATE_CONNECTED, NULL);
+	}
+	else
+	{
+		// GetLastError reports errno, and the callback runs on this thread.
+		errno = nError;
+		ChangeSocketState(pSocket, SOCKET_STATE_ERROR, NULL);
+	}
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// StartAttempt - Internal function that starts a non-blocking connect to the
+// next address on the request's list.  Returns the index of the attempt if
+// it connected on the spot, or ERROR otherwise (including when it is merely
+// in progress, or failed and was written off).
+
+static int StartAttempt(PCONNECTREQUEST pRequest, long long nNowMs)
+{
+	PRESOLVEDADDRESS pAddr = &pRequest->pAddrs[pRequest->nStarted];
+	PCONNECTATTEMPT pAttempt = &pRequest->pAttempts[pRequest->nStarted];
+	struct epoll_event ev;
+
+	pAttempt->pRequest = pRequest;
+	pAttempt->nSocketDescriptor = -1;
+	pRequest->nStarted++;
+	pRequest->nNextStartMs = nNowMs + CONNECT_ATTEMPT_DELAY_MS;
+
+	int nSocketDescriptor = socket(pAddr->addr.ss_family,
+			SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (nSocketDescriptor < 0)
+	{
+		pRequest->nLastError = errno;
+		pRequest->nNextStartMs = nNowMs;	/* no point waiting on this one */
+		return ERROR;
+	}
+
+	pAttempt->nSocketDescriptor = nSocketDescriptor;
+
+	if (0 == connect(nSocketDescriptor, (struct sockaddr*)&pAddr->addr, pAddr->nAddrLength))
+		return pRequest->nStarted - 1;
+
+	if (EINPROGRESS == errno)
+	{
+		memset(&ev, 0, sizeof(struct epoll_event));
+		ev.events = EPOLLOUT;
+		ev.data.ptr = pAttempt;
+		if (0 == epoll_ctl(g_nConnectorEpollFd, EPOLL_CTL_ADD, nSocketDescriptor, &ev))
+		{
+			pRequest->nPending++;
+			return ERROR;
+		}
+	}
+
+	pRequest->nLastError = errno;
+	pRequest->nNextStartMs = nNowMs;
+	close(nSocketDescriptor);
+	pAttempt->nSocketDescriptor = -1;
+
+	return ERROR;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// PumpRequest - Internal function that moves a request along: starts the
+// next attempt if it is time, and ends the request if it was cancelled, has
+// run out of addresses, or has run out of time.  Returns nonzero if the
+// request ended, and otherwise lowers *pnWakeMs to the next time the request
+// needs attention.
+
+static int PumpRequest(PCONNECTREQUEST pRequest, long long nNowMs, long long* pnWakeMs)
+{
+	int bCancelled = 0;
+
+	if (pRequest->bFinished)
+		return 1;
+
+	pthread_mutex_lock(&g_connectMutex);
+	bCancelled = (NULL == pRequest->pSocket);
+	pthread_mutex_unlock(&g_connectMutex);
+
+	if (bCancelled)
+	{
+		FinishRequest(pRequest, -1, ECANCELED);
+		return 1;
+	}
+
+	if (0 != pRequest->nDeadlineMs && nNowMs >= pRequest->nDeadlineMs)
+	{
+		FinishRequest(pRequest, -1, ETIMEDOUT);
+		return 1;
+	}
+
+	while (pRequest->nStarted < pRequest->nAddrs
+			&& (0 == pRequest->nPending || nNowMs >= pRequest->nNextStartMs))
+	{
+		int nWinner = StartAttempt(pRequest, nNowMs);
+		if (nWinner >= 0)
+		{
+			FinishRequest(pRequest, nWinner, 0);
+			return 1;
+		}
+
+		if (nNowMs < pRequest->nNextStartMs)
+			break;	/* in flight; the next one waits its turn */
+	}
+
+	if (0 == pRequest->nPending && pRequest->nStarted >= pRequest->nAddrs)
+	{
+		FinishRequest(pRequest, -1,
+				0 != pRequest->nLastError ? pRequest->nLastError : ECONNREFUSED);
+		return 1;
+	}
+
+	if (pRequest->nStarted < pRequest->nAddrs && pRequest->nNextStartMs < *pnWakeMs)
+		*pnWakeMs = pRequest->nNextStartMs;
+
+	if (0 != pRequest->nDeadlineMs && pRequest->nDeadlineMs < *pnWakeMs)
+		*pnWakeMs = pRequest->nDeadlineMs;
+
+	return 0;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// ConnectorThread - Internal function that is the body of the connector
+// thread.  Never returns.
+
+static void* ConnectorThread(void* pArg)
+{
+	struct epoll_event events[MAX_CONNECT_EVENTS];
+
+	(void)pArg;
+
+	for (;;)
+	{
+		PCONNECTREQUEST pFinished = NULL;
+		PCONNECTREQUEST* ppLink = &g_pActive;
+		long long nNowMs = NowMs();
+		long long nWakeMs = LLONG_MAX;
+		int nTimeoutMs = -1;
+		int nEvents = 0;
+
+		// Take on whatever has been submitted since the last time around.
+		pthread_mutex_lock(&g_connectMutex);
+		while (NULL != g_pSubmitted)
+		{
+			PCONNECTREQUEST pRequest = g_pSubmitted;
+			g_pSubmitted = pRequest->pNext;
+			pRequest->pNext = g_pActive;
+			g_pActive = pRequest;
+		}
+		pthread_mutex_unlock(&g_connectMutex);
+
+		while (NULL != *ppLink)
+		{
+			PCONNECTREQUEST pRequest = *ppLink;
+
+			if (PumpRequest(pRequest, nNowMs, &nWakeMs))
+			{
+				*ppLink = pRequest->pNext;
+				pRequest->pNext = pFinished;
+				pFinished = pRequest;
+				continue;
+			}
+
+			ppLink = &pRequest->pNext;
+		}
+
+		// Nothing that ended above can have events pending in epoll, since
+		// its attempts were closed before the wait.
+		while (NULL != pFinished)
+		{
+			PCONNECTREQUEST pRequest = pFinished;
+			pFinished = pRequest->pNext;
+			FreeRequest(pRequest);
+		}
+
+		if (LLONG_MAX != nWakeMs)
+			nTimeoutMs = (nWakeMs <= nNowMs) ? 0
+					: (nWakeMs - nNowMs > INT_MAX) ? INT_MAX : (int)(nWakeMs - nNowMs);
+
+		nEvents = epoll_wait(g_nConnectorEpollFd, events, MAX_CONNECT_EVENTS, nTimeoutMs);
+
+		for (int i = 0; i < nEvents; i++)
+		{
+			PCONNECTATTEMPT pAttempt = (PCONNECTATTEMPT)events[i].data.ptr;
+			PCONNECTREQUEST pRequest = NULL;
+			int nError = 0;
+			socklen_t nErrorLength = sizeof(int);
+
+			if (NULL == pAttempt)
+			{
+				uint64_t nCount = 0;
+				if (read(g_nConnectorWakeFd, &nCount, sizeof(uint64_t)) < 0)
+				{
+					/* nothing to do; the eventfd was already drained */
+				}
+				continue;
+			}
+
+			pRequest = pAttempt->pRequest;
+
+			// A request that has already finished in this batch has closed
+			// all of its attempts.  It is taken off the active list on the
+			// next pass.
+			if (pAttempt->nSocketDescriptor < 0)
+				continue;
+
+			if (getsockopt(pAttempt->nSocketDescriptor, SOL_SOCKET, SO_ERROR,
+					&nError, &nErrorLength) < 0)
+				nError = errno;
+
+			if (0 == nError)
+			{
+				FinishRequest(pRequest, (int)(pAttempt - pRequest->pAttempts), 0);
+				continue;
+			}
+
+			// This address is no good; start on the next one right away.
+			CloseAttempt(pAttempt);
+			pRequest->nPending--;
+			pRequest->nLastError = nError;
+			pRequest->nNextStartMs = 0;
+		}
+	}
+
+	return NULL;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// StartConnector - Internal function, run once, that sets up the connector's
+// epoll instance and wake-up eventfd and starts the connector thread.
+
+static void StartConnector(void)
+{
+	struct epoll_event ev;
+	pthread_t thread;
+
+	g_nConnectorEpollFd = epoll_create1(EPOLL_CLOEXEC);
+	if (g_nConnectorEpollFd < 0)
+		return;
+
+	g_nConnectorWakeFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (g_nConnectorWakeFd < 0)
+		goto fail;
+
+	memset(&ev, 0, sizeof(struct epoll_event));
+	ev.events = EPOLLIN;
+	ev.data.ptr = NULL;
+	if (epoll_ctl(g_nConnectorEpollFd, EPOLL_CTL_ADD, g_nConnectorWakeFd, &ev) < 0)
+		goto fail;
+
+	if (0 != pthread_create(&thread, NULL, ConnectorThread, NULL))
+		goto fail;
+
+	pthread_detach(thread);
+	return;
+
+fail:
+	if (g_nConnectorWakeFd >= 0)
+		close(g_nConnectorWakeFd);
+
+	close(g_nConnectorEpollFd);
+	g_nConnectorWakeFd = -1;
+	g_nConnectorEpollFd = -1;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// WakeConnector - Internal function that makes the connector thread look at
+// its lists again.
+
+static void WakeConnector(void)
+{
+	uint64_t nOne = 1;
+	if (write(g_nConnectorWakeFd, &nOne, sizeof(uint64_t)) < 0)
+	{
+		/* the counter is already nonzero, which is just as good */
+	}
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// CancelConnect - Stops any connect that is in progress on the specified
+// socket, without firing its callback.  Called by CloseSocket.
+
+void CancelConnect(PSOCKET pSocket)
+{
+	if (NULL == __atomic_load_n(&pSocket->pConnect, __ATOMIC_ACQUIRE))
+		return;
+
+	pthread_mutex_lock(&g_connectMutex);
+
+	if (NULL != pSocket->pConnect)
+	{
+		pSocket->pConnect->pSocket = NULL;
+		pSocket->pConnect = NULL;
+		WakeConnector();
+	}
+
+	pthread_mutex_unlock(&g_connectMutex);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// StartConnect - Resolves the host and hands the connect over to the
+// connector thread.  Returns zero if the connect is under way, or ERROR with
+// errno set if it could not be started.
+
+int StartConnect(PSOCKET pSocket, const char* pszHostAddress, int nPort, int nTimeoutMs)
+{
+	PCONNECTREQUEST pRequest = NULL;
+	PRESOLVEDADDRESS pResolved = NULL;
+	int nResolved = 0;
+	unsigned long long nStartNs = StatsNow();
+
+	pthread_once(&g_connectorOnce, StartConnector);
+	if (g_nConnectorEpollFd < 0)
+		return ERROR;
+
+	pRequest = (PCONNECTREQUEST)calloc(1, sizeof(CONNECTREQUEST));
+	if (NULL == pRequest)
+		return ERROR;
+
+	// Resolve on the caller's thread, through the cache, so a slow name
+	// server never holds up everyone else's connects.
+	nResolved = ResolveHost(pszHostAddress, nPort, &pResolved);
+	if (nResolved <= 0)
+	{
+		FreeRequest(pRequest);
+		return ERROR;
+	}
+
+	if (OrderAddresses(pRequest, pResolved, nResolved) < 0)
+	{
+		free_buffer((void**)&pResolved);
+		FreeRequest(pRequest);
+		errno = ENOMEM;
+		return ERROR;
+	}
+
+	free_buffer((void**)&pResolved);
+
+	pRequest->pSocket = pSocket;
+	pRequest->nStartNs = nStartNs;
+	pRequest->nDeadlineMs = (nTimeoutMs > 0) ? NowMs() + nTimeoutMs : 0;
+
+	pthread_mutex_lock(&g_connectMutex);
+
+	if (NULL != pSocket->pConnect)
+	{
+		pthread_mutex_unlock(&g_connectMutex);
+		FreeRequest(pRequest);
+		errno = EALREADY;
+		return ERROR;
+	}
+
+	pSocket->pConnect = pRequest;
+	pRequest->pNext = g_pSubmitted;
+	g_pSubmitted = pRequest;
+	WakeConnector();
+
+	pthread_mutex_unlock(&g_connectMutex);
+
+	return 0;
+}
+
+///////////////////////////////////////////////////////////////////////////////
@@ -0,0 +1,267 @@
+// datagram.c - provides the batched I/O behind SOCKET_TYPE_DATAGRAM sockets
+// (see SendDatagrams and ReceiveDatagrams)
+//
+// Datagrams move in runs of up to DATAGRAM_BATCH_SIZE per system call, with
+// sendmmsg() and recvmmsg(), so that a busy UDP socket pays for one trip into
+// the kernel per batch rather than per packet.  Received payloads land in a
+// buffer that belongs to the socket: one slot of DATAGRAM_BUFFER_SIZE bytes
+// per datagram of a batch, enough for the largest UDP payload, allocated the
+// first time the socket receives and kept until it is closed, so that
+// steady-state receiving does not allocate.  Payloads are lent out of that
+// buffer, not copied, and are good until the next receive.
+//
+// Where the kernel supports it, UDP segmentation offload moves even more per
+// call: on the way out (GSO), a payload is split into datagrams of a given
+// size below the socket layer, in the NIC if it can; on the way in (GRO),
+// datagrams from the same flow that arrive back to back are handed up as one.
+// Either way, a SOCKETDATAGRAM's nSegmentSize says where the datagrams start.
+//
+
+#include "stdafx.h"
+
+#include "socket_internal.h"
+
+/**
+ * @brief Size, in bytes, of each datagram's slot in a datagram socket's receive buffer.  Longer
+ * datagrams are cut short.
+ */
+#ifndef DATAGRAM_BUFFER_SIZE
+#define DATAGRAM_BUFFER_SIZE			65536
+#endif //DATAGRAM_BUFFER_SIZE
+
+///////////////////////////////////////////////////////////////////////////////
+// Room for one UDP_SEGMENT or UDP_GRO control message, suitably aligned.
+
+typedef union _tagSEGMENTCMSG {
+	char			buf[CMSG_SPACE(sizeof(int))];
+	struct cmsghdr	align;
+} SEGMENTCMSG;
+
+///////////////////////////////////////////////////////////////////////////////
+// SendDatagramBatch - Sends a run of datagrams, as many as the kernel takes,
+// with one sendmmsg() per DATAGRAM_BATCH_SIZE of them.  A datagram with a
+// segment size goes out with a UDP_SEGMENT control message, so that it leaves
+// as a run of datagrams of that size.  Returns the number of datagrams sent,
+// or ERROR with errno set if not even the first one could be.
+
+int SendDatagramBatch(PSOCKET pSocket, const SOCKETDATAGRAM* pDatagrams, int nCount)
+{
+	struct mmsghdr msgs[DATAGRAM_BATCH_SIZE];
+	struct iovec iov[DATAGRAM_BATCH_SIZE];
+	SEGMENTCMSG control[DATAGRAM_BATCH_SIZE];
+	int nTotalSent = 0;
+
+	// Segment sizes travel in 16 bits.
+	for (int i = 0; i < nCount; i++)
+	{
+		if (pDatagrams[i].nSegmentSize > UINT16_MAX)
+		{
+			errno = EINVAL;
+			return ERROR;
+		}
+	}
+
+	while (nTotalSent < nCount)
+	{
+		int nBatch = nCount - nTotalSent;
+		size_t nRequested = 0;
+		size_t nBytesSent = 0;
+		int nSent = 0;
+
+		if (nBatch > DATAGRAM_BATCH_SIZE)
+			nBatch = DATAGRAM_BATCH_SIZE;
+
+		memset(msgs, 0, nBatch * sizeof(struct mmsghdr));
+
+		for (int i = 0; i < nBatch; i++)
+		{
+			const SOCKETDATAGRAM* pDatagram = &pDatagrams[nTotalSent + i];
+			struct msghdr* pMsg = &msgs[i].msg_hdr;
+
+			iov[i].iov_base = (void*)pDatagram->pData;
+			iov[i].iov_len = pDatagram->nLength;
+			pMsg->msg_iov = &iov[i];
+			pMsg->msg_iovlen = 1;
+
+			// No address means the peer the socket is connected to.
+			if (pDatagram->nAddrLength > 0)
+			{
+				pMsg->msg_name = (void*)&pDatagram->addr;
+				pMsg->msg_namelen = pDatagram->nAddrLength;
+			}
+
+			if (pDatagram->nSegmentSize > 0)
+			{
+				struct cmsghdr* pCmsg = NULL;
+				uint16_t nSegmentSize = (uint16_t)pDatagram->nSegmentSize;
+
+				pMsg->msg_control = control[i].buf;
+				pMsg->msg_controllen = CMSG_SPACE(sizeof(uint16_t));
+
+				pCmsg = CMSG_FIRSTHDR(pMsg);
+				pCmsg->cmsg_level = SOL_UDP;
+				pCmsg->cmsg_type = UDP_SEGMENT;
+				pCmsg->cmsg_len = CMSG_LEN(sizeof(uint16_t));
+				memcpy(CMSG_DATA(pCmsg), &nSegmentSize, sizeof(uint16_t));
+			}
+
+			nRequested += pDatagram->nLength;
+		}
+
+		nSent = sendmmsg(pSocket->nSocketDescriptor, msgs, (unsigned int)nBatch, MSG_NOSIGNAL);
+		if (nSent < 0)
+		{
+			CountSend(pSocket, ERROR, nRequested);
+
+			if (EINTR == errno)
+				continue;
+
+			if (0 == nTotalSent)
+				return ERROR;
+
+			break;		/* the rest is for the caller to try again */
+		}
+
+		for (int i = 0; i < nSent; i++)
+			nBytesSent += msgs[i].msg_len;
+
+		CountSend(pSocket, (ssize_t)nBytesSent, nRequested);
+
+		nTotalSent += nSent;
+
+		// The kernel stopped part of the way through; the next datagram
+		// would fail, and the caller needs to hear why.
+		if (nSent < nBatch)
+			break;
+	}
+
+	return nTotalSent;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// ReceiveDatagramBatch - Receives up to DATAGRAM_BATCH_SIZE datagrams with one
+// recvmmsg() into the slots of the socket's receive buffer, allocating the
+// buffer first if the socket has never received.  MSG_WAITFORONE is always
+// set, so a blocking socket waits for the first datagram and no longer.
+// Returns the number of datagrams received, or ERROR with errno set.
+
+int ReceiveDatagramBatch(PSOCKET pSocket, PSOCKETDATAGRAM pDatagrams, int nMaxDatagrams,
+		int nFlags)
+{
+	struct mmsghdr msgs[DATAGRAM_BATCH_SIZE];
+	struct iovec iov[DATAGRAM_BATCH_SIZE];
+	SEGMENTCMSG control[DATAGRAM_BATCH_SIZE];
+	size_t nBytesReceived = 0;
+	int nReceived = 0;
+
+	if (nMaxDatagrams > DATAGRAM_BATCH_SIZE)
+		nMaxDatagrams = DATAGRAM_BATCH_SIZE;
+
+	if (NULL == pSocket->pDatagramBuffer)
+	{
+		pSocket->pDatagramBuffer = (char*)malloc((size_t)DATAGRAM_BATCH_SIZE * DATAGRAM_BUFFER_SIZE);
+		if (NULL == pSocket->pDatagramBuffer)
+		{
+			errno = ENOMEM;
+			return ERROR;
+		}
+	}
+
+	memset(msgs, 0, nMaxDatagrams * sizeof(struct mmsghdr));
+
+	for (int i = 0; i < nMaxDatagrams; i++)
+	{
+		struct msghdr* pMsg = &msgs[i].msg_hdr;
+
+		iov[i].iov_base = pSocket->pDatagramBuffer + (size_t)i * DATAGRAM_BUFFER_SIZE;
+		iov[i].iov_len = DATAGRAM_BUFFER_SIZE;
+		pMsg->msg_iov = &iov[i];
+		pMsg->msg_iovlen = 1;
+		pMsg->msg_name = &pDatagrams[i].addr;
+		pMsg->msg_namelen = sizeof(struct sockaddr_storage);
+
+		// Only a socket with GRO on can get datagrams that were run together.
+		if (pSocket->nDatagramSegmentSize > 0)
+		{
+			pMsg->msg_control = control[i].buf;
+			pMsg->msg_controllen = sizeof(control[i].buf);
+		}
+	}
+
+	do
+	{
+		nReceived = recvmmsg(pSocket->nSocketDescriptor, msgs, (unsigned int)nMaxDatagrams,
+				nFlags | MSG_WAITFORONE, NULL);
+	} while (nReceived < 0 && EINTR == errno);
+
+	if (nReceived < 0)
+	{
+		CountRecv(pSocket, ERROR);
+		return ERROR;
+	}
+
+	for (int i = 0; i < nReceived; i++)
+	{
+		struct msghdr* pMsg = &msgs[i].msg_hdr;
+		PSOCKETDATAGRAM pDatagram = &pDatagrams[i];
+
+		pDatagram->pData = (const char*)iov[i].iov_base;
+		pDatagram->nLength = msgs[i].msg_len;
+		pDatagram->nSegmentSize = 0;
+		pDatagram->nAddrLength = pMsg->msg_namelen;
+
+		for (struct cmsghdr* pCmsg = CMSG_FIRSTHDR(pMsg); NULL != pCmsg;
+				pCmsg = CMSG_NXTHDR(pMsg, pCmsg))
+		{
+			if (SOL_UDP == pCmsg->cmsg_level && UDP_GRO == pCmsg->cmsg_type)
+			{
+				int nSegmentSize = 0;
+				memcpy(&nSegmentSize, CMSG_DATA(pCmsg), sizeof(int));
+
+				// A lone datagram is reported as a run of one, too.
+				if (nSegmentSize > 0 && (size_t)nSegmentSize < pDatagram->nLength)
+					pDatagram->nSegmentSize = (size_t)nSegmentSize;
+			}
+		}
+
+		nBytesReceived += msgs[i].msg_len;
+	}
+
+	CountRecv(pSocket, (ssize_t)nBytesReceived);
+
+	return nReceived;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// ApplyDatagramSegmentation - Hands a datagram socket's segment size to the
+// kernel as its UDP_SEGMENT option, which applies to every send that does not
+// say otherwise, and turns UDP_GRO on if it is nonzero, off if it is zero.
+// Returns zero on success, or ERROR with errno set (ENOPROTOOPT on kernels
+// without UDP segmentation offload).
+
+int ApplyDatagramSegmentation(PSOCKET pSocket)
+{
+	int nSegmentSize = (int)pSocket->nDatagramSegmentSize;
+	int bGro = (nSegmentSize > 0);
+
+	if (setsockopt(pSocket->nSocketDescriptor, SOL_UDP, UDP_SEGMENT,
+			&nSegmentSize, sizeof(int)) < 0)
+		return ERROR;
+
+	if (setsockopt(pSocket->nSocketDescriptor, SOL_UDP, UDP_GRO,
+			&bGro, sizeof(int)) < 0)
+		return ERROR;
+
+	return 0;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// FreeDatagramBuffer - Lets go of a datagram socket's receive buffer, if it
+// has one.
+
+void FreeDatagramBuffer(PSOCKET pSocket)
+{
+	free_buffer((void**)&pSocket->pDatagramBuffer);
+}
+
+///////////////////////////////////////////////////////////////////////////////
@@ -0,0 +1,494 @@
+// dns_cache.c - provides the in-process cache of host name lookups that
+// ConnectToServer and ConnectToServerAsync resolve through
+//
+// The libc resolver does not tell us the TTLs of the records it found, so
+// entries live for a fixed, configurable time.  Names that do not exist are
+// cached too, for a shorter time, so that a misconfigured upstream does not
+// turn every connect into a round trip to the name server.  With background
+// refresh turned on, a lookup that hits an entry in the last quarter of its
+// life gets the cached answer at once and kicks off a new lookup on another
+// thread, so that a busy name never expires in front of a caller.
+//
+// Address literals never go near the cache; parsing one is cheaper than
+// hashing it.  Neither do "unix:" addresses (see unix_socket.c), which are
+// their own one and only address.
+//
+
+#include "stdafx.h"
+
+#include "socket_internal.h"
+
+#include <arpa/inet.h>
+
+/**
+ * @brief Number of hash buckets in the cache.  Must be a power of two.
+ */
+#ifndef DNS_CACHE_BUCKETS
+#define DNS_CACHE_BUCKETS				256
+#endif //DNS_CACHE_BUCKETS
+
+/**
+ * @brief Maximum number of names the cache holds.  Once it is full, the
+ * results of new lookups are simply not cached until entries expire.
+ */
+#ifndef DNS_CACHE_MAX_ENTRIES
+#define DNS_CACHE_MAX_ENTRIES			4096
+#endif //DNS_CACHE_MAX_ENTRIES
+
+/**
+ * @brief Default number of seconds a successful lookup is cached for.
+ */
+#ifndef DNS_CACHE_DEFAULT_TTL
+#define DNS_CACHE_DEFAULT_TTL			60
+#endif //DNS_CACHE_DEFAULT_TTL
+
+/**
+ * @brief Default number of seconds a lookup of a name that does not exist is
+ * cached for.
+ */
+#ifndef DNS_CACHE_DEFAULT_NEGATIVE_TTL
+#define DNS_CACHE_DEFAULT_NEGATIVE_TTL	5
+#endif //DNS_CACHE_DEFAULT_NEGATIVE_TTL
+
+///////////////////////////////////////////////////////////////////////////////
+// DNSCACHEENTRY struct - the cached result of looking up one host name.  An
+// entry with no addresses records that the name does not exist.
+
+typedef struct _tagDNSCACHEENTRY {
+	char*			pszHost;		/* Host name, as the caller spelled it */
+	PRESOLVEDADDRESS pAddrs;		/* Addresses, in the order the resolver gave them; port 0 */
+	int				nAddrs;			/* Number of addresses; zero for a negative entry */
+	time_t			nExpires;		/* Monotonic time, in seconds, the entry stops being valid */
+	time_t			nRefreshAt;		/* Monotonic time after which a hit triggers a refresh */
+	int				bRefreshing;	/* Nonzero while a background refresh is under way */
+	struct _tagDNSCACHEENTRY* pNext;	/* Next entry in the same hash bucket */
+} DNSCACHEENTRY, *PDNSCACHEENTRY;
+
+///////////////////////////////////////////////////////////////////////////////
+// Cache state.  Everything but the counters is protected by g_dnsMutex.
+
+static pthread_mutex_t g_dnsMutex = PTHREAD_MUTEX_INITIALIZER;
+static PDNSCACHEENTRY g_pDnsBuckets[DNS_CACHE_BUCKETS];
+static int g_nDnsEntries = 0;
+static int g_nDnsTtl = DNS_CACHE_DEFAULT_TTL;
+static int g_nDnsNegativeTtl = DNS_CACHE_DEFAULT_NEGATIVE_TTL;
+static int g_bDnsRefresh = 0;
+static DNSCACHESTATS g_dnsStats;
+
+///////////////////////////////////////////////////////////////////////////////
+// NowSeconds - Internal function that reads the monotonic clock, in seconds.
+
+static time_t NowSeconds(void)
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// HashHost - Internal function that picks the hash bucket for a host name.
+// Host names are case-insensitive, so the hash is too (FNV-1a).
+
+static unsigned int HashHost(const char* pszHost)
+{
+	unsigned int nHash = 2166136261U;
+
+	for (const char* p = pszHost; '\0' != *p; p++)
+	{
+		char c = *p;
+		if (c >= 'A' && c <= 'Z')
+			c = (char)(c - 'A' + 'a');
+
+		nHash = (nHash ^ (unsigned char)c) * 16777619U;
+	}
+
+	return nHash & (DNS_CACHE_BUCKETS - 1);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// FindEntry - Internal function that finds the cache entry for a host name,
+// or returns NULL.  The caller must hold g_dnsMutex.
+
+static PDNSCACHEENTRY FindEntry(const char* pszHost, PDNSCACHEENTRY** pppLink)
+{
+	PDNSCACHEENTRY* ppLink = &g_pDnsBuckets[HashHost(pszHost)];
+
+	for (; NULL != *ppLink; ppLink = &(*ppLink)->pNext)
+	{
+		if (0 == strcasecmp((*ppLink)->pszHost, pszHost))
+			break;
+	}
+
+	if (NULL != pppLink)
+		*pppLink = ppLink;
+
+	return *ppLink;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// FreeEntry - Internal function that releases a cache entry that has already
+// been unlinked from its bucket.
+
+static void FreeEntry(PDNSCACHEENTRY pEntry)
+{
+	free_buffer((void**)&pEntry->pszHost);
+	free_buffer((void**)&pEntry->pAddrs);
+	free_buffer((void**)&pEntry);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// CopyAddresses - Internal function that makes the caller's copy of a list
+// of addresses, with the specified port filled in.  Returns the number of
+// addresses, or ERROR if out of memory.
+
+static int CopyAddresses(const PRESOLVEDADDRESS pAddrs, int nAddrs, int nPort,
+		PRESOLVEDADDRESS* ppAddrs)
+{
+	*ppAddrs = (PRESOLVEDADDRESS)malloc(nAddrs * sizeof(RESOLVEDADDRESS));
+	if (NULL == *ppAddrs)
+	{
+		errno = ENOMEM;
+		return ERROR;
+	}
+
+	memcpy(*ppAddrs, pAddrs, nAddrs * sizeof(RESOLVEDADDRESS));
+
+	for (int i = 0; i < nAddrs; i++)
+	{
+		if (AF_INET6 == (*ppAddrs)[i].addr.ss_family)
+			((struct sockaddr_in6*)&(*ppAddrs)[i].addr)->sin6_port = htons((uint16_t)nPort);
+		else
+			((struct sockaddr_in*)&(*ppAddrs)[i].addr)->sin_port = htons((uint16_t)nPort);
+	}
+
+	return nAddrs;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// LookUpHost - Internal function that asks the libc resolver for the stream
+// socket addresses of a host.  Returns the number of addresses found (with
+// port 0), zero if the name does not exist, or ERROR with errno set if the
+// lookup itself failed and so says nothing about the name.
+
+static int LookUpHost(const char* pszHost, int nFlags, PRESOLVEDADDRESS* ppAddrs)
+{
+	struct addrinfo hints;
+	struct addrinfo* pAddrInfo = NULL;
+	int nAddrs = 0;
+	int nResult = 0;
+
+	*ppAddrs = NULL;
+
+	memset(&hints, 0, sizeof(struct addrinfo));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	hints.ai_flags = nFlags;
+
+	nResult = getaddrinfo(pszHost, NULL, &hints, &pAddrInfo);
+	if (EAI_NONAME == nResult || EAI_NODATA == nResult)
+		return 0;
+
+	if (0 != nResult)
+	{
+		if (EAI_SYSTEM != nResult)
+			errno = (EAI_MEMORY == nResult) ? ENOMEM : EAGAIN;
+
+		return ERROR;
+	}
+
+	for (struct addrinfo* pAddr = pAddrInfo; NULL != pAddr; pAddr = pAddr->ai_next)
+		nAddrs++;
+
+	*ppAddrs = (PRESOLVEDADDRESS)calloc(nAddrs, sizeof(RESOLVEDADDRESS));
+	if (NULL == *ppAddrs)
+	{
+		freeaddrinfo(pAddrInfo);
+		errno = ENOMEM;
+		return ERROR;
+	}
+
+	nAddrs = 0;
+	for (struct addrinfo* pAddr = pAddrInfo; NULL != pAddr; pAddr = pAddr->ai_next)
+	{
+		if (pAddr->ai_addrlen > sizeof(struct sockaddr_storage))
+			continue;
+
+		memcpy(&(*ppAddrs)[nAddrs].addr, pAddr->ai_addr, pAddr->ai_addrlen);
+		(*ppAddrs)[nAddrs].nAddrLength = pAddr->ai_addrlen;
+		nAddrs++;
+	}
+
+	freeaddrinfo(pAddrInfo);
+
+	return nAddrs;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// StoreEntry - Internal function that puts the result of a lookup in the
+// cache, replacing whatever was there for the same name.  Takes ownership of
+// pAddrs, which may be NULL for a negative entry.
+
+static void StoreEntry(const char* pszHost, PRESOLVEDADDRESS pAddrs, int nAddrs)
+{
+	PDNSCACHEENTRY* ppLink = NULL;
+	PDNSCACHEENTRY pEntry = NULL;
+	time_t nNow = NowSeconds();
+	int nTtl = 0;
+
+	pthread_mutex_lock(&g_dnsMutex);
+
+	nTtl = (nAddrs > 0) ? g_nDnsTtl : g_nDnsNegativeTtl;
+
+	pEntry = FindEntry(pszHost, &ppLink);
+	if (NULL == pEntry)
+	{
+		if (nTtl <= 0 || g_nDnsEntries >= DNS_CACHE_MAX_ENTRIES)
+			goto done;
+
+		pEntry = (PDNSCACHEENTRY)calloc(1, sizeof(DNSCACHEENTRY));
+		if (NULL == pEntry)
+			goto done;
+
+		pEntry->pszHost = strdup(pszHost);
+		if (NULL == pEntry->pszHost)
+		{
+			free_buffer((void**)&pEntry);
+			goto done;
+		}
+
+		*ppLink = pEntry;
+		g_nDnsEntries++;
+	}
+	else if (nTtl <= 0)
+	{
+		*ppLink = pEntry->pNext;
+		g_nDnsEntries--;
+		FreeEntry(pEntry);
+		goto done;
+	}
+
+	free_buffer((void**)&pEntry->pAddrs);
+	pEntry->pAddrs = pAddrs;
+	pEntry->nAddrs = nAddrs;
+	pEntry->nExpires = nNow + nTtl;
+	pEntry->nRefreshAt = nNow + nTtl - nTtl / 4;
+	pEntry->bRefreshing = 0;
+	pAddrs = NULL;
+
+done:
+	pthread_mutex_unlock(&g_dnsMutex);
+
+	free_buffer((void**)&pAddrs);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// RefreshThread - Internal function that is the body of a background refresh
+// of one cache entry.  If the lookup fails outright, the old entry is left to
+// serve until it expires.
+
+static void* RefreshThread(void* pArg)
+{
+	char* pszHost = (char*)pArg;
+	PRESOLVEDADDRESS pAddrs = NULL;
+	int nAddrs = LookUpHost(pszHost, 0, &pAddrs);
+
+	__atomic_add_fetch(&g_dnsStats.nRefreshes, 1, __ATOMIC_RELAXED);
+
+	if (nAddrs >= 0)
+	{
+		StoreEntry(pszHost, pAddrs, nAddrs);
+	}
+	else
+	{
+		pthread_mutex_lock(&g_dnsMutex);
+
+		PDNSCACHEENTRY pEntry = FindEntry(pszHost, NULL);
+		if (NULL != pEntry)
+			pEntry->bRefreshing = 0;
+
+		pthread_mutex_unlock(&g_dnsMutex);
+	}
+
+	free_buffer((void**)&pszHost);
+
+	return NULL;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// StartRefresh - Internal function that looks the host of a cache entry up
+// again on a thread of its own.  The caller must hold g_dnsMutex.
+
+static void StartRefresh(PDNSCACHEENTRY pEntry)
+{
+	pthread_attr_t attr;
+	pthread_t thread;
+	char* pszHost = strdup(pEntry->pszHost);
+
+	if (NULL == pszHost)
+		return;
+
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+
+	if (0 == pthread_create(&thread, &attr, RefreshThread, pszHost))
+		pEntry->bRefreshing = 1;
+	else
+		free_buffer((void**)&pszHost);
+
+	pthread_attr_destroy(&attr);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// ConfigureDnsCache - Sets how long host name lookups are cached for, and
+// whether names that are in use are refreshed in the background before they
+// expire.  Entries already in the cache keep the lifetime they were given.
+
+void ConfigureDnsCache(int nTtlSeconds, int nNegativeTtlSeconds, int bBackgroundRefresh)
+{
+	pthread_mutex_lock(&g_dnsMutex);
+
+	g_nDnsTtl = (nTtlSeconds > 0) ? nTtlSeconds : 0;
+	g_nDnsNegativeTtl = (nNegativeTtlSeconds > 0) ? nNegativeTtlSeconds : 0;
+	g_bDnsRefresh = bBackgroundRefresh;
+
+	pthread_mutex_unlock(&g_dnsMutex);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// FlushDnsCache - Throws away every cached host name lookup.  The counters
+// are left alone.
+
+void FlushDnsCache(void)
+{
+	pthread_mutex_lock(&g_dnsMutex);
+
+	for (int i = 0; i < DNS_CACHE_BUCKETS; i++)
+	{
+		while (NULL != g_pDnsBuckets[i])
+		{
+			PDNSCACHEENTRY pEntry = g_pDnsBuckets[i];
+			g_pDnsBuckets[i] = pEntry->pNext;
+			FreeEntry(pEntry);
+		}
+	}
+
+	g_nDnsEntries = 0;
+
+	pthread_mutex_unlock(&g_dnsMutex);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// GetDnsCacheStats - Fills in the specified structure with the cache's hit
+// and miss counters.
+
+void GetDnsCacheStats(PDNSCACHESTATS pStats)
+{
+	if (NULL == pStats)
+		return;
+
+	pStats->nHits = __atomic_load_n(&g_dnsStats.nHits, __ATOMIC_RELAXED);
+	pStats->nNegativeHits = __atomic_load_n(&g_dnsStats.nNegativeHits, __ATOMIC_RELAXED);
+	pStats->nMisses = __atomic_load_n(&g_dnsStats.nMisses, __ATOMIC_RELAXED);
+	pStats->nRefreshes = __atomic_load_n(&g_dnsStats.nRefreshes, __ATOMIC_RELAXED);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// ResolveHost - Finds the stream socket addresses of a host, from the cache
+// if it can, and gives the caller its own copy of them with the specified
+// port filled in.  A "unix:" address needs no lookup and has no port.
+
+int ResolveHost(const char* pszHostAddress, int nPort, PRESOLVEDADDRESS* ppAddrs)
+{
+	PDNSCACHEENTRY pEntry = NULL;
+	PRESOLVEDADDRESS pAddrs = NULL;
+	unsigned char literal[sizeof(struct in6_addr)];
+	int nFound = 0;
+	int nAddrs = ERROR;
+
+	*ppAddrs = NULL;
+
+	if (NULL == pszHostAddress || '\0' == pszHostAddress[0])
+	{
+		errno = EINVAL;
+		return ERROR;
+	}
+
+	if (IsUnixAddress(pszHostAddress))
+	{
+		pAddrs = (PRESOLVEDADDRESS)calloc(1, sizeof(RESOLVEDADDRESS));
+		if (NULL == pAddrs)
+		{
+			errno = ENOMEM;
+			return ERROR;
+		}
+
+		if (ParseUnixAddress(pszHostAddress, &pAddrs->addr, &pAddrs->nAddrLength) < 0)
+		{
+			free_buffer((void**)&pAddrs);
+			return ERROR;
+		}
+
+		*ppAddrs = pAddrs;
+		return 1;
+	}
+
+	// Address literals: nothing to look up, and nothing worth caching.
+	if (1 == inet_pton(AF_INET, pszHostAddress, literal)
+			|| 1 == inet_pton(AF_INET6, pszHostAddress, literal))
+	{
+		nFound = LookUpHost(pszHostAddress, AI_NUMERICHOST, &pAddrs);
+		if (nFound > 0)
+			nAddrs = CopyAddresses(pAddrs, nFound, nPort, ppAddrs);
+
+		free_buffer((void**)&pAddrs);
+		return (nFound > 0) ? nAddrs : ERROR;
+	}
+
+	pthread_mutex_lock(&g_dnsMutex);
+
+	pEntry = FindEntry(pszHostAddress, NULL);
+	if (NULL != pEntry && NowSeconds() < pEntry->nExpires)
+	{
+		if (0 == pEntry->nAddrs)
+		{
+			pthread_mutex_unlock(&g_dnsMutex);
+			__atomic_add_fetch(&g_dnsStats.nNegativeHits, 1, __ATOMIC_RELAXED);
+			errno = EHOSTUNREACH;
+			return ERROR;
+		}
+
+		if (g_bDnsRefresh && !pEntry->bRefreshing
+				&& NowSeconds() >= pEntry->nRefreshAt)
+			StartRefresh(pEntry);
+
+		nAddrs = CopyAddresses(pEntry->pAddrs, pEntry->nAddrs, nPort, ppAddrs);
+
+		pthread_mutex_unlock(&g_dnsMutex);
+		__atomic_add_fetch(&g_dnsStats.nHits, 1, __ATOMIC_RELAXED);
+		return nAddrs;
+	}
+
+	pthread_mutex_unlock(&g_dnsMutex);
+	__atomic_add_fetch(&g_dnsStats.nMisses, 1, __ATOMIC_RELAXED);
+
+	// Go to the resolver without holding the lock; two threads that miss on
+	// the same name at once both look it up, and the second answer wins.
+	nFound = LookUpHost(pszHostAddress, 0, &pAddrs);
+	if (nFound < 0)
+		return ERROR;	/* e.g., the name server is down; say nothing about the name */
+
+	if (nFound > 0)
+		nAddrs = CopyAddresses(pAddrs, nFound, nPort, ppAddrs);
+
+	StoreEntry(pszHostAddress, pAddrs, nFound);
+
+	if (0 == nFound)
+	{
+		errno = EHOSTUNREACH;
+		return ERROR;
+	}
+
+	return nAddrs;
+}
+
+///////////////////////////////////////////////////////////////////////////////
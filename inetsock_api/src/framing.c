@@ -0,0 +1,240 @@
+// framing.c - provides the message framing behind SetSocketFraming and
+// ReceiveMessage
+//
+// A framed socket's receive ring is cut into messages where they lie: each
+// message is handed out as a pointer into the ring, past its length prefix
+// and short of its delimiter, and nothing is copied.  The ring is compacted
+// before each read, so the unread bytes, and every message in them, are
+// always contiguous.
+//
+// Delimiters are found with memchr() for their first byte, which glibc
+// implements with the widest vector instructions the CPU has (SSE2, AVX2 or
+// EVEX, picked when the library is loaded), and then a memcmp() of the rest.
+// The bytes searched without finding a delimiter are remembered, so that a
+// long message arriving in many pieces is only ever searched once.
+//
+
+#include "stdafx.h"
+
+#include "socket_internal.h"
+
+/**
+ * @brief Number of bytes a varint length prefix may take before it is rejected as malformed.
+ * Ten is enough for any 64-bit value.
+ */
+#ifndef FRAME_VARINT_MAX_BYTES
+#define FRAME_VARINT_MAX_BYTES			10
+#endif //FRAME_VARINT_MAX_BYTES
+
+///////////////////////////////////////////////////////////////////////////////
+// ReadLengthPrefix - Internal function that decodes the length prefix at the
+// start of the unread data.  Returns the size of the prefix, zero if not all
+// of it has arrived yet, or ERROR with errno set to EBADMSG if it is
+// malformed.
+
+static int ReadLengthPrefix(SOCKET_FRAMING framing, const unsigned char* pData,
+		size_t nUnread, size_t* pnLength)
+{
+	size_t nLength = 0;
+
+	switch (framing)
+	{
+		case SOCKET_FRAMING_PREFIX_8:
+			if (nUnread < 1)
+				return 0;
+
+			*pnLength = pData[0];
+			return 1;
+
+		case SOCKET_FRAMING_PREFIX_16:
+			if (nUnread < 2)
+				return 0;
+
+			*pnLength = ((size_t)pData[0] << 8) | pData[1];
+			return 2;
+
+		case SOCKET_FRAMING_PREFIX_32:
+			if (nUnread < 4)
+				return 0;
+
+			*pnLength = ((size_t)pData[0] << 24) | ((size_t)pData[1] << 16)
+					| ((size_t)pData[2] << 8) | pData[3];
+			return 4;
+
+		default:
+			break;
+	}
+
+	// LEB128: seven bits per byte, least significant first, with the top
+	// bit set on every byte but the last.
+	for (int i = 0; i < FRAME_VARINT_MAX_BYTES; i++)
+	{
+		if ((size_t)i >= nUnread)
+			return 0;
+
+		if (i < 9)
+			nLength |= (size_t)(pData[i] & 0x7F) << (7 * i);
+		else if (pData[i] > 1)
+			break;		/* more than 64 bits */
+		else
+			nLength |= (size_t)pData[i] << 63;
+
+		if (0 == (pData[i] & 0x80))
+		{
+			*pnLength = nLength;
+			return i + 1;
+		}
+	}
+
+	errno = EBADMSG;
+	return ERROR;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// FindDelimiter - Internal function that searches the unread data for the
+// socket's delimiter, starting where the last search left off.  Returns the
+// offset of the delimiter, or ERROR if it is not there (yet).
+
+static ssize_t FindDelimiter(PSOCKET pSocket, const char* pData, size_t nUnread)
+{
+	size_t nDelimiterLength = pSocket->nFrameDelimiterLength;
+	size_t nOffset = pSocket->nFrameScanned;
+
+	while (nOffset < nUnread)
+	{
+		const char* pHit = (const char*)memchr(pData + nOffset,
+				pSocket->frameDelimiter[0], nUnread - nOffset);
+		if (NULL == pHit)
+			break;
+
+		nOffset = (size_t)(pHit - pData);
+
+		// Part of a delimiter at the very end: look here again next time.
+		if (nOffset + nDelimiterLength > nUnread)
+		{
+			pSocket->nFrameScanned = nOffset;
+			return ERROR;
+		}
+
+		if (0 == memcmp(pHit + 1, pSocket->frameDelimiter + 1, nDelimiterLength - 1))
+			return (ssize_t)nOffset;
+
+		nOffset++;
+	}
+
+	pSocket->nFrameScanned = nUnread;
+	return ERROR;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// FindMessage - Looks for a complete message at the front of a framed
+// socket's unread data.  Returns 1 if there is one, with the offset and
+// length of its payload and the number of bytes it takes up in the ring;
+// zero if the message is not all there yet, with the number of bytes it will
+// take up if that is known, or one more than there are now if not; or ERROR
+// with errno set to EMSGSIZE if the message is larger than the socket allows,
+// or EBADMSG if its length prefix is malformed.
+
+int FindMessage(PSOCKET pSocket, size_t* pnOffset, size_t* pnLength, size_t* pnConsumed)
+{
+	const char* pData = NULL;
+	size_t nUnread = pSocket->nRecvTail - pSocket->nRecvHead;
+	size_t nMaxSize = pSocket->nMaxMessageSize;
+	size_t nLength = 0;
+
+	// Nothing has been received yet.
+	if (NULL == pSocket->pRecvRing)
+	{
+		*pnConsumed = 1;
+		return 0;
+	}
+
+	pData = pSocket->pRecvRing + pSocket->nRecvHead;
+
+	if (SOCKET_FRAMING_DELIMITER == pSocket->framing)
+	{
+		ssize_t nDelimiter = FindDelimiter(pSocket, pData, nUnread);
+		if (nDelimiter < 0)
+		{
+			// No delimiter in sight, and already more than a message's worth
+			// of data to look through.
+			if (nUnread >= nMaxSize + pSocket->nFrameDelimiterLength)
+			{
+				errno = EMSGSIZE;
+				return ERROR;
+			}
+
+			*pnConsumed = nUnread + 1;
+			return 0;
+		}
+
+		if ((size_t)nDelimiter > nMaxSize)
+		{
+			errno = EMSGSIZE;
+			return ERROR;
+		}
+
+		*pnOffset = 0;
+		*pnLength = (size_t)nDelimiter;
+		*pnConsumed = (size_t)nDelimiter + pSocket->nFrameDelimiterLength;
+		pSocket->nFrameScanned = 0;
+
+		return 1;
+	}
+
+	int nPrefix = ReadLengthPrefix(pSocket->framing, (const unsigned char*)pData,
+			nUnread, &nLength);
+	if (nPrefix < 0)
+		return ERROR;
+
+	if (0 == nPrefix)
+	{
+		*pnConsumed = nUnread + 1;
+		return 0;
+	}
+
+	if (nLength > nMaxSize)
+	{
+		errno = EMSGSIZE;
+		return ERROR;
+	}
+
+	*pnConsumed = (size_t)nPrefix + nLength;
+	if (nUnread < *pnConsumed)
+		return 0;
+
+	*pnOffset = (size_t)nPrefix;
+	*pnLength = nLength;
+
+	return 1;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// GetFrameOverhead - Gets the largest number of bytes a message of the
+// specified framing takes up in the ring besides its payload.
+
+size_t GetFrameOverhead(SOCKET_FRAMING framing, size_t nDelimiterLength)
+{
+	switch (framing)
+	{
+		case SOCKET_FRAMING_DELIMITER:
+			return nDelimiterLength;
+
+		case SOCKET_FRAMING_PREFIX_8:
+			return 1;
+
+		case SOCKET_FRAMING_PREFIX_16:
+			return 2;
+
+		case SOCKET_FRAMING_PREFIX_32:
+			return 4;
+
+		case SOCKET_FRAMING_PREFIX_VARINT:
+			return FRAME_VARINT_MAX_BYTES;
+
+		default:
+			return 0;
+	}
+}
+
+///////////////////////////////////////////////////////////////////////////////
@@ -6,6 +6,7 @@
 #include "stdafx.h"
 
 #include "inetsock_api.h"
+#include "socket_internal.h"
 
 /**
  * @brief Defines the value for an invalid Socket Descriptor. In Linux,
@@ -17,6 +18,101 @@
 #define INVALID_SOCKET_DESCRIPTOR 		2
 #endif //INVALID_SOCKET_DESCRIPTOR
 
+/**
+ * @brief Maximum number of epoll events that RunServer's event loop processes
+ * per call to epoll_wait.
+ */
+#ifndef MAX_EPOLL_EVENTS
+#define MAX_EPOLL_EVENTS				256
+#endif //MAX_EPOLL_EVENTS
+
+/**
+ * @brief Default capacity, in bytes, of the ring buffer each socket receives
+ * data into.  Rounded up to a multiple of the page size.
+ */
+#ifndef RECV_BUFFER_SIZE
+#define RECV_BUFFER_SIZE				65536
+#endif //RECV_BUFFER_SIZE
+
+/**
+ * @brief Largest capacity, in bytes, that a socket's receive ring is allowed
+ * to grow to while a callback holds on to an incomplete message.
+ */
+#ifndef RECV_BUFFER_MAX_SIZE
+#define RECV_BUFFER_MAX_SIZE			(16 * 1024 * 1024)
+#endif //RECV_BUFFER_MAX_SIZE
+
+/**
+ * @brief Number of buffers SendV can handle without allocating memory for its
+ * working copy of the caller's iovec array.
+ */
+#ifndef SENDV_LOCAL_IOV_COUNT
+#define SENDV_LOCAL_IOV_COUNT			16
+#endif //SENDV_LOCAL_IOV_COUNT
+
+/**
+ * @brief Number of bytes SendFile and ReceiveFile move per system call, and
+ * therefore how often they report progress to the socket callback.
+ */
+#ifndef FILE_TRANSFER_CHUNK_SIZE
+#define FILE_TRANSFER_CHUNK_SIZE		(1024 * 1024)
+#endif //FILE_TRANSFER_CHUNK_SIZE
+
+/**
+ * @brief Backlog passed to listen() by RunServer.
+ */
+#ifndef LISTEN_BACKLOG
+#define LISTEN_BACKLOG					SOMAXCONN
+#endif //LISTEN_BACKLOG
+
+/**
+ * @brief Number of submission queue entries in the io_uring instance of an
+ * event loop that runs on the io_uring backend.
+ */
+#ifndef URING_QUEUE_DEPTH
+#define URING_QUEUE_DEPTH				1024
+#endif //URING_QUEUE_DEPTH
+
+/**
+ * @brief Number of slots in the fixed file table of an event loop that runs on
+ * the io_uring backend; clients accepted once it is full use their plain
+ * descriptors.  Capped at the process's RLIMIT_NOFILE.
+ */
+#ifndef URING_FIXED_FILES
+#define URING_FIXED_FILES				4096
+#endif //URING_FIXED_FILES
+
+/**
+ * @brief Milliseconds an event loop that runs on the io_uring backend waits before it tries
+ * to accept connections again, after running out of descriptors or memory.
+ */
+#ifndef URING_ACCEPT_RETRY_MS
+#define URING_ACCEPT_RETRY_MS			100
+#endif //URING_ACCEPT_RETRY_MS
+
+/*
+ * What each io_uring request of an event loop is for, kept in the low bits of
+ * its user_data; socket objects are cache-line aligned, which leaves those bits
+ * free.  The rest of user_data is the socket the request is for, or, for
+ * URING_OP_FILES_CLEAR, the fixed file slot being emptied.
+ */
+#define URING_OP_ACCEPT					1
+#define URING_OP_RECV					2
+#define URING_OP_FILES_UPDATE			3
+#define URING_OP_FILES_CLEAR			4
+#define URING_OP_CLOSE					5
+#define URING_OP_WAKE					6
+#define URING_OP_CANCEL					7
+#define URING_OP_WRITABLE				8
+#define URING_OP_MASK					15
+#define URING_OP_SHIFT					4
+
+///////////////////////////////////////////////////////////////////////////////
+// Backend that the event loop of a newly opened server socket uses, unless
+// SetSocketIoBackend says otherwise.
+
+static SOCKET_IO_BACKEND g_defaultIoBackend = SOCKET_IO_BACKEND_EPOLL;
+
 ///////////////////////////////////////////////////////////////////////////////
 // free_buffer - Internal function that is not exposed to users of this library.
 // This function is in charge, simply, of calling free() on a non-NULL void
@@ -24,8 +120,6 @@
 
 void free_buffer(void **ppBuffer)
 {
-	log_info("In inetsock_api's free_buffer");
-
     if (ppBuffer == NULL || *ppBuffer == NULL)
         return;     // Nothing to do since there is no address referenced
 
@@ -34,16 +128,257 @@ void free_buffer(void **ppBuffer)
 }
 
 ///////////////////////////////////////////////////////////////////////////////
-// SOCKET struct - wraps a socket file descriptor in an opaque type that also
-// carries information about the state and type of socket.
+// SERVERLOOP struct - state of the event loop that RunServer runs: either
+// edge-triggered epoll or, if the server socket asks for it, io_uring.  Lives
+// on RunServer's stack for as long as the loop runs.
+
+typedef struct _tagSERVERLOOP {
+	int				nEpollFd;		/* epoll instance descriptor */
+	int				bRunning;		/* Loop keeps going while this is nonzero */
+	int				bInDispatch;	/* Nonzero while callbacks may be firing from the loop */
+	PSOCKET			pServer;		/* Listening socket */
+	HSOCKET			hServer;		/* Its handle, which outlives it if it is closed from a callback */
+	PSOCKET			pClients;		/* Head of the list of accepted client sockets */
+	PSOCKET			pPendingClose;	/* Sockets that were closed from inside a callback */
+	PSOCKET			pPendingFlush;	/* Sockets with buffered output to write out after dispatch */
+	int				nWakeFd;		/* eventfd used to wake the loop up, or -1 */
+	int				nCpu;			/* Core the loop's thread is pinned to (RunServerEx) */
+	struct _tagSERVERGROUP* pGroup;	/* Group of loops this loop belongs to (RunServerEx), or NULL */
+	PURING			pUring;			/* io_uring instance, if the loop runs on io_uring; else NULL */
+	unsigned int	nUringInFlight;	/* Requests outstanding on the loop's io_uring */
+	int*			pFreeFixed;		/* Stack of free slots in the loop's fixed file table */
+	int				nFreeFixed;		/* Number of slots on the stack */
+	unsigned long long nAcceptRetryMs;	/* When to arm a new io_uring accept after running short, or 0 */
+	TIMERWHEEL		timers;			/* Timeouts of the loop's clients (see SetSocketTimeouts) */
+} SERVERLOOP, *PSERVERLOOP;
+
+///////////////////////////////////////////////////////////////////////////////
+// SERVERGROUP struct - the set of per-core event loops that RunServerEx runs.
+// The only state the workers share is the flag that tells them all to stop.
+
+typedef struct _tagSERVERGROUP {
+	int				nWorkers;		/* Number of loops (and threads) in the group */
+	int				bStopping;		/* Set atomically once any loop has stopped */
+	PSERVERLOOP		pLoops;			/* One loop per worker */
+	pthread_t*		pThreads;		/* One thread per worker */
+} SERVERGROUP, *PSERVERGROUP;
+
+///////////////////////////////////////////////////////////////////////////////
+// Event loop the calling thread is running, if any.  Lets a thread tell
+// whether a socket is its own without looking inside a loop that may belong
+// to some other thread, and may be gone already.
+
+static __thread PSERVERLOOP t_pCurrentLoop = NULL;
+
+static void DestroySocket(PSOCKET pSocket);
+static void DetachFromLoop(PSOCKET pSocket);
+static ssize_t DrainSendQueue(PSOCKET pSocket);
+static void FinishSocket(PSOCKET pSocket);
+static void FreeRecvRing(PSOCKET pSocket);
+static int FlushSendBuffer(PSOCKET pSocket);
+static void QueueUringCancel(PSERVERLOOP pLoop, uint64_t nUserData);
+static int QueueUringClose(PSOCKET pSocket);
+static int ReserveRecvRing(PSOCKET pSocket, size_t nBytes);
+static int WaitForSendQueue(PSOCKET pSocket);
+static int WaitForSocket(PSOCKET pSocket, short nEvents);
+static int WatchWritable(PSERVERLOOP pLoop, PSOCKET pSocket);
+static int WriteAll(PSOCKET pSocket, struct iovec* pIov, int nIovCount, int nFlags);
+static PSOCKET NewSocket(int nSocketDescriptor, SOCKET_TYPE type,
+		LPSOCKET_EVENT_ROUTINE lpfnCallback, SOCKET_STATE initialState);
+
+///////////////////////////////////////////////////////////////////////////////
+// IsValidTransition - Internal function that decides whether a socket may be
+// moved from one state to another.  SOCKET_STATE_ERROR sticks, as it always
+// has; a socket that is closing may only go on to SOCKET_STATE_CLOSED, and a
+// closed one goes nowhere.  Everything else is up to the caller.
+
+static int IsValidTransition(SOCKET_STATE oldState, SOCKET_STATE newState)
+{
+	if ((unsigned int)newState >= SOCKET_STATE_UNKNOWN)
+		return 0;
+
+	switch (oldState)
+	{
+		case SOCKET_STATE_ERROR:
+		case SOCKET_STATE_CLOSED:
+			return 0;
+
+		case SOCKET_STATE_CLOSING:
+			return SOCKET_STATE_CLOSED == newState;
+
+		default:
+			return 1;
+	}
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// ChangeSocketState - Internal function that does the work of SetSocketStateEx
+// for a socket object the library already holds.  The state is only ever
+// changed with a compare-and-swap, so that when two threads race (e.g., a
+// sender and the thread closing the socket), the loser's move is checked
+// against the state the winner left behind and rejected if it no longer
+// makes sense.  The callback is handed the socket's handle, never the object
+// itself.  Returns nonzero if the state was changed.
+
+int ChangeSocketState(PSOCKET pSocket, SOCKET_STATE newState, void* lpUserState)
+{
+	return ChangeSocketStateCopy(pSocket, newState, lpUserState, 0, 0);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// ChangeSocketStateCopy - Internal function that does the work of
+// ChangeSocketState.  The state bag is copied, if the callback is to be run
+// by the callback workers, when nBagBytes is nonzero; it must be, for bags
+// that live on the caller's stack.
+
+int ChangeSocketStateCopy(PSOCKET pSocket, SOCKET_STATE newState, void* lpUserState,
+		size_t nBagBytes, size_t nDataBytes)
+{
+	SOCKET_STATE oldState = SOCKET_STATE_UNKNOWN;
+
+	if (pSocket->nSocketDescriptor <= INVALID_SOCKET_DESCRIPTOR)
+		return 0;
+
+	oldState = __atomic_load_n(&pSocket->sockState, __ATOMIC_ACQUIRE);
+	do
+	{
+		if (!IsValidTransition(oldState, newState))
+			return 0;
+	} while (!__atomic_compare_exchange_n(&pSocket->sockState, &oldState, newState,
+			1, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE));
+
+	// Remember what went wrong now, while errno still says so; by the time
+	// anybody asks, it may have been overwritten many times over.
+	if (SOCKET_STATE_ERROR == newState)
+		__atomic_store_n(&pSocket->dwLastError, (long)errno, __ATOMIC_RELEASE);
+
+	CountStateChange(pSocket, newState);
+
+	// Fire the callback to let the user of this socket know that something
+	// neat happened -- but only if they asked to hear about this state.
+	if (NULL == pSocket->lpfnCallback)
+		return 1;
+
+	if (0 == (__atomic_load_n(&pSocket->dwEventMask, __ATOMIC_RELAXED)
+			& SOCKET_EVENT(newState)))
+		return 1;
+
+	// To avoid race conditions, do not call the callback function if
+	// the socket is put into the READY state.
+	if (SOCKET_STATE_READY == newState)
+		return 1;
+
+	// In worker mode, this thread only queues the call.  Since the callback
+	// cannot put the socket back into the READY state in time for whatever
+	// this thread does next, do that for it at the end of an operation --
+	// unless something else has moved the socket on in the meantime.
+	if (SOCKET_CALLBACK_WORKERS == __atomic_load_n(&pSocket->callbackMode, __ATOMIC_RELAXED)
+			&& 0 == QueueCallback(pSocket, newState, lpUserState, nBagBytes, nDataBytes))
+	{
+		SOCKET_STATE expected = newState;
+
+		if ((SOCKET_STATE_ACCEPTED == newState || SOCKET_STATE_CONNECTED == newState
+				|| SOCKET_STATE_SENT == newState || SOCKET_STATE_RECEIVED == newState)
+				&& __atomic_compare_exchange_n(&pSocket->sockState, &expected,
+						SOCKET_STATE_READY, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+			CountStateChange(pSocket, SOCKET_STATE_READY);
+
+		return 1;
+	}
+
+	unsigned long long nStartNs = StatsNow();
+
+	pSocket->lpfnCallback(pSocket->hSelf, lpUserState);
+
+	RecordLatency(LATENCY_CALLBACK, nStartNs);
+
+	return 1;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// IsLoopThread - Internal function that tells whether the calling thread is
+// the one running the specified event loop.  Only that thread may touch the
+// loop's lists, its epoll set or its io_uring.
+
+static int IsLoopThread(PSERVERLOOP pLoop)
+{
+	return pLoop == t_pCurrentLoop;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// IsServerSocket - Internal function that tells whether a socket is of a type
+// that an event loop is run on (a server socket, or a datagram socket, which
+// RunServer receives on directly), as opposed to the client sockets that a
+// loop services.
+
+static int IsServerSocket(PSOCKET pSocket)
+{
+	return SOCKET_TYPE_SERVER == pSocket->sockType
+			|| SOCKET_TYPE_DATAGRAM == pSocket->sockType;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// EnterSocket - Internal function that looks up the socket object for a
+// handle and takes a reference to it, so that the object, and its descriptor,
+// stay put until the matching LeaveSocket even if another thread closes the
+// socket in the meantime.  Returns NULL, with errno set to EBADF, if the
+// handle is stale or the socket is already being closed.
+
+PSOCKET EnterSocket(HSOCKET hSocket)
+{
+	PSOCKET pSocket = LookupSocket(hSocket);
+	int nRefs = 0;
+
+	if (NULL == pSocket)
+	{
+		errno = EBADF;
+		return NULL;
+	}
+
+	// A socket whose last reference is gone is on its way back to the pool;
+	// it must not be brought back to life.
+	nRefs = __atomic_load_n(&pSocket->nRefs, __ATOMIC_ACQUIRE);
+	do
+	{
+		if (0 == nRefs)
+		{
+			errno = EBADF;
+			return NULL;
+		}
+	} while (!__atomic_compare_exchange_n(&pSocket->nRefs, &nRefs, nRefs + 1,
+			1, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE));
+
+	// The slot may have been released and handed out again between the
+	// lookup and the increment, in which case the reference belongs to
+	// somebody else's socket.
+	if (pSocket != LookupSocket(hSocket)
+			|| __atomic_load_n(&pSocket->bClosePending, __ATOMIC_ACQUIRE))
+	{
+		LeaveSocket(pSocket);
+		errno = EBADF;
+		return NULL;
+	}
+
+	return pSocket;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// LeaveSocket - Internal function that drops a reference taken by
+// EnterSocket.  If the socket was closed in the meantime and this was the
+// last reference, the calling thread finishes closing it.  errno is left as
+// it was.
 
-struct _tagSOCKET {
-	int				nSocketDescriptor;		/* Linux file descriptor */
-	long			dwLastError;	/* WSA* error code for the last network error */
-	SOCKET_TYPE 	sockType;		/* What type of socket is this? */
-	SOCKET_STATE 	sockState;		/* What state is this socket in? */
-	LPSOCKET_EVENT_ROUTINE lpfnCallback;	/* Function that gets called when something happens on this socket */
-};
+void LeaveSocket(PSOCKET pSocket)
+{
+	int nSavedErrno = errno;
+
+	if (0 == __atomic_sub_fetch(&pSocket->nRefs, 1, __ATOMIC_ACQ_REL))
+	{
+		// Callers report their own errors; closing must not clobber them.
+		FinishSocket(pSocket);
+		errno = nSavedErrno;
+	}
+}
 
 ///////////////////////////////////////////////////////////////////////////////
 // CloseSocket - Closes the socket with the specified handle and releases the
@@ -53,56 +388,347 @@ struct _tagSOCKET {
 
 void CloseSocket(HSOCKET hSocket)
 {
-	if (INVALID_HANDLE_VALUE == hSocket)
+	PSOCKET pSocket = EnterSocket(hSocket);
+	PSERVERLOOP pLoop = NULL;
+	int bExpected = 0;
+
+	if (NULL == pSocket)
+		return;		/* invalid, already closed and released, or on its way out */
+
+	// A client socket that an event loop services belongs to the loop's
+	// thread.  From any other thread, just hang up on the connection; the
+	// loop sees the hang-up and closes the socket itself.
+	pLoop = __atomic_load_n(&pSocket->pServerLoop, __ATOMIC_ACQUIRE);
+	if (NULL != pLoop && !IsLoopThread(pLoop) && !IsServerSocket(pSocket))
+	{
+		shutdown(pSocket->nSocketDescriptor, SHUT_RDWR);
+
+		LeaveSocket(pSocket);
+		return;
+	}
+
+	// Of several threads closing the same socket at once, one gets to do it.
+	if (!__atomic_compare_exchange_n(&pSocket->bClosePending, &bExpected, 1,
+			0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+	{
+		LeaveSocket(pSocket);
+		return;		/* already on its way out */
+	}
+
+	// The owner's reference keeps the socket around from here on.
+	LeaveSocket(pSocket);
+
+	// If an event loop is in the middle of dispatching callbacks, it may still
+	// hold this socket in its current batch of events.  Let the loop do the
+	// actual closing once it is safe to release the socket.  A listening
+	// socket is closed right away; its loop holds a reference to it, and
+	// stops once it sees that the socket is closing.
+	if (NULL != pLoop && IsLoopThread(pLoop) && pLoop->bInDispatch
+			&& pSocket != pLoop->pServer)
+	{
+		pSocket->pNextPending = pLoop->pPendingClose;
+		pLoop->pPendingClose = pSocket;
+		return;
+	}
+
+	DestroySocket(pSocket);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// DestroySocket - Internal function that does the actual work of closing a
+// socket for CloseSocket: fires the CLOSING callback, unlinks the socket from
+// its event loop, and drops the owner's reference.  Runs on the thread that
+// owns the socket; that is, its event loop's thread, if it is a client socket
+// the loop services.  If no other thread is in the middle of a call on the
+// socket, FinishSocket closes it right away.  Otherwise, the connection is
+// shut down, so that the other thread's call fails instead of blocking, and
+// the last thread out finishes the job.
+
+static void DestroySocket(PSOCKET pSocket)
+{
+	PSERVERLOOP pLoop = NULL;
+	int nOwnerOnly = 1;
+
+	// A listening socket's loop may be running on another thread; it lets
+	// go of the socket by itself.
+	if (!IsServerSocket(pSocket))
+		pLoop = pSocket->pServerLoop;
+
+	// A connect that has not finished yet is simply dropped.
+	CancelConnect(pSocket);
+
+	// A pooled connection that is closed rather than released makes room
+	// for a new one to the same destination.
+	DetachPooledSocket(pSocket);
+
+	// Buffered and queued output still goes out, on a best-effort basis; the
+	// socket is going away either way.  If another thread is sending right
+	// now, it is not waited for; it is about to fail anyway.  Neither is a
+	// peer that will not take what is queued.
+	if ((pSocket->nSendLength > 0 || NULL != pSocket->pSendQueueHead)
+			&& 0 == pthread_mutex_trylock(&pSocket->sendLock))
+	{
+		if (SOCKET_STATE_ERROR != __atomic_load_n(&pSocket->sockState, __ATOMIC_ACQUIRE)
+				&& FlushSendBuffer(pSocket) >= 0)
+			WriteSendQueue(pSocket);
+
+		pthread_mutex_unlock(&pSocket->sendLock);
+	}
+
+	ChangeSocketState(pSocket, SOCKET_STATE_CLOSING, NULL);
+
+	// Take the socket out of the event loop's client list, and its timer off
+	// the loop's timer wheel.
+	if (NULL != pLoop)
+	{
+		TimerWheelCancel(&pLoop->timers, &pSocket->timer);
+
+		if (NULL != pSocket->pPrev)
+			pSocket->pPrev->pNext = pSocket->pNext;
+		else
+			pLoop->pClients = pSocket->pNext;
+
+		if (NULL != pSocket->pNext)
+			pSocket->pNext->pPrev = pSocket->pPrev;
+	}
+
+	// Closed outside of dispatch (e.g., on the way out of the loop) while
+	// still waiting to be flushed.
+	if (NULL != pLoop && pSocket->bFlushQueued)
+	{
+		PSOCKET* ppLink = &pLoop->pPendingFlush;
+		while (NULL != *ppLink && pSocket != *ppLink)
+			ppLink = &(*ppLink)->pNextFlush;
+
+		if (NULL != *ppLink)
+			*ppLink = pSocket->pNextFlush;
+
+		pSocket->bFlushQueued = 0;
+	}
+
+	if (__atomic_compare_exchange_n(&pSocket->nRefs, &nOwnerOnly, 0, 0,
+			__ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+	{
+		FinishSocket(pSocket);
 		return;
+	}
+
+	// Some other thread is still using the socket, and may be the one to
+	// finish it off.  Only this thread can cut the socket loose from its
+	// event loop, so do that now.
+	if (NULL != pLoop)
+		DetachFromLoop(pSocket);
+
+	shutdown(pSocket->nSocketDescriptor, SHUT_RDWR);
+
+	LeaveSocket(pSocket);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// DetachFromLoop - Internal function, called by DestroySocket on the event
+// loop's thread, that takes a client socket out of the loop's epoll set or
+// io_uring fixed file table, for when the socket will be finished off by
+// another thread.  Closing the descriptor would not be enough, since the
+// other thread may not get to that until the loop has moved on.
+
+static void DetachFromLoop(PSOCKET pSocket)
+{
+	PSERVERLOOP pLoop = pSocket->pServerLoop;
+
+	if (NULL == pLoop->pUring)
+	{
+		epoll_ctl(pLoop->nEpollFd, EPOLL_CTL_DEL, pSocket->nSocketDescriptor, NULL);
+	}
+	else if (pSocket->nFixedFile >= 0)
+	{
+		if (0 == UringUpdateFile(pLoop->pUring, (unsigned int)pSocket->nFixedFile, -1))
+			pLoop->pFreeFixed[pLoop->nFreeFixed++] = pSocket->nFixedFile;
+
+		pSocket->nFixedFile = -1;
+	}
+
+	__atomic_store_n(&pSocket->pServerLoop, NULL, __ATOMIC_RELEASE);
+}
 
-	SetSocketState(hSocket, SOCKET_STATE_CLOSING);
+///////////////////////////////////////////////////////////////////////////////
+// FinishSocket - Internal function that completes closing a socket once its
+// last reference is gone: closes the descriptor, fires the CLOSED callback,
+// and returns the socket object to the pool.
 
+static void FinishSocket(PSOCKET pSocket)
+{
 	// This library sits on top of the inetsock_core library; so, call that library's
-	// SocketDemoUtils_close function to actually do the closing.
-	SocketDemoUtils_close(hSocket->nSocketDescriptor);
+	// SocketDemoUtils_close function to actually do the closing -- unless the
+	// socket belongs to an io_uring event loop, which batches the close with
+	// the rest of its requests.
+	if (!QueueUringClose(pSocket))
+		SocketDemoUtils_close(pSocket->nSocketDescriptor);
+
+	ChangeSocketState(pSocket, SOCKET_STATE_CLOSED, NULL);
+
+	ReleaseCallbackQueue(pSocket);
+
+	free_buffer((void**)&pSocket->pSendBuffer);
+	FreeSendQueue(pSocket);
+	FreeDatagramBuffer(pSocket);
+	FreeDescriptorQueue(pSocket);
+	ReleaseUnixAddress(pSocket);
+
+	// The receive ring goes with the socket, so that the pool's idle slots
+	// do not hang on to memory.
+	FreeRecvRing(pSocket);
+
+	pthread_mutex_destroy(&pSocket->sendLock);
+
+	// This library manages the memory for socket objects on behalf of the
+	// caller.  Since we have closed this socket, hand its object back to the
+	// pool.  This also makes the handle stale.
+	ReleaseSocket(pSocket);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// ConnectSocket - Internal function that connects a socket, synchronously, to
+// the first address of the specified host that fits the socket's address
+// family and accepts the connection.  Fires no callbacks.  Returns zero on
+// success, or ERROR with errno set.
+
+int ConnectSocket(PSOCKET pSocket, const char* pszHostAddress, int nPort)
+{
+	PRESOLVEDADDRESS pAddrs = NULL;
+	int nAddrs = 0;
+	int nDomain = AF_INET;
+	socklen_t nDomainLength = sizeof(int);
+	int bConnected = 0;
+	int nSavedErrno = EAFNOSUPPORT;
+	unsigned long long nStartNs = StatsNow();
+
+	nAddrs = ResolveHost(pszHostAddress, nPort, &pAddrs);
+	if (nAddrs <= 0)
+		return ERROR;
+
+	// A Unix-domain address is the only one its "host" has; the socket that
+	// OpenSocket made becomes a Unix-domain socket to fit it.
+	if (AF_UNIX == pAddrs[0].addr.ss_family && SwitchToUnixDomain(pSocket) < 0)
+	{
+		nSavedErrno = errno;
+		free_buffer((void**)&pAddrs);
+		errno = nSavedErrno;
+		return ERROR;
+	}
+
+	getsockopt(pSocket->nSocketDescriptor, SOL_SOCKET, SO_DOMAIN, &nDomain, &nDomainLength);
+
+	for (int i = 0; i < nAddrs && !bConnected; i++)
+	{
+		if (nDomain != pAddrs[i].addr.ss_family)
+			continue;
+
+		bConnected = (0 == connect(pSocket->nSocketDescriptor,
+				(struct sockaddr*)&pAddrs[i].addr, pAddrs[i].nAddrLength));
+		if (!bConnected)
+			nSavedErrno = errno;
+	}
+
+	free_buffer((void**)&pAddrs);
+
+	if (!bConnected)
+	{
+		errno = nSavedErrno;
+		return ERROR;
+	}
 
-	SetSocketState(hSocket, SOCKET_STATE_CLOSED);
+	RecordLatency(LATENCY_CONNECT, nStartNs);
 
-	// This library manages calling malloc() and free() on socket handles for
-	// the caller.  Sincer we have closed this socket, time to free it.
-	free_buffer((void**)&hSocket);
+	// A Unix-domain address gave the socket a new descriptor, with none of
+	// the options of the old one.
+	ApplySocketTuning(pSocket, NULL, TUNING_STAGE_CONNECTED);
+
+	return 0;
 }
 
 ///////////////////////////////////////////////////////////////////////////////
 // ConnectToServer - sets up a client socket and then connects to a server at a
 // specified host name and port.  Provides the caller an ability to set up a
 // callback function referred to by a given function pointer as what is called
-// when the socket's state changes
+// when the socket's state changes.  The host name is resolved through the
+// library's DNS cache (see dns_cache.c), and each of its addresses that fits
+// the socket is tried in turn.  A "unix:" address (see unix_socket.c) connects
+// to a Unix-domain socket instead, and the port is ignored.
 //
 
 void ConnectToServer(HSOCKET hSocket, const char* pszHostAddress, int nPort)
 {
 	/* Cannot do anything with a socket that has not been opened */
-	if (INVALID_HANDLE_VALUE == hSocket){
+	PSOCKET pSocket = LookupSocket(hSocket);
+	if (NULL == pSocket){
 		return;
 	}
 
-	if (NULL == hSocket->lpfnCallback)
+	if (NULL == pSocket->lpfnCallback)
 		return;
 
 	// if this is not a socket of type SOCKET_TYPE_CLIENT, stop.  Only Client sockets
-	// can connect to Servers.
-	if (SOCKET_TYPE_CLIENT != GetSocketType(hSocket))
+	// can connect to Servers.  A datagram socket can be connected as well; that
+	// just gives it a default peer.
+	if (SOCKET_TYPE_CLIENT != pSocket->sockType
+			&& SOCKET_TYPE_DATAGRAM != pSocket->sockType)
 		error("Not a client socket.");
 
 	// Put the socket in state SOCKET_STATE_CONNECTING
-	SetSocketState(hSocket, SOCKET_STATE_CONNECTING);
+	ChangeSocketState(pSocket, SOCKET_STATE_CONNECTING, NULL);
 
-	// Attempt to connect to the server.  The function below is guaranteed to close the socket
-	// and forcibly terminate this program in the event of a network error, so we do not need
-	// to check the result.
-	SocketDemoUtils_connect(hSocket->nSocketDescriptor,
-			pszHostAddress, nPort);
+	// Attempt to connect to the server.  As has always been the case, failure
+	// closes the socket and forcibly terminates this program.
+	if (ConnectSocket(pSocket, pszHostAddress, nPort) < 0)
+		KillSocket(hSocket, "Failed to connect to the server.");
 
 	// If we are still here, then connection succeeded.  Put the socket in the
 	// SOCKET_STATE_CONNECTED state.  This will trigger the callback.
-	SetSocketState(hSocket, SOCKET_STATE_CONNECTED);
+	ChangeSocketState(pSocket, SOCKET_STATE_CONNECTED, NULL);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// ConnectToServerAsync - starts connecting a client socket to a server at a
+// specified host name and port, and returns without waiting for the connect
+// to finish.  Every address the host resolves to is tried, in a staggered
+// race (see connector.c), and the callback hears CONNECTED or ERROR, from
+// the library's connector thread, once one of them wins or the time is up.
+// A "unix:" address has no port, and is raced against nothing.  Returns zero
+// if the connect is under way, or ERROR if it never started.
+
+int ConnectToServerAsync(HSOCKET hSocket, const char* pszHostAddress, int nPort,
+		int nTimeoutMs)
+{
+	PSOCKET pSocket = LookupSocket(hSocket);
+	if (NULL == pSocket)
+	{
+		errno = EBADF;
+		return ERROR;
+	}
+
+	if (NULL == pszHostAddress || '\0' == pszHostAddress[0]
+			|| ((nPort <= 0 || nPort > 65535) && !IsUnixAddress(pszHostAddress)))
+	{
+		errno = EINVAL;
+		return ERROR;
+	}
+
+	// Only Client sockets can connect to Servers.
+	if (SOCKET_TYPE_CLIENT != pSocket->sockType)
+	{
+		errno = EINVAL;
+		return ERROR;
+	}
+
+	ChangeSocketState(pSocket, SOCKET_STATE_CONNECTING, NULL);
+
+	if (StartConnect(pSocket, pszHostAddress, nPort, nTimeoutMs) < 0)
+	{
+		ChangeSocketState(pSocket, SOCKET_STATE_ERROR, NULL);
+		return ERROR;
+	}
+
+	return 0;
 }
 
 ///////////////////////////////////////////////////////////////////////////////
@@ -112,16 +738,20 @@ void ConnectToServer(HSOCKET hSocket, const char* pszHostAddress, int nPort)
 
 long GetLastError(HSOCKET hSocket)
 {
-	if (SOCKET_STATE_ERROR != GetSocketState(hSocket))
+	PSOCKET pSocket = LookupSocket(hSocket);
+	if (NULL == pSocket)
+		return 0;
+
+	if (SOCKET_STATE_ERROR != __atomic_load_n(&pSocket->sockState, __ATOMIC_ACQUIRE))
 		return 0;		/* no error */
 
-	/* return the errno value, since the socket being in an error state
-	 * most likely means that this function is being called from the callback
-	 * the user of this library set up right after the callback was fired
-	 * when a inetsock_core library function failed.
+	/* return the errno value that was current when the socket went into the
+	 * error state, which ChangeSocketState saved, rather than errno itself:
+	 * that belongs to whichever thread is asking, and may long since have
+	 * been overwritten.
 	 */
 
-	return errno;
+	return __atomic_load_n(&pSocket->dwLastError, __ATOMIC_ACQUIRE);
 }
 
 
@@ -133,11 +763,17 @@ SOCKET_STATE GetSocketState(HSOCKET hSocket)
 {
 	SOCKET_STATE result = SOCKET_STATE_UNKNOWN;	// default return value
 
-	// Obviously, an invalid socket handle does not have a state
-	if (INVALID_HANDLE_VALUE == hSocket)
+	// A callback run by the callback workers sees the state it was called
+	// for, as it would have inline, and not whatever the socket is in now.
+	if (GetCallbackState(hSocket, &result))
+		return result;
+
+	// Obviously, an invalid (or stale) socket handle does not have a state
+	PSOCKET pSocket = LookupSocket(hSocket);
+	if (NULL == pSocket)
 		return result;
 
-	result = hSocket->sockState;
+	result = __atomic_load_n(&pSocket->sockState, __ATOMIC_ACQUIRE);
 
 	return result;
 }
@@ -149,10 +785,11 @@ SOCKET_TYPE GetSocketType(HSOCKET hSocket)
 {
 	SOCKET_TYPE result = SOCKET_TYPE_UNKNOWN;
 
-	if (INVALID_HANDLE_VALUE == hSocket)
+	PSOCKET pSocket = LookupSocket(hSocket);
+	if (NULL == pSocket)
 		return result;
 
-	result = hSocket->sockType;
+	result = pSocket->sockType;
 
 	return result;
 }
@@ -184,96 +821,3715 @@ void KillSocket(HSOCKET hSocket, const char* pszMessage)
 // OpenSocket - creates a new socket in the operating system of the specified
 // type, and, depending on the type of socket, prepares it according to whether
 // the socket is for a client, data, or server connection.  Returns a handle
-// to the new socket.
+// to the new socket.  The callback hears about every state transition.
 
 HSOCKET OpenSocket(SOCKET_TYPE type, LPSOCKET_EVENT_ROUTINE lpfnCallback)
 {
-	HSOCKET hSocket = (HSOCKET)INVALID_HANDLE_VALUE;
+	return OpenSocketEx(type, lpfnCallback, SOCKET_EVENT_ALL);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// OpenSocketEx - Same as OpenSocket, except that the callback is only called
+// for transitions into the states in the specified event mask.  Transitions
+// into other states update the socket's state and nothing else, which saves
+// an indirect call per packet on busy sockets whose callbacks would ignore
+// most of them anyway.
+
+HSOCKET OpenSocketEx(SOCKET_TYPE type, LPSOCKET_EVENT_ROUTINE lpfnCallback,
+		SOCKET_EVENT_MASK dwEventMask)
+{
+	PSOCKET pSocket = NULL;
+	int nSocketDescriptor = -1;
 
 	if (type == SOCKET_TYPE_UNKNOWN)
-		return hSocket;
+		return INVALID_HANDLE_VALUE;
 
 	if (lpfnCallback == NULL)
-		return hSocket;
+		return INVALID_HANDLE_VALUE;
 
-	// Use malloc to dynamically allocate a new HSOCKET (really a new
-	// tagSOCKET structure but HSOCKET is a pointer type).
-	hSocket = (HSOCKET)malloc(sizeof(HSOCKET));
+	// Initialize the new socket with a call to SocketDemoUtils_createTcpSocket.
+	// The core library only does TCP, so datagram sockets are made here.
+	if (SOCKET_TYPE_DATAGRAM == type)
+		nSocketDescriptor = socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+	else
+		nSocketDescriptor = SocketDemoUtils_createTcpSocket();
 
-	// Initialize the new socket with a call to SocketDemoUtils_createTcpSocket
-	hSocket->nSocketDescriptor = SocketDemoUtils_createTcpSocket();
-	if (hSocket->nSocketDescriptor <= 0)
+	if (nSocketDescriptor <= 0)
 	{
-		// Failed to open new socket.  Call GetLastError to get the errno
-		// and then use strerror to tell the user.
-		SetSocketState(hSocket, SOCKET_STATE_ERROR);
-
-		free_buffer((void**)&hSocket);
+		// Failed to open new socket.  There is no handle yet to report the
+		// error on, so the caller has to look at errno.
+		return INVALID_HANDLE_VALUE;
+	}
 
+	// Take a socket object from the pool, rather than asking the general-purpose
+	// allocator for one, and associate the descriptor and callback with it.
+	pSocket = NewSocket(nSocketDescriptor, type, lpfnCallback, SOCKET_STATE_UNKNOWN);
+	if (NULL == pSocket)
+	{
+		SocketDemoUtils_close(nSocketDescriptor);
 		return INVALID_HANDLE_VALUE;
 	}
 
-	// Associate the callback with the new socket
-	hSocket->lpfnCallback = lpfnCallback;
+	pSocket->dwEventMask = dwEventMask;
+
+	// Tuning is an optimization; a socket whose options the kernel will not
+	// take all of is still a socket.
+	ApplySocketTuning(pSocket, NULL, TUNING_STAGE_OPEN);
 
-	SetSocketState(hSocket, SOCKET_STATE_OPENED);
+	ChangeSocketState(pSocket, SOCKET_STATE_OPENED, NULL);
 
-	return hSocket;
+	// There is no connection to wait for; a datagram socket can send right
+	// away.
+	if (SOCKET_TYPE_DATAGRAM == type)
+		ChangeSocketState(pSocket, SOCKET_STATE_READY, NULL);
+
+	return pSocket->hSelf;
 }
 
 ///////////////////////////////////////////////////////////////////////////////
-// RunServer - Runs a server on the specified port, using the specified server
-// socket for listening for incoming connections.  A callback provided by the
-// caller is called for each change in the server socket's state.  Run the
-// listen/accept/respond loop for a server socket and fires the calllback as
-// needed.  The socket handle passed should already have been opened by a call
-// to OpenSocket.
+// NewSocket - Internal function that wraps a socket descriptor in a socket
+// object from the pool, of the specified type, in the specified state,
+// reporting to the specified callback.  No callback is fired.  Returns NULL
+// if the pool is exhausted.
 
-void RunServer(HSOCKET hSocket, int nPort)
+static PSOCKET NewSocket(int nSocketDescriptor, SOCKET_TYPE type,
+		LPSOCKET_EVENT_ROUTINE lpfnCallback, SOCKET_STATE initialState)
 {
-	// TODO: Add implementation code here
+	PSOCKET pSocket = AllocSocket();
+	if (NULL == pSocket)
+		return NULL;
+
+	pSocket->nSocketDescriptor = nSocketDescriptor;
+	pSocket->sockType = type;
+	pSocket->sockState = initialState;
+	pSocket->lpfnCallback = lpfnCallback;
+	pSocket->dwEventMask = SOCKET_EVENT_ALL;
+	pSocket->ioBackend = __atomic_load_n(&g_defaultIoBackend, __ATOMIC_RELAXED);
+	pSocket->callbackMode = GetDefaultCallbackMode();
+	GetDefaultTuning(&pSocket->tuning);
+	pSocket->nFixedFile = -1;
+
+	// The owner's reference; CloseSocket drops it.
+	__atomic_store_n(&pSocket->nRefs, 1, __ATOMIC_RELEASE);
+
+	return pSocket;
 }
 
 ///////////////////////////////////////////////////////////////////////////////
-// Send - Sends data synchronously on a connected socket.
+// ResizeRecvRing - Internal function that gives the socket a receive ring of
+// (at least) the specified capacity, moving any unread bytes from the old
+// ring to the start of the new one.  The ring is a flat heap buffer: one
+// allocation, and no file descriptor or memory mapping of its own, so that
+// tens of thousands of connections do not run the process out of either.
+// Returns zero on success, or ERROR (leaving the old ring in place) if the
+// new ring could not be made.
 
-int Send(HSOCKET hSocket, const char* pszData)
+static int ResizeRecvRing(PSOCKET pSocket, size_t nCapacity)
 {
-	if (INVALID_HANDLE_VALUE == hSocket)
-		exit(ERROR);
+	size_t nPageSize = (size_t)sysconf(_SC_PAGESIZE);
+	size_t nUnread = pSocket->nRecvTail - pSocket->nRecvHead;
+	char* pRing = NULL;
 
-	if (NULL == pszData || strlen(pszData) == 0)
+	nCapacity = (0 == nCapacity) ? nPageSize
+			: (nCapacity + nPageSize - 1) / nPageSize * nPageSize;
+
+	if (nCapacity > RECV_BUFFER_MAX_SIZE || nCapacity < nUnread)
+	{
+		errno = EINVAL;
+		return ERROR;
+	}
+
+	pRing = (char*)malloc(nCapacity);
+	if (NULL == pRing)
+		return ERROR;
+
+	if (NULL != pSocket->pRecvRing)
+	{
+		memcpy(pRing, pSocket->pRecvRing + pSocket->nRecvHead, nUnread);
+		free(pSocket->pRecvRing);
+	}
+
+	pSocket->pRecvRing = pRing;
+	pSocket->nRecvCapacity = nCapacity;
+	pSocket->nRecvHead = 0;
+	pSocket->nRecvTail = nUnread;
+
+	return 0;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// CompactRecvRing - Internal function that moves the unread bytes in the
+// socket's receive ring down to the start of it, so that all of the free
+// space is one run at the end, ready for the next read.  Usually there is
+// nothing unread, and nothing to move; otherwise it is what is left of a
+// partial message.
+
+static void CompactRecvRing(PSOCKET pSocket)
+{
+	size_t nUnread = pSocket->nRecvTail - pSocket->nRecvHead;
+
+	if (0 == pSocket->nRecvHead)
+		return;
+
+	memmove(pSocket->pRecvRing, pSocket->pRecvRing + pSocket->nRecvHead, nUnread);
+
+	pSocket->nRecvHead = 0;
+	pSocket->nRecvTail = nUnread;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// FreeRecvRing - Internal function that releases the socket's receive ring,
+// if it has one.
+
+static void FreeRecvRing(PSOCKET pSocket)
+{
+	if (NULL == pSocket->pRecvRing)
+		return;
+
+	free(pSocket->pRecvRing);
+
+	pSocket->pRecvRing = NULL;
+	pSocket->nRecvCapacity = 0;
+	pSocket->nRecvHead = 0;
+	pSocket->nRecvTail = 0;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// ReserveRecvRing - Internal function that grows the socket's receive ring, if
+// need be, so that it can hold the specified number of unread bytes.  A
+// socket with no ring yet gets one of the default size from FillRecvRing,
+// unless that is too small.  Returns zero on success, or ERROR with errno set.
+
+static int ReserveRecvRing(PSOCKET pSocket, size_t nBytes)
+{
+	size_t nCapacity = (NULL == pSocket->pRecvRing) ? RECV_BUFFER_SIZE
+			: pSocket->nRecvCapacity;
+
+	if (nBytes <= nCapacity)
+		return 0;
+
+	return ResizeRecvRing(pSocket, nBytes);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// FillRecvRing - Internal function that reads as much as the kernel has for
+// the socket, up to the free space left in its receive ring, with a single
+// readv() call.  The ring is created on first use.  Returns the number of
+// bytes read, zero if the peer has shut down its end of the connection, or
+// ERROR with errno set (EAGAIN if a non-blocking socket has nothing to read,
+// ENOBUFS if the ring is full).
+
+static int FillRecvRing(PSOCKET pSocket)
+{
+	struct iovec iov;
+	ssize_t nRead = 0;
+
+	if (NULL == pSocket->pRecvRing
+			&& ResizeRecvRing(pSocket, RECV_BUFFER_SIZE) < 0)
+		return ERROR;
+
+	CompactRecvRing(pSocket);
+
+	iov.iov_base = pSocket->pRecvRing + pSocket->nRecvTail;
+	iov.iov_len = pSocket->nRecvCapacity - pSocket->nRecvTail;
+
+	if (0 == iov.iov_len)
+	{
+		errno = ENOBUFS;
+		return ERROR;
+	}
+
+	do
+	{
+		// In descriptor passing mode, the descriptors that come along with
+		// the data have to be picked up as it is read.
+		if (pSocket->bPassDescriptors)
+			nRead = ReceiveWithDescriptors(pSocket, &iov);
+		else
+			nRead = readv(pSocket->nSocketDescriptor, &iov, 1);
+		CountRecv(pSocket, nRead);
+	} while (nRead < 0 && EINTR == errno);
+
+	if (nRead < 0)
+		return ERROR;
+
+	pSocket->nRecvTail += (size_t)nRead;
+
+	RearmQuickAck(pSocket);
+
+	return (int)nRead;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// ListenOnPort - Internal function that binds the server socket to the
+// specified port on all local interfaces, puts it into non-blocking mode, and
+// starts listening on it.  Fires the BINDING/BOUND callbacks along the way.
+// If bReusePort is nonzero, SO_REUSEPORT is set so that several listeners can
+// share the port.  A socket that was given a Unix-domain address with
+// SetServerAddress is bound to that instead, and the port is ignored.
+// Returns zero on success, or ERROR if any of the steps failed.
+
+static int ListenOnPort(PSOCKET pSocket, int nPort, int bReusePort)
+{
+	struct sockaddr_in addr;
+	int nReuse = 1;
+	int nFlags = 0;
+
+	ChangeSocketState(pSocket, SOCKET_STATE_BINDING, NULL);
+
+	if (NULL != pSocket->pListenAddr)
+	{
+		if (BindUnixAddress(pSocket) < 0)
+			return ERROR;
+	}
+	else
+	{
+		// Let the server come right back up on the same port after a restart
+		// instead of waiting out TIME_WAIT.
+		if (setsockopt(pSocket->nSocketDescriptor, SOL_SOCKET, SO_REUSEADDR,
+				&nReuse, sizeof(nReuse)) < 0)
+			return ERROR;
+
+		if (bReusePort
+				&& setsockopt(pSocket->nSocketDescriptor, SOL_SOCKET, SO_REUSEPORT,
+						&nReuse, sizeof(nReuse)) < 0)
+			return ERROR;
+
+		memset(&addr, 0, sizeof(struct sockaddr_in));
+		addr.sin_family = AF_INET;
+		addr.sin_addr.s_addr = htonl(INADDR_ANY);
+		addr.sin_port = htons((unsigned short)nPort);
+
+		if (bind(pSocket->nSocketDescriptor, (struct sockaddr*)&addr,
+				sizeof(struct sockaddr_in)) < 0)
+			return ERROR;
+	}
+
+	ChangeSocketState(pSocket, SOCKET_STATE_BOUND, NULL);
+
+	// The event loop is edge-triggered, so it always accepts until the
+	// kernel says EAGAIN; that only works on a non-blocking socket.
+	nFlags = fcntl(pSocket->nSocketDescriptor, F_GETFL, 0);
+	if (nFlags < 0
+			|| fcntl(pSocket->nSocketDescriptor, F_SETFL, nFlags | O_NONBLOCK) < 0)
+		return ERROR;
+
+	// A datagram socket has nothing to listen for; it just receives.
+	if (SOCKET_TYPE_DATAGRAM == pSocket->sockType)
+		return (pSocket->nDatagramSegmentSize > 0) ? ApplyDatagramSegmentation(pSocket) : 0;
+
+	if (listen(pSocket->nSocketDescriptor, LISTEN_BACKLOG) < 0)
+		return ERROR;
+
+	return 0;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// InheritSettings - Internal function that gives a socket the per-socket
+// settings of the server socket it was accepted by (or, for the extra
+// listeners of RunServerEx, cloned from).
+
+static void InheritSettings(PSOCKET pSocket, PSOCKET pServer)
+{
+	pSocket->dwEventMask = __atomic_load_n(&pServer->dwEventMask, __ATOMIC_RELAXED);
+	pSocket->nSendThreshold = pServer->nSendThreshold;
+	pSocket->callbackMode = __atomic_load_n(&pServer->callbackMode, __ATOMIC_RELAXED);
+	pSocket->framing = pServer->framing;
+	memcpy(pSocket->frameDelimiter, pServer->frameDelimiter, FRAME_DELIMITER_MAX_LENGTH);
+	pSocket->nFrameDelimiterLength = pServer->nFrameDelimiterLength;
+	pSocket->nMaxMessageSize = pServer->nMaxMessageSize;
+	pSocket->nIdleTimeoutMs = pServer->nIdleTimeoutMs;
+	pSocket->nReadTimeoutMs = pServer->nReadTimeoutMs;
+	pSocket->nWriteTimeoutMs = pServer->nWriteTimeoutMs;
+	pSocket->nSendHighWatermark = pServer->nSendHighWatermark;
+	pSocket->nSendLowWatermark = pServer->nSendLowWatermark;
+	pSocket->nDatagramSegmentSize = pServer->nDatagramSegmentSize;
+	pSocket->bPassDescriptors = pServer->bPassDescriptors;
+	pSocket->tuning = pServer->tuning;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// ArmSocketTimer - Internal function, called on the event loop's thread, that
+// sets a client socket's timer for the earliest moment one of its timeouts
+// could expire, or takes it off the loop's timer wheel if the socket has no
+// timeouts.  Traffic does not touch the timer; it only records when it
+// happened, and the timer is set again from that whenever it goes off early.
+// A write timeout is counted from the last send while the kernel may still
+// be holding on to data; otherwise, from now, since the next send may start
+// it at any moment.
+
+static void ArmSocketTimer(PSERVERLOOP pLoop, PSOCKET pSocket, unsigned long long nNowMs)
+{
+	unsigned long long nSinceMs = pSocket->nTimeoutsSinceMs;
+	unsigned long long nLastRecvMs = pSocket->nLastRecvMs;
+	unsigned long long nLastSendMs = __atomic_load_n(&pSocket->nLastSendMs, __ATOMIC_RELAXED);
+	unsigned long long nExpiresMs = ULLONG_MAX;
+	int nIdleMs = __atomic_load_n(&pSocket->nIdleTimeoutMs, __ATOMIC_RELAXED);
+	int nReadMs = __atomic_load_n(&pSocket->nReadTimeoutMs, __ATOMIC_RELAXED);
+	int nWriteMs = __atomic_load_n(&pSocket->nWriteTimeoutMs, __ATOMIC_RELAXED);
+
+	if (nLastRecvMs < nSinceMs)
+		nLastRecvMs = nSinceMs;
+
+	if (nReadMs > 0 && nLastRecvMs + (unsigned long long)nReadMs < nExpiresMs)
+		nExpiresMs = nLastRecvMs + (unsigned long long)nReadMs;
+
+	if (nWriteMs > 0)
+	{
+		unsigned long long nFromMs = nNowMs;
+
+		if (__atomic_load_n(&pSocket->stats.nBytesSent, __ATOMIC_RELAXED)
+				!= pSocket->nDrainedBytesSent)
+			nFromMs = (nLastSendMs > nSinceMs) ? nLastSendMs : nSinceMs;
+
+		if (nFromMs + (unsigned long long)nWriteMs < nExpiresMs)
+			nExpiresMs = nFromMs + (unsigned long long)nWriteMs;
+	}
+
+	if (nLastSendMs > nLastRecvMs)
+		nLastRecvMs = nLastSendMs;
+
+	if (nIdleMs > 0 && nLastRecvMs + (unsigned long long)nIdleMs < nExpiresMs)
+		nExpiresMs = nLastRecvMs + (unsigned long long)nIdleMs;
+
+	if (ULLONG_MAX == nExpiresMs)
+		TimerWheelCancel(&pLoop->timers, &pSocket->timer);
+	else
+		TimerWheelArm(&pLoop->timers, &pSocket->timer, nExpiresMs);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// GetExpiredTimeout - Internal function that tells whether one of a client
+// socket's timeouts has expired, and if so, which.  Sent data only counts
+// against the write timeout while the kernel still has some of it that the
+// peer has not acknowledged; once the send queue has been seen empty, the
+// write timeout is off until the next send.
+
+static int GetExpiredTimeout(PSOCKET pSocket, unsigned long long nNowMs,
+		SOCKET_TIMEOUT_KIND* pKind)
+{
+	unsigned long long nSinceMs = pSocket->nTimeoutsSinceMs;
+	unsigned long long nLastRecvMs = pSocket->nLastRecvMs;
+	unsigned long long nLastSendMs = __atomic_load_n(&pSocket->nLastSendMs, __ATOMIC_RELAXED);
+	unsigned long long nBytesSent = __atomic_load_n(&pSocket->stats.nBytesSent, __ATOMIC_RELAXED);
+	int nIdleMs = __atomic_load_n(&pSocket->nIdleTimeoutMs, __ATOMIC_RELAXED);
+	int nReadMs = __atomic_load_n(&pSocket->nReadTimeoutMs, __ATOMIC_RELAXED);
+	int nWriteMs = __atomic_load_n(&pSocket->nWriteTimeoutMs, __ATOMIC_RELAXED);
+	int nUnacked = 0;
+
+	if (nWriteMs > 0 && nBytesSent != pSocket->nDrainedBytesSent
+			&& (nLastSendMs > nSinceMs ? nLastSendMs : nSinceMs)
+					+ (unsigned long long)nWriteMs <= nNowMs)
+	{
+		if (0 == ioctl(pSocket->nSocketDescriptor, SIOCOUTQ, &nUnacked) && nUnacked > 0)
+		{
+			*pKind = SOCKET_TIMEOUT_WRITE;
+			return 1;
+		}
+
+		pSocket->nDrainedBytesSent = nBytesSent;
+	}
+
+	if (nLastRecvMs < nSinceMs)
+		nLastRecvMs = nSinceMs;
+
+	if (nReadMs > 0 && nLastRecvMs + (unsigned long long)nReadMs <= nNowMs)
+	{
+		*pKind = SOCKET_TIMEOUT_READ;
+		return 1;
+	}
+
+	if (nLastSendMs > nLastRecvMs)
+		nLastRecvMs = nLastSendMs;
+
+	if (nIdleMs > 0 && nLastRecvMs + (unsigned long long)nIdleMs <= nNowMs)
+	{
+		*pKind = SOCKET_TIMEOUT_IDLE;
+		return 1;
+	}
+
+	return 0;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// StartSocketTimer - Internal function that starts a newly accepted client
+// socket's timeouts, including any it is given later on.
+
+static void StartSocketTimer(PSERVERLOOP pLoop, PSOCKET pClient)
+{
+	pClient->nTimeoutsSinceMs = GetCoarseTimeMs();
+
+	if (0 != (pClient->nIdleTimeoutMs | pClient->nReadTimeoutMs | pClient->nWriteTimeoutMs))
+		ArmSocketTimer(pLoop, pClient, pClient->nTimeoutsSinceMs);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// AcceptClients - Internal function that accepts every connection that is
+// waiting on the event loop's listening socket, wraps each one in a new
+// HSOCKET, registers it with the loop's epoll instance, and fires the
+// ACCEPTED callback on the server socket with the new handle as the state bag.
+
+static void AcceptClients(PSERVERLOOP pLoop)
+{
+	PSOCKET pServer = pLoop->pServer;
+
+	// Edge-triggered: keep accepting until the backlog is drained.
+	while (!__atomic_load_n(&pServer->bClosePending, __ATOMIC_ACQUIRE))
+	{
+		struct epoll_event ev;
+		PSOCKET pClient = NULL;
+
+		int nClientFd = accept4(pServer->nSocketDescriptor, NULL, NULL,
+				SOCK_NONBLOCK | SOCK_CLOEXEC);
+		if (nClientFd < 0)
+		{
+			if (EINTR == errno || ECONNABORTED == errno)
+				continue;
+
+			// EAGAIN means we are done for now.  Anything else (e.g., EMFILE)
+			// leaves the connection in the backlog for the next wakeup.
+			return;
+		}
+
+		// From the server's point of view, an accepted connection is the
+		// far end of a client socket.  It reports to the server's callback.
+		pClient = NewSocket(nClientFd, SOCKET_TYPE_CLIENT,
+				pServer->lpfnCallback, SOCKET_STATE_READY);
+		if (NULL == pClient)
+		{
+			close(nClientFd);
+			continue;
+		}
+
+		InheritSettings(pClient, pServer);
+		ApplySocketTuning(pClient, NULL, TUNING_STAGE_ACCEPTED);
+		pClient->pServerLoop = pLoop;
+
+		// Clients in non-blocking send mode also hear when there is room to
+		// write out their send queues.
+		memset(&ev, 0, sizeof(struct epoll_event));
+		ev.events = EPOLLIN | EPOLLRDHUP | EPOLLET
+				| ((pClient->nSendHighWatermark > 0) ? EPOLLOUT : 0);
+		ev.data.ptr = pClient;
+		if (epoll_ctl(pLoop->nEpollFd, EPOLL_CTL_ADD, nClientFd, &ev) < 0)
+		{
+			close(nClientFd);
+			ReleaseSocket(pClient);
+			continue;
+		}
+
+		pClient->pNext = pLoop->pClients;
+		if (NULL != pLoop->pClients)
+			pLoop->pClients->pPrev = pClient;
+		pLoop->pClients = pClient;
+
+		StartSocketTimer(pLoop, pClient);
+
+		ChangeSocketState(pServer, SOCKET_STATE_ACCEPTED, pClient->hSelf);
+	}
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// DispatchDatagrams - Internal function that receives every datagram that is
+// waiting on the event loop's datagram socket, a batch at a time, and fires
+// the RECEIVED callback on the socket once for each, with a SOCKETDATAGRAM as
+// the state bag.  The datagrams of a batch are only good until the next one
+// is received, so the socket is put back into the READY state after each
+// callback, as if the callback had done so.
+
+static void DispatchDatagrams(PSERVERLOOP pLoop)
+{
+	SOCKETDATAGRAM datagrams[DATAGRAM_BATCH_SIZE];
+	PSOCKET pServer = pLoop->pServer;
+
+	// Edge-triggered: keep receiving until the kernel runs dry.
+	while (!__atomic_load_n(&pServer->bClosePending, __ATOMIC_ACQUIRE))
+	{
+		int nReceived = ReceiveDatagramBatch(pServer, datagrams, DATAGRAM_BATCH_SIZE,
+				MSG_DONTWAIT);
+		if (nReceived < 0)
+		{
+			// EAGAIN means we are done for now.  Other errors (e.g.,
+			// ECONNREFUSED, when an ICMP port unreachable came back for a
+			// datagram the callback sent) concern one packet, and are
+			// cleared by being reported.
+			if (EAGAIN == errno || EWOULDBLOCK == errno || ENOMEM == errno)
+				return;
+
+			continue;
+		}
+
+		for (int i = 0; i < nReceived
+				&& !__atomic_load_n(&pServer->bClosePending, __ATOMIC_ACQUIRE); i++)
+		{
+			ChangeSocketStateCopy(pServer, SOCKET_STATE_RECEIVED, &datagrams[i],
+					sizeof(SOCKETDATAGRAM), datagrams[i].nLength);
+
+			if (SOCKET_STATE_RECEIVED == __atomic_load_n(&pServer->sockState, __ATOMIC_ACQUIRE))
+				ChangeSocketState(pServer, SOCKET_STATE_READY, NULL);
+		}
+
+		// A short batch means the kernel had no more.
+		if (nReceived < DATAGRAM_BATCH_SIZE)
+			return;
+	}
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// DispatchMessages - Internal function that does the work of DispatchReceived
+// for a socket with a framing mode: fires the RECEIVED callback once for each
+// complete message in the receive ring, consuming each one as the callback
+// returns, and then makes room in the ring for the rest of the message that
+// is still coming in.  Returns zero on success, or ERROR if the connection
+// should be closed.
+
+static int DispatchMessages(PSOCKET pClient)
+{
+	SOCKETRECVDATA recvData;
+	size_t nOffset = 0;
+	size_t nLength = 0;
+	size_t nConsumed = 0;
+	int result = 0;
+
+	while (!__atomic_load_n(&pClient->bClosePending, __ATOMIC_ACQUIRE))
+	{
+		result = FindMessage(pClient, &nOffset, &nLength, &nConsumed);
+		if (result <= 0)
+			break;
+
+		recvData.pData = pClient->pRecvRing + pClient->nRecvHead + nOffset;
+		recvData.nBytesReceived = (int)nLength;
+
+		ChangeSocketStateCopy(pClient, SOCKET_STATE_RECEIVED, &recvData,
+				sizeof(SOCKETRECVDATA), nLength);
+
+		pClient->nRecvHead += nConsumed;
+
+		if (SOCKET_STATE_RECEIVED == __atomic_load_n(&pClient->sockState, __ATOMIC_ACQUIRE))
+			ChangeSocketState(pClient, SOCKET_STATE_READY, NULL);
+
+		if (SOCKET_STATE_ERROR == __atomic_load_n(&pClient->sockState, __ATOMIC_ACQUIRE))
+			return ERROR;
+	}
+
+	// E.g., a message that is larger than the socket allows.
+	if (result < 0)
+	{
+		ChangeSocketState(pClient, SOCKET_STATE_ERROR, NULL);
+		return ERROR;
+	}
+
+	if (0 == result && ReserveRecvRing(pClient, nConsumed) < 0)
+		return ERROR;
+
+	return 0;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// DispatchReceived - Internal function that fires the RECEIVED callback for
+// a client socket whose receive ring has just taken in more data, and then
+// tidies up after the callback: consumes the data unless the callback took
+// charge of that with ReceiveCommit, puts the socket back into the READY
+// state, and grows the ring if a partial message is filling it.  Sockets with
+// a framing mode get one callback per message instead.  Returns zero on
+// success, or ERROR if the connection should be closed.
+
+static int DispatchReceived(PSOCKET pClient)
+{
+	SOCKETRECVDATA recvData;
+
+	// Puts off the read and idle timeouts.  New timeouts set from another
+	// thread take effect here.
+	pClient->nLastRecvMs = GetCoarseTimeMs();
+	if (__atomic_load_n(&pClient->bTimeoutsChanged, __ATOMIC_ACQUIRE))
+	{
+		__atomic_store_n(&pClient->bTimeoutsChanged, 0, __ATOMIC_RELAXED);
+		ArmSocketTimer(pClient->pServerLoop, pClient, pClient->nLastRecvMs);
+	}
+
+	if (SOCKET_FRAMING_NONE != pClient->framing)
+		return DispatchMessages(pClient);
+
+	// Hand the callback everything that has not been consumed yet, right
+	// where it sits in the ring.
+	recvData.pData = pClient->pRecvRing + pClient->nRecvHead;
+	recvData.nBytesReceived = (int)(pClient->nRecvTail - pClient->nRecvHead);
+
+	pClient->bRecvCommitted = 0;
+
+	// The callback workers get a copy of the data, since the ring is
+	// consumed below, long before they get to it.
+	ChangeSocketStateCopy(pClient, SOCKET_STATE_RECEIVED, &recvData,
+			sizeof(SOCKETRECVDATA), (size_t)recvData.nBytesReceived);
+
+	// Callbacks that never call ReceiveCommit get the original behavior:
+	// the data is gone once the callback returns.
+	if (!pClient->bRecvCommitted)
+		pClient->nRecvHead = pClient->nRecvTail;
+
+	// Be forgiving of callbacks that forget to put the socket back into
+	// the READY state.
+	if (SOCKET_STATE_RECEIVED == __atomic_load_n(&pClient->sockState, __ATOMIC_ACQUIRE))
+		ChangeSocketState(pClient, SOCKET_STATE_READY, NULL);
+
+	// E.g., a Send from inside the callback failed.
+	if (SOCKET_STATE_ERROR == __atomic_load_n(&pClient->sockState, __ATOMIC_ACQUIRE))
+		return ERROR;
+
+	// The callback is holding on to a partial message that fills the whole
+	// ring; make room for the rest of it.
+	if (pClient->nRecvTail - pClient->nRecvHead == pClient->nRecvCapacity
+			&& ResizeRecvRing(pClient, 2 * pClient->nRecvCapacity) < 0)
+		return ERROR;
+
+	return 0;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// ServiceClient - Internal function that handles readiness events for one of
+// the event loop's client sockets.  Reads everything the kernel has for the
+// socket, firing the RECEIVED callback once per read, writes out what it can
+// of the socket's send queue, and closes the socket if the peer hung up or
+// an error occurred.
+
+static void ServiceClient(PSOCKET pClient, unsigned int nEvents)
+{
+	int bHangUp = (nEvents & (EPOLLHUP | EPOLLERR)) != 0;
+
+	if (nEvents & (EPOLLIN | EPOLLRDHUP))
+	{
+		// Edge-triggered: keep reading until the kernel runs dry, or the
+		// callback closes the socket.
+		while (!pClient->bClosePending)
+		{
+			size_t nFree = (NULL == pClient->pRecvRing) ? RECV_BUFFER_SIZE
+					: pClient->nRecvCapacity - (pClient->nRecvTail - pClient->nRecvHead);
+
+			int nRead = FillRecvRing(pClient);
+			if (nRead < 0)
+			{
+				if (EAGAIN != errno && EWOULDBLOCK != errno)
+					bHangUp = 1;
+
+				break;
+			}
+
+			if (0 == nRead)
+			{
+				bHangUp = 1;	/* orderly shutdown by the peer */
+				break;
+			}
+
+			if (DispatchReceived(pClient) < 0)
+			{
+				bHangUp = 1;
+				break;
+			}
+
+			// A short read means the kernel buffer is empty, so skip the
+			// extra read that would only return EAGAIN.
+			if ((size_t)nRead < nFree
+					&& 0 == (nEvents & EPOLLRDHUP))
+				break;
+		}
+	}
+
+	if ((nEvents & EPOLLOUT) && !bHangUp && !pClient->bClosePending
+			&& __atomic_load_n(&pClient->nSendQueued, __ATOMIC_ACQUIRE) > 0)
+	{
+		pthread_mutex_lock(&pClient->sendLock);
+		if (DrainSendQueue(pClient) < 0)
+			bHangUp = 1;
+		pthread_mutex_unlock(&pClient->sendLock);
+	}
+
+	if (bHangUp)
+		CloseSocket(pClient->hSelf);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// ExpireSocketTimers - Internal function that goes through the client
+// sockets whose timers have gone off on the event loop's timer wheel.  A
+// socket whose timeout has really expired goes into SOCKET_STATE_TIMEOUT,
+// and is closed, unless the callback moves it on to some other state, which
+// starts its timeouts over.  The timers of the rest are set again for their
+// new deadlines.  Runs while the loop is dispatching, so closed sockets wait
+// for ClosePendingSockets.
+
+static void ExpireSocketTimers(PSERVERLOOP pLoop)
+{
+	unsigned long long nNowMs = 0;
+	PTIMERNODE pNode = NULL;
+
+	if (0 == pLoop->timers.nTimers)
+		return;
+
+	nNowMs = GetCoarseTimeMs();
+
+	while (NULL != (pNode = TimerWheelExpire(&pLoop->timers, nNowMs)))
+	{
+		PSOCKET pClient = (PSOCKET)((char*)pNode - offsetof(struct _tagSOCKET, timer));
+		SOCKET_TIMEOUT_KIND kind = SOCKET_TIMEOUT_IDLE;
+
+		if (__atomic_load_n(&pClient->bClosePending, __ATOMIC_ACQUIRE))
+			continue;
+
+		if (GetExpiredTimeout(pClient, nNowMs, &kind))
+		{
+			SOCKET_STATE state = SOCKET_STATE_TIMEOUT;
+
+			if (!ChangeSocketStateCopy(pClient, SOCKET_STATE_TIMEOUT, &kind,
+					sizeof(SOCKET_TIMEOUT_KIND), 0))
+				state = SOCKET_STATE_ERROR;		/* e.g., already in error */
+			else
+				state = __atomic_load_n(&pClient->sockState, __ATOMIC_ACQUIRE);
+
+			if (SOCKET_STATE_TIMEOUT == state || SOCKET_STATE_ERROR == state
+					|| __atomic_load_n(&pClient->bClosePending, __ATOMIC_ACQUIRE))
+			{
+				CloseSocket(pClient->hSelf);
+				continue;
+			}
+
+			pClient->nTimeoutsSinceMs = nNowMs;
+		}
+
+		ArmSocketTimer(pLoop, pClient, nNowMs);
+	}
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// ClosePendingSockets - Internal function that finishes closing every socket
+// that CloseSocket was called on while the event loop was dispatching
+// callbacks.
+
+static void ClosePendingSockets(PSERVERLOOP pLoop)
+{
+	while (NULL != pLoop->pPendingClose)
+	{
+		PSOCKET pSocket = pLoop->pPendingClose;
+		pLoop->pPendingClose = pSocket->pNextPending;
+		pSocket->pNextPending = NULL;
+
+		// On io_uring, a socket cannot be released while the kernel may
+		// still write into its receive ring.  Shutting it down makes the
+		// outstanding receive complete, cancelling its poll for writability
+		// does the same for that, and the loop finishes the job then.
+		if (pSocket->nUringInFlight > 0)
+		{
+			shutdown(pSocket->nSocketDescriptor, SHUT_RDWR);
+			if (pSocket->bWritableArmed)
+				QueueUringCancel(pLoop, (uintptr_t)pSocket | URING_OP_WRITABLE);
+			continue;
+		}
+
+		DestroySocket(pSocket);
+	}
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// FlushPendingSockets - Internal function that writes out the output buffer
+// of every socket that was sent data in buffered mode while the event loop
+// was dispatching callbacks, so that each reply goes out with one system
+// call no matter how many Send calls built it.  Runs before the loop leaves
+// dispatch, so that sockets closed here are closed by ClosePendingSockets.
+
+static void FlushPendingSockets(PSERVERLOOP pLoop)
+{
+	int result = 0;
+
+	while (NULL != pLoop->pPendingFlush)
+	{
+		PSOCKET pSocket = pLoop->pPendingFlush;
+		pLoop->pPendingFlush = pSocket->pNextFlush;
+		pSocket->pNextFlush = NULL;
+		pSocket->bFlushQueued = 0;
+
+		pthread_mutex_lock(&pSocket->sendLock);
+		result = FlushSendBuffer(pSocket);
+		if (result < 0)
+			ChangeSocketState(pSocket, SOCKET_STATE_ERROR, NULL);
+		pthread_mutex_unlock(&pSocket->sendLock);
+
+		if (result < 0)
+			CloseSocket(pSocket->hSelf);
+	}
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Receive - Lends the caller a pointer to every byte that has been received on
+// the socket but not yet consumed with ReceiveCommit.  The bytes stay in the
+// socket's receive ring; nothing is allocated or copied.  If the ring is
+// empty, data is read from the kernel first (blocking, if the socket is).
+
+int Receive(HSOCKET hSocket, const char** ppData)
+{
+	PSOCKET pSocket = NULL;
+	int result = 0;
+
+	if (NULL == ppData)
+		return ERROR;
+
+	*ppData = NULL;
+
+	pSocket = EnterSocket(hSocket);
+	if (NULL == pSocket)
+		return ERROR;
+
+	if (SOCKET_STATE_ERROR == __atomic_load_n(&pSocket->sockState, __ATOMIC_ACQUIRE))
+	{
+		LeaveSocket(pSocket);
+		return ERROR;
+	}
+
+	if (pSocket->nRecvTail == pSocket->nRecvHead)
+	{
+		result = FillRecvRing(pSocket);
+
+		// Having nothing to read yet is not an error in the socket.
+		if (result < 0 && EAGAIN != errno && EWOULDBLOCK != errno)
+			ChangeSocketState(pSocket, SOCKET_STATE_ERROR, NULL);
+	}
+
+	// Zero from FillRecvRing means that the peer has closed the connection.
+	if (pSocket->nRecvTail != pSocket->nRecvHead)
+	{
+		*ppData = pSocket->pRecvRing + pSocket->nRecvHead;
+		result = (int)(pSocket->nRecvTail - pSocket->nRecvHead);
+	}
+
+	LeaveSocket(pSocket);
+
+	return result;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// ReceiveMessage - Lends the caller a pointer to the next complete message in
+// the socket's receive ring, reading from the kernel (blocking, if the socket
+// is) until there is one.  The message is consumed straight away; its bytes
+// stay put until the next receive call.
+
+int ReceiveMessage(HSOCKET hSocket, const char** ppData)
+{
+	PSOCKET pSocket = NULL;
+	size_t nOffset = 0;
+	size_t nLength = 0;
+	size_t nConsumed = 0;
+	int result = 0;
+
+	if (NULL == ppData)
+		return ERROR;
+
+	*ppData = NULL;
+
+	pSocket = EnterSocket(hSocket);
+	if (NULL == pSocket)
+		return ERROR;
+
+	if (SOCKET_STATE_ERROR == __atomic_load_n(&pSocket->sockState, __ATOMIC_ACQUIRE))
+	{
+		LeaveSocket(pSocket);
+		return ERROR;
+	}
+
+	if (SOCKET_FRAMING_NONE == pSocket->framing)
+	{
+		LeaveSocket(pSocket);
+		errno = EINVAL;
+		return ERROR;
+	}
+
+	for (;;)
+	{
+		result = FindMessage(pSocket, &nOffset, &nLength, &nConsumed);
+		if (result > 0)
+		{
+			*ppData = pSocket->pRecvRing + pSocket->nRecvHead + nOffset;
+			pSocket->nRecvHead += nConsumed;
+			result = (int)nLength;
+			break;
+		}
+
+		if (result < 0 || ReserveRecvRing(pSocket, nConsumed) < 0)
+		{
+			ChangeSocketState(pSocket, SOCKET_STATE_ERROR, NULL);
+			result = ERROR;
+			break;
+		}
+
+		result = FillRecvRing(pSocket);
+		if (result < 0)
+		{
+			// Not having all of the message yet is not an error in the socket.
+			if (EAGAIN != errno && EWOULDBLOCK != errno)
+				ChangeSocketState(pSocket, SOCKET_STATE_ERROR, NULL);
+
+			break;
+		}
+
+		// The peer has closed the connection; any partial message left in
+		// the ring will never be completed.
+		if (0 == result)
+			break;
+	}
+
+	LeaveSocket(pSocket);
+
+	return result;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// ReceiveCommit - Marks the specified number of bytes at the front of the
+// socket's receive ring as consumed, so that the space can be reused.  Asking
+// to commit more than is in the ring commits everything.
+
+void ReceiveCommit(HSOCKET hSocket, size_t nBytes)
+{
+	PSOCKET pSocket = EnterSocket(hSocket);
+	SOCKET_STATE state = SOCKET_STATE_UNKNOWN;
+	size_t nUnread = 0;
+
+	if (NULL == pSocket)
+		return;
+
+	// A callback run by the callback workers was handed a copy of data
+	// that has already been consumed; and messages of a framed socket are
+	// consumed as they are handed out.
+	if (GetCallbackState(hSocket, &state) || SOCKET_FRAMING_NONE != pSocket->framing)
+	{
+		LeaveSocket(pSocket);
+		return;
+	}
+
+	nUnread = pSocket->nRecvTail - pSocket->nRecvHead;
+	if (nBytes > nUnread)
+		nBytes = nUnread;
+
+	pSocket->nRecvHead += nBytes;
+	pSocket->bRecvCommitted = 1;
+
+	LeaveSocket(pSocket);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// ReceiveSocketFile - Internal function that does the work of ReceiveFile for
+// a socket object the caller holds a reference to.
+
+static ssize_t ReceiveSocketFile(PSOCKET pSocket, int nFileDescriptor, off_t nOffset,
+		size_t nCount)
+{
+	SOCKETFILEPROGRESS progress;
+	int nPipe[2] = { -1, -1 };
+	int bFailed = 0;
+
+	if (nFileDescriptor < 0 || nOffset < 0)
+	{
+		errno = EBADF;
+		return ERROR;
+	}
+
+	if (SOCKET_STATE_ERROR == __atomic_load_n(&pSocket->sockState, __ATOMIC_ACQUIRE))
+		return ERROR;
+
+	memset(&progress, 0, sizeof(SOCKETFILEPROGRESS));
+	progress.nBytesTotal = nCount;	/* zero: until the peer closes the connection */
+
+	// Bytes that an earlier Receive already pulled into the ring have to go
+	// first, or the file would come out scrambled.
+	while (pSocket->nRecvTail != pSocket->nRecvHead
+			&& (0 == nCount || progress.nBytesTransferred < nCount))
+	{
+		size_t nChunk = pSocket->nRecvTail - pSocket->nRecvHead;
+		if (0 != nCount && nChunk > nCount - progress.nBytesTransferred)
+			nChunk = nCount - progress.nBytesTransferred;
+
+		ssize_t nWritten = pwrite(nFileDescriptor, pSocket->pRecvRing + pSocket->nRecvHead,
+				nChunk, nOffset);
+		if (nWritten < 0)
+		{
+			if (EINTR == errno)
+				continue;
+
+			return ERROR;
+		}
+
+		pSocket->nRecvHead += (size_t)nWritten;
+		nOffset += nWritten;
+		progress.nBytesTransferred += (size_t)nWritten;
+	}
+
+	if (pipe2(nPipe, O_CLOEXEC) < 0)
+		return ERROR;
+
+	// A bigger pipe means fewer splice() round trips per chunk.  If the
+	// system will not allow it, the default size works too.
+	fcntl(nPipe[1], F_SETPIPE_SZ, FILE_TRANSFER_CHUNK_SIZE);
+
+	while (0 == nCount || progress.nBytesTransferred < nCount)
+	{
+		size_t nChunk = FILE_TRANSFER_CHUNK_SIZE;
+		if (0 != nCount && nChunk > nCount - progress.nBytesTransferred)
+			nChunk = nCount - progress.nBytesTransferred;
+
+		ssize_t nInPipe = splice(pSocket->nSocketDescriptor, NULL, nPipe[1], NULL,
+				nChunk, SPLICE_F_MOVE | SPLICE_F_MORE);
+		CountRecv(pSocket, nInPipe);
+		if (nInPipe < 0)
+		{
+			if (EINTR == errno)
+				continue;
+
+			if ((EAGAIN == errno || EWOULDBLOCK == errno)
+					&& WaitForSocket(pSocket, POLLIN) >= 0)
+				continue;
+
+			bFailed = 1;
+			break;
+		}
+
+		if (0 == nInPipe)
+		{
+			// The peer closed the connection.  That is how an open-ended
+			// transfer ends; for a sized one, it is premature.
+			if (0 != nCount)
+			{
+				bFailed = 1;
+				errno = ECONNRESET;
+			}
+			break;
+		}
+
+		// Drain the pipe into the file.
+		while (nInPipe > 0)
+		{
+			ssize_t nWritten = splice(nPipe[0], NULL, nFileDescriptor, &nOffset,
+					(size_t)nInPipe, SPLICE_F_MOVE | SPLICE_F_MORE);
+			if (nWritten < 0 && EINTR == errno)
+				continue;
+
+			if (nWritten <= 0)
+			{
+				bFailed = 1;
+				break;
+			}
+
+			nInPipe -= nWritten;
+			progress.nBytesTransferred += (size_t)nWritten;
+		}
+
+		if (bFailed)
+			break;
+
+		ChangeSocketStateCopy(pSocket, SOCKET_STATE_RECEIVING, &progress,
+				sizeof(SOCKETFILEPROGRESS), 0);
+	}
+
+	close(nPipe[0]);
+	close(nPipe[1]);
+
+	if (bFailed)
+	{
+		ChangeSocketState(pSocket, SOCKET_STATE_ERROR, NULL);
+		return ERROR;
+	}
+
+	ChangeSocketStateCopy(pSocket, SOCKET_STATE_RECEIVED, &progress,
+			sizeof(SOCKETFILEPROGRESS), 0);
+
+	return (ssize_t)progress.nBytesTransferred;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// ReceiveFile - Receives data from a connected socket straight into a file.
+// Anything already sitting in the socket's receive ring is written out first;
+// after that, the data is moved from the socket to the file with splice()
+// through a pipe, so it never passes through user memory.  Fires RECEIVING
+// on the socket after each chunk and RECEIVED at the end, with a
+// SOCKETFILEPROGRESS as the state bag both times.
+
+ssize_t ReceiveFile(HSOCKET hSocket, int nFileDescriptor, off_t nOffset, size_t nCount)
+{
+	PSOCKET pSocket = EnterSocket(hSocket);
+	ssize_t result = 0;
+
+	if (NULL == pSocket)
+		return ERROR;
+
+	result = ReceiveSocketFile(pSocket, nFileDescriptor, nOffset, nCount);
+
+	LeaveSocket(pSocket);
+
+	return result;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// ReceiveDatagrams - Receives up to the specified number of datagrams on a
+// datagram socket with one recvmmsg(), waiting for the first one if the
+// socket is blocking.  The payloads are lent out of the socket's datagram
+// receive buffer.  Returns the number of datagrams received, or ERROR with
+// errno set.
+
+int ReceiveDatagrams(HSOCKET hSocket, PSOCKETDATAGRAM pDatagrams, int nMaxDatagrams)
+{
+	PSOCKET pSocket = NULL;
+	int result = 0;
+
+	if (NULL == pDatagrams || nMaxDatagrams <= 0)
+	{
+		errno = EINVAL;
+		return ERROR;
+	}
+
+	pSocket = EnterSocket(hSocket);
+	if (NULL == pSocket)
+	{
+		errno = EBADF;
+		return ERROR;
+	}
+
+	if (SOCKET_TYPE_DATAGRAM != pSocket->sockType)
+	{
+		LeaveSocket(pSocket);
+		errno = EINVAL;
+		return ERROR;
+	}
+
+	result = ReceiveDatagramBatch(pSocket, pDatagrams, nMaxDatagrams, 0);
+
+	LeaveSocket(pSocket);
+
+	return result;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// ReceiveFrom - Receives one datagram on a datagram socket, and says who sent
+// it.  Returns the length of the datagram, or ERROR with errno set.
+
+int ReceiveFrom(HSOCKET hSocket, PSOCKETDATAGRAM pDatagram)
+{
+	int result = ReceiveDatagrams(hSocket, pDatagram, 1);
+
+	if (result <= 0)
+		return result;
+
+	return (int)pDatagram->nLength;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// ReceiveDescriptors - Takes descriptors that have come in on a socket in
+// descriptor passing mode (see SetDescriptorPassing), oldest first.  They
+// belong to the caller from then on.  Returns the number of descriptors
+// taken, which is zero if none have come in, or ERROR with errno set.
+
+int ReceiveDescriptors(HSOCKET hSocket, int* pFds, int nMaxFds)
+{
+	PSOCKET pSocket = NULL;
+	int result = 0;
+
+	if (NULL == pFds || nMaxFds <= 0)
+	{
+		errno = EINVAL;
+		return ERROR;
+	}
+
+	pSocket = EnterSocket(hSocket);
+	if (NULL == pSocket)
+	{
+		errno = EBADF;
+		return ERROR;
+	}
+
+	result = TakeDescriptors(pSocket, pFds, nMaxFds);
+
+	LeaveSocket(pSocket);
+
+	return result;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// QueueUringAccept - Internal function that arms a multishot accept on the
+// io_uring event loop's listening socket.  One request keeps producing a
+// completion per accepted connection until the kernel drops it.  Returns
+// zero on success, or ERROR.
+
+static int QueueUringAccept(PSERVERLOOP pLoop)
+{
+	struct io_uring_sqe* pSqe = UringGetSqe(pLoop->pUring);
+	if (NULL == pSqe)
+		return ERROR;
+
+	// Accepted connections are non-blocking, just like on the epoll loop,
+	// so that Send from a callback never stalls the loop indefinitely.
+	pSqe->opcode = IORING_OP_ACCEPT;
+	pSqe->fd = pLoop->pServer->nSocketDescriptor;
+	pSqe->ioprio = IORING_ACCEPT_MULTISHOT;
+	pSqe->accept_flags = SOCK_NONBLOCK | SOCK_CLOEXEC;
+	pSqe->user_data = (uintptr_t)pLoop->pServer | URING_OP_ACCEPT;
+
+	pLoop->nUringInFlight++;
+
+	return 0;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// RearmUringAccept - Internal function that decides what to do once the
+// kernel has dropped the io_uring event loop's multishot accept, which ended
+// with the specified result.  Arms a new one straight away if the accept just
+// ran its course, or failed for a reason that will pass by itself; waits a
+// little first if the process is short of descriptors or memory, since a new
+// accept would only fail again at once; and, on any other error, which a new
+// accept would only repeat forever, gives up and stops the loop.
+
+static void RearmUringAccept(PSERVERLOOP pLoop, int nResult)
+{
+	if (nResult < 0)
+	{
+		switch (-nResult)
+		{
+			case EMFILE:
+			case ENFILE:
+			case ENOBUFS:
+			case ENOMEM:
+				pLoop->nAcceptRetryMs = GetCoarseTimeMs() + URING_ACCEPT_RETRY_MS;
+				return;
+
+			case EINTR:
+			case EAGAIN:
+			case ECONNABORTED:
+			case EPERM:		/* refused by a firewall rule */
+				break;
+
+			default:
+				ChangeSocketState(pLoop->pServer, SOCKET_STATE_ERROR, NULL);
+				pLoop->bRunning = 0;
+				return;
+		}
+	}
+
+	if (QueueUringAccept(pLoop) < 0)
+		pLoop->nAcceptRetryMs = GetCoarseTimeMs() + URING_ACCEPT_RETRY_MS;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// QueueUringWake - Internal function that has the io_uring event loop's
+// io_uring watch the loop's wakeup eventfd (see RunServerEx).  Returns zero
+// on success, or ERROR.
+
+static int QueueUringWake(PSERVERLOOP pLoop)
+{
+	struct io_uring_sqe* pSqe = UringGetSqe(pLoop->pUring);
+	if (NULL == pSqe)
+		return ERROR;
+
+	pSqe->opcode = IORING_OP_POLL_ADD;
+	pSqe->fd = pLoop->nWakeFd;
+	pSqe->poll32_events = POLLIN;
+	pSqe->user_data = URING_OP_WAKE;
+
+	pLoop->nUringInFlight++;
+
+	return 0;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// QueueUringCancel - Internal function that cancels the io_uring request with
+// the specified user_data (e.g., the multishot accept, when the loop shuts
+// down).  The cancellation itself completes like any other request.
+
+static void QueueUringCancel(PSERVERLOOP pLoop, uint64_t nUserData)
+{
+	struct io_uring_sqe* pSqe = UringGetSqe(pLoop->pUring);
+	if (NULL == pSqe)
+		return;
+
+	pSqe->opcode = IORING_OP_ASYNC_CANCEL;
+	pSqe->fd = -1;
+	pSqe->addr = nUserData;
+	pSqe->user_data = URING_OP_CANCEL;
+
+	pLoop->nUringInFlight++;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// QueueUringRecv - Internal function that asks the io_uring event loop's
+// io_uring to receive into all the free space of a client socket's receive
+// ring.  The kernel copies straight into the ring the callback reads from,
+// so, unlike with a pool of registered or provided buffers, there is no copy
+// to make afterwards.  Returns zero on success, or ERROR.
+
+static int QueueUringRecv(PSERVERLOOP pLoop, PSOCKET pClient)
+{
+	struct io_uring_sqe* pSqe = NULL;
+
+	if (NULL == pClient->pRecvRing
+			&& ResizeRecvRing(pClient, RECV_BUFFER_SIZE) < 0)
+		return ERROR;
+
+	pSqe = UringGetSqe(pLoop->pUring);
+	if (NULL == pSqe)
+		return ERROR;
+
+	CompactRecvRing(pClient);
+
+	pSqe->opcode = IORING_OP_RECV;
+	pSqe->addr = (uintptr_t)(pClient->pRecvRing + pClient->nRecvTail);
+	pSqe->len = (unsigned int)(pClient->nRecvCapacity - pClient->nRecvTail);
+	pSqe->user_data = (uintptr_t)pClient | URING_OP_RECV;
+
+	if (pClient->nFixedFile >= 0)
+	{
+		pSqe->fd = pClient->nFixedFile;
+		pSqe->flags |= IOSQE_FIXED_FILE;
+	}
+	else
+	{
+		pSqe->fd = pClient->nSocketDescriptor;
+	}
+
+	pClient->nUringInFlight++;
+	pLoop->nUringInFlight++;
+
+	return 0;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// QueueUringWritable - Internal function that has the io_uring event loop's
+// io_uring tell it, with a multishot poll, each time there is room to write
+// out a client socket's send queue.  Returns zero on success, or ERROR.
+
+static int QueueUringWritable(PSERVERLOOP pLoop, PSOCKET pClient)
+{
+	struct io_uring_sqe* pSqe = UringGetSqe(pLoop->pUring);
+	if (NULL == pSqe)
+		return ERROR;
+
+	pSqe->opcode = IORING_OP_POLL_ADD;
+	pSqe->fd = pClient->nSocketDescriptor;
+	pSqe->poll32_events = POLLOUT;
+	pSqe->len = IORING_POLL_ADD_MULTI;
+	pSqe->user_data = (uintptr_t)pClient | URING_OP_WRITABLE;
+
+	pClient->bWritableArmed = 1;
+	pClient->nUringInFlight++;
+	pLoop->nUringInFlight++;
+
+	return 0;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// WatchWritable - Internal function that has a client socket's event loop
+// tell it, from now on, whenever the socket becomes writable, so that it can
+// write out the socket's send queue.  The epoll set may be changed from any
+// thread; an io_uring poll may only be armed by the loop's own thread, so
+// other threads leave the loop a note instead.  Returns zero on success, or
+// ERROR.
+
+static int WatchWritable(PSERVERLOOP pLoop, PSOCKET pSocket)
+{
+	if (NULL == pLoop->pUring)
+	{
+		struct epoll_event ev;
+
+		memset(&ev, 0, sizeof(struct epoll_event));
+		ev.events = EPOLLIN | EPOLLRDHUP | EPOLLET | EPOLLOUT;
+		ev.data.ptr = pSocket;
+		return epoll_ctl(pLoop->nEpollFd, EPOLL_CTL_MOD, pSocket->nSocketDescriptor, &ev);
+	}
+
+	if (!IsLoopThread(pLoop))
+	{
+		__atomic_store_n(&pSocket->bWritableWanted, 1, __ATOMIC_RELEASE);
+		return 0;
+	}
+
+	if (pSocket->bWritableArmed || pSocket->bClosePending)
+		return 0;
+
+	return QueueUringWritable(pLoop, pSocket);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// QueueUringClose - Internal function, called by DestroySocket, that closes a
+// client socket of an io_uring event loop through the loop's io_uring rather
+// than with a system call of its own, and empties the socket's slot in the
+// fixed file table.  Returns nonzero if the close was queued, or zero if the
+// caller has to close the descriptor itself.
+
+static int QueueUringClose(PSOCKET pSocket)
+{
+	static const int nNoFile = -1;
+	PSERVERLOOP pLoop = pSocket->pServerLoop;
+	struct io_uring_sqe* pSqe = NULL;
+
+	if (NULL == pLoop || NULL == pLoop->pUring || pSocket == pLoop->pServer)
+		return 0;
+
+	// The fixed file table holds a reference of its own to the connection,
+	// which would keep it open after the descriptor is closed.  The slot is
+	// only reused once the kernel has let go of it.
+	if (pSocket->nFixedFile >= 0)
+	{
+		pSqe = UringGetSqe(pLoop->pUring);
+		if (NULL != pSqe)
+		{
+			pSqe->opcode = IORING_OP_FILES_UPDATE;
+			pSqe->fd = -1;
+			pSqe->addr = (uintptr_t)&nNoFile;
+			pSqe->len = 1;
+			pSqe->off = (unsigned int)pSocket->nFixedFile;
+			pSqe->user_data = ((uint64_t)pSocket->nFixedFile << URING_OP_SHIFT)
+					| URING_OP_FILES_CLEAR;
+			pLoop->nUringInFlight++;
+		}
+		else if (0 == UringUpdateFile(pLoop->pUring, (unsigned int)pSocket->nFixedFile, -1))
+		{
+			pLoop->pFreeFixed[pLoop->nFreeFixed++] = pSocket->nFixedFile;
+		}
+
+		pSocket->nFixedFile = -1;
+	}
+
+	pSqe = UringGetSqe(pLoop->pUring);
+	if (NULL == pSqe)
+		return 0;
+
+	pSqe->opcode = IORING_OP_CLOSE;
+	pSqe->fd = pSocket->nSocketDescriptor;
+	pSqe->user_data = URING_OP_CLOSE;
+
+	pLoop->nUringInFlight++;
+
+	return 1;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// AcceptUringClient - Internal function that takes on a connection the
+// io_uring event loop's multishot accept produced: wraps it in a new HSOCKET,
+// fires the ACCEPTED callback on the server socket with the new handle as
+// the state bag, installs the connection in the fixed file table if there is
+// room, and starts receiving on it.
+
+static void AcceptUringClient(PSERVERLOOP pLoop, int nClientFd)
+{
+	PSOCKET pServer = pLoop->pServer;
+	PSOCKET pClient = NewSocket(nClientFd, SOCKET_TYPE_CLIENT,
+			pServer->lpfnCallback, SOCKET_STATE_READY);
+	if (NULL == pClient)
+	{
+		close(nClientFd);
+		return;
+	}
+
+	InheritSettings(pClient, pServer);
+	ApplySocketTuning(pClient, NULL, TUNING_STAGE_ACCEPTED);
+	pClient->pServerLoop = pLoop;
+
+	pClient->pNext = pLoop->pClients;
+	if (NULL != pLoop->pClients)
+		pLoop->pClients->pPrev = pClient;
+	pLoop->pClients = pClient;
+
+	StartSocketTimer(pLoop, pClient);
+
+	ChangeSocketState(pServer, SOCKET_STATE_ACCEPTED, pClient->hSelf);
+
+	if (pClient->bClosePending)
+		return;		/* the callback turned it away */
+
+	// The receive ring has to exist before the receive is linked to the
+	// fixed file update below, lest the link attach to some other request.
+	if (NULL == pClient->pRecvRing
+			&& ResizeRecvRing(pClient, RECV_BUFFER_SIZE) < 0)
+	{
+		CloseSocket(pClient->hSelf);
+		return;
+	}
+
+	if (pLoop->nFreeFixed > 0)
+	{
+		struct io_uring_sqe* pSqe = UringGetSqe(pLoop->pUring);
+		if (NULL != pSqe)
+		{
+			pClient->nFixedFile = pLoop->pFreeFixed[--pLoop->nFreeFixed];
+
+			// The receive that follows only starts once the update is done.
+			pSqe->opcode = IORING_OP_FILES_UPDATE;
+			pSqe->fd = -1;
+			pSqe->addr = (uintptr_t)&pClient->nSocketDescriptor;
+			pSqe->len = 1;
+			pSqe->off = (unsigned int)pClient->nFixedFile;
+			pSqe->flags = IOSQE_IO_LINK;
+			pSqe->user_data = (uintptr_t)pClient | URING_OP_FILES_UPDATE;
+
+			pClient->nUringInFlight++;
+			pLoop->nUringInFlight++;
+		}
+	}
+
+	if (QueueUringRecv(pLoop, pClient) < 0
+			|| (pClient->nSendHighWatermark > 0 && !pClient->bWritableArmed
+					&& QueueUringWritable(pLoop, pClient) < 0))
+		CloseSocket(pClient->hSelf);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// CompleteUringRecv - Internal function that handles the completion of a
+// receive on one of the io_uring event loop's client sockets: fires the
+// RECEIVED callback and starts the next receive, or closes the socket if the
+// peer hung up or an error occurred.
+
+static void CompleteUringRecv(PSERVERLOOP pLoop, PSOCKET pClient, int nResult)
+{
+	int bHangUp = 0;
+
+	pClient->nUringInFlight--;
+
+	// io_uring hands back errors as negated errno values.
+	if (nResult < 0)
+		errno = -nResult;
+
+	CountRecv(pClient, nResult);
+
+	// Closed while the receive was in flight; now it can be released.
+	if (pClient->bClosePending)
+	{
+		if (0 == pClient->nUringInFlight)
+			DestroySocket(pClient);
+
+		return;
+	}
+
+	if (nResult > 0)
+	{
+		pClient->nRecvTail += (size_t)nResult;
+		RearmQuickAck(pClient);
+		bHangUp = (DispatchReceived(pClient) < 0);
+	}
+	else if (0 == nResult)
+	{
+		bHangUp = 1;	/* orderly shutdown by the peer */
+	}
+	else if (-ECANCELED != nResult && -EAGAIN != nResult && -EINTR != nResult)
+	{
+		// ECANCELED means the fixed file update this receive was linked
+		// to failed; the socket just carries on with its descriptor.
+		bHangUp = 1;
+	}
+
+	if (bHangUp)
+	{
+		CloseSocket(pClient->hSelf);
+		return;
+	}
+
+	// Non-blocking send mode, turned on from another thread.
+	if (__atomic_load_n(&pClient->bWritableWanted, __ATOMIC_ACQUIRE)
+			&& !pClient->bClosePending)
+	{
+		__atomic_store_n(&pClient->bWritableWanted, 0, __ATOMIC_RELAXED);
+		if (!pClient->bWritableArmed && QueueUringWritable(pLoop, pClient) < 0)
+		{
+			CloseSocket(pClient->hSelf);
+			return;
+		}
+	}
+
+	if (!pClient->bClosePending && QueueUringRecv(pLoop, pClient) < 0)
+		CloseSocket(pClient->hSelf);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// CompleteUringWritable - Internal function that handles a completion of the
+// multishot poll that tells the io_uring event loop when one of its client
+// sockets is writable: writes out what it can of the socket's send queue,
+// and arms a new poll if the kernel dropped the old one.
+
+static void CompleteUringWritable(PSERVERLOOP pLoop, PSOCKET pClient, int nResult,
+		unsigned int nFlags)
+{
+	if (0 == (nFlags & IORING_CQE_F_MORE))
+	{
+		pLoop->nUringInFlight--;
+		pClient->nUringInFlight--;
+		pClient->bWritableArmed = 0;
+	}
+
+	// Closed while the poll was armed; now it can be released.
+	if (pClient->bClosePending)
+	{
+		if (0 == pClient->nUringInFlight)
+			DestroySocket(pClient);
+
+		return;
+	}
+
+	if (nResult > 0 && __atomic_load_n(&pClient->nSendQueued, __ATOMIC_ACQUIRE) > 0)
+	{
+		ssize_t result = 0;
+
+		pthread_mutex_lock(&pClient->sendLock);
+		result = DrainSendQueue(pClient);
+		pthread_mutex_unlock(&pClient->sendLock);
+
+		if (result < 0)
+		{
+			CloseSocket(pClient->hSelf);
+			return;
+		}
+	}
+
+	// E.g., the completion queue overflowed.
+	if (nResult > 0 && !pClient->bWritableArmed && pLoop->bRunning
+			&& QueueUringWritable(pLoop, pClient) < 0)
+		CloseSocket(pClient->hSelf);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// CompleteUringRequest - Internal function that handles one completion from
+// the io_uring event loop's io_uring.
+
+static void CompleteUringRequest(PSERVERLOOP pLoop, uint64_t nUserData, int nResult,
+		unsigned int nFlags)
+{
+	PSOCKET pSocket = (PSOCKET)(uintptr_t)(nUserData & ~(uint64_t)URING_OP_MASK);
+	PSOCKET pServer = pLoop->pServer;
+
+	switch (nUserData & URING_OP_MASK)
+	{
+		case URING_OP_ACCEPT:
+			// A multishot accept stays armed for as long as the kernel says
+			// there is MORE to come; otherwise, arm a new one.
+			if (0 == (nFlags & IORING_CQE_F_MORE))
+			{
+				pLoop->nUringInFlight--;
+				if (pLoop->bRunning
+						&& !__atomic_load_n(&pServer->bClosePending, __ATOMIC_ACQUIRE))
+					RearmUringAccept(pLoop, nResult);
+			}
+
+			if (nResult < 0)
+				break;		/* e.g., EMFILE; the connection stays in the backlog */
+
+			if (!pLoop->bRunning
+					|| __atomic_load_n(&pServer->bClosePending, __ATOMIC_ACQUIRE))
+				close(nResult);
+			else
+				AcceptUringClient(pLoop, nResult);
+
+			break;
+
+		case URING_OP_RECV:
+			pLoop->nUringInFlight--;
+			CompleteUringRecv(pLoop, pSocket, nResult);
+			break;
+
+		case URING_OP_FILES_UPDATE:
+			pLoop->nUringInFlight--;
+			pSocket->nUringInFlight--;
+
+			// No room for it after all; the linked receive is cancelled and
+			// tried again with the plain descriptor.
+			if (nResult < 0)
+			{
+				pLoop->pFreeFixed[pLoop->nFreeFixed++] = pSocket->nFixedFile;
+				pSocket->nFixedFile = -1;
+			}
+
+			if (pSocket->bClosePending && 0 == pSocket->nUringInFlight)
+				DestroySocket(pSocket);
+
+			break;
+
+		case URING_OP_WRITABLE:
+			CompleteUringWritable(pLoop, pSocket, nResult, nFlags);
+			break;
+
+		case URING_OP_FILES_CLEAR:
+			pLoop->nUringInFlight--;
+			pLoop->pFreeFixed[pLoop->nFreeFixed++] = (int)(nUserData >> URING_OP_SHIFT);
+			break;
+
+		case URING_OP_WAKE:
+			// Wakeup from the server group; the check at the top of the
+			// loop takes care of it.
+			pLoop->nUringInFlight--;
+			break;
+
+		default:	/* URING_OP_CLOSE, URING_OP_CANCEL */
+			pLoop->nUringInFlight--;
+			break;
+	}
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// ReapUringCompletions - Internal function that handles every completion the
+// io_uring event loop's io_uring has posted.
+
+static void ReapUringCompletions(PSERVERLOOP pLoop)
+{
+	struct io_uring_cqe* pCqe = NULL;
+
+	while (NULL != (pCqe = UringPeekCqe(pLoop->pUring)))
+	{
+		uint64_t nUserData = pCqe->user_data;
+		int nResult = pCqe->res;
+		unsigned int nFlags = pCqe->flags;
+
+		// Give the entry back first; handling it may queue new requests.
+		UringSeenCqe(pLoop->pUring);
+
+		CompleteUringRequest(pLoop, nUserData, nResult, nFlags);
+	}
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// RunUringLoop - Internal function that runs the event loop on io_uring
+// instead of epoll.  Accepts come from one multishot accept request, and
+// every client always has exactly one receive in flight, straight into its
+// receive ring.  All the requests queued while a batch of completions is
+// dispatched go to the kernel with the one system call that waits for the
+// next batch.  Returns when the loop would have returned on epoll, or ERROR
+// straight away, without firing any callbacks, if io_uring is not available,
+// or is too old for the requests the loop makes.
+
+static int RunUringLoop(PSERVERLOOP pLoop)
+{
+	static const unsigned char requiredOps[] = {
+		IORING_OP_ACCEPT, IORING_OP_RECV, IORING_OP_POLL_ADD, IORING_OP_ASYNC_CANCEL,
+		IORING_OP_CLOSE, IORING_OP_FILES_UPDATE
+	};
+	PSOCKET pServer = pLoop->pServer;
+	unsigned int nFixedFiles = URING_FIXED_FILES;
+	struct io_uring_cqe* pCqe = NULL;
+	struct rlimit limit;
+	URING uring;
+
+	if (UringInit(&uring, URING_QUEUE_DEPTH) < 0)
+		return ERROR;
+
+	// UringWait passes its timeout along with IORING_ENTER_EXT_ARG.
+	if (0 == (uring.nFeatures & IORING_FEAT_EXT_ARG)
+			|| !UringSupports(&uring, requiredOps, (int)sizeof(requiredOps)))
+	{
+		UringDestroy(&uring);
+		errno = EOPNOTSUPP;
+		return ERROR;
+	}
+
+	pLoop->pUring = &uring;
+	pLoop->nUringInFlight = 0;
+	pLoop->nAcceptRetryMs = 0;
+
+	// Fixed files are an optimization; without a table, clients are simply
+	// referred to by their descriptors.
+	if (0 == getrlimit(RLIMIT_NOFILE, &limit) && limit.rlim_cur < nFixedFiles)
+		nFixedFiles = (unsigned int)limit.rlim_cur;
+
+	pLoop->pFreeFixed = (int*)malloc(nFixedFiles * sizeof(int));
+	pLoop->nFreeFixed = 0;
+	if (NULL != pLoop->pFreeFixed
+			&& 0 == UringRegisterFiles(&uring, nFixedFiles))
+	{
+		// Hand out the low slots first.
+		for (int i = (int)nFixedFiles - 1; i >= 0; i--)
+			pLoop->pFreeFixed[pLoop->nFreeFixed++] = i;
+	}
+
+	// Multishot accept (Linux 5.19), and the multishot poll that came before
+	// it, have no feature flag or probe bit of their own.  A kernel that does
+	// not know the flag fails the accept with EINVAL as it is submitted, so
+	// submit it on its own and look.  A connection that is accepted right
+	// away is left for the loop to pick up.
+	if (QueueUringAccept(pLoop) < 0
+			|| UringSubmit(&uring, 0) < 0
+			|| (NULL != (pCqe = UringPeekCqe(&uring))
+				&& ((uintptr_t)pServer | URING_OP_ACCEPT) == pCqe->user_data
+				&& -EINVAL == pCqe->res)
+			|| (pLoop->nWakeFd >= 0 && QueueUringWake(pLoop) < 0))
+	{
+		free_buffer((void**)&pLoop->pFreeFixed);
+		UringDestroy(&uring);
+		pLoop->pUring = NULL;
+		pLoop->nUringInFlight = 0;
+		errno = EOPNOTSUPP;
+		return ERROR;
+	}
+
+	__atomic_store_n(&pServer->pServerLoop, pLoop, __ATOMIC_RELEASE);
+	pLoop->bRunning = 1;
+
+	ChangeSocketState(pServer, SOCKET_STATE_LISTENING, NULL);
+
+	while (pLoop->bRunning && !__atomic_load_n(&pServer->bClosePending, __ATOMIC_ACQUIRE))
+	{
+		if (NULL != pLoop->pGroup
+				&& __atomic_load_n(&pLoop->pGroup->bStopping, __ATOMIC_ACQUIRE))
+			break;
+
+		unsigned long long nNowMs = GetCoarseTimeMs();
+		int nTimeoutMs = TimerWheelTimeout(&pLoop->timers, nNowMs);
+
+		// Accepting again after running short of descriptors or memory.
+		if (0 != pLoop->nAcceptRetryMs)
+		{
+			if (nNowMs >= pLoop->nAcceptRetryMs)
+			{
+				pLoop->nAcceptRetryMs = 0;
+				RearmUringAccept(pLoop, 0);
+			}
+			else if (nTimeoutMs < 0 || (unsigned long long)nTimeoutMs
+					> pLoop->nAcceptRetryMs - nNowMs)
+			{
+				nTimeoutMs = (int)(pLoop->nAcceptRetryMs - nNowMs);
+			}
+		}
+
+		// EBUSY/EAGAIN mean the completion queue needs draining before the
+		// kernel takes more, which is what comes next anyway; ETIME, that
+		// it is time to look at the timer wheel.
+		if (UringWait(&uring, nTimeoutMs) < 0
+				&& EINTR != errno && EBUSY != errno && EAGAIN != errno && ETIME != errno)
+		{
+			ChangeSocketState(pServer, SOCKET_STATE_ERROR, NULL);
+			break;
+		}
+
+		pLoop->bInDispatch = 1;
+
+		ReapUringCompletions(pLoop);
+
+		ExpireSocketTimers(pLoop);
+
+		FlushPendingSockets(pLoop);
+
+		pLoop->bInDispatch = 0;
+
+		ClosePendingSockets(pLoop);
+	}
+
+	// Shut down: stop accepting, hang up on every client that is still
+	// connected, and wait for the kernel to be done with all of them before
+	// releasing the loop's resources.
+	pLoop->bRunning = 0;
+
+	QueueUringCancel(pLoop, (uintptr_t)pServer | URING_OP_ACCEPT);
+	if (pLoop->nWakeFd >= 0)
+		QueueUringCancel(pLoop, URING_OP_WAKE);
+
+	for (PSOCKET pClient = pLoop->pClients; NULL != pClient; )
+	{
+		PSOCKET pNext = pClient->pNext;
+
+		if (pClient->nUringInFlight > 0)
+		{
+			pClient->bClosePending = 1;
+			shutdown(pClient->nSocketDescriptor, SHUT_RDWR);
+			if (pClient->bWritableArmed)
+				QueueUringCancel(pLoop, (uintptr_t)pClient | URING_OP_WRITABLE);
+		}
+		else
+		{
+			CloseSocket(pClient->hSelf);
+		}
+
+		pClient = pNext;
+	}
+
+	while (pLoop->nUringInFlight > 0)
+	{
+		if (UringSubmit(&uring, 1) < 0
+				&& EINTR != errno && EBUSY != errno && EAGAIN != errno)
+			break;
+
+		ReapUringCompletions(pLoop);
+	}
+
+	// Anything still here could not be waited for; let it go regardless.
+	while (NULL != pLoop->pClients)
+	{
+		PSOCKET pClient = pLoop->pClients;
+		pClient->nUringInFlight = 0;
+		pClient->bClosePending = 1;
+		DestroySocket(pClient);
+	}
+
+	UringSubmit(&uring, 0);
+
+	free_buffer((void**)&pLoop->pFreeFixed);
+	UringDestroy(&uring);
+	pLoop->pUring = NULL;
+
+	__atomic_store_n(&pServer->pServerLoop, NULL, __ATOMIC_RELEASE);
+
+	return 0;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// RunEpollLoop - Internal function that runs the edge-triggered epoll event
+// loop for a listening socket that ListenOnPort has already set up.  Returns
+// when CloseSocket is called on the listening socket, when the loop's server
+// group is told to stop, or when epoll fails.  On the way out, every client
+// the loop accepted is closed.
+
+static void RunEpollLoop(PSERVERLOOP pLoop)
+{
+	struct epoll_event events[MAX_EPOLL_EVENTS];
+	struct epoll_event ev;
+	PSOCKET pServer = pLoop->pServer;
+
+	pLoop->nEpollFd = epoll_create1(EPOLL_CLOEXEC);
+	if (pLoop->nEpollFd < 0)
+	{
+		ChangeSocketState(pServer, SOCKET_STATE_ERROR, NULL);
+		return;
+	}
+
+	memset(&ev, 0, sizeof(struct epoll_event));
+	ev.events = EPOLLIN | EPOLLET;
+	ev.data.ptr = pServer;
+	if (epoll_ctl(pLoop->nEpollFd, EPOLL_CTL_ADD, pServer->nSocketDescriptor, &ev) < 0)
+	{
+		close(pLoop->nEpollFd);
+		ChangeSocketState(pServer, SOCKET_STATE_ERROR, NULL);
+		return;
+	}
+
+	// Loops that belong to a server group also watch an eventfd, which the
+	// group pokes to tell them to shut down.  It is the only epoll entry
+	// whose data pointer is NULL.
+	if (pLoop->nWakeFd >= 0)
+	{
+		memset(&ev, 0, sizeof(struct epoll_event));
+		ev.events = EPOLLIN;
+		ev.data.ptr = NULL;
+		epoll_ctl(pLoop->nEpollFd, EPOLL_CTL_ADD, pLoop->nWakeFd, &ev);
+	}
+
+	__atomic_store_n(&pServer->pServerLoop, pLoop, __ATOMIC_RELEASE);
+	pLoop->bRunning = 1;
+
+	ChangeSocketState(pServer, SOCKET_STATE_LISTENING, NULL);
+
+	// A datagram socket can go on sending while it receives.
+	if (SOCKET_TYPE_DATAGRAM == pServer->sockType
+			&& SOCKET_STATE_LISTENING == __atomic_load_n(&pServer->sockState, __ATOMIC_ACQUIRE))
+		ChangeSocketState(pServer, SOCKET_STATE_READY, NULL);
+
+	while (pLoop->bRunning && !__atomic_load_n(&pServer->bClosePending, __ATOMIC_ACQUIRE))
+	{
+		if (NULL != pLoop->pGroup
+				&& __atomic_load_n(&pLoop->pGroup->bStopping, __ATOMIC_ACQUIRE))
+			break;
+
+		int nEvents = epoll_wait(pLoop->nEpollFd, events, MAX_EPOLL_EVENTS,
+				TimerWheelTimeout(&pLoop->timers, GetCoarseTimeMs()));
+		if (nEvents < 0)
+		{
+			if (EINTR == errno)
+				continue;
+
+			ChangeSocketState(pServer, SOCKET_STATE_ERROR, NULL);
+			break;
+		}
+
+		pLoop->bInDispatch = 1;
+
+		for (int i = 0; i < nEvents; i++)
+		{
+			PSOCKET pEventSocket = (PSOCKET)events[i].data.ptr;
+
+			// Wakeup from the server group; the check at the top of the
+			// loop takes care of it.
+			if (NULL == pEventSocket)
+				continue;
+
+			// Skip sockets that an earlier callback in this batch closed
+			if (__atomic_load_n(&pEventSocket->bClosePending, __ATOMIC_ACQUIRE))
+				continue;
+
+			if (pEventSocket == pServer && SOCKET_TYPE_DATAGRAM == pServer->sockType)
+				DispatchDatagrams(pLoop);
+			else if (pEventSocket == pServer)
+				AcceptClients(pLoop);
+			else
+				ServiceClient(pEventSocket, events[i].events);
+		}
+
+		ExpireSocketTimers(pLoop);
+
+		FlushPendingSockets(pLoop);
+
+		pLoop->bInDispatch = 0;
+
+		ClosePendingSockets(pLoop);
+	}
+
+	// Shut down: hang up on every client that is still connected, then
+	// release the loop's resources.
+	while (NULL != pLoop->pClients)
+		CloseSocket(pLoop->pClients->hSelf);
+
+	close(pLoop->nEpollFd);
+
+	__atomic_store_n(&pServer->pServerLoop, NULL, __ATOMIC_RELEASE);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// RunServerLoop - Internal function that runs the event loop for a listening
+// socket on the calling thread: RunUringLoop for server sockets that asked
+// for the io_uring backend, if io_uring is available, and RunEpollLoop
+// otherwise.  The loop holds a reference to the listening socket while it
+// runs, so that CloseSocket, from a callback or from any other thread, only
+// marks the socket and wakes the loop up; the socket is finished off here,
+// once the loop is done with it.
+
+static void RunServerLoop(PSERVERLOOP pLoop)
+{
+	PSOCKET pServer = pLoop->pServer;
+
+	__atomic_add_fetch(&pServer->nRefs, 1, __ATOMIC_ACQ_REL);
+
+	t_pCurrentLoop = pLoop;
+
+	TimerWheelInit(&pLoop->timers, GetCoarseTimeMs());
+
+	// Fall back on epoll where io_uring is not available (old kernels,
+	// seccomp filters, io_uring_disabled, ...).  The io_uring loop only
+	// knows how to accept connections, so datagram sockets always use epoll;
+	// and its receives drop control messages, so descriptor passing does too.
+	// A Unix-domain listener that has been shut down goes on failing accepts
+	// with EAGAIN rather than EINVAL, so an io_uring loop would never hear
+	// that CloseSocket was called on it; those use epoll as well.
+	if (SOCKET_IO_BACKEND_IO_URING != __atomic_load_n(&pServer->ioBackend, __ATOMIC_RELAXED)
+			|| SOCKET_TYPE_DATAGRAM == pServer->sockType
+			|| pServer->bPassDescriptors
+			|| NULL != pServer->pListenAddr
+			|| 0 != RunUringLoop(pLoop))
+		RunEpollLoop(pLoop);
+
+	t_pCurrentLoop = NULL;
+
+	LeaveSocket(pServer);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// RunServer - Runs a server on the specified port, using the specified server
+// socket for listening for incoming connections.  A callback provided by the
+// caller is called for each change in the server socket's state.  Run the
+// listen/accept/respond loop for a server socket and fires the calllback as
+// needed.  The socket handle passed should already have been opened by a call
+// to OpenSocket.  If the socket was given a Unix-domain address with
+// SetServerAddress, it listens there, and the port is ignored.
+
+void RunServer(HSOCKET hSocket, int nPort)
+{
+	PSOCKET pSocket = LookupSocket(hSocket);
+	SERVERLOOP loop;
+
+	if (NULL == pSocket)
+		return;
+
+	if (NULL == pSocket->lpfnCallback)
+		return;
+
+	// Only Server sockets can listen for incoming connections; datagram
+	// sockets receive on the port instead.
+	if (!IsServerSocket(pSocket))
+		error("Not a server socket.");
+
+	if (ListenOnPort(pSocket, nPort, 0) < 0)
+	{
+		ChangeSocketState(pSocket, SOCKET_STATE_ERROR, NULL);
+		return;
+	}
+
+	memset(&loop, 0, sizeof(SERVERLOOP));
+	loop.pServer = pSocket;
+	loop.hServer = hSocket;
+	loop.nWakeFd = -1;
+
+	// If the loop stops because CloseSocket was called on the server socket,
+	// the socket is closed on the way out of the loop.
+	RunServerLoop(&loop);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// ServerWorkerThread - Internal thread procedure for one of RunServerEx's
+// workers.  Pins the thread to its core and runs the worker's event loop.
+// When the loop ends for any reason, the rest of the group is told to stop
+// too, so that closing any one listener shuts down the whole server.
+
+static void* ServerWorkerThread(void* pArg)
+{
+	PSERVERLOOP pLoop = (PSERVERLOOP)pArg;
+	PSERVERGROUP pGroup = pLoop->pGroup;
+	cpu_set_t cpuSet;
+
+	CPU_ZERO(&cpuSet);
+	CPU_SET(pLoop->nCpu, &cpuSet);
+
+	// Pinning is an optimization; the worker runs fine unpinned.
+	pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t), &cpuSet);
+
+	RunServerLoop(pLoop);
+
+	__atomic_store_n(&pGroup->bStopping, 1, __ATOMIC_RELEASE);
+
+	for (int i = 0; i < pGroup->nWorkers; i++)
+	{
+		uint64_t nWake = 1;
+		if (write(pGroup->pLoops[i].nWakeFd, &nWake, sizeof(uint64_t)) < 0)
+			continue;	/* counter saturated; the loop is already awake */
+	}
+
+	return NULL;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// RunServerEx - Runs a server on the specified port with one listening socket
+// and one event loop per worker thread.  Every listener is bound to the same
+// port with SO_REUSEPORT, so the kernel spreads incoming connections across
+// the workers and each accepted client stays on the worker that accepted it
+// for its whole lifetime.  Workers share nothing on the hot path.  The first
+// worker listens on the socket passed in; the library opens the others.  A
+// Unix-domain address cannot be shared that way, so with one (see
+// SetServerAddress), the other workers listen on duplicates of the first
+// worker's descriptor, and all of them accept off the same queue.
+
+void RunServerEx(HSOCKET hSocket, int nPort, int nThreads)
+{
+	PSOCKET pSocket = LookupSocket(hSocket);
+	SERVERGROUP group;
+	long nCpus = sysconf(_SC_NPROCESSORS_ONLN);
+	int nStarted = 0;
+
+	if (NULL == pSocket)
+		return;
+
+	if (NULL == pSocket->lpfnCallback)
+		return;
+
+	// Only Server sockets can listen for incoming connections; datagram
+	// sockets receive on the port instead.
+	if (!IsServerSocket(pSocket))
+		error("Not a server socket.");
+
+	if (nThreads <= 0)
+		nThreads = nCpus > 0 ? (int)nCpus : 1;
+
+	if (1 == nThreads)
+	{
+		RunServer(hSocket, nPort);
+		return;
+	}
+
+	if (nCpus <= 0)
+		nCpus = 1;
+
+	memset(&group, 0, sizeof(SERVERGROUP));
+	group.pLoops = (PSERVERLOOP)calloc(nThreads, sizeof(SERVERLOOP));
+	group.pThreads = (pthread_t*)calloc(nThreads, sizeof(pthread_t));
+	if (NULL == group.pLoops || NULL == group.pThreads)
+	{
+		free_buffer((void**)&group.pLoops);
+		free_buffer((void**)&group.pThreads);
+		ChangeSocketState(pSocket, SOCKET_STATE_ERROR, NULL);
+		return;
+	}
+
+	for (int i = 0; i < nThreads; i++)
+		group.pLoops[i].nWakeFd = -1;
+
+	// Set up every listener before starting any worker, so that a failure
+	// to bind is reported to the caller instead of leaving a partial server
+	// running.
+	for (int i = 0; i < nThreads; i++)
+	{
+		PSERVERLOOP pLoop = &group.pLoops[i];
+		PSOCKET pListener = pSocket;
+
+		if (i > 0)
+		{
+			int nListenerFd = (NULL != pSocket->pListenAddr)
+					? fcntl(pSocket->nSocketDescriptor, F_DUPFD_CLOEXEC, 0)
+					: socket(AF_INET, ((SOCKET_TYPE_DATAGRAM == pSocket->sockType)
+							? SOCK_DGRAM : SOCK_STREAM) | SOCK_CLOEXEC, 0);
+			if (nListenerFd < 0)
+				break;
+
+			pListener = NewSocket(nListenerFd, pSocket->sockType,
+					pSocket->lpfnCallback, SOCKET_STATE_OPENED);
+			if (NULL == pListener)
+			{
+				close(nListenerFd);
+				break;
+			}
+
+			InheritSettings(pListener, pSocket);
+			ApplySocketTuning(pListener, NULL, TUNING_STAGE_OPEN);
+			pListener->ioBackend = __atomic_load_n(&pSocket->ioBackend, __ATOMIC_RELAXED);
+		}
+
+		pLoop->pServer = pListener;
+		pLoop->hServer = pListener->hSelf;
+		pLoop->pGroup = &group;
+		pLoop->nCpu = (int)(i % nCpus);
+
+		// A duplicate is listening already, along with the original.
+		if ((0 == i || NULL == pSocket->pListenAddr)
+				&& ListenOnPort(pListener, nPort, 1) < 0)
+			break;
+
+		pLoop->nWakeFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+		if (pLoop->nWakeFd < 0)
+			break;
+
+		group.nWorkers++;
+	}
+
+	if (group.nWorkers == nThreads)
+	{
+		for (nStarted = 0; nStarted < nThreads; nStarted++)
+			if (0 != pthread_create(&group.pThreads[nStarted], NULL,
+					ServerWorkerThread, &group.pLoops[nStarted]))
+				break;
+
+		// If some worker could not be started, stop the ones that were.
+		if (nStarted < nThreads)
+		{
+			__atomic_store_n(&group.bStopping, 1, __ATOMIC_RELEASE);
+			for (int i = 0; i < nStarted; i++)
+			{
+				uint64_t nWake = 1;
+				if (write(group.pLoops[i].nWakeFd, &nWake, sizeof(uint64_t)) < 0)
+					continue;
+			}
+		}
+
+		for (int i = 0; i < nStarted; i++)
+			pthread_join(group.pThreads[i], NULL);
+	}
+
+	if (nStarted < nThreads)
+		SetSocketState(hSocket, SOCKET_STATE_ERROR);
+
+	// Release the listeners the library opened, and the wakeup descriptors.
+	for (int i = 0; i < nThreads; i++)
+	{
+		PSERVERLOOP pLoop = &group.pLoops[i];
+
+		if (pLoop->nWakeFd >= 0)
+			close(pLoop->nWakeFd);
+
+		// The listener may have been closed already, from a callback;
+		// then the handle is stale, and this does nothing.
+		if (i > 0 && NULL != pLoop->pServer)
+			CloseSocket(pLoop->hServer);
+	}
+
+	free_buffer((void**)&group.pLoops);
+	free_buffer((void**)&group.pThreads);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// WaitForSocket - Internal function that blocks until the socket is ready for
+// the specified poll() events (e.g., POLLOUT when a non-blocking socket's send
+// buffer was full), for no longer than the socket's write timeout (POLLOUT)
+// or read timeout (POLLIN), if it has one.  Never waits on the thread of
+// the socket's own event loop, which would hold up every other socket of the
+// loop, perhaps for good; there, it fails with EAGAIN right away.  Returns
+// zero when the socket is ready, or ERROR with errno set (ETIMEDOUT if the
+// time ran out).
+
+static int WaitForSocket(PSOCKET pSocket, short nEvents)
+{
+	struct pollfd pfd;
+	PSERVERLOOP pLoop = __atomic_load_n(&pSocket->pServerLoop, __ATOMIC_ACQUIRE);
+	int nTimeoutMs = __atomic_load_n((nEvents & POLLOUT) ? &pSocket->nWriteTimeoutMs
+			: &pSocket->nReadTimeoutMs, __ATOMIC_RELAXED);
+	int result = 0;
+
+	if (NULL != pLoop && IsLoopThread(pLoop))
+	{
+		errno = EAGAIN;
+		return ERROR;
+	}
+
+	pfd.fd = pSocket->nSocketDescriptor;
+	pfd.events = nEvents;
+	pfd.revents = 0;
+
+	while ((result = poll(&pfd, 1, (nTimeoutMs > 0) ? nTimeoutMs : -1)) < 0)
+	{
+		if (EINTR != errno)
+			return ERROR;
+	}
+
+	if (0 == result)
+	{
+		errno = ETIMEDOUT;
+		return ERROR;
+	}
+
+	return 0;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// WriteAll - Internal function that writes every byte described by the array
+// of buffers to the socket, looping over partial writes.  If the socket is
+// non-blocking (as the ones RunServer accepts are), waits for it to become
+// writable whenever the kernel's send buffer is full, so that callers always
+// get all-or-nothing semantics.  In non-blocking send mode (see SetSendQueue),
+// and on the thread of the socket's own event loop, which must never wait,
+// it puts whatever the kernel will not take on the send queue instead, and
+// it never sends ahead of what is queued already.  The array is modified as
+// data is written.  nFlags is passed on to sendmsg() (e.g., MSG_MORE).
+// Returns the total number of bytes written or queued, or ERROR with errno
+// set.
+
+static int WriteAll(PSOCKET pSocket, struct iovec* pIov, int nIovCount, int nFlags)
+{
+	struct msghdr msg;
+	int nTotalSent = 0;
+	size_t nRemaining = 0;
+	PSERVERLOOP pLoop = __atomic_load_n(&pSocket->pServerLoop, __ATOMIC_ACQUIRE);
+	int bQueueMode = (pSocket->nSendHighWatermark > 0);
+	int bQueue = bQueueMode
+			|| (NULL != pLoop && !IsServerSocket(pSocket) && IsLoopThread(pLoop));
+
+	memset(&msg, 0, sizeof(struct msghdr));
+	msg.msg_iov = pIov;
+	msg.msg_iovlen = nIovCount;
+
+	for (int i = 0; i < nIovCount; i++)
+		nRemaining += pIov[i].iov_len;
+
+	// Left behind by an earlier send on the loop's thread; it goes first.
+	if (!bQueue && NULL != pSocket->pSendQueueHead && WaitForSendQueue(pSocket) < 0)
+		return ERROR;
+
+	if (bQueue && NULL != pSocket->pSendQueueHead)
+	{
+		if (WriteSendQueue(pSocket) < 0)
+			return ERROR;
+
+		if (NULL != pSocket->pSendQueueHead)
+			return (AppendSendQueue(pSocket, pIov, nIovCount) < 0) ? ERROR : (int)nRemaining;
+	}
+
+	if (bQueue)
+		nFlags |= MSG_DONTWAIT;
+
+	while (msg.msg_iovlen > 0)
+	{
+		// MSG_NOSIGNAL: a peer that hung up is reported as EPIPE instead of
+		// killing the process with SIGPIPE.
+		ssize_t nSent = sendmsg(pSocket->nSocketDescriptor, &msg, MSG_NOSIGNAL | nFlags);
+		CountSend(pSocket, nSent, nRemaining);
+		if (nSent < 0)
+		{
+			if (EINTR == errno)
+				continue;
+
+			// A socket in Fast Open mode that has not finished its handshake
+			// yet is as good as one with a full send buffer.
+			if (EINPROGRESS == errno)
+				errno = EAGAIN;
+
+			if ((EAGAIN == errno || EWOULDBLOCK == errno) && bQueue)
+			{
+				if (AppendSendQueue(pSocket, msg.msg_iov, (int)msg.msg_iovlen) < 0)
+					return ERROR;
+
+				// Outside of non-blocking send mode, the loop is not watching
+				// for the socket to become writable yet.
+				if (!bQueueMode && WatchWritable(pLoop, pSocket) < 0)
+					return ERROR;
+
+				return nTotalSent + (int)nRemaining;
+			}
+
+			if ((EAGAIN == errno || EWOULDBLOCK == errno)
+					&& WaitForSocket(pSocket, POLLOUT) >= 0)
+				continue;
+
+			return ERROR;
+		}
+
+		nTotalSent += (int)nSent;
+		nRemaining -= (size_t)nSent;
+
+		__atomic_store_n(&pSocket->nLastSendMs, GetCoarseTimeMs(), __ATOMIC_RELAXED);
+
+		// Skip the buffers that went out completely, and trim the front off
+		// of the one that only went out in part.
+		while (msg.msg_iovlen > 0
+				&& (size_t)nSent >= msg.msg_iov->iov_len)
+		{
+			nSent -= msg.msg_iov->iov_len;
+			msg.msg_iov++;
+			msg.msg_iovlen--;
+		}
+
+		if (msg.msg_iovlen > 0)
+		{
+			msg.msg_iov->iov_base = (char*)msg.msg_iov->iov_base + nSent;
+			msg.msg_iov->iov_len -= nSent;
+		}
+	}
+
+	return nTotalSent;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// FlushSendBuffer - Internal function that writes out the socket's output
+// buffer, without MSG_MORE, so that the kernel sends everything it has been
+// holding back as well.  If the buffer is empty but earlier writes went out
+// with MSG_MORE, clearing TCP_CORK (which this library never sets) pushes
+// out the partial segment the kernel kept.  Fires no callbacks.  Returns the
+// number of bytes written from the buffer, or ERROR with errno set.
+
+static int FlushSendBuffer(PSOCKET pSocket)
+{
+	struct iovec iov;
+	int result = 0;
+
+	if (0 == pSocket->nSendLength)
+	{
+		if (pSocket->bSendCorked)
+		{
+			int nOff = 0;
+			setsockopt(pSocket->nSocketDescriptor, IPPROTO_TCP, TCP_CORK, &nOff, sizeof(int));
+			pSocket->bSendCorked = 0;
+		}
+
+		return 0;
+	}
+
+	iov.iov_base = pSocket->pSendBuffer;
+	iov.iov_len = pSocket->nSendLength;
+
+	// The buffered bytes are gone either way; a failed write leaves the
+	// stream in an unknown state, and the socket in SOCKET_STATE_ERROR.
+	result = WriteAll(pSocket, &iov, 1, 0);
+
+	pSocket->nSendLength = 0;
+	pSocket->bSendCorked = 0;
+
+	return result;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// QueueFlush - Internal function that puts a socket whose output buffer has
+// data in it on its event loop's pending-flush list, if it is serviced by an
+// event loop and is not on the list already.  Only the loop's own thread may
+// do that; other threads that send on the socket have to call Flush.
+
+static void QueueFlush(PSOCKET pSocket)
+{
+	PSERVERLOOP pLoop = __atomic_load_n(&pSocket->pServerLoop, __ATOMIC_ACQUIRE);
+
+	if (NULL == pLoop || !IsLoopThread(pLoop) || pSocket->bFlushQueued
+			|| pSocket == pLoop->pServer)
+		return;
+
+	pSocket->pNextFlush = pLoop->pPendingFlush;
+	pLoop->pPendingFlush = pSocket;
+	pSocket->bFlushQueued = 1;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// AppendSendBuffer - Internal function that copies the contents of several
+// buffers onto the end of the socket's output buffer, which the caller has
+// made sure they fit in.  The output buffer is allocated, at its full
+// threshold size, the first time it is needed.  Returns the number of bytes
+// copied, or ERROR with errno set.
+
+static int AppendSendBuffer(PSOCKET pSocket, const struct iovec* pIov, int nIovCount)
+{
+	size_t nAppended = 0;
+
+	if (NULL == pSocket->pSendBuffer)
+	{
+		pSocket->pSendBuffer = (char*)malloc(pSocket->nSendThreshold);
+		if (NULL == pSocket->pSendBuffer)
+			return ERROR;
+	}
+
+	for (int i = 0; i < nIovCount; i++)
+	{
+		memcpy(pSocket->pSendBuffer + pSocket->nSendLength, pIov[i].iov_base,
+				pIov[i].iov_len);
+		pSocket->nSendLength += pIov[i].iov_len;
+		nAppended += pIov[i].iov_len;
+	}
+
+	QueueFlush(pSocket);
+
+	return (int)nAppended;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// NotifySendQueue - Internal function that fires the WRITE_HIGH_WATERMARK
+// callback when the socket's send queue has just reached its high watermark,
+// or the WRITE_DRAINED callback when it has fallen back to its low watermark
+// after that, with the number of bytes queued as the state bag.  Afterwards,
+// the socket goes back to the state it was in, unless the callback moved it
+// on.  The caller holds the send lock.
+
+static void NotifySendQueue(PSOCKET pSocket)
+{
+	size_t nQueued = __atomic_load_n(&pSocket->nSendQueued, __ATOMIC_ACQUIRE);
+	SOCKET_STATE event = SOCKET_STATE_UNKNOWN;
+	SOCKET_STATE oldState = SOCKET_STATE_UNKNOWN;
+
+	if (!pSocket->bSendQueueHigh && pSocket->nSendHighWatermark > 0
+			&& nQueued >= pSocket->nSendHighWatermark)
+		event = SOCKET_STATE_WRITE_HIGH_WATERMARK;
+	else if (pSocket->bSendQueueHigh && nQueued <= pSocket->nSendLowWatermark)
+		event = SOCKET_STATE_WRITE_DRAINED;
+	else
+		return;
+
+	pSocket->bSendQueueHigh = (SOCKET_STATE_WRITE_HIGH_WATERMARK == event);
+
+	oldState = __atomic_load_n(&pSocket->sockState, __ATOMIC_ACQUIRE);
+	if (ChangeSocketStateCopy(pSocket, event, &nQueued, sizeof(size_t), 0))
+	{
+		SOCKET_STATE expected = event;
+
+		if (__atomic_compare_exchange_n(&pSocket->sockState, &expected, oldState,
+				0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+			CountStateChange(pSocket, oldState);
+	}
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// DrainSendQueue - Internal function that writes out as much of the socket's
+// send queue as the kernel will take without blocking, and fires the
+// WRITE_DRAINED callback if that brought the queue down far enough.  The
+// caller holds the send lock.  Returns the number of bytes written, or ERROR
+// with errno set, in which case the socket is in SOCKET_STATE_ERROR.
+
+static ssize_t DrainSendQueue(PSOCKET pSocket)
+{
+	ssize_t result = 0;
+
+	if (NULL == pSocket->pSendQueueHead)
+		return 0;
+
+	result = WriteSendQueue(pSocket);
+	if (result < 0)
+	{
+		ChangeSocketState(pSocket, SOCKET_STATE_ERROR, NULL);
+		return ERROR;
+	}
+
+	NotifySendQueue(pSocket);
+
+	return result;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// WaitForSendQueue - Internal function that writes out all of the socket's
+// send queue, waiting for the socket to become writable as often as it takes
+// (but no longer than the write timeout each time), for the senders that have
+// to go through the kernel themselves.  The caller holds the send lock.
+// Returns zero on success, or ERROR with errno set, in which case the socket
+// is in SOCKET_STATE_ERROR, unless it is EAGAIN (the caller is on the
+// socket's event loop thread, which does not wait; see WaitForSocket).
+
+static int WaitForSendQueue(PSOCKET pSocket)
+{
+	while (NULL != pSocket->pSendQueueHead)
+	{
+		ssize_t nWritten = DrainSendQueue(pSocket);
+		if (nWritten < 0)
+			return ERROR;
+
+		if (0 == nWritten && WaitForSocket(pSocket, POLLOUT) < 0)
+		{
+			if (EAGAIN != errno)
+				ChangeSocketState(pSocket, SOCKET_STATE_ERROR, NULL);
+			return ERROR;
+		}
+	}
+
+	return 0;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Flush - Writes out the output buffer of a socket in buffered send mode,
+// and as much of the send queue of one in non-blocking send mode as the
+// kernel will take.
+
+int Flush(HSOCKET hSocket)
+{
+	PSOCKET pSocket = NULL;
+	int result = 0;
+
+	if (INVALID_HANDLE_VALUE == hSocket)
+	{
+		errno = EBADF;
+		return ERROR;
+	}
+
+	pSocket = EnterSocket(hSocket);
+	if (NULL == pSocket)
+		return ERROR;
+
+	pthread_mutex_lock(&pSocket->sendLock);
+
+	result = FlushSendBuffer(pSocket);
+	if (result < 0)
+		ChangeSocketState(pSocket, SOCKET_STATE_ERROR, NULL);
+	else if (DrainSendQueue(pSocket) < 0)
+		result = ERROR;
+
+	pthread_mutex_unlock(&pSocket->sendLock);
+
+	LeaveSocket(pSocket);
+
+	return result;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Send - Sends data synchronously on a connected socket.
+
+int Send(HSOCKET hSocket, const char* pszData)
+{
+	if (INVALID_HANDLE_VALUE == hSocket)
+		exit(ERROR);
+
+	if (NULL == pszData || '\0' == pszData[0])
+		return 0;	/* zero bytes sent if zero bytes requested to be sent! */
+
+	return SendBytes(hSocket, pszData, strlen(pszData));
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// SendBytes - Sends a buffer of the specified length synchronously on a
+// connected socket.  Unlike Send, the data may contain zero bytes.
+
+int SendBytes(HSOCKET hSocket, const void* pvData, size_t nLength)
+{
+	struct iovec iov;
+
+	if (INVALID_HANDLE_VALUE == hSocket)
+	{
+		errno = EBADF;
+		return ERROR;
+	}
+
+	if (NULL == pvData || 0 == nLength)
+		return 0;	/* zero bytes sent if zero bytes requested to be sent! */
+
+	iov.iov_base = (void*)pvData;
+	iov.iov_len = nLength;
+
+	return SendV(hSocket, &iov, 1);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// SendDatagrams - Sends a run of datagrams on a datagram socket, as many per
+// sendmmsg() as possible, each to its own peer.  Fires SENDING, then SENT with
+// the number of datagrams sent as the state bag.  A failure only concerns the
+// datagram that could not be sent, so it puts the socket back into the READY
+// state rather than into the ERROR state.  Returns the number of datagrams
+// sent, or ERROR with errno set.
+
+int SendDatagrams(HSOCKET hSocket, const SOCKETDATAGRAM* pDatagrams, int nCount)
+{
+	PSOCKET pSocket = NULL;
+	unsigned long long nStartNs = 0;
+	int result = 0;
+
+	if (INVALID_HANDLE_VALUE == hSocket)
+	{
+		errno = EBADF;
+		return ERROR;
+	}
+
+	if (NULL == pDatagrams || nCount <= 0)
+		return 0;	/* zero datagrams sent if zero datagrams requested to be sent! */
+
+	pSocket = EnterSocket(hSocket);
+	if (NULL == pSocket)
+	{
+		errno = EBADF;
+		return ERROR;
+	}
+
+	if (SOCKET_TYPE_DATAGRAM != pSocket->sockType)
+	{
+		LeaveSocket(pSocket);
+		errno = EINVAL;
+		return ERROR;
+	}
+
+	pthread_mutex_lock(&pSocket->sendLock);
+
+	if (SOCKET_STATE_READY != __atomic_load_n(&pSocket->sockState, __ATOMIC_ACQUIRE))
+	{
+		result = ERROR;
+	}
+	else
+	{
+		nStartNs = StatsNow();
+
+		ChangeSocketState(pSocket, SOCKET_STATE_SENDING, NULL);
+
+		result = SendDatagramBatch(pSocket, pDatagrams, nCount);
+
+		RecordLatency(LATENCY_SEND, nStartNs);
+
+		if (result >= 0)
+		{
+			ChangeSocketStateCopy(pSocket, SOCKET_STATE_SENT, &result, sizeof(int), 0);
+		}
+		else
+		{
+			int nSavedErrno = errno;
+			ChangeSocketState(pSocket, SOCKET_STATE_READY, NULL);
+			errno = nSavedErrno;
+		}
+	}
+
+	pthread_mutex_unlock(&pSocket->sendLock);
+
+	LeaveSocket(pSocket);
+
+	return result;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// SendSocketDescriptors - Internal function that does the work of
+// SendDescriptors for a socket object whose send lock the caller holds.
+
+static int SendSocketDescriptors(PSOCKET pSocket, const void* pvData, size_t nLength,
+		const int* pFds, int nFds)
+{
+	struct iovec iov;
+	ssize_t nSent = 0;
+	int result = 0;
+
+	if (SOCKET_STATE_READY != __atomic_load_n(&pSocket->sockState, __ATOMIC_ACQUIRE))
+		return ERROR;
+
+	// The descriptors go with the first byte; nothing that was sent before
+	// may land after it.
+	if (FlushSendBuffer(pSocket) < 0)
+	{
+		ChangeSocketState(pSocket, SOCKET_STATE_ERROR, NULL);
+		return ERROR;
+	}
+
+	if (WaitForSendQueue(pSocket) < 0)
+		return ERROR;
+
+	ChangeSocketState(pSocket, SOCKET_STATE_SENDING, NULL);
+
+	while ((nSent = SendWithDescriptors(pSocket, pvData, nLength, pFds, nFds)) < 0)
+	{
+		if ((EAGAIN != errno && EWOULDBLOCK != errno)
+				|| WaitForSocket(pSocket, POLLOUT) < 0)
+		{
+			// EAGAIN here means the caller is on the socket's event loop
+			// thread; nothing has gone out, so it may try again later.
+			ChangeSocketState(pSocket, (EAGAIN == errno) ? SOCKET_STATE_READY
+					: SOCKET_STATE_ERROR, NULL);
+			return ERROR;
+		}
+	}
+
+	__atomic_store_n(&pSocket->nLastSendMs, GetCoarseTimeMs(), __ATOMIC_RELAXED);
+
+	// The descriptors are on their way; the rest of the data, if the kernel
+	// did not take it all, goes like any other.
+	if ((size_t)nSent < nLength)
+	{
+		iov.iov_base = (char*)pvData + nSent;
+		iov.iov_len = nLength - (size_t)nSent;
+
+		if (WriteAll(pSocket, &iov, 1, 0) < 0)
+		{
+			ChangeSocketState(pSocket, SOCKET_STATE_ERROR, NULL);
+			return ERROR;
+		}
+	}
+
+	result = (int)nLength;
+
+	ChangeSocketStateCopy(pSocket, SOCKET_STATE_SENT, &result, sizeof(int), 0);
+
+	return result;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// SendDescriptors - Sends data on a Unix-domain socket with open file
+// descriptors attached, which the peer gets duplicates of, as if it had
+// opened them itself.  The descriptors stay open here; closing them is up to
+// the caller.  Fires SENDING, then SENT with the number of bytes sent as the
+// state bag.  Returns the number of bytes sent, or ERROR with errno set.
+
+int SendDescriptors(HSOCKET hSocket, const void* pvData, size_t nLength,
+		const int* pFds, int nFds)
+{
+	PSOCKET pSocket = NULL;
+	int result = 0;
+
+	if (INVALID_HANDLE_VALUE == hSocket)
+	{
+		errno = EBADF;
+		return ERROR;
+	}
+
+	// Descriptors cannot travel on their own; they need at least one byte
+	// to ride along with.
+	if (NULL == pvData || 0 == nLength || nLength > INT_MAX
+			|| NULL == pFds || nFds <= 0 || nFds > UNIX_PASSED_FDS_MAX)
+	{
+		errno = EINVAL;
+		return ERROR;
+	}
+
+	pSocket = EnterSocket(hSocket);
+	if (NULL == pSocket)
+	{
+		errno = EBADF;
+		return ERROR;
+	}
+
+	pthread_mutex_lock(&pSocket->sendLock);
+	result = SendSocketDescriptors(pSocket, pvData, nLength, pFds, nFds);
+	pthread_mutex_unlock(&pSocket->sendLock);
+
+	LeaveSocket(pSocket);
+
+	return result;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// SendSocketFile - Internal function that does the work of SendFile for a
+// socket object whose send lock the caller holds.
+
+static ssize_t SendSocketFile(PSOCKET pSocket, int nFileDescriptor, off_t nOffset,
+		size_t nCount)
+{
+	SOCKETFILEPROGRESS progress;
+	sigset_t sigPipe;
+	sigset_t oldMask;
+	int bPeerGone = 0;
+
+	if (nFileDescriptor < 0 || nOffset < 0)
+	{
+		errno = EBADF;
+		return ERROR;
+	}
+
+	// A count of zero means "from the offset to the end of the file".
+	if (0 == nCount)
+	{
+		struct stat fileInfo;
+		if (fstat(nFileDescriptor, &fileInfo) < 0)
+			return ERROR;
+
+		if (fileInfo.st_size <= nOffset)
+			return 0;
+
+		nCount = (size_t)(fileInfo.st_size - nOffset);
+	}
+
+	if (SOCKET_STATE_READY != __atomic_load_n(&pSocket->sockState, __ATOMIC_ACQUIRE))
+		return ERROR;
+
+	// Whatever has been buffered or queued (e.g., a header) goes out ahead
+	// of the file.
+	if (FlushSendBuffer(pSocket) < 0)
+	{
+		ChangeSocketState(pSocket, SOCKET_STATE_ERROR, NULL);
+		return ERROR;
+	}
+
+	if (WaitForSendQueue(pSocket) < 0)
+		return ERROR;
+
+	memset(&progress, 0, sizeof(SOCKETFILEPROGRESS));
+	progress.nBytesTotal = nCount;
+
+	// sendfile() has no MSG_NOSIGNAL; hold off SIGPIPE for the duration so
+	// that a peer that hangs up is reported as EPIPE like it is by Send.
+	sigemptyset(&sigPipe);
+	sigaddset(&sigPipe, SIGPIPE);
+	pthread_sigmask(SIG_BLOCK, &sigPipe, &oldMask);
+
+	while (progress.nBytesTransferred < nCount)
+	{
+		size_t nChunk = nCount - progress.nBytesTransferred;
+		if (nChunk > FILE_TRANSFER_CHUNK_SIZE)
+			nChunk = FILE_TRANSFER_CHUNK_SIZE;
+
+		// sendfile() advances nOffset for us and leaves the file position alone.
+		ssize_t nSent = sendfile(pSocket->nSocketDescriptor, nFileDescriptor,
+				&nOffset, nChunk);
+		CountSend(pSocket, nSent, nChunk);
+		if (nSent < 0)
+		{
+			if (EINTR == errno)
+				continue;
+
+			if ((EAGAIN == errno || EWOULDBLOCK == errno)
+					&& WaitForSocket(pSocket, POLLOUT) >= 0)
+				continue;
+
+			bPeerGone = (EPIPE == errno);
+			break;
+		}
+
+		if (0 == nSent)
+			break;		/* the file is shorter than promised */
+
+		progress.nBytesTransferred += (size_t)nSent;
+
+		__atomic_store_n(&pSocket->nLastSendMs, GetCoarseTimeMs(), __ATOMIC_RELAXED);
+
+		ChangeSocketStateCopy(pSocket, SOCKET_STATE_SENDING, &progress,
+				sizeof(SOCKETFILEPROGRESS), 0);
+	}
+
+	if (bPeerGone)
+	{
+		// Swallow the SIGPIPE the failed sendfile() raised, keeping errno.
+		struct timespec noWait = { 0, 0 };
+		int nSavedErrno = errno;
+		sigtimedwait(&sigPipe, NULL, &noWait);
+		errno = nSavedErrno;
+	}
+
+	pthread_sigmask(SIG_SETMASK, &oldMask, NULL);
+
+	if (progress.nBytesTransferred < nCount)
+	{
+		ChangeSocketState(pSocket, SOCKET_STATE_ERROR, NULL);
+		return ERROR;
+	}
+
+	ChangeSocketStateCopy(pSocket, SOCKET_STATE_SENT, &progress,
+			sizeof(SOCKETFILEPROGRESS), 0);
+
+	return (ssize_t)progress.nBytesTransferred;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// SendFile - Sends part or all of a file on a connected socket with
+// sendfile(), so that the file's contents go from the page cache to the
+// socket without ever being copied into user memory.  Fires SENDING on the
+// socket after each chunk and SENT at the end, with a SOCKETFILEPROGRESS
+// as the state bag both times.
+
+ssize_t SendFile(HSOCKET hSocket, int nFileDescriptor, off_t nOffset, size_t nCount)
+{
+	PSOCKET pSocket = NULL;
+	ssize_t result = 0;
+
+	if (INVALID_HANDLE_VALUE == hSocket)
+	{
+		errno = EBADF;
+		return ERROR;
+	}
+
+	pSocket = EnterSocket(hSocket);
+	if (NULL == pSocket)
+		return ERROR;
+
+	// Nothing else goes out on the socket until the whole file has.
+	pthread_mutex_lock(&pSocket->sendLock);
+	result = SendSocketFile(pSocket, nFileDescriptor, nOffset, nCount);
+	pthread_mutex_unlock(&pSocket->sendLock);
+
+	LeaveSocket(pSocket);
+
+	return result;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// SendTo - Sends one datagram on a datagram socket to the specified host and
+// port, resolved through the library's DNS cache.  Returns the number of
+// bytes sent, or ERROR with errno set.
+
+int SendTo(HSOCKET hSocket, const void* pvData, size_t nLength, const char* pszHostAddress,
+		int nPort)
+{
+	SOCKETDATAGRAM datagram;
+	int result = 0;
+
+	if (INVALID_HANDLE_VALUE == hSocket)
+	{
+		errno = EBADF;
+		return ERROR;
+	}
+
+	// The byte count is reported back as an int.
+	if (nLength > INT_MAX)
+	{
+		errno = EMSGSIZE;
+		return ERROR;
+	}
+
+	memset(&datagram, 0, sizeof(SOCKETDATAGRAM));
+	datagram.pData = (const char*)pvData;
+	datagram.nLength = nLength;
+
+	if (SetDatagramAddress(hSocket, &datagram, pszHostAddress, nPort) < 0)
+		return ERROR;
+
+	result = SendDatagrams(hSocket, &datagram, 1);
+	if (result <= 0)
+		return ERROR;
+
+	return (int)nLength;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// SendSocketV - Internal function that does the work of SendV for a socket
+// object whose send lock the caller holds.
+
+static int SendSocketV(PSOCKET pSocket, const struct iovec* pIov, int nIovCount)
+{
+	struct iovec iovLocal[SENDV_LOCAL_IOV_COUNT + 1];
+	struct iovec* pIovCopy = iovLocal;
+	size_t nTotal = 0;
+	int nBuffered = 0;
+	int nFlags = 0;
+	unsigned long long nStartNs = 0;
+	int result = 0;
+
+	if (NULL == pIov || nIovCount <= 0)
 		return 0;	/* zero bytes sent if zero bytes requested to be sent! */
 
-	if (SOCKET_STATE_READY != GetSocketState(hSocket))
+	if (nIovCount > IOV_MAX)
+	{
+		errno = EINVAL;
+		return ERROR;
+	}
+
+	for (int i = 0; i < nIovCount; i++)
+		nTotal += pIov[i].iov_len;
+
+	if (0 == nTotal)
+		return 0;
+
+	// The byte count is reported back as an int, both as the return value
+	// and in the SENT state bag.
+	if (nTotal > INT_MAX)
+	{
+		errno = EMSGSIZE;
+		return ERROR;
+	}
+
+	if (SOCKET_STATE_READY != __atomic_load_n(&pSocket->sockState, __ATOMIC_ACQUIRE))
+		return ERROR;
+
+	// Past the high watermark, nothing more is taken until the queue has
+	// drained down to the low one; the caller is told to try again later.
+	if (pSocket->bSendQueueHigh)
+	{
+		if (DrainSendQueue(pSocket) < 0)
+			return ERROR;
+
+		if (pSocket->bSendQueueHigh)
+		{
+			errno = EAGAIN;
+			return ERROR;
+		}
+	}
+
+	nStartNs = StatsNow();
+
+	if (pSocket->nSendThreshold > 0)
+	{
+		// Small writes just pile up in the output buffer.
+		if (pSocket->nSendLength + nTotal <= pSocket->nSendThreshold)
+		{
+			ChangeSocketState(pSocket, SOCKET_STATE_SENDING, NULL);
+
+			result = AppendSendBuffer(pSocket, pIov, nIovCount);
+
+			RecordLatency(LATENCY_SEND, nStartNs);
+
+			if (result >= 0)
+				ChangeSocketStateCopy(pSocket, SOCKET_STATE_SENT, &result, sizeof(int), 0);
+			else
+				ChangeSocketState(pSocket, SOCKET_STATE_ERROR, NULL);
+
+			return result;
+		}
+
+		// Big ones take the buffered bytes along with them.  MSG_MORE lets
+		// the kernel hold back the last, partly filled segment, on the
+		// assumption that more of the same reply is on its way before Flush.
+		if (nIovCount == IOV_MAX && pSocket->nSendLength > 0
+				&& FlushSendBuffer(pSocket) < 0)
+		{
+			ChangeSocketState(pSocket, SOCKET_STATE_ERROR, NULL);
+			return ERROR;
+		}
+
+		nBuffered = (int)pSocket->nSendLength;
+		nFlags = MSG_MORE;
+	}
+
+	// WriteAll advances through the array as the kernel accepts data, so it
+	// needs a copy it is allowed to modify.  Only the descriptors are
+	// copied, never the data they point at.  Buffered output, if any, goes
+	// in front.
+	if (nIovCount + (nBuffered > 0) > SENDV_LOCAL_IOV_COUNT + 1)
+	{
+		pIovCopy = (struct iovec*)malloc((nIovCount + 1) * sizeof(struct iovec));
+		if (NULL == pIovCopy)
+			return ERROR;
+	}
+
+	if (nBuffered > 0)
+	{
+		pIovCopy[0].iov_base = pSocket->pSendBuffer;
+		pIovCopy[0].iov_len = (size_t)nBuffered;
+	}
+
+	memcpy(pIovCopy + (nBuffered > 0), pIov, nIovCount * sizeof(struct iovec));
+
+	ChangeSocketState(pSocket, SOCKET_STATE_SENDING, NULL);
+
+	result = WriteAll(pSocket, pIovCopy, nIovCount + (nBuffered > 0), nFlags);
+
+	if (pIovCopy != iovLocal)
+		free_buffer((void**)&pIovCopy);
+
+	if (pSocket->nSendThreshold > 0)
+	{
+		pSocket->nSendLength = 0;
+		pSocket->bSendCorked = 1;
+		QueueFlush(pSocket);
+	}
+
+	RecordLatency(LATENCY_SEND, nStartNs);
+
+	// Only the caller's own bytes count as sent by this call.
+	if (result >= 0)
+		result -= nBuffered;
+
+	// Only put the socket in the SOCKET_STATE_SENT state if the send
+	// was successful; i.e., if result >= 0.  Otherwise, an error occurred,
+	// so else put the socket into the SOCKET_STATE_ERROR state.  BTW: If the
+	// send was successful, pass the number of bytes sent by the socket
+	// into the user state bag passed to the callback
+	if (result >= 0)
+	{
+		ChangeSocketStateCopy(pSocket, SOCKET_STATE_SENT, &result, sizeof(int), 0);
+
+		// Whatever did not go out may have taken the send queue past its
+		// high watermark.
+		NotifySendQueue(pSocket);
+	}
+	else
+	{
+		ChangeSocketState(pSocket, SOCKET_STATE_ERROR, NULL);
+	}
+
+	return result;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// SendV - Sends the contents of several buffers, in order, as one contiguous
+// stream of bytes on a connected socket.  The buffers go to the kernel with
+// sendmsg() directly from where they live; nothing is copied into a temporary
+// buffer first.  In buffered send mode, writes that fit are copied into the
+// socket's output buffer instead, and writes that do not go out together with
+// whatever is already in it.  Threads sending on the same socket take turns,
+// so the bytes of one call never end up in the middle of another's.
+
+int SendV(HSOCKET hSocket, const struct iovec* pIov, int nIovCount)
+{
+	PSOCKET pSocket = NULL;
+	int result = 0;
+
+	if (INVALID_HANDLE_VALUE == hSocket)
+	{
+		errno = EBADF;
 		return ERROR;
+	}
 
-	SetSocketState(hSocket, SOCKET_STATE_SENDING);
+	pSocket = EnterSocket(hSocket);
+	if (NULL == pSocket)
+		return ERROR;
 
-	// Send the data, using the SocketDemoUtils_send function
-	int result = SocketDemoUtils_send(hSocket->nSocketDescriptor, pszData);
+	pthread_mutex_lock(&pSocket->sendLock);
+	result = SendSocketV(pSocket, pIov, nIovCount);
+	pthread_mutex_unlock(&pSocket->sendLock);
 
-	/*PSOCKETSENDDATA pUserState = (PSOCKETSENDDATA)malloc(sizeof(SOCKETSENDDATA));
-	pUserState->hSocket = hSocket;
-	pUserState->nBytesSent = result;
-	pUserState->pszData = pszData;*/
+	LeaveSocket(pSocket);
 
-	// Only put the socket in the SOCKET_STATE_SENT state if the send
-	// was successful; i.e., if result > 0.  Otherwise, an error occurred,
-	// so else put the socket into the SOCKET_STATE_ERROR state.  BTW: If the
-	// send was successful, pass the number of bytes sent by the socket
-	// into the user state bag passed to the callback
-	if (result >= 0)
-		SetSocketStateEx(hSocket, SOCKET_STATE_SENT, &result);
+	return result;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// SetDatagramAddress - Fills in a datagram's destination with the first
+// address of the specified host that fits the datagram socket's address
+// family, resolved through the library's DNS cache.  Returns zero on success,
+// or ERROR with errno set.
+
+int SetDatagramAddress(HSOCKET hSocket, PSOCKETDATAGRAM pDatagram, const char* pszHostAddress,
+		int nPort)
+{
+	PSOCKET pSocket = NULL;
+	PRESOLVEDADDRESS pAddrs = NULL;
+	int nAddrs = 0;
+	int nDomain = AF_INET;
+	socklen_t nDomainLength = sizeof(int);
+	int result = ERROR;
+
+	if (NULL == pDatagram || NULL == pszHostAddress || '\0' == pszHostAddress[0]
+			|| nPort <= 0 || nPort > 65535)
+	{
+		errno = EINVAL;
+		return ERROR;
+	}
+
+	pSocket = EnterSocket(hSocket);
+	if (NULL == pSocket)
+	{
+		errno = EBADF;
+		return ERROR;
+	}
+
+	getsockopt(pSocket->nSocketDescriptor, SOL_SOCKET, SO_DOMAIN, &nDomain, &nDomainLength);
+
+	LeaveSocket(pSocket);
+
+	nAddrs = ResolveHost(pszHostAddress, nPort, &pAddrs);
+	if (nAddrs <= 0)
+		return ERROR;
+
+	errno = EAFNOSUPPORT;
+
+	for (int i = 0; i < nAddrs; i++)
+	{
+		if (nDomain != pAddrs[i].addr.ss_family)
+			continue;
+
+		memcpy(&pDatagram->addr, &pAddrs[i].addr, pAddrs[i].nAddrLength);
+		pDatagram->nAddrLength = pAddrs[i].nAddrLength;
+		result = 0;
+		break;
+	}
+
+	free_buffer((void**)&pAddrs);
+
+	return result;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// SetDatagramSegmentation - Sets the size of the datagrams that a datagram
+// socket's sends are split into by UDP GSO, and turns UDP GRO on for its
+// receives; or, with a size of zero, turns both off.  Returns zero on
+// success, or ERROR with errno set, in which case nothing has changed.
+
+int SetDatagramSegmentation(HSOCKET hSocket, size_t nSegmentSize)
+{
+	PSOCKET pSocket = NULL;
+	size_t nOldSegmentSize = 0;
+	int result = 0;
+
+	// Segment sizes travel in 16 bits.
+	if (nSegmentSize > UINT16_MAX)
+	{
+		errno = EINVAL;
+		return ERROR;
+	}
+
+	pSocket = EnterSocket(hSocket);
+	if (NULL == pSocket)
+	{
+		errno = EBADF;
+		return ERROR;
+	}
+
+	if (SOCKET_TYPE_DATAGRAM != pSocket->sockType)
+	{
+		LeaveSocket(pSocket);
+		errno = EINVAL;
+		return ERROR;
+	}
+
+	nOldSegmentSize = pSocket->nDatagramSegmentSize;
+	pSocket->nDatagramSegmentSize = nSegmentSize;
+
+	result = ApplyDatagramSegmentation(pSocket);
+	if (result < 0)
+	{
+		int nSavedErrno = errno;
+
+		pSocket->nDatagramSegmentSize = nOldSegmentSize;
+		ApplyDatagramSegmentation(pSocket);
+
+		errno = nSavedErrno;
+	}
+
+	LeaveSocket(pSocket);
+
+	return result;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// SetDefaultIoBackend - Selects the backend that the event loops of server
+// sockets opened from now on use, process-wide.
+
+void SetDefaultIoBackend(SOCKET_IO_BACKEND backend)
+{
+	if (SOCKET_IO_BACKEND_EPOLL != backend && SOCKET_IO_BACKEND_IO_URING != backend)
+		return;
+
+	__atomic_store_n(&g_defaultIoBackend, backend, __ATOMIC_RELAXED);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// SetDescriptorPassing - Turns descriptor passing mode on or off for a
+// Unix-domain socket.  In that mode, descriptors that the peer sends along
+// with its data (see SendDescriptors) are kept for ReceiveDescriptors;
+// otherwise, they are closed as the data is read.  Set on a server socket,
+// before RunServer, it applies to every client the server accepts, and the
+// server always runs on the epoll backend.  Returns zero on success, or ERROR
+// with errno set.
+
+int SetDescriptorPassing(HSOCKET hSocket, int bEnable)
+{
+	PSOCKET pSocket = EnterSocket(hSocket);
+	if (NULL == pSocket)
+	{
+		errno = EBADF;
+		return ERROR;
+	}
+
+	// Datagrams are read a batch at a time, with no room for descriptors.
+	if (SOCKET_TYPE_DATAGRAM == pSocket->sockType)
+	{
+		LeaveSocket(pSocket);
+		errno = EINVAL;
+		return ERROR;
+	}
+
+	__atomic_store_n(&pSocket->bPassDescriptors, bEnable ? 1 : 0, __ATOMIC_RELAXED);
+
+	LeaveSocket(pSocket);
+
+	return 0;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// SetReceiveBufferSize - Sets the capacity of the ring buffer that the socket
+// receives data into.  The capacity is rounded up to a multiple of the page
+// size.  Bytes that have been received but not consumed are kept.  Returns zero on success, or ERROR with errno set.
+
+int SetReceiveBufferSize(HSOCKET hSocket, size_t nBytes)
+{
+	PSOCKET pSocket = EnterSocket(hSocket);
+	int result = 0;
+
+	if (NULL == pSocket)
+	{
+		errno = EBADF;
+		return ERROR;
+	}
+
+	result = ResizeRecvRing(pSocket, nBytes);
+
+	LeaveSocket(pSocket);
+
+	return result;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// SetSendBuffering - Turns buffered send mode on (with the specified output
+// buffer size) or off (with zero) for the socket.  Whatever is buffered is
+// written out first, so that the new buffer starts out empty.  Returns zero
+// on success, or ERROR with errno set.
+
+int SetSendBuffering(HSOCKET hSocket, size_t nThreshold)
+{
+	PSOCKET pSocket = NULL;
+	int result = 0;
+
+	if (nThreshold > INT_MAX)
+	{
+		errno = EINVAL;
+		return ERROR;
+	}
+
+	pSocket = EnterSocket(hSocket);
+	if (NULL == pSocket)
+		return ERROR;
+
+	// Datagrams are sent whole, or not at all; they are never run together.
+	if (SOCKET_TYPE_DATAGRAM == pSocket->sockType)
+	{
+		LeaveSocket(pSocket);
+		errno = EINVAL;
+		return ERROR;
+	}
+
+	pthread_mutex_lock(&pSocket->sendLock);
+
+	result = FlushSendBuffer(pSocket);
+	if (result < 0)
+	{
+		ChangeSocketState(pSocket, SOCKET_STATE_ERROR, NULL);
+	}
 	else
-		SetSocketState(hSocket, SOCKET_STATE_ERROR);
+	{
+		free_buffer((void**)&pSocket->pSendBuffer);
+		pSocket->nSendThreshold = nThreshold;
+		result = 0;
+	}
+
+	pthread_mutex_unlock(&pSocket->sendLock);
+
+	LeaveSocket(pSocket);
+
+	return result;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// SetSendQueue - Turns non-blocking send mode on (with the specified
+// watermarks) or off (with a high watermark of zero) for the socket.  Turning
+// it off writes out the send queue first, waiting as long as that takes.
+// Turning it on for a client that an event loop services has the loop watch
+// for the client becoming writable: epoll can be told so from any thread,
+// while an io_uring loop is asked to see to it the next time it runs the
+// client's callback.  Returns zero on success, or ERROR with errno set.
+
+int SetSendQueue(HSOCKET hSocket, size_t nHighWatermark, size_t nLowWatermark)
+{
+	PSOCKET pSocket = NULL;
+	PSERVERLOOP pLoop = NULL;
+	int bWasQueued = 0;
+	int result = 0;
+
+	if (nHighWatermark > 0 && nLowWatermark > nHighWatermark)
+	{
+		errno = EINVAL;
+		return ERROR;
+	}
+
+	pSocket = EnterSocket(hSocket);
+	if (NULL == pSocket)
+		return ERROR;
+
+	// Datagrams are sent whole, or not at all; they are never run together.
+	if (SOCKET_TYPE_DATAGRAM == pSocket->sockType)
+	{
+		LeaveSocket(pSocket);
+		errno = EINVAL;
+		return ERROR;
+	}
+
+	pthread_mutex_lock(&pSocket->sendLock);
+
+	bWasQueued = (pSocket->nSendHighWatermark > 0);
+
+	if (0 == nHighWatermark)
+	{
+		result = WaitForSendQueue(pSocket);
+		nLowWatermark = 0;
+	}
+
+	if (result >= 0)
+	{
+		pSocket->nSendHighWatermark = nHighWatermark;
+		pSocket->nSendLowWatermark = nLowWatermark;
+
+		// The new watermarks may already have been crossed.
+		NotifySendQueue(pSocket);
+	}
+
+	pthread_mutex_unlock(&pSocket->sendLock);
+
+	pLoop = __atomic_load_n(&pSocket->pServerLoop, __ATOMIC_ACQUIRE);
+	if (result >= 0 && !bWasQueued && nHighWatermark > 0 && NULL != pLoop
+			&& SOCKET_TYPE_SERVER != pSocket->sockType
+			&& WatchWritable(pLoop, pSocket) < 0)
+		result = ERROR;
+
+	LeaveSocket(pSocket);
+
+	return result;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// SetServerAddress - Gives a server (or datagram) socket a Unix-domain
+// address, "unix:/path" or "unix:@name", to listen on instead of a port.  The
+// socket becomes a Unix-domain socket on the spot; RunServer and RunServerEx
+// bind it to the address and ignore their port.  Returns zero on success, or
+// ERROR with errno set (EINVAL if the address is not a "unix:" one, or the
+// socket is bound already).
+
+int SetServerAddress(HSOCKET hSocket, const char* pszAddress)
+{
+	PSOCKET pSocket = NULL;
+	PRESOLVEDADDRESS pAddr = NULL;
+	struct sockaddr_storage bound;
+	socklen_t nBoundLength = sizeof(struct sockaddr_storage);
+	int result = ERROR;
+	int nSavedErrno = 0;
+
+	if (!IsUnixAddress(pszAddress))
+	{
+		errno = EINVAL;
+		return ERROR;
+	}
+
+	pAddr = (PRESOLVEDADDRESS)calloc(1, sizeof(RESOLVEDADDRESS));
+	if (NULL == pAddr)
+	{
+		errno = ENOMEM;
+		return ERROR;
+	}
+
+	if (ParseUnixAddress(pszAddress, &pAddr->addr, &pAddr->nAddrLength) < 0)
+	{
+		free_buffer((void**)&pAddr);
+		return ERROR;
+	}
+
+	pSocket = EnterSocket(hSocket);
+	if (NULL == pSocket)
+	{
+		free_buffer((void**)&pAddr);
+		errno = EBADF;
+		return ERROR;
+	}
+
+	// The descriptor is about to be replaced, which must not happen under a
+	// socket that is bound, or connected, already.
+	memset(&bound, 0, sizeof(struct sockaddr_storage));
+	getsockname(pSocket->nSocketDescriptor, (struct sockaddr*)&bound, &nBoundLength);
+
+	if (!IsServerSocket(pSocket) || NULL != pSocket->pListenAddr
+			|| (AF_INET == bound.ss_family && 0 != ((struct sockaddr_in*)&bound)->sin_port))
+	{
+		errno = EINVAL;
+	}
+	else if (0 == SwitchToUnixDomain(pSocket))
+	{
+		pSocket->pListenAddr = pAddr;
+		pAddr = NULL;
+		result = 0;
+	}
+
+	nSavedErrno = errno;
 
-	/*free(pUserState);
-	pUserState = NULL;*/
+	LeaveSocket(pSocket);
+
+	free_buffer((void**)&pAddr);
+
+	errno = nSavedErrno;
 
 	return result;
 }
 
+///////////////////////////////////////////////////////////////////////////////
+// SetSocketEventMask - Changes which state transitions the specified socket's
+// callback is called for.  Does nothing if the handle is invalid, except set
+// errno to EBADF.  The mask is read by whichever thread fires a callback, so
+// it is stored atomically.
+
+void SetSocketEventMask(HSOCKET hSocket, SOCKET_EVENT_MASK dwEventMask)
+{
+	PSOCKET pSocket = EnterSocket(hSocket);
+	if (NULL == pSocket)
+		return;
+
+	__atomic_store_n(&pSocket->dwEventMask, dwEventMask, __ATOMIC_RELAXED);
+
+	LeaveSocket(pSocket);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// SetSocketFraming - Selects how the data the specified socket receives is
+// split into messages (see framing.c).  Returns zero on success, or ERROR
+// with errno set.
+
+int SetSocketFraming(HSOCKET hSocket, SOCKET_FRAMING framing, const char* pszDelimiter,
+		size_t nMaxMessageSize)
+{
+	PSOCKET pSocket = NULL;
+	size_t nDelimiterLength = 0;
+	size_t nLimit = 0;
+
+	if ((unsigned int)framing > SOCKET_FRAMING_PREFIX_VARINT)
+	{
+		errno = EINVAL;
+		return ERROR;
+	}
+
+	if (SOCKET_FRAMING_DELIMITER == framing)
+	{
+		if (NULL == pszDelimiter)
+			pszDelimiter = "\r\n";
+
+		nDelimiterLength = strlen(pszDelimiter);
+		if (0 == nDelimiterLength || nDelimiterLength > FRAME_DELIMITER_MAX_LENGTH)
+		{
+			errno = EINVAL;
+			return ERROR;
+		}
+	}
+
+	// A message has to fit in the receive ring all at once, framing and all.
+	nLimit = RECV_BUFFER_MAX_SIZE - GetFrameOverhead(framing, nDelimiterLength);
+	if (0 == nMaxMessageSize || nMaxMessageSize > nLimit)
+		nMaxMessageSize = nLimit;
+
+	pSocket = EnterSocket(hSocket);
+	if (NULL == pSocket)
+		return ERROR;
+
+	pSocket->framing = framing;
+	if (nDelimiterLength > 0)
+		memcpy(pSocket->frameDelimiter, pszDelimiter, nDelimiterLength);
+	pSocket->nFrameDelimiterLength = nDelimiterLength;
+	pSocket->nMaxMessageSize = nMaxMessageSize;
+	pSocket->nFrameScanned = 0;
+
+	LeaveSocket(pSocket);
+
+	return 0;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// SetSocketIoBackend - Selects the backend the event loop run on the specified
+// server socket uses.  Returns zero on success, or ERROR with errno set.
+
+int SetSocketIoBackend(HSOCKET hSocket, SOCKET_IO_BACKEND backend)
+{
+	PSOCKET pSocket = NULL;
+
+	if (SOCKET_IO_BACKEND_EPOLL != backend && SOCKET_IO_BACKEND_IO_URING != backend)
+	{
+		errno = EINVAL;
+		return ERROR;
+	}
+
+	pSocket = EnterSocket(hSocket);
+	if (NULL == pSocket)
+		return ERROR;
+
+	__atomic_store_n(&pSocket->ioBackend, backend, __ATOMIC_RELAXED);
+
+	LeaveSocket(pSocket);
+
+	return 0;
+}
+
 ///////////////////////////////////////////////////////////////////////////////
 // SetSocketState - Sets the state of the specified socket to the specified
 // SOCKET_STATE value.  If the socket handle has an invalid value, this function
@@ -300,28 +4556,54 @@ void SetSocketState(HSOCKET hSocket, SOCKET_STATE newState)
 
 void SetSocketStateEx(HSOCKET hSocket, SOCKET_STATE newState, void* lpUserState)
 {
-	if (INVALID_HANDLE_VALUE == hSocket)
+	PSOCKET pSocket = EnterSocket(hSocket);
+	if (NULL == pSocket)
 		return;
 
-	if (hSocket->nSocketDescriptor <= INVALID_SOCKET_DESCRIPTOR)
-		return;
+	ChangeSocketState(pSocket, newState, lpUserState);
 
-	if (SOCKET_STATE_ERROR == hSocket->sockState)
-		return;
+	LeaveSocket(pSocket);
+}
 
-	hSocket->sockState = newState;
+///////////////////////////////////////////////////////////////////////////////
+// SetSocketTimeouts - Sets the idle, read and write timeouts of the specified
+// socket.  A client's timer belongs to its event loop's thread, so from any
+// other thread, the loop is only told to look at the new timeouts; until it
+// does, the timer still goes off at the time it was set for, and the new
+// timeouts are checked then.  Returns zero on success, or ERROR.
 
-	// Fire the callback to let the user of this socket know that something
-	// neat happened.
-	if (NULL == hSocket->lpfnCallback)
-		return;
+int SetSocketTimeouts(HSOCKET hSocket, int nIdleTimeoutMs, int nReadTimeoutMs,
+		int nWriteTimeoutMs)
+{
+	PSOCKET pSocket = NULL;
+	PSERVERLOOP pLoop = NULL;
 
-	// To avoid race conditions, do not call the callback function if
-	// the socket is put into the READY state.
-	if (SOCKET_STATE_READY == newState)
-		return;
+	if (nIdleTimeoutMs < 0 || nReadTimeoutMs < 0 || nWriteTimeoutMs < 0)
+	{
+		errno = EINVAL;
+		return ERROR;
+	}
+
+	pSocket = EnterSocket(hSocket);
+	if (NULL == pSocket)
+		return ERROR;
 
-	hSocket->lpfnCallback(hSocket, lpUserState);
+	__atomic_store_n(&pSocket->nIdleTimeoutMs, nIdleTimeoutMs, __ATOMIC_RELAXED);
+	__atomic_store_n(&pSocket->nReadTimeoutMs, nReadTimeoutMs, __ATOMIC_RELAXED);
+	__atomic_store_n(&pSocket->nWriteTimeoutMs, nWriteTimeoutMs, __ATOMIC_RELAXED);
+
+	pLoop = __atomic_load_n(&pSocket->pServerLoop, __ATOMIC_ACQUIRE);
+	if (NULL != pLoop && !IsServerSocket(pSocket))
+	{
+		if (IsLoopThread(pLoop))
+			ArmSocketTimer(pLoop, pSocket, GetCoarseTimeMs());
+		else
+			__atomic_store_n(&pSocket->bTimeoutsChanged, 1, __ATOMIC_RELEASE);
+	}
+
+	LeaveSocket(pSocket);
+
+	return 0;
 }
 
 ///////////////////////////////////////////////////////////////////////////////
@@ -335,26 +4617,23 @@ void SetSocketStateEx(HSOCKET hSocket, SOCKET_STATE newState, void* lpUserState)
 
 void SetSocketType(HSOCKET hSocket, SOCKET_TYPE newType)
 {
-	if (INVALID_HANDLE_VALUE == hSocket)
-		return;
-
-	if (hSocket->nSocketDescriptor <= INVALID_SOCKET_DESCRIPTOR)
+	PSOCKET pSocket = EnterSocket(hSocket);
+	if (NULL == pSocket)
 		return;
 
-	if (SOCKET_STATE_ERROR == hSocket->sockState)
-		return;
-
-	if (SOCKET_TYPE_UNKNOWN != hSocket->sockType)
-		return;
-
-	hSocket->sockType = newType;
+	if (pSocket->nSocketDescriptor > INVALID_SOCKET_DESCRIPTOR
+			&& SOCKET_STATE_ERROR != __atomic_load_n(&pSocket->sockState, __ATOMIC_ACQUIRE)
+			&& SOCKET_TYPE_UNKNOWN == pSocket->sockType)
+	{
+		pSocket->sockType = newType;
 
-	// Fire the callback to let the user of this socket know that something
-	// neat happened.
-	if (NULL == hSocket->lpfnCallback)
-		return;
+		// Fire the callback to let the user of this socket know that something
+		// neat happened.
+		if (NULL != pSocket->lpfnCallback)
+			pSocket->lpfnCallback(pSocket->hSelf, NULL);
+	}
 
-	hSocket->lpfnCallback(hSocket, NULL);
+	LeaveSocket(pSocket);
 }
 
 ///////////////////////////////////////////////////////////////////////////////
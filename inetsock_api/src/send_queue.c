@@ -0,0 +1,290 @@
+// send_queue.c - provides the output queue behind non-blocking sends (see
+// SetSendQueue)
+//
+// Data the kernel will not take right away is copied onto the end of the
+// socket's queue, a chain of fixed-size chunks, and written out from there,
+// oldest first, with one sendmsg() per run of up to SEND_QUEUE_WRITE_CHUNKS
+// chunks, whenever the socket becomes writable again.  Chunks come from a
+// process-wide free list, so a busy server stops allocating once its queues
+// have grown to their working size; the list keeps at most
+// SEND_QUEUE_POOL_CHUNKS of them and gives the rest back to the heap.
+//
+// A socket's queue is only ever touched by the thread that holds its send
+// lock.  The queue length is also read without the lock, to decide whether
+// there is anything to do, so it is stored atomically.
+//
+
+#include "stdafx.h"
+
+#include "socket_internal.h"
+
+/**
+ * @brief Size, in bytes, of each chunk of a send queue, header included.
+ */
+#ifndef SEND_QUEUE_CHUNK_SIZE
+#define SEND_QUEUE_CHUNK_SIZE			(16 * 1024)
+#endif //SEND_QUEUE_CHUNK_SIZE
+
+/**
+ * @brief Largest number of free chunks kept for reuse, process-wide (16 MB with the defaults).
+ */
+#ifndef SEND_QUEUE_POOL_CHUNKS
+#define SEND_QUEUE_POOL_CHUNKS			1024
+#endif //SEND_QUEUE_POOL_CHUNKS
+
+/**
+ * @brief Largest number of chunks handed to the kernel with one sendmsg().
+ */
+#ifndef SEND_QUEUE_WRITE_CHUNKS
+#define SEND_QUEUE_WRITE_CHUNKS			64
+#endif //SEND_QUEUE_WRITE_CHUNKS
+
+///////////////////////////////////////////////////////////////////////////////
+// SENDCHUNK struct - one link of a socket's send queue.  The bytes between
+// nHead and nTail are still to be written.
+
+struct _tagSENDCHUNK {
+	PSENDCHUNK		pNext;			/* Next chunk in the queue, or on the free list */
+	size_t			nHead;			/* Offset of the first byte not written yet */
+	size_t			nTail;			/* Offset just past the last byte queued */
+	char			data[];			/* SEND_CHUNK_CAPACITY bytes */
+};
+
+#define SEND_CHUNK_CAPACITY				(SEND_QUEUE_CHUNK_SIZE - offsetof(struct _tagSENDCHUNK, data))
+
+///////////////////////////////////////////////////////////////////////////////
+// Free chunks, shared by every socket in the process.
+
+static pthread_mutex_t g_chunkLock = PTHREAD_MUTEX_INITIALIZER;
+static PSENDCHUNK g_pFreeChunks = NULL;
+static int g_nFreeChunks = 0;
+
+///////////////////////////////////////////////////////////////////////////////
+// AllocChunk - Internal function that gets an empty chunk, from the free list
+// if there is one there.  Returns NULL if memory runs out.
+
+static PSENDCHUNK AllocChunk(void)
+{
+	PSENDCHUNK pChunk = NULL;
+
+	pthread_mutex_lock(&g_chunkLock);
+	pChunk = g_pFreeChunks;
+	if (NULL != pChunk)
+	{
+		g_pFreeChunks = pChunk->pNext;
+		g_nFreeChunks--;
+	}
+	pthread_mutex_unlock(&g_chunkLock);
+
+	if (NULL == pChunk)
+	{
+		pChunk = (PSENDCHUNK)malloc(SEND_QUEUE_CHUNK_SIZE);
+		if (NULL == pChunk)
+			return NULL;
+	}
+
+	pChunk->pNext = NULL;
+	pChunk->nHead = 0;
+	pChunk->nTail = 0;
+
+	return pChunk;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// FreeChunk - Internal function that puts a chunk back on the free list, or
+// frees it if the list is full.
+
+static void FreeChunk(PSENDCHUNK pChunk)
+{
+	pthread_mutex_lock(&g_chunkLock);
+	if (g_nFreeChunks < SEND_QUEUE_POOL_CHUNKS)
+	{
+		pChunk->pNext = g_pFreeChunks;
+		g_pFreeChunks = pChunk;
+		g_nFreeChunks++;
+		pChunk = NULL;
+	}
+	pthread_mutex_unlock(&g_chunkLock);
+
+	free_buffer((void**)&pChunk);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// AppendSendQueue - Copies the contents of several buffers onto the end of
+// the socket's send queue, filling up the last chunk before starting a new
+// one.  Returns zero on success, or ERROR with errno set to ENOMEM, in which
+// case nothing has been queued.
+
+int AppendSendQueue(PSOCKET pSocket, const struct iovec* pIov, int nIovCount)
+{
+	PSENDCHUNK pFirstNew = NULL;
+	PSENDCHUNK pLast = pSocket->pSendQueueTail;
+	size_t nLastTail = (NULL != pLast) ? pLast->nTail : 0;
+	size_t nAppended = 0;
+
+	for (int i = 0; i < nIovCount; i++)
+	{
+		const char* pData = (const char*)pIov[i].iov_base;
+		size_t nLeft = pIov[i].iov_len;
+
+		while (nLeft > 0)
+		{
+			size_t nCopy = 0;
+
+			if (NULL == pLast || SEND_CHUNK_CAPACITY == pLast->nTail)
+			{
+				PSENDCHUNK pChunk = AllocChunk();
+				if (NULL == pChunk)
+					goto nomem;
+
+				if (NULL == pFirstNew)
+					pFirstNew = pChunk;
+
+				if (NULL != pLast)
+					pLast->pNext = pChunk;
+
+				pLast = pChunk;
+			}
+
+			nCopy = SEND_CHUNK_CAPACITY - pLast->nTail;
+			if (nCopy > nLeft)
+				nCopy = nLeft;
+
+			memcpy(pLast->data + pLast->nTail, pData, nCopy);
+			pLast->nTail += nCopy;
+			pData += nCopy;
+			nLeft -= nCopy;
+			nAppended += nCopy;
+		}
+	}
+
+	if (NULL == pSocket->pSendQueueHead)
+		pSocket->pSendQueueHead = (NULL != pFirstNew) ? pFirstNew : pLast;
+
+	pSocket->pSendQueueTail = pLast;
+	__atomic_store_n(&pSocket->nSendQueued, pSocket->nSendQueued + nAppended,
+			__ATOMIC_RELEASE);
+
+	return 0;
+
+nomem:
+	// Take back what was added to the old last chunk, and let go of the new
+	// ones.
+	if (NULL != pSocket->pSendQueueTail)
+	{
+		pSocket->pSendQueueTail->nTail = nLastTail;
+		pSocket->pSendQueueTail->pNext = NULL;
+	}
+
+	while (NULL != pFirstNew)
+	{
+		PSENDCHUNK pNext = pFirstNew->pNext;
+		FreeChunk(pFirstNew);
+		pFirstNew = pNext;
+	}
+
+	errno = ENOMEM;
+	return ERROR;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// WriteSendQueue - Writes as much of the socket's send queue as the kernel
+// will take without blocking, and lets go of the chunks that went out.
+// Returns the number of bytes written, which is zero if the kernel's send
+// buffer is full; or ERROR with errno set if the connection failed.
+
+ssize_t WriteSendQueue(PSOCKET pSocket)
+{
+	struct iovec iov[SEND_QUEUE_WRITE_CHUNKS];
+	struct msghdr msg;
+	ssize_t nTotalSent = 0;
+
+	memset(&msg, 0, sizeof(struct msghdr));
+	msg.msg_iov = iov;
+
+	while (NULL != pSocket->pSendQueueHead)
+	{
+		PSENDCHUNK pChunk = pSocket->pSendQueueHead;
+		size_t nRequested = 0;
+		ssize_t nSent = 0;
+		int nCount = 0;
+
+		for ( ; NULL != pChunk && nCount < SEND_QUEUE_WRITE_CHUNKS; pChunk = pChunk->pNext)
+		{
+			iov[nCount].iov_base = pChunk->data + pChunk->nHead;
+			iov[nCount].iov_len = pChunk->nTail - pChunk->nHead;
+			nRequested += iov[nCount].iov_len;
+			nCount++;
+		}
+
+		msg.msg_iovlen = nCount;
+
+		nSent = sendmsg(pSocket->nSocketDescriptor, &msg, MSG_NOSIGNAL | MSG_DONTWAIT);
+		CountSend(pSocket, nSent, nRequested);
+		if (nSent < 0)
+		{
+			if (EINTR == errno)
+				continue;
+
+			if (EAGAIN == errno || EWOULDBLOCK == errno)
+				break;
+
+			return ERROR;
+		}
+
+		nTotalSent += nSent;
+
+		// Let go of the chunks that went out completely, and move the head
+		// of the one that only went out in part.
+		for (size_t nLeft = (size_t)nSent; nLeft > 0; )
+		{
+			pChunk = pSocket->pSendQueueHead;
+
+			if (nLeft < pChunk->nTail - pChunk->nHead)
+			{
+				pChunk->nHead += nLeft;
+				break;
+			}
+
+			nLeft -= pChunk->nTail - pChunk->nHead;
+
+			pSocket->pSendQueueHead = pChunk->pNext;
+			if (NULL == pSocket->pSendQueueHead)
+				pSocket->pSendQueueTail = NULL;
+
+			FreeChunk(pChunk);
+		}
+
+		// A short write means the kernel's send buffer is full.
+		if ((size_t)nSent < nRequested)
+			break;
+	}
+
+	if (nTotalSent > 0)
+	{
+		__atomic_store_n(&pSocket->nSendQueued, pSocket->nSendQueued - (size_t)nTotalSent,
+				__ATOMIC_RELEASE);
+		__atomic_store_n(&pSocket->nLastSendMs, GetCoarseTimeMs(), __ATOMIC_RELAXED);
+	}
+
+	return nTotalSent;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// FreeSendQueue - Lets go of everything on the socket's send queue, written
+// or not.
+
+void FreeSendQueue(PSOCKET pSocket)
+{
+	while (NULL != pSocket->pSendQueueHead)
+	{
+		PSENDCHUNK pChunk = pSocket->pSendQueueHead;
+		pSocket->pSendQueueHead = pChunk->pNext;
+		FreeChunk(pChunk);
+	}
+
+	pSocket->pSendQueueTail = NULL;
+	__atomic_store_n(&pSocket->nSendQueued, 0, __ATOMIC_RELEASE);
+}
+
+///////////////////////////////////////////////////////////////////////////////
@@ -0,0 +1,251 @@
+// socket_pool.c - provides the pool that socket objects are allocated from, and
+// the translation between HSOCKET handles and the objects they refer to
+//
+// Socket objects are carved out of cache-line-aligned slabs that are never
+// freed, so a pointer to a slot stays valid for the life of the process.  A
+// handle encodes the slot's index and the generation the slot was in when it
+// was handed out.  Releasing a slot bumps its generation, so any handle still
+// floating around after CloseSocket simply fails to match, instead of
+// pointing at freed (or, worse, reused) memory.
+//
+// Free slots are kept on a lock-free (Treiber) stack whose head carries an ABA
+// tag, so opening and closing sockets from several threads at once never takes
+// a lock.  The lock is only taken to add a new slab when the pool runs dry.
+//
+
+#include "stdafx.h"
+
+#include "socket_internal.h"
+
+/**
+ * @brief Number of socket objects in each slab of the pool.
+ */
+#ifndef SOCKET_POOL_SLAB_SIZE
+#define SOCKET_POOL_SLAB_SIZE			1024
+#endif //SOCKET_POOL_SLAB_SIZE
+
+/**
+ * @brief Maximum number of slabs the pool can grow to.  With the defaults,
+ * the pool holds up to about a million open sockets.
+ */
+#ifndef SOCKET_POOL_MAX_SLABS
+#define SOCKET_POOL_MAX_SLABS			1024
+#endif //SOCKET_POOL_MAX_SLABS
+
+/**
+ * @brief Number of bits of a handle value that hold the slot index (plus one,
+ * so that no valid handle is ever NULL).  The remaining high bits hold the
+ * slot's generation.
+ */
+#define HANDLE_INDEX_BITS				(sizeof(uintptr_t) * 4)
+#define HANDLE_INDEX_MASK				((((uintptr_t)1) << HANDLE_INDEX_BITS) - 1)
+#define HANDLE_GENERATION_MASK			(UINTPTR_MAX >> HANDLE_INDEX_BITS)
+
+///////////////////////////////////////////////////////////////////////////////
+// Pool state.  The slab table only ever grows, and a slab's entry is written
+// before the slab count that makes it visible, so readers need no lock.
+
+static PSOCKET g_pSlabs[SOCKET_POOL_MAX_SLABS];
+static unsigned int g_nSlabCount = 0;
+
+// Head of the free list: ABA tag in the high 32 bits, index + 1 of the top
+// slot in the low 32 bits (zero when the list is empty).
+static uint64_t g_nFreeHead = 0;
+
+static pthread_mutex_t g_growMutex = PTHREAD_MUTEX_INITIALIZER;
+
+///////////////////////////////////////////////////////////////////////////////
+// SlotAt - Internal function that finds the slot with the specified index.
+// The caller must have checked that the index is within the pool.
+
+static inline PSOCKET SlotAt(unsigned int nIndex)
+{
+	return &g_pSlabs[nIndex / SOCKET_POOL_SLAB_SIZE][nIndex % SOCKET_POOL_SLAB_SIZE];
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// PushFreeSlots - Internal function that puts a chain of slots, already
+// linked together through nNextFree and starting with the slot at the
+// specified index, on top of the free list.
+
+static void PushFreeSlots(PSOCKET pLast, unsigned int nFirstIndex)
+{
+	uint64_t nHead = __atomic_load_n(&g_nFreeHead, __ATOMIC_ACQUIRE);
+	uint64_t nNewHead = 0;
+
+	do
+	{
+		__atomic_store_n(&pLast->nNextFree, (unsigned int)(nHead & 0xFFFFFFFF),
+				__ATOMIC_RELAXED);
+		nNewHead = (((nHead >> 32) + 1) << 32) | (uint64_t)(nFirstIndex + 1);
+	} while (!__atomic_compare_exchange_n(&g_nFreeHead, &nHead, nNewHead, 0,
+			__ATOMIC_RELEASE, __ATOMIC_ACQUIRE));
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// GrowPool - Internal function that adds a slab to the pool and puts all of
+// its slots on the free list.  Returns zero on success (or if another thread
+// refilled the free list in the meantime), or ERROR if the pool is at its
+// maximum size or out of memory.
+
+static int GrowPool(void)
+{
+	PSOCKET pSlab = NULL;
+	unsigned int nSlab = 0;
+	unsigned int nFirstIndex = 0;
+	int result = 0;
+
+	pthread_mutex_lock(&g_growMutex);
+
+	// Someone else may have grown the pool (or closed a socket) while we
+	// were waiting for the lock.
+	if (0 != (__atomic_load_n(&g_nFreeHead, __ATOMIC_ACQUIRE) & 0xFFFFFFFF))
+		goto done;
+
+	nSlab = __atomic_load_n(&g_nSlabCount, __ATOMIC_ACQUIRE);
+	nFirstIndex = nSlab * SOCKET_POOL_SLAB_SIZE;
+
+	if (nSlab >= SOCKET_POOL_MAX_SLABS
+			|| (uintptr_t)nFirstIndex + SOCKET_POOL_SLAB_SIZE >= HANDLE_INDEX_MASK)
+	{
+		errno = EMFILE;
+		result = ERROR;
+		goto done;
+	}
+
+	pSlab = (PSOCKET)aligned_alloc(CACHE_LINE_SIZE,
+			SOCKET_POOL_SLAB_SIZE * sizeof(struct _tagSOCKET));
+	if (NULL == pSlab)
+	{
+		result = ERROR;
+		goto done;
+	}
+
+	memset(pSlab, 0, SOCKET_POOL_SLAB_SIZE * sizeof(struct _tagSOCKET));
+
+	// Chain the new slots together in index order.
+	for (unsigned int i = 0; i + 1 < SOCKET_POOL_SLAB_SIZE; i++)
+		pSlab[i].nNextFree = nFirstIndex + i + 2;
+
+	g_pSlabs[nSlab] = pSlab;
+	__atomic_store_n(&g_nSlabCount, nSlab + 1, __ATOMIC_RELEASE);
+
+	PushFreeSlots(&pSlab[SOCKET_POOL_SLAB_SIZE - 1], nFirstIndex);
+
+done:
+	pthread_mutex_unlock(&g_growMutex);
+
+	return result;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// AllocSocket - Takes a socket object off the pool's free list, growing the
+// pool if the list is empty, and gives it a fresh handle.
+
+PSOCKET AllocSocket(void)
+{
+	uint64_t nHead = __atomic_load_n(&g_nFreeHead, __ATOMIC_ACQUIRE);
+	PSOCKET pSocket = NULL;
+	unsigned int nIndex = 0;
+	unsigned int nGeneration = 0;
+
+	for (;;)
+	{
+		uint64_t nNewHead = 0;
+
+		if (0 == (nHead & 0xFFFFFFFF))
+		{
+			if (GrowPool() < 0)
+				return NULL;
+
+			nHead = __atomic_load_n(&g_nFreeHead, __ATOMIC_ACQUIRE);
+			continue;
+		}
+
+		nIndex = (unsigned int)(nHead & 0xFFFFFFFF) - 1;
+		pSocket = SlotAt(nIndex);
+
+		// If another thread pops this slot first, the tag in the head will
+		// have moved on and the exchange below fails, so a stale read of
+		// nNextFree here is harmless.
+		nNewHead = (((nHead >> 32) + 1) << 32)
+				| __atomic_load_n(&pSocket->nNextFree, __ATOMIC_RELAXED);
+
+		if (__atomic_compare_exchange_n(&g_nFreeHead, &nHead, nNewHead, 0,
+				__ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+			break;
+	}
+
+	// Start from a clean slate, but hang on to the generation, so that old
+	// handles stay stale.
+	nGeneration = pSocket->nGeneration;
+
+	memset(pSocket, 0, sizeof(struct _tagSOCKET));
+
+	pSocket->nGeneration = nGeneration;
+	pSocket->nSocketDescriptor = -1;
+	pSocket->sockType = SOCKET_TYPE_UNKNOWN;
+	pSocket->sockState = SOCKET_STATE_UNKNOWN;
+	pSocket->sendLock = (pthread_mutex_t)PTHREAD_RECURSIVE_MUTEX_INITIALIZER_NP;
+	pSocket->hSelf = (HSOCKET)((((uintptr_t)nGeneration & HANDLE_GENERATION_MASK)
+			<< HANDLE_INDEX_BITS) | ((uintptr_t)nIndex + 1));
+
+	__atomic_store_n(&pSocket->bInUse, 1, __ATOMIC_RELEASE);
+
+	return pSocket;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// ReleaseSocket - Returns a socket object to the pool.  Bumping the
+// generation is what makes every outstanding handle to it stale.
+
+void ReleaseSocket(PSOCKET pSocket)
+{
+	unsigned int nIndex = 0;
+
+	if (NULL == pSocket)
+		return;
+
+	nIndex = (unsigned int)(((uintptr_t)pSocket->hSelf & HANDLE_INDEX_MASK) - 1);
+
+	__atomic_store_n(&pSocket->bInUse, 0, __ATOMIC_RELEASE);
+	__atomic_add_fetch(&pSocket->nGeneration, 1, __ATOMIC_RELEASE);
+
+	pSocket->hSelf = INVALID_HANDLE_VALUE;
+
+	PushFreeSlots(pSocket, nIndex);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// LookupSocket - Translates a handle into the socket object it refers to, or
+// NULL if the handle is invalid or stale.
+
+PSOCKET LookupSocket(HSOCKET hSocket)
+{
+	uintptr_t nHandle = (uintptr_t)hSocket;
+	uintptr_t nIndexPlusOne = nHandle & HANDLE_INDEX_MASK;
+	unsigned int nIndex = 0;
+	PSOCKET pSocket = NULL;
+
+	if (0 == nIndexPlusOne)
+		return NULL;	/* INVALID_HANDLE_VALUE, or garbage */
+
+	nIndex = (unsigned int)(nIndexPlusOne - 1);
+
+	if (nIndex / SOCKET_POOL_SLAB_SIZE
+			>= __atomic_load_n(&g_nSlabCount, __ATOMIC_ACQUIRE))
+		return NULL;
+
+	pSocket = SlotAt(nIndex);
+
+	if (!__atomic_load_n(&pSocket->bInUse, __ATOMIC_ACQUIRE))
+		return NULL;
+
+	if (((uintptr_t)__atomic_load_n(&pSocket->nGeneration, __ATOMIC_ACQUIRE)
+			& HANDLE_GENERATION_MASK) != (nHandle >> HANDLE_INDEX_BITS))
+		return NULL;
+
+	return pSocket;
+}
+
+///////////////////////////////////////////////////////////////////////////////
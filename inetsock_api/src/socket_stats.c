@@ -0,0 +1,318 @@
+// socket_stats.c - provides the I/O counters and latency histograms behind
+// GetSocketStats and GetGlobalStats
+//
+// Every counter is bumped with a relaxed atomic add and nothing here ever
+// takes a lock, so the counters can stay on under full load.  The
+// process-wide numbers are kept in one block per thread rather than in one
+// shared block, so that the event loops of RunServerEx, each on its own core,
+// never fight over the same cache lines; GetGlobalStats adds the blocks up.
+// A thread's block outlives the thread, so that nothing it counted is lost.
+//
+// Histograms are log-linear, in the manner of HdrHistogram: each power of two
+// is split into four equal buckets, so recording a sample is a count of
+// leading zeros, two shifts and an add.
+//
+
+#include "stdafx.h"
+
+#include "socket_internal.h"
+
+///////////////////////////////////////////////////////////////////////////////
+// THREADSTATS struct - the process-wide counters and histograms that one
+// thread has contributed to.
+
+typedef struct _tagTHREADSTATS {
+	SOCKETSTATS		counters;		/* Counters for the sockets this thread did I/O on */
+	LATENCYHISTOGRAM histograms[LATENCY_KIND_COUNT];	/* One histogram per LATENCY_KIND */
+	struct _tagTHREADSTATS* pNext;	/* Next block in the list of all blocks */
+} THREADSTATS, *PTHREADSTATS;
+
+///////////////////////////////////////////////////////////////////////////////
+// Statistics state.  g_pAllStats only ever grows, by atomic pushes onto its
+// head.  Threads that cannot get a block of their own share g_fallbackStats.
+
+static __thread PTHREADSTATS t_pStats = NULL;
+static PTHREADSTATS g_pAllStats = NULL;
+static THREADSTATS g_fallbackStats;
+
+///////////////////////////////////////////////////////////////////////////////
+// GetThreadStats - Internal function that gets the calling thread's block of
+// counters, creating and publishing it the first time.
+
+static PTHREADSTATS GetThreadStats(void)
+{
+	PTHREADSTATS pStats = t_pStats;
+	if (NULL != pStats)
+		return pStats;
+
+	// Callers count a failed system call before they look at errno.
+	int nSavedErrno = errno;
+
+	pStats = (PTHREADSTATS)calloc(1, sizeof(THREADSTATS));
+	errno = nSavedErrno;
+	if (NULL == pStats)
+		return &g_fallbackStats;
+
+	pStats->pNext = __atomic_load_n(&g_pAllStats, __ATOMIC_RELAXED);
+	while (!__atomic_compare_exchange_n(&g_pAllStats, &pStats->pNext, pStats, 1,
+			__ATOMIC_RELEASE, __ATOMIC_RELAXED))
+		;
+
+	t_pStats = pStats;
+
+	return pStats;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// BucketOf, BucketUpperBound - Internal functions that map a latency, in
+// nanoseconds, to its histogram bucket, and a bucket back to the largest
+// latency it holds.
+
+static int BucketOf(unsigned long long nValue)
+{
+	int nMsb = 0;
+	int nBucket = 0;
+
+	if (nValue < 4)
+		return (int)nValue;
+
+	nMsb = 63 - __builtin_clzll(nValue);
+	nBucket = (nMsb - 1) * 4 + (int)((nValue >> (nMsb - 2)) & 3);
+
+	return (nBucket < SOCKET_LATENCY_BUCKETS) ? nBucket : SOCKET_LATENCY_BUCKETS - 1;
+}
+
+static unsigned long long BucketUpperBound(int nBucket)
+{
+	int nMsb = nBucket / 4 + 1;
+	unsigned long long nLower = 0;
+
+	if (nBucket < 4)
+		return (unsigned long long)nBucket;
+
+	nLower = (unsigned long long)(4 + nBucket % 4) << (nMsb - 2);
+
+	return nLower + (1ULL << (nMsb - 2)) - 1;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// AddCounter - Internal function that bumps a counter without a lock.
+
+static inline void AddCounter(unsigned long long* pCounter, unsigned long long nValue)
+{
+	__atomic_fetch_add(pCounter, nValue, __ATOMIC_RELAXED);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// StatsNow - Reads the monotonic clock, in nanoseconds.
+
+unsigned long long StatsNow(void)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	return (unsigned long long)now.tv_sec * 1000000000ULL + (unsigned long long)now.tv_nsec;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// RecordLatency - Records the time since nStartNs in the calling thread's
+// histogram of the specified kind.
+
+void RecordLatency(LATENCY_KIND kind, unsigned long long nStartNs)
+{
+	PLATENCYHISTOGRAM pHistogram = &GetThreadStats()->histograms[kind];
+	unsigned long long nNow = StatsNow();
+	unsigned long long nElapsed = (nNow > nStartNs) ? nNow - nStartNs : 0;
+	unsigned long long nMax = __atomic_load_n(&pHistogram->nMaxNs, __ATOMIC_RELAXED);
+
+	AddCounter(&pHistogram->nCount, 1);
+	AddCounter(&pHistogram->nTotalNs, nElapsed);
+	AddCounter(&pHistogram->nBuckets[BucketOf(nElapsed)], 1);
+
+	while (nElapsed > nMax
+			&& !__atomic_compare_exchange_n(&pHistogram->nMaxNs, &nMax, nElapsed, 1,
+					__ATOMIC_RELAXED, __ATOMIC_RELAXED))
+		;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// CountSend - Counts one system call made to send data.
+
+void CountSend(PSOCKET pSocket, ssize_t nResult, size_t nRequested)
+{
+	PSOCKETSTATS pTotals = &GetThreadStats()->counters;
+
+	AddCounter(&pSocket->stats.nSendCalls, 1);
+	AddCounter(&pTotals->nSendCalls, 1);
+
+	if (nResult < 0)
+	{
+		if (EAGAIN == errno || EWOULDBLOCK == errno)
+		{
+			AddCounter(&pSocket->stats.nSendWouldBlock, 1);
+			AddCounter(&pTotals->nSendWouldBlock, 1);
+		}
+
+		return;
+	}
+
+	AddCounter(&pSocket->stats.nBytesSent, (unsigned long long)nResult);
+	AddCounter(&pTotals->nBytesSent, (unsigned long long)nResult);
+
+	if ((size_t)nResult < nRequested)
+	{
+		AddCounter(&pSocket->stats.nPartialSends, 1);
+		AddCounter(&pTotals->nPartialSends, 1);
+	}
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// CountRecv - Counts one system call (or io_uring request) made to receive
+// data.
+
+void CountRecv(PSOCKET pSocket, ssize_t nResult)
+{
+	PSOCKETSTATS pTotals = &GetThreadStats()->counters;
+
+	AddCounter(&pSocket->stats.nRecvCalls, 1);
+	AddCounter(&pTotals->nRecvCalls, 1);
+
+	if (nResult < 0)
+	{
+		if (EAGAIN == errno || EWOULDBLOCK == errno)
+		{
+			AddCounter(&pSocket->stats.nRecvWouldBlock, 1);
+			AddCounter(&pTotals->nRecvWouldBlock, 1);
+		}
+
+		return;
+	}
+
+	AddCounter(&pSocket->stats.nBytesReceived, (unsigned long long)nResult);
+	AddCounter(&pTotals->nBytesReceived, (unsigned long long)nResult);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// CountStateChange - Counts a transition of a socket into a new state.
+
+void CountStateChange(PSOCKET pSocket, SOCKET_STATE newState)
+{
+	if ((unsigned int)newState >= SOCKET_STATE_COUNT)
+		return;
+
+	AddCounter(&pSocket->stats.nStateChanges[newState], 1);
+	AddCounter(&GetThreadStats()->counters.nStateChanges[newState], 1);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// SumCounters, SumHistogram - Internal functions that add one block's worth
+// of counters or one histogram onto a running total.
+
+static void SumCounters(PSOCKETSTATS pTotal, PSOCKETSTATS pPart)
+{
+	pTotal->nBytesSent += __atomic_load_n(&pPart->nBytesSent, __ATOMIC_RELAXED);
+	pTotal->nBytesReceived += __atomic_load_n(&pPart->nBytesReceived, __ATOMIC_RELAXED);
+	pTotal->nSendCalls += __atomic_load_n(&pPart->nSendCalls, __ATOMIC_RELAXED);
+	pTotal->nRecvCalls += __atomic_load_n(&pPart->nRecvCalls, __ATOMIC_RELAXED);
+	pTotal->nPartialSends += __atomic_load_n(&pPart->nPartialSends, __ATOMIC_RELAXED);
+	pTotal->nSendWouldBlock += __atomic_load_n(&pPart->nSendWouldBlock, __ATOMIC_RELAXED);
+	pTotal->nRecvWouldBlock += __atomic_load_n(&pPart->nRecvWouldBlock, __ATOMIC_RELAXED);
+
+	for (int i = 0; i < SOCKET_STATE_COUNT; i++)
+		pTotal->nStateChanges[i] += __atomic_load_n(&pPart->nStateChanges[i], __ATOMIC_RELAXED);
+}
+
+static void SumHistogram(PLATENCYHISTOGRAM pTotal, PLATENCYHISTOGRAM pPart)
+{
+	unsigned long long nMax = __atomic_load_n(&pPart->nMaxNs, __ATOMIC_RELAXED);
+
+	pTotal->nCount += __atomic_load_n(&pPart->nCount, __ATOMIC_RELAXED);
+	pTotal->nTotalNs += __atomic_load_n(&pPart->nTotalNs, __ATOMIC_RELAXED);
+	if (nMax > pTotal->nMaxNs)
+		pTotal->nMaxNs = nMax;
+
+	for (int i = 0; i < SOCKET_LATENCY_BUCKETS; i++)
+		pTotal->nBuckets[i] += __atomic_load_n(&pPart->nBuckets[i], __ATOMIC_RELAXED);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// SumBlock - Internal function that adds one thread's block onto the totals
+// GetGlobalStats reports.
+
+static void SumBlock(PGLOBALSTATS pStats, PTHREADSTATS pBlock)
+{
+	SumCounters(&pStats->totals, &pBlock->counters);
+	SumHistogram(&pStats->connectLatency, &pBlock->histograms[LATENCY_CONNECT]);
+	SumHistogram(&pStats->sendLatency, &pBlock->histograms[LATENCY_SEND]);
+	SumHistogram(&pStats->callbackLatency, &pBlock->histograms[LATENCY_CALLBACK]);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// GetGlobalStats - Adds up the counters and histograms of every thread.
+
+void GetGlobalStats(PGLOBALSTATS pStats)
+{
+	if (NULL == pStats)
+		return;
+
+	memset(pStats, 0, sizeof(GLOBALSTATS));
+
+	SumBlock(pStats, &g_fallbackStats);
+
+	for (PTHREADSTATS pBlock = __atomic_load_n(&g_pAllStats, __ATOMIC_ACQUIRE);
+			NULL != pBlock; pBlock = pBlock->pNext)
+		SumBlock(pStats, pBlock);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// GetLatencyPercentile - Walks the buckets of a histogram until the specified
+// percentage of its samples has been passed.
+
+unsigned long long GetLatencyPercentile(const LATENCYHISTOGRAM* pHistogram, double dPercentile)
+{
+	unsigned long long nTarget = 0;
+	unsigned long long nSeen = 0;
+
+	if (NULL == pHistogram || 0 == pHistogram->nCount)
+		return 0;
+
+	if (dPercentile < 0.0)
+		dPercentile = 0.0;
+	if (dPercentile > 100.0)
+		dPercentile = 100.0;
+
+	// The sample the percentile lands on, counting from one.
+	nTarget = (unsigned long long)(dPercentile / 100.0 * (double)pHistogram->nCount + 0.5);
+	if (nTarget < 1)
+		nTarget = 1;
+
+	for (int i = 0; i < SOCKET_LATENCY_BUCKETS; i++)
+	{
+		nSeen += pHistogram->nBuckets[i];
+		if (nSeen >= nTarget)
+		{
+			unsigned long long nUpper = BucketUpperBound(i);
+			return (nUpper < pHistogram->nMaxNs) ? nUpper : pHistogram->nMaxNs;
+		}
+	}
+
+	return pHistogram->nMaxNs;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// GetSocketStats - Copies out the counters of the specified socket.
+
+int GetSocketStats(HSOCKET hSocket, PSOCKETSTATS pStats)
+{
+	PSOCKET pSocket = LookupSocket(hSocket);
+	if (NULL == pSocket || NULL == pStats)
+		return ERROR;
+
+	memset(pStats, 0, sizeof(SOCKETSTATS));
+	SumCounters(pStats, &pSocket->stats);
+
+	return 0;
+}
+
+///////////////////////////////////////////////////////////////////////////////
@@ -0,0 +1,314 @@
+// socket_tuning.c - provides the kernel socket options that trade latency
+// against throughput and memory (see SetSocketTuning and the tuning profiles)
+//
+// A socket's SOCKETTUNING says which options it wants; ApplySocketTuning is
+// what hands them to the kernel, at the moments when they can still make a
+// difference: when the socket is opened (before it connects or listens, which
+// is when buffer sizes are taken into account for the TCP window, and when
+// Fast Open has to be asked for), when it connects on a descriptor of its own
+// (the connector and Unix-domain addresses both swap descriptors), and when
+// it is accepted.  The kernel copies a listener's options onto every
+// connection it accepts, so accepting only costs a system call for
+// TCP_QUICKACK, which the kernel forgets about on its own; for the same
+// reason, that one is set again after every read.
+//
+// Options are only ever set when they are asked for, or when a change turns
+// them back off, so that a socket that is left at the defaults costs nothing.
+// A kernel that refuses an option (e.g., SO_BUSY_POLL without CAP_NET_ADMIN)
+// is not cause to refuse the socket; tuning is an optimization.
+//
+
+#include "stdafx.h"
+
+#include "socket_internal.h"
+
+/**
+ * @brief Length of the queue of connections that a listening socket in Fast Open mode lets
+ * complete their handshakes without a cookie check's round trip.
+ */
+#ifndef TUNING_FASTOPEN_QUEUE_LENGTH
+#define TUNING_FASTOPEN_QUEUE_LENGTH	256
+#endif //TUNING_FASTOPEN_QUEUE_LENGTH
+
+///////////////////////////////////////////////////////////////////////////////
+// The settings behind each SOCKET_TUNING_PROFILE value, in enum order.
+
+static const SOCKETTUNING g_tuningProfiles[] = {
+	/* SOCKET_TUNING_DEFAULT: whatever the kernel does */
+	{ 0 },
+
+	/* SOCKET_TUNING_LOW_LATENCY: nothing waits -- not small writes (Nagle),
+	   not acknowledgements, and not fresh data stuck behind a backlog of
+	   stale data in the kernel.  Fast Open is left for callers to ask for,
+	   since it changes how ConnectToServer reports a failed connect. */
+	{
+		.bNoDelay = 1,
+		.bQuickAck = 1,
+		.nBusyPollUs = 50,
+		.nNotSentLowWatermark = 16384
+	},
+
+	/* SOCKET_TUNING_BULK_THROUGHPUT: full segments, and room for a long fat
+	   pipe's worth of data in flight */
+	{
+		.nSendBufferSize = 4 * 1024 * 1024,
+		.nRecvBufferSize = 4 * 1024 * 1024
+	},
+
+	/* SOCKET_TUNING_MANY_IDLE: as little kernel memory per connection as
+	   will do for the odd small message */
+	{
+		.bNoDelay = 1,
+		.nSendBufferSize = 16384,
+		.nRecvBufferSize = 16384
+	}
+};
+
+///////////////////////////////////////////////////////////////////////////////
+// Profile the sockets that are opened from now on start out with.
+
+static SOCKET_TUNING_PROFILE g_defaultTuningProfile = SOCKET_TUNING_DEFAULT;
+
+///////////////////////////////////////////////////////////////////////////////
+// IsTcpSocket - Internal function that tells whether a descriptor is a TCP
+// socket, as opposed to a datagram or Unix-domain one, which have no TCP
+// options to set.
+
+static int IsTcpSocket(int nSocketDescriptor)
+{
+	int nProtocol = 0;
+	socklen_t nOptionLength = sizeof(int);
+
+	if (getsockopt(nSocketDescriptor, SOL_SOCKET, SO_PROTOCOL, &nProtocol, &nOptionLength) < 0)
+		return 0;
+
+	return IPPROTO_TCP == nProtocol;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// SetOption - Internal function that sets one integer socket option, and
+// remembers the first error, if any, for the caller to report.
+
+static void SetOption(int nSocketDescriptor, int nLevel, int nName, int nValue,
+		int* pnFirstError)
+{
+	if (setsockopt(nSocketDescriptor, nLevel, nName, &nValue, sizeof(int)) < 0
+			&& 0 == *pnFirstError)
+		*pnFirstError = errno;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// SetBufferSize - Internal function that sets SO_SNDBUF or SO_RCVBUF.  The
+// FORCE variant, for those who may, gets past the net.core.wmem_max and
+// rmem_max limits that otherwise cap the size quietly.
+
+static void SetBufferSize(int nSocketDescriptor, int nForceName, int nName, int nBytes,
+		int* pnFirstError)
+{
+	if (0 == setsockopt(nSocketDescriptor, SOL_SOCKET, nForceName, &nBytes, sizeof(int)))
+		return;
+
+	SetOption(nSocketDescriptor, SOL_SOCKET, nName, nBytes, pnFirstError);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// ApplySocketTuning - Hands a socket's tuning to the kernel, as fits the
+// point in the socket's life it is at.  An option is set if it is asked for,
+// or if pOld says it used to be and the change turns it off.  Every option
+// is tried.  Returns zero on success, or ERROR with errno set to the reason
+// the first option that the kernel refused was refused.
+
+int ApplySocketTuning(PSOCKET pSocket, const SOCKETTUNING* pOld, TUNING_STAGE stage)
+{
+	const SOCKETTUNING* pNew = &pSocket->tuning;
+	int nFd = pSocket->nSocketDescriptor;
+	int nFirstError = 0;
+
+#define WANTS(field)	(0 != pNew->field || (NULL != pOld && pOld->field != pNew->field))
+
+	// An accepted connection already has everything from its listener, except
+	// for quick acknowledgements, which are not kept.
+	if (TUNING_STAGE_ACCEPTED == stage)
+	{
+		RearmQuickAck(pSocket);
+		return 0;
+	}
+
+	// A buffer size cannot be taken back; zero just leaves it alone.
+	if (pNew->nSendBufferSize > 0)
+		SetBufferSize(nFd, SO_SNDBUFFORCE, SO_SNDBUF, pNew->nSendBufferSize, &nFirstError);
+
+	if (pNew->nRecvBufferSize > 0)
+		SetBufferSize(nFd, SO_RCVBUFFORCE, SO_RCVBUF, pNew->nRecvBufferSize, &nFirstError);
+
+	if (WANTS(nBusyPollUs))
+		SetOption(nFd, SOL_SOCKET, SO_BUSY_POLL, pNew->nBusyPollUs, &nFirstError);
+
+	if ((WANTS(bNoDelay) || WANTS(bQuickAck) || WANTS(nNotSentLowWatermark)
+			|| (TUNING_STAGE_OPEN == stage && WANTS(bFastOpen)))
+			&& IsTcpSocket(nFd))
+	{
+		if (WANTS(bNoDelay))
+			SetOption(nFd, IPPROTO_TCP, TCP_NODELAY, pNew->bNoDelay, &nFirstError);
+
+		if (pNew->bQuickAck)
+			SetOption(nFd, IPPROTO_TCP, TCP_QUICKACK, 1, &nFirstError);
+
+		// Zero means the net.ipv4.tcp_notsent_lowat default.
+		if (WANTS(nNotSentLowWatermark))
+			SetOption(nFd, IPPROTO_TCP, TCP_NOTSENT_LOWAT, pNew->nNotSentLowWatermark,
+					&nFirstError);
+
+		// Fast Open is decided on before the handshake: a listener takes
+		// data in SYNs, and a client defers its SYN to its first send, so
+		// that the data can ride along.
+		if (TUNING_STAGE_OPEN == stage && WANTS(bFastOpen))
+		{
+			if (SOCKET_TYPE_SERVER == pSocket->sockType)
+				SetOption(nFd, IPPROTO_TCP, TCP_FASTOPEN,
+						pNew->bFastOpen ? TUNING_FASTOPEN_QUEUE_LENGTH : 0, &nFirstError);
+			else
+				SetOption(nFd, IPPROTO_TCP, TCP_FASTOPEN_CONNECT, pNew->bFastOpen ? 1 : 0,
+						&nFirstError);
+		}
+	}
+
+#undef WANTS
+
+	if (0 != nFirstError)
+	{
+		errno = nFirstError;
+		return ERROR;
+	}
+
+	return 0;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// RearmQuickAck - Puts a socket that wants quick acknowledgements back into
+// quick acknowledgement mode, which the kernel leaves on its own whenever it
+// sees fit.  Called after every read.  A socket that turns out not to be a
+// TCP one stops asking.
+
+void RearmQuickAck(PSOCKET pSocket)
+{
+	int nOn = 1;
+
+	if (!pSocket->tuning.bQuickAck)
+		return;
+
+	if (setsockopt(pSocket->nSocketDescriptor, IPPROTO_TCP, TCP_QUICKACK,
+			&nOn, sizeof(int)) < 0)
+		pSocket->tuning.bQuickAck = 0;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// GetDefaultTuning - Gets the tuning that newly opened sockets start out
+// with.
+
+void GetDefaultTuning(PSOCKETTUNING pTuning)
+{
+	*pTuning = g_tuningProfiles[__atomic_load_n(&g_defaultTuningProfile, __ATOMIC_RELAXED)];
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// GetTuningProfile - Gets the settings behind a tuning profile, as a starting
+// point for settings of one's own.  Returns zero on success, or ERROR.
+
+int GetTuningProfile(SOCKET_TUNING_PROFILE profile, PSOCKETTUNING pTuning)
+{
+	if (NULL == pTuning || (unsigned int)profile > SOCKET_TUNING_MANY_IDLE)
+	{
+		errno = EINVAL;
+		return ERROR;
+	}
+
+	*pTuning = g_tuningProfiles[profile];
+
+	return 0;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// GetSocketTuning - Gets the tuning of the specified socket.  Returns zero on
+// success, or ERROR.
+
+int GetSocketTuning(HSOCKET hSocket, PSOCKETTUNING pTuning)
+{
+	PSOCKET pSocket = LookupSocket(hSocket);
+	if (NULL == pSocket)
+	{
+		errno = EBADF;
+		return ERROR;
+	}
+
+	if (NULL == pTuning)
+	{
+		errno = EINVAL;
+		return ERROR;
+	}
+
+	*pTuning = pSocket->tuning;
+
+	return 0;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// SetDefaultTuningProfile - Selects the tuning profile that sockets opened
+// from now on start out with, process-wide.
+
+void SetDefaultTuningProfile(SOCKET_TUNING_PROFILE profile)
+{
+	if ((unsigned int)profile > SOCKET_TUNING_MANY_IDLE)
+		return;
+
+	__atomic_store_n(&g_defaultTuningProfile, profile, __ATOMIC_RELAXED);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// SetSocketTuning - Changes the tuning of the specified socket, and hands it
+// to the kernel right away.  Returns zero on success, or ERROR with errno set,
+// in which case the options the kernel did take have still taken effect.
+
+int SetSocketTuning(HSOCKET hSocket, const SOCKETTUNING* pTuning)
+{
+	PSOCKET pSocket = LookupSocket(hSocket);
+	SOCKETTUNING oldTuning;
+
+	if (NULL == pSocket)
+	{
+		errno = EBADF;
+		return ERROR;
+	}
+
+	if (NULL == pTuning || pTuning->nSendBufferSize < 0 || pTuning->nRecvBufferSize < 0
+			|| pTuning->nBusyPollUs < 0 || pTuning->nNotSentLowWatermark < 0)
+	{
+		errno = EINVAL;
+		return ERROR;
+	}
+
+	oldTuning = pSocket->tuning;
+	pSocket->tuning = *pTuning;
+
+	// Past SOCKET_STATE_OPENED, the socket is connected or listening, and it
+	// is too late for Fast Open either way.
+	return ApplySocketTuning(pSocket, &oldTuning,
+			(SOCKET_STATE_OPENED == __atomic_load_n(&pSocket->sockState, __ATOMIC_ACQUIRE))
+					? TUNING_STAGE_OPEN : TUNING_STAGE_CONNECTED);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// SetSocketTuningProfile - Changes the tuning of the specified socket to that
+// of a tuning profile.  Returns zero on success, or ERROR with errno set.
+
+int SetSocketTuningProfile(HSOCKET hSocket, SOCKET_TUNING_PROFILE profile)
+{
+	SOCKETTUNING tuning;
+
+	if (GetTuningProfile(profile, &tuning) < 0)
+		return ERROR;
+
+	return SetSocketTuning(hSocket, &tuning);
+}
+
+///////////////////////////////////////////////////////////////////////////////
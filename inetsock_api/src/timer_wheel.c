@@ -0,0 +1,274 @@
+// timer_wheel.c - provides the hierarchical timer wheel that each event loop
+// keeps the timeouts of its client sockets on (see SetSocketTimeouts)
+//
+// Time is counted in ticks of TIMER_WHEEL_TICK_MS.  The wheel has
+// TIMER_WHEEL_LEVELS levels of TIMER_WHEEL_SLOTS slots each; a slot on level
+// 0 holds the timers that expire on one tick, a slot on level 1 those that
+// expire within one run of 64 ticks, and so on, 64 times coarser per level.
+// Each time level 0 comes round, the next slot of level 1 is cascaded down
+// into it, and likewise up the levels; this is the scheme of Varghese and
+// Lauck, which the Linux timer wheel used for many years.  A timer is a node
+// that is embedded in the object it times, and a slot is a doubly linked list
+// of nodes, so that arming and cancelling a timer are O(1), with no
+// allocation; expiry is O(1) per tick plus the timers that expire or cascade.
+// A bitmap of the slots in use per level tells the loop how long it may sleep.
+//
+// The wheel belongs to the one thread that runs its event loop, so nothing
+// here is locked.
+//
+
+#include "stdafx.h"
+
+#include "socket_internal.h"
+
+#define TIMER_WHEEL_SLOT_MASK			(TIMER_WHEEL_SLOTS - 1)
+
+/*
+ * Farthest in the future, in ticks, that a timer can be put on the wheel.
+ * Timers set to expire later than that go into the last slot they can reach,
+ * and are put back further along when it is cascaded.
+ */
+#define TIMER_WHEEL_MAX_TICKS			((1ULL << (TIMER_WHEEL_SLOT_BITS * TIMER_WHEEL_LEVELS)) - 1)
+
+///////////////////////////////////////////////////////////////////////////////
+// GetCoarseTimeMs - Reads the coarse monotonic clock, in milliseconds.  The
+// coarse clock is only as fine as the kernel's tick (1-4 ms), which is more
+// than enough for socket timeouts, and it is read without so much as looking
+// at the TSC.
+
+unsigned long long GetCoarseTimeMs(void)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC_COARSE, &now);
+
+	return (unsigned long long)now.tv_sec * 1000ULL
+			+ (unsigned long long)now.tv_nsec / 1000000ULL;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// AddTimer - Internal function that puts a timer that is not on the wheel
+// into the slot for its expiry tick.
+
+static void AddTimer(PTIMERWHEEL pWheel, PTIMERNODE pNode)
+{
+	unsigned long long nExpires = pNode->nExpires;
+	unsigned long long nDelta = 0;
+	unsigned int nLevel = 0;
+	unsigned int nSlot = 0;
+
+	// Already due: run it at the next tick the wheel processes.
+	if (nExpires < pWheel->nNext)
+		nExpires = pWheel->nNext;
+
+	nDelta = nExpires - pWheel->nNext;
+	if (nDelta > TIMER_WHEEL_MAX_TICKS)
+	{
+		nDelta = TIMER_WHEEL_MAX_TICKS;
+		nExpires = pWheel->nNext + nDelta;
+	}
+
+	while (nLevel < TIMER_WHEEL_LEVELS - 1
+			&& nDelta >= (1ULL << (TIMER_WHEEL_SLOT_BITS * (nLevel + 1))))
+		nLevel++;
+
+	nSlot = nLevel * TIMER_WHEEL_SLOTS
+			+ (unsigned int)((nExpires >> (TIMER_WHEEL_SLOT_BITS * nLevel)) & TIMER_WHEEL_SLOT_MASK);
+
+	pNode->nSlot = nSlot;
+	pNode->ppPrev = &pWheel->pSlots[nSlot];
+	pNode->pNext = pWheel->pSlots[nSlot];
+	if (NULL != pNode->pNext)
+		pNode->pNext->ppPrev = &pNode->pNext;
+
+	pWheel->pSlots[nSlot] = pNode;
+	pWheel->nOccupied[nLevel] |= 1ULL << (nSlot & TIMER_WHEEL_SLOT_MASK);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// TakeSlot - Internal function that empties a slot, and returns the list of
+// timers that were in it, linked through pNext.  The timers are still counted
+// as armed; the caller puts them back or expires them.
+
+static PTIMERNODE TakeSlot(PTIMERWHEEL pWheel, unsigned int nLevel, unsigned int nIndex)
+{
+	unsigned int nSlot = nLevel * TIMER_WHEEL_SLOTS + nIndex;
+	PTIMERNODE pList = pWheel->pSlots[nSlot];
+
+	pWheel->pSlots[nSlot] = NULL;
+	pWheel->nOccupied[nLevel] &= ~(1ULL << nIndex);
+
+	return pList;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// TimerWheelInit - Sets up an empty wheel whose clock starts at the specified
+// time.
+
+void TimerWheelInit(PTIMERWHEEL pWheel, unsigned long long nNowMs)
+{
+	memset(pWheel, 0, sizeof(TIMERWHEEL));
+	pWheel->nNext = nNowMs / TIMER_WHEEL_TICK_MS;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// TimerWheelArm - Sets a timer to expire at the specified time, or moves it
+// there if it is already armed.  It expires on the first tick that starts no
+// earlier than that, so never early, and at most one tick late.
+
+void TimerWheelArm(PTIMERWHEEL pWheel, PTIMERNODE pNode, unsigned long long nExpiresMs)
+{
+	if (NULL != pNode->ppPrev)
+		TimerWheelCancel(pWheel, pNode);
+
+	pNode->nExpires = (nExpiresMs + TIMER_WHEEL_TICK_MS - 1) / TIMER_WHEEL_TICK_MS;
+
+	AddTimer(pWheel, pNode);
+	pWheel->nTimers++;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// TimerWheelCancel - Takes a timer off the wheel.  Does nothing if it is not
+// armed.
+
+void TimerWheelCancel(PTIMERWHEEL pWheel, PTIMERNODE pNode)
+{
+	if (NULL == pNode->ppPrev)
+		return;
+
+	// The slot is empty now if this timer was alone in it.  A timer that has
+	// expired, but not been handed out yet, is in no slot.
+	*pNode->ppPrev = pNode->pNext;
+	if (NULL != pNode->pNext)
+		pNode->pNext->ppPrev = pNode->ppPrev;
+	else if (pNode->ppPrev == &pWheel->pSlots[pNode->nSlot])
+		pWheel->nOccupied[pNode->nSlot / TIMER_WHEEL_SLOTS]
+				&= ~(1ULL << (pNode->nSlot & TIMER_WHEEL_SLOT_MASK));
+
+	pNode->pNext = NULL;
+	pNode->ppPrev = NULL;
+	pWheel->nTimers--;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// TimerWheelExpire - Advances the wheel towards the specified time, and
+// takes off it one timer that has expired by then.  Returns that timer, no
+// longer armed, or NULL once there are none left; the caller calls this in a
+// loop.  The timers of a tick that has come due wait on a list of their own,
+// where they can still be cancelled or re-armed, so that whatever the caller
+// does with one timer may safely touch any other.
+
+PTIMERNODE TimerWheelExpire(PTIMERWHEEL pWheel, unsigned long long nNowMs)
+{
+	unsigned long long nNow = nNowMs / TIMER_WHEEL_TICK_MS;
+	PTIMERNODE pNode = NULL;
+
+	while (NULL == pWheel->pExpired && pWheel->nNext <= nNow)
+	{
+		unsigned long long nTick = pWheel->nNext;
+		unsigned int nIndex = (unsigned int)(nTick & TIMER_WHEEL_SLOT_MASK);
+
+		// Nothing on the wheel: skip straight to now.
+		if (0 == pWheel->nTimers)
+		{
+			pWheel->nNext = nNow + 1;
+			break;
+		}
+
+		// Nothing on level 0: skip to where level 0 comes round again, or
+		// to now, whichever is first.
+		if (0 != nIndex && 0 == pWheel->nOccupied[0])
+		{
+			pWheel->nNext = (nTick | TIMER_WHEEL_SLOT_MASK) + 1;
+			if (pWheel->nNext > nNow + 1)
+				pWheel->nNext = nNow + 1;
+
+			continue;
+		}
+
+		// Level 0 has come round: bring the next run of ticks down from the
+		// level above, and that level's from the one above it if it has come
+		// round as well.
+		if (0 == nIndex)
+		{
+			for (unsigned int nLevel = 1; nLevel < TIMER_WHEEL_LEVELS; nLevel++)
+			{
+				unsigned int nLevelIndex = (unsigned int)((nTick
+						>> (TIMER_WHEEL_SLOT_BITS * nLevel)) & TIMER_WHEEL_SLOT_MASK);
+				PTIMERNODE pList = TakeSlot(pWheel, nLevel, nLevelIndex);
+
+				while (NULL != pList)
+				{
+					pNode = pList;
+					pList = pNode->pNext;
+					AddTimer(pWheel, pNode);
+				}
+
+				if (0 != nLevelIndex)
+					break;
+			}
+		}
+
+		pWheel->nNext = nTick + 1;
+
+		// Everything in the slot expires on this tick.  Only the head of
+		// the list has to be told that it has moved.
+		pWheel->pExpired = TakeSlot(pWheel, 0, nIndex);
+		if (NULL != pWheel->pExpired)
+			pWheel->pExpired->ppPrev = &pWheel->pExpired;
+	}
+
+	pNode = pWheel->pExpired;
+	if (NULL == pNode)
+		return NULL;
+
+	pWheel->pExpired = pNode->pNext;
+	if (NULL != pNode->pNext)
+		pNode->pNext->ppPrev = &pWheel->pExpired;
+
+	pNode->pNext = NULL;
+	pNode->ppPrev = NULL;
+	pWheel->nTimers--;
+
+	return pNode;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// TimerWheelTimeout - Gets how long, in milliseconds, an event loop may sleep
+// before the wheel next needs TimerWheelExpire: until the next timer on level
+// 0 expires, or until level 0 comes round and a slot of a higher level has to
+// be cascaded.  Returns -1 (sleep until woken) if the wheel is empty.
+
+int TimerWheelTimeout(PTIMERWHEEL pWheel, unsigned long long nNowMs)
+{
+	unsigned long long nNext = pWheel->nNext;
+	unsigned long long nWake = 0;
+	unsigned int nIndex = (unsigned int)(nNext & TIMER_WHEEL_SLOT_MASK);
+
+	if (0 == pWheel->nTimers)
+		return -1;
+
+	if (NULL != pWheel->pExpired)
+		return 0;
+
+	// Where level 0 next comes round.
+	nWake = (0 == nIndex) ? nNext : (nNext | TIMER_WHEEL_SLOT_MASK) + 1;
+
+	if (0 != pWheel->nOccupied[0])
+	{
+		// Rotate the bitmap so that bit 0 is the next tick to process; the
+		// lowest set bit is then how many ticks away the next timer is.
+		unsigned long long nBits = pWheel->nOccupied[0];
+		if (0 != nIndex)
+			nBits = (nBits >> nIndex) | (nBits << (TIMER_WHEEL_SLOTS - nIndex));
+
+		if (nNext + (unsigned long long)__builtin_ctzll(nBits) < nWake)
+			nWake = nNext + (unsigned long long)__builtin_ctzll(nBits);
+	}
+
+	nWake *= TIMER_WHEEL_TICK_MS;
+
+	return (nWake > nNowMs) ? (int)(nWake - nNowMs) : 0;
+}
+
+///////////////////////////////////////////////////////////////////////////////
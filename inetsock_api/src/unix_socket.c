@@ -0,0 +1,399 @@
+// unix_socket.c - provides Unix-domain addresses, and the passing of open
+// file descriptors over Unix-domain connections (see SetServerAddress and
+// SendDescriptors)
+//
+// An address that starts with "unix:" names a Unix-domain socket instead of a
+// host: "unix:/run/app.sock" (or a relative path) is a socket file, and
+// "unix:@name" is a name in Linux's abstract namespace, which needs no file
+// and goes away with the last socket bound to it.  ResolveHost hands such an
+// address back as the one and only address of the "host", so every way there
+// is of connecting -- ConnectToServer, ConnectToServerAsync, AcquireConnection
+// -- takes it as it is, and the TCP socket that OpenSocket made is swapped for
+// a Unix-domain one on the same descriptor number.  Traffic between processes
+// on the same machine then skips the TCP/IP stack altogether: no checksums,
+// segments, acknowledgements or congestion window, just a copy from one
+// process's buffer into the other's socket queue.
+//
+// Open file descriptors can travel over a Unix-domain connection along with
+// the data (SCM_RIGHTS).  On a socket in descriptor passing mode, the ones
+// that come in are kept, in the order in which they came, until the caller
+// takes them with ReceiveDescriptors; on any other socket, the kernel closes
+// them as the data is read.
+//
+
+#include "stdafx.h"
+
+#include "socket_internal.h"
+
+#define UNIX_ADDRESS_PREFIX				"unix:"
+#define UNIX_ADDRESS_PREFIX_LENGTH		(sizeof(UNIX_ADDRESS_PREFIX) - 1)
+
+///////////////////////////////////////////////////////////////////////////////
+// FDQUEUE struct - descriptors that have come in on a socket in descriptor
+// passing mode and that the caller has not taken yet.  The event loop adds to
+// it while a callback worker may be taking from it, hence the lock.
+
+struct _tagFDQUEUE {
+	pthread_mutex_t	lock;			/* Guards everything below */
+	int*			pFds;			/* Descriptors, oldest first */
+	int				nCount;			/* Number of descriptors in pFds */
+	int				nCapacity;		/* Room in pFds */
+};
+
+///////////////////////////////////////////////////////////////////////////////
+// Room for one SCM_RIGHTS control message with the most descriptors that are
+// passed at once, suitably aligned.
+
+typedef union _tagRIGHTSCMSG {
+	char			buf[CMSG_SPACE(UNIX_PASSED_FDS_MAX * sizeof(int))];
+	struct cmsghdr	align;
+} RIGHTSCMSG;
+
+///////////////////////////////////////////////////////////////////////////////
+// IsUnixAddress - Tells whether an address names a Unix-domain socket rather
+// than a host.
+
+int IsUnixAddress(const char* pszAddress)
+{
+	return NULL != pszAddress
+			&& 0 == strncmp(pszAddress, UNIX_ADDRESS_PREFIX, UNIX_ADDRESS_PREFIX_LENGTH);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// ParseUnixAddress - Turns a "unix:" address into the socket address it names.
+// A leading '@' on the path stands for the NUL byte that starts a name in
+// the abstract namespace.  Returns zero on success, or ERROR with errno set.
+
+int ParseUnixAddress(const char* pszAddress, struct sockaddr_storage* pAddr,
+		socklen_t* pnAddrLength)
+{
+	struct sockaddr_un* pUnix = (struct sockaddr_un*)pAddr;
+	const char* pszPath = pszAddress + UNIX_ADDRESS_PREFIX_LENGTH;
+	size_t nLength = strlen(pszPath);
+	int bAbstract = ('@' == pszPath[0]);
+
+	if (0 == nLength || (bAbstract && 1 == nLength))
+	{
+		errno = EINVAL;
+		return ERROR;
+	}
+
+	// A path needs room for its terminator; an abstract name does not.
+	if (nLength + (bAbstract ? 0 : 1) > sizeof(pUnix->sun_path))
+	{
+		errno = ENAMETOOLONG;
+		return ERROR;
+	}
+
+	memset(pAddr, 0, sizeof(struct sockaddr_storage));
+	pUnix->sun_family = AF_UNIX;
+	memcpy(pUnix->sun_path, pszPath, nLength);
+
+	if (bAbstract)
+		pUnix->sun_path[0] = '\0';
+
+	*pnAddrLength = (socklen_t)(offsetof(struct sockaddr_un, sun_path) + nLength
+			+ (bAbstract ? 0 : 1));
+
+	return 0;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// SwitchToUnixDomain - Replaces a socket's descriptor with a new Unix-domain
+// socket of the same type, on the same descriptor number, unless it is a
+// Unix-domain socket already.  Returns zero on success, or ERROR with errno
+// set.
+
+int SwitchToUnixDomain(PSOCKET pSocket)
+{
+	int nDomain = AF_UNIX;
+	int nType = SOCK_STREAM;
+	socklen_t nOptionLength = sizeof(int);
+	int nNewFd = -1;
+
+	if (0 == getsockopt(pSocket->nSocketDescriptor, SOL_SOCKET, SO_DOMAIN,
+			&nDomain, &nOptionLength) && AF_UNIX == nDomain)
+		return 0;
+
+	nOptionLength = sizeof(int);
+	getsockopt(pSocket->nSocketDescriptor, SOL_SOCKET, SO_TYPE, &nType, &nOptionLength);
+
+	nNewFd = socket(AF_UNIX, nType | SOCK_CLOEXEC, 0);
+	if (nNewFd < 0)
+		return ERROR;
+
+	// Callers may be holding on to the descriptor number, so the new socket
+	// takes it over, the same way a connector's winning attempt does.
+	if (dup3(nNewFd, pSocket->nSocketDescriptor, O_CLOEXEC) < 0)
+	{
+		int nSavedErrno = errno;
+		close(nNewFd);
+		errno = nSavedErrno;
+		return ERROR;
+	}
+
+	close(nNewFd);
+
+	return 0;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// IsStaleSocketFile - Internal function that tells whether the file at a
+// Unix-domain socket's path is a socket that nobody is listening on any more,
+// e.g. one left behind by a server that crashed.  Anything that is not a
+// socket is never stale; it is not ours to remove.
+
+static int IsStaleSocketFile(const struct sockaddr_un* pUnix, socklen_t nAddrLength)
+{
+	struct stat fileInfo;
+	int nProbeFd = -1;
+	int bStale = 0;
+
+	if (lstat(pUnix->sun_path, &fileInfo) < 0 || !S_ISSOCK(fileInfo.st_mode))
+		return 0;
+
+	nProbeFd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (nProbeFd < 0)
+		return 0;
+
+	bStale = (connect(nProbeFd, (const struct sockaddr*)pUnix, nAddrLength) < 0
+			&& ECONNREFUSED == errno);
+
+	close(nProbeFd);
+
+	return bStale;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// BindUnixAddress - Binds a server socket to the Unix-domain address set with
+// SetServerAddress.  A socket file that is in the way but stale is removed
+// first.  The socket file this creates is removed again when the socket is
+// closed.  Returns zero on success, or ERROR with errno set.
+
+int BindUnixAddress(PSOCKET pSocket)
+{
+	PRESOLVEDADDRESS pAddr = pSocket->pListenAddr;
+	const struct sockaddr_un* pUnix = (const struct sockaddr_un*)&pAddr->addr;
+
+	if (bind(pSocket->nSocketDescriptor, (struct sockaddr*)&pAddr->addr,
+			pAddr->nAddrLength) < 0)
+	{
+		if (EADDRINUSE != errno || '\0' == pUnix->sun_path[0]
+				|| !IsStaleSocketFile(pUnix, pAddr->nAddrLength))
+		{
+			errno = EADDRINUSE;
+			return ERROR;
+		}
+
+		unlink(pUnix->sun_path);
+
+		if (bind(pSocket->nSocketDescriptor, (struct sockaddr*)&pAddr->addr,
+				pAddr->nAddrLength) < 0)
+			return ERROR;
+	}
+
+	pSocket->bUnlinkOnClose = ('\0' != pUnix->sun_path[0]);
+
+	return 0;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// ReleaseUnixAddress - Removes the socket file a server socket created, if
+// any, and lets go of its Unix-domain address.
+
+void ReleaseUnixAddress(PSOCKET pSocket)
+{
+	if (NULL == pSocket->pListenAddr)
+		return;
+
+	if (pSocket->bUnlinkOnClose)
+		unlink(((struct sockaddr_un*)&pSocket->pListenAddr->addr)->sun_path);
+
+	pSocket->bUnlinkOnClose = 0;
+	free_buffer((void**)&pSocket->pListenAddr);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// QueueDescriptors - Internal function that adds descriptors that came in on
+// a socket to the end of its queue, making the queue first if this is the
+// first time.  Runs on the one thread that receives on the socket.  If memory
+// runs out, the descriptors are closed; nobody will ever take them.
+
+static void QueueDescriptors(PSOCKET pSocket, const int* pFds, int nFds)
+{
+	PFDQUEUE pQueue = pSocket->pReceivedFds;
+
+	if (NULL == pQueue)
+	{
+		pQueue = (PFDQUEUE)calloc(1, sizeof(struct _tagFDQUEUE));
+		if (NULL == pQueue)
+			goto nomem;
+
+		pthread_mutex_init(&pQueue->lock, NULL);
+		__atomic_store_n(&pSocket->pReceivedFds, pQueue, __ATOMIC_RELEASE);
+	}
+
+	pthread_mutex_lock(&pQueue->lock);
+
+	if (pQueue->nCount + nFds > pQueue->nCapacity)
+	{
+		int nCapacity = (pQueue->nCapacity > 0) ? 2 * pQueue->nCapacity : UNIX_PASSED_FDS_MAX;
+		int* pGrown = NULL;
+
+		while (nCapacity < pQueue->nCount + nFds)
+			nCapacity *= 2;
+
+		pGrown = (int*)realloc(pQueue->pFds, nCapacity * sizeof(int));
+		if (NULL == pGrown)
+		{
+			pthread_mutex_unlock(&pQueue->lock);
+			goto nomem;
+		}
+
+		pQueue->pFds = pGrown;
+		pQueue->nCapacity = nCapacity;
+	}
+
+	memcpy(pQueue->pFds + pQueue->nCount, pFds, nFds * sizeof(int));
+	pQueue->nCount += nFds;
+
+	pthread_mutex_unlock(&pQueue->lock);
+	return;
+
+nomem:
+	for (int i = 0; i < nFds; i++)
+		close(pFds[i]);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// ReceiveWithDescriptors - Reads data from a socket in descriptor passing
+// mode into the specified buffer, as readv() would, and queues whatever
+// descriptors came with it.  They arrive close-on-exec.  Returns the number
+// of bytes read, zero if the peer has closed the connection, or ERROR with
+// errno set.
+
+ssize_t ReceiveWithDescriptors(PSOCKET pSocket, const struct iovec* pIov)
+{
+	RIGHTSCMSG control;
+	struct msghdr msg;
+	ssize_t nRead = 0;
+
+	memset(&msg, 0, sizeof(struct msghdr));
+	msg.msg_iov = (struct iovec*)pIov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control.buf;
+	msg.msg_controllen = sizeof(control.buf);
+
+	nRead = recvmsg(pSocket->nSocketDescriptor, &msg, MSG_CMSG_CLOEXEC);
+	if (nRead < 0)
+		return ERROR;
+
+	for (struct cmsghdr* pCmsg = CMSG_FIRSTHDR(&msg); NULL != pCmsg;
+			pCmsg = CMSG_NXTHDR(&msg, pCmsg))
+	{
+		int fds[UNIX_PASSED_FDS_MAX];
+		int nFds = 0;
+
+		if (SOL_SOCKET != pCmsg->cmsg_level || SCM_RIGHTS != pCmsg->cmsg_type)
+			continue;
+
+		nFds = (int)((pCmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int));
+		memcpy(fds, CMSG_DATA(pCmsg), nFds * sizeof(int));
+
+		QueueDescriptors(pSocket, fds, nFds);
+	}
+
+	return nRead;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// SendWithDescriptors - Sends data on a Unix-domain socket, as sendmsg() would,
+// with the specified descriptors attached to its first byte.  The caller
+// holds the socket's send lock.  Returns the number of bytes sent, which may
+// be fewer than were asked for (the descriptors have gone, either way), or
+// ERROR with errno set, in which case nothing has.
+
+ssize_t SendWithDescriptors(PSOCKET pSocket, const void* pvData, size_t nLength,
+		const int* pFds, int nFds)
+{
+	RIGHTSCMSG control;
+	struct msghdr msg;
+	struct iovec iov;
+	struct cmsghdr* pCmsg = NULL;
+	ssize_t nSent = 0;
+
+	if (nFds <= 0 || nFds > UNIX_PASSED_FDS_MAX)
+	{
+		errno = EINVAL;
+		return ERROR;
+	}
+
+	iov.iov_base = (void*)pvData;
+	iov.iov_len = nLength;
+
+	memset(&msg, 0, sizeof(struct msghdr));
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control.buf;
+	msg.msg_controllen = CMSG_SPACE(nFds * sizeof(int));
+
+	pCmsg = CMSG_FIRSTHDR(&msg);
+	pCmsg->cmsg_level = SOL_SOCKET;
+	pCmsg->cmsg_type = SCM_RIGHTS;
+	pCmsg->cmsg_len = CMSG_LEN(nFds * sizeof(int));
+	memcpy(CMSG_DATA(pCmsg), pFds, nFds * sizeof(int));
+
+	do
+	{
+		nSent = sendmsg(pSocket->nSocketDescriptor, &msg, MSG_NOSIGNAL);
+		CountSend(pSocket, nSent, nLength);
+	} while (nSent < 0 && EINTR == errno);
+
+	return nSent;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// TakeDescriptors - Takes up to the specified number of descriptors off the
+// front of a socket's queue of received ones.  Returns how many it took.
+
+int TakeDescriptors(PSOCKET pSocket, int* pFds, int nMaxFds)
+{
+	PFDQUEUE pQueue = __atomic_load_n(&pSocket->pReceivedFds, __ATOMIC_ACQUIRE);
+	int nTaken = 0;
+
+	if (NULL == pQueue)
+		return 0;
+
+	pthread_mutex_lock(&pQueue->lock);
+
+	nTaken = (pQueue->nCount < nMaxFds) ? pQueue->nCount : nMaxFds;
+	memcpy(pFds, pQueue->pFds, nTaken * sizeof(int));
+
+	pQueue->nCount -= nTaken;
+	memmove(pQueue->pFds, pQueue->pFds + nTaken, pQueue->nCount * sizeof(int));
+
+	pthread_mutex_unlock(&pQueue->lock);
+
+	return nTaken;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// FreeDescriptorQueue - Closes the descriptors that came in on a socket and
+// were never taken, and lets go of the socket's queue.
+
+void FreeDescriptorQueue(PSOCKET pSocket)
+{
+	PFDQUEUE pQueue = pSocket->pReceivedFds;
+
+	if (NULL == pQueue)
+		return;
+
+	for (int i = 0; i < pQueue->nCount; i++)
+		close(pQueue->pFds[i]);
+
+	pthread_mutex_destroy(&pQueue->lock);
+	free_buffer((void**)&pQueue->pFds);
+	free_buffer((void**)&pSocket->pReceivedFds);
+}
+
+///////////////////////////////////////////////////////////////////////////////
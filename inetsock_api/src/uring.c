@@ -0,0 +1,360 @@
+// uring.c - provides a thin wrapper around the io_uring system calls, for the
+// event loop's io_uring backend
+//
+// There is no liburing to lean on, so this sets up the submission and
+// completion rings by hand: io_uring_setup, then mmap of the rings and the
+// SQE array, then loads and stores of the shared head and tail indexes with
+// the acquire/release ordering the kernel expects.  The event loop only ever
+// touches a ring from the one thread that runs it, so nothing here is locked.
+//
+
+#include "stdafx.h"
+
+#include "socket_internal.h"
+
+/**
+ * @brief Number of opcodes UringSupports asks the kernel about; every opcode fits in a byte.
+ */
+#define URING_PROBE_OPS					256
+
+///////////////////////////////////////////////////////////////////////////////
+// UringSetup, UringEnter, UringRegister - Internal functions that make the
+// raw io_uring system calls.
+
+static int UringSetup(unsigned int nEntries, struct io_uring_params* pParams)
+{
+	return (int)syscall(__NR_io_uring_setup, nEntries, pParams);
+}
+
+static int UringEnter(int nRingFd, unsigned int nToSubmit, unsigned int nMinComplete,
+		unsigned int nFlags, const void* pArg, size_t nArgSize)
+{
+	return (int)syscall(__NR_io_uring_enter, nRingFd, nToSubmit, nMinComplete, nFlags,
+			pArg, nArgSize);
+}
+
+static int UringRegister(int nRingFd, unsigned int nOpcode, const void* pArg,
+		unsigned int nArgs)
+{
+	return (int)syscall(__NR_io_uring_register, nRingFd, nOpcode, pArg, nArgs);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// UringInit - Creates an io_uring instance with (at least) the specified
+// number of submission queue entries and maps its rings.  Returns zero on
+// success, or ERROR with errno set (e.g., ENOSYS on kernels without io_uring,
+// or EPERM where it has been turned off).
+
+int UringInit(PURING pUring, unsigned int nEntries)
+{
+	struct io_uring_params params;
+	char* pSqRing = NULL;
+	char* pCqRing = NULL;
+
+	memset(pUring, 0, sizeof(URING));
+	pUring->nRingFd = -1;
+
+	// The completion queue gets twice the room of the submission queue,
+	// since multishot accepts can post more completions than there are
+	// submissions.  Ask for the cheaper task-running modes, but take what
+	// the kernel will give.
+	memset(&params, 0, sizeof(struct io_uring_params));
+	params.flags = IORING_SETUP_CQSIZE | IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_COOP_TASKRUN;
+	params.cq_entries = 2 * nEntries;
+
+	pUring->nRingFd = UringSetup(nEntries, &params);
+	if (pUring->nRingFd < 0 && EINVAL == errno)
+	{
+		memset(&params, 0, sizeof(struct io_uring_params));
+		params.flags = IORING_SETUP_CQSIZE;
+		params.cq_entries = 2 * nEntries;
+		pUring->nRingFd = UringSetup(nEntries, &params);
+	}
+
+	if (pUring->nRingFd < 0)
+		return ERROR;
+
+	pUring->nSqRingSize = params.sq_off.array + params.sq_entries * sizeof(unsigned int);
+	pUring->nCqRingSize = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+
+	// Newer kernels map both rings with one mmap.
+	if (params.features & IORING_FEAT_SINGLE_MMAP)
+	{
+		if (pUring->nCqRingSize > pUring->nSqRingSize)
+			pUring->nSqRingSize = pUring->nCqRingSize;
+
+		pUring->nCqRingSize = pUring->nSqRingSize;
+	}
+
+	pSqRing = (char*)mmap(NULL, pUring->nSqRingSize, PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_POPULATE, pUring->nRingFd, IORING_OFF_SQ_RING);
+	if (MAP_FAILED == pSqRing)
+		goto fail;
+
+	pUring->pSqRing = pSqRing;
+
+	if (params.features & IORING_FEAT_SINGLE_MMAP)
+	{
+		pCqRing = pSqRing;
+	}
+	else
+	{
+		pCqRing = (char*)mmap(NULL, pUring->nCqRingSize, PROT_READ | PROT_WRITE,
+				MAP_SHARED | MAP_POPULATE, pUring->nRingFd, IORING_OFF_CQ_RING);
+		if (MAP_FAILED == pCqRing)
+			goto fail;
+	}
+
+	pUring->pCqRing = pCqRing;
+
+	pUring->nSqesSize = params.sq_entries * sizeof(struct io_uring_sqe);
+	pUring->pSqes = (struct io_uring_sqe*)mmap(NULL, pUring->nSqesSize,
+			PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, pUring->nRingFd,
+			IORING_OFF_SQES);
+	if (MAP_FAILED == (void*)pUring->pSqes)
+	{
+		pUring->pSqes = NULL;
+		goto fail;
+	}
+
+	pUring->pSqHead = (unsigned int*)(pSqRing + params.sq_off.head);
+	pUring->pSqTail = (unsigned int*)(pSqRing + params.sq_off.tail);
+	pUring->nSqMask = *(unsigned int*)(pSqRing + params.sq_off.ring_mask);
+	pUring->nSqEntries = params.sq_entries;
+	pUring->pSqArray = (unsigned int*)(pSqRing + params.sq_off.array);
+
+	pUring->pCqHead = (unsigned int*)(pCqRing + params.cq_off.head);
+	pUring->pCqTail = (unsigned int*)(pCqRing + params.cq_off.tail);
+	pUring->nCqMask = *(unsigned int*)(pCqRing + params.cq_off.ring_mask);
+	pUring->pCqes = (struct io_uring_cqe*)(pCqRing + params.cq_off.cqes);
+
+	pUring->nSqTail = *pUring->pSqTail;
+	pUring->nFeatures = params.features;
+
+	return 0;
+
+fail:
+	UringDestroy(pUring);
+	return ERROR;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// UringDestroy - Unmaps the rings and closes the io_uring instance.  Anything
+// still in flight is cancelled by the kernel.
+
+void UringDestroy(PURING pUring)
+{
+	if (NULL != pUring->pSqes)
+		munmap(pUring->pSqes, pUring->nSqesSize);
+
+	if (NULL != pUring->pCqRing && pUring->pCqRing != pUring->pSqRing)
+		munmap(pUring->pCqRing, pUring->nCqRingSize);
+
+	if (NULL != pUring->pSqRing)
+		munmap(pUring->pSqRing, pUring->nSqRingSize);
+
+	if (pUring->nRingFd >= 0)
+		close(pUring->nRingFd);
+
+	memset(pUring, 0, sizeof(URING));
+	pUring->nRingFd = -1;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// UringSupports - Tells whether the kernel behind an io_uring instance knows
+// every one of the specified request opcodes, by way of IORING_REGISTER_PROBE.
+// A kernel too old to be asked does not count as knowing them.  Returns
+// nonzero if it does, or zero.
+
+int UringSupports(PURING pUring, const unsigned char* pOpcodes, int nOpcodes)
+{
+	struct io_uring_probe* pProbe = NULL;
+	int bSupported = 1;
+
+	pProbe = (struct io_uring_probe*)calloc(1, sizeof(struct io_uring_probe)
+			+ URING_PROBE_OPS * sizeof(struct io_uring_probe_op));
+	if (NULL == pProbe)
+		return 0;
+
+	if (UringRegister(pUring->nRingFd, IORING_REGISTER_PROBE, pProbe, URING_PROBE_OPS) < 0)
+	{
+		free(pProbe);
+		return 0;
+	}
+
+	for (int i = 0; i < nOpcodes && bSupported; i++)
+		bSupported = pOpcodes[i] <= pProbe->last_op
+				&& 0 != (pProbe->ops[pOpcodes[i]].flags & IO_URING_OP_SUPPORTED);
+
+	free(pProbe);
+
+	return bSupported;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// UringGetSqe - Gets a cleared submission queue entry to fill in.  Entries are
+// only handed to the kernel by UringSubmit, so that a whole batch goes in
+// with one system call; if the queue is full, what is in it is submitted now
+// to make room.  Returns NULL only if that submission fails.
+
+struct io_uring_sqe* UringGetSqe(PURING pUring)
+{
+	struct io_uring_sqe* pSqe = NULL;
+	unsigned int nHead = __atomic_load_n(pUring->pSqHead, __ATOMIC_ACQUIRE);
+
+	if (pUring->nSqTail - nHead >= pUring->nSqEntries)
+	{
+		if (UringSubmit(pUring, 0) < 0)
+			return NULL;
+
+		nHead = __atomic_load_n(pUring->pSqHead, __ATOMIC_ACQUIRE);
+		if (pUring->nSqTail - nHead >= pUring->nSqEntries)
+		{
+			errno = EBUSY;
+			return NULL;
+		}
+	}
+
+	pSqe = &pUring->pSqes[pUring->nSqTail & pUring->nSqMask];
+	memset(pSqe, 0, sizeof(struct io_uring_sqe));
+
+	pUring->pSqArray[pUring->nSqTail & pUring->nSqMask] = pUring->nSqTail & pUring->nSqMask;
+	pUring->nSqTail++;
+	pUring->nToSubmit++;
+
+	return pSqe;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// UringSubmit - Hands every queued submission to the kernel and, if nWaitFor
+// is nonzero, waits until at least that many completions are available.
+// Returns the number of entries submitted, or ERROR with errno set.  EINTR
+// is passed back to the caller, who is expected to just go around again.
+
+int UringSubmit(PURING pUring, unsigned int nWaitFor)
+{
+	unsigned int nToSubmit = pUring->nToSubmit;
+	int nSubmitted = 0;
+
+	// Publish the new entries before telling the kernel about them.
+	__atomic_store_n(pUring->pSqTail, pUring->nSqTail, __ATOMIC_RELEASE);
+
+	if (0 == nToSubmit && 0 == nWaitFor)
+		return 0;
+
+	nSubmitted = UringEnter(pUring->nRingFd, nToSubmit, nWaitFor,
+			(nWaitFor > 0) ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+	if (nSubmitted < 0)
+		return ERROR;
+
+	pUring->nToSubmit -= (unsigned int)nSubmitted;
+
+	return nSubmitted;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// UringWait - Hands every queued submission to the kernel and waits for a
+// completion, but for no longer than the specified number of milliseconds
+// (-1 for as long as it takes).  The timeout goes along with the one system
+// call, by way of IORING_ENTER_EXT_ARG (Linux 5.11; the multishot accept the
+// event loop relies on is newer still), instead of as a request of its own.
+// Returns the number of entries submitted, or ERROR with errno set; ETIME
+// means the time ran out, which, like EINTR, the caller just goes around on.
+
+int UringWait(PURING pUring, int nTimeoutMs)
+{
+	struct io_uring_getevents_arg arg;
+	struct __kernel_timespec ts;
+	unsigned int nToSubmit = pUring->nToSubmit;
+	int nSubmitted = 0;
+
+	if (nTimeoutMs < 0)
+		return UringSubmit(pUring, 1);
+
+	__atomic_store_n(pUring->pSqTail, pUring->nSqTail, __ATOMIC_RELEASE);
+
+	ts.tv_sec = nTimeoutMs / 1000;
+	ts.tv_nsec = (long long)(nTimeoutMs % 1000) * 1000000LL;
+
+	memset(&arg, 0, sizeof(struct io_uring_getevents_arg));
+	arg.ts = (uintptr_t)&ts;
+
+	nSubmitted = UringEnter(pUring->nRingFd, nToSubmit, 1,
+			IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG, &arg, sizeof(arg));
+	if (nSubmitted < 0)
+		return ERROR;
+
+	pUring->nToSubmit -= (unsigned int)nSubmitted;
+
+	return nSubmitted;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// UringPeekCqe - Gets the oldest completion that has not been consumed yet,
+// or NULL if there is none.  Consume it with UringSeenCqe.
+
+struct io_uring_cqe* UringPeekCqe(PURING pUring)
+{
+	unsigned int nHead = *pUring->pCqHead;
+
+	if (nHead == __atomic_load_n(pUring->pCqTail, __ATOMIC_ACQUIRE))
+		return NULL;
+
+	return &pUring->pCqes[nHead & pUring->nCqMask];
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// UringSeenCqe - Gives the completion UringPeekCqe returned back to the
+// kernel.
+
+void UringSeenCqe(PURING pUring)
+{
+	__atomic_store_n(pUring->pCqHead, *pUring->pCqHead + 1, __ATOMIC_RELEASE);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// UringRegisterFiles - Registers an empty table of the specified number of
+// fixed files, to be filled in later with IORING_OP_FILES_UPDATE.  Requests
+// that name a fixed file skip looking the descriptor up (and taking and
+// dropping a reference to it) every time.  Returns zero on success, or ERROR
+// with errno set.
+
+int UringRegisterFiles(PURING pUring, unsigned int nCount)
+{
+	int* pFds = (int*)malloc(nCount * sizeof(int));
+	int nResult = 0;
+
+	if (NULL == pFds)
+		return ERROR;
+
+	for (unsigned int i = 0; i < nCount; i++)
+		pFds[i] = -1;	/* empty slot */
+
+	nResult = UringRegister(pUring->nRingFd, IORING_REGISTER_FILES, pFds, nCount);
+
+	free_buffer((void**)&pFds);
+
+	return (nResult < 0) ? ERROR : 0;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// UringUpdateFile - Puts a descriptor into (or, with -1, empties) one slot of
+// the fixed file table right away, for when there is no submission queue
+// entry to spare for IORING_OP_FILES_UPDATE.  Returns zero on success, or
+// ERROR with errno set.
+
+int UringUpdateFile(PURING pUring, unsigned int nSlot, int nFileDescriptor)
+{
+	struct io_uring_files_update update;
+
+	memset(&update, 0, sizeof(struct io_uring_files_update));
+	update.offset = nSlot;
+	update.fds = (uintptr_t)&nFileDescriptor;
+
+	if (UringRegister(pUring->nRingFd, IORING_REGISTER_FILES_UPDATE, &update, 1) < 0)
+		return ERROR;
+
+	return 0;
+}
+
+///////////////////////////////////////////////////////////////////////////////